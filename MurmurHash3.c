@@ -68,7 +68,7 @@ FORCE_INLINE uint64_t fmix64 ( uint64_t k )
 
 //-----------------------------------------------------------------------------
 
-void MurmurHash3_x64_128 (const void *key, const Size len,
+void MurmurHash3_x64_128 (const void *key, const size_t len,
 						  const uint64_t seed, void *out)
 {
 	const uint8_t * data = (const uint8_t*)key;
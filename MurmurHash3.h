@@ -11,12 +11,12 @@
 
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
+#include <stddef.h>
 #include <stdint.h>
-#include "c.h"
 
 //-----------------------------------------------------------------------------
 
-void MurmurHash3_x64_128 (const void *key, const Size len, const uint64_t seed, void *out);
+void MurmurHash3_x64_128 (const void *key, const size_t len, const uint64_t seed, void *out);
 
 //-----------------------------------------------------------------------------
 
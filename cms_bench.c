@@ -0,0 +1,654 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_bench.c
+ *
+ * Microbenchmark for the sketch core kernels. It measures add and estimate
+ * throughput, union and inner product bandwidth and send/recv bandwidth of a
+ * single sketch over a pre-generated key stream, and prints one JSON object per
+ * measured operation so that results of different builds (counter types,
+ * layouts, hash functions) can be compared by scripts.
+ *
+ * Usage: cms_bench [options]
+ *   -e errorBound       error bound used to size the sketch (default 0.001)
+ *   -c confidence       confidence interval used to size the sketch (default 0.99)
+ *   -d depth            sketch depth, overrides -c
+ *   -w width            sketch width, overrides -e
+ *   -k int4|int8|text   key type (default int8)
+ *   -l length           maximum text key length; lengths are uniform in [1, length]
+ *   -u keys             number of distinct keys (default 1000000)
+ *   -z exponent         Zipf exponent of the key distribution, 0 is uniform
+ *   -n items            number of items in the stream (default 10000000)
+ *   -r repeat           repetitions of union, inner product and send/recv
+ *                       (default 100)
+ *   -s seed             random seed
+ *   -x level            kernel level: scalar, sse4.2, avx2, avx512 or neon
+ *                       (default: best level the CPU supports)
+ *   -b slots            also measure adds through an update buffer with this
+ *                       many slots, like cms_add_agg with agg_buffer_size set
+ *   -B items            also measure adds through an update batch of this many
+ *                       items, like cms_add_agg with agg_batch_size set
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cms_core.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+
+typedef enum KeyType
+{
+	KEY_INT4,
+	KEY_INT8,
+	KEY_TEXT
+} KeyType;
+
+/*
+ * BenchOptions keeps the command line options. KeyStream keeps the generated
+ * keys back to back in one buffer, so generation costs are not measured.
+ */
+typedef struct BenchOptions
+{
+	double errorBound;
+	double confidenceInterval;
+	uint32_t depth;
+	uint32_t width;
+	KeyType keyType;
+	uint32_t maxKeyLength;
+	uint64_t distinctKeyCount;
+	double zipfExponent;
+	uint64_t itemCount;
+	uint32_t repeatCount;
+	uint64_t seed;
+	CmsSimdLevel simdLevel;
+	uint32_t bufferSlotCount;
+	uint32_t batchCapacity;
+} BenchOptions;
+
+typedef struct KeyStream
+{
+	char *keyData;
+	size_t *keyOffsets;
+	uint32_t *keyLengths;
+	uint64_t itemCount;
+	size_t keyBytes;
+} KeyStream;
+
+/*
+ * BenchTimer records wall clock time and, where available, the time stamp
+ * counter. The time stamp counter runs at a constant reference frequency, so
+ * cycle numbers are comparable across runs on the same machine.
+ */
+typedef struct BenchTimer
+{
+	struct timespec startTime;
+	uint64_t startCycles;
+	double seconds;
+	double cycles;
+} BenchTimer;
+
+
+static void _parseOptions(int argc, char **argv, BenchOptions *options);
+static void _generateKeyStream(const BenchOptions *options, KeyStream *keyStream);
+static uint64_t _nextRandom(uint64_t *state);
+static double *_zipfDistribution(uint64_t distinctKeyCount, double exponent);
+static uint64_t _sampleKey(const BenchOptions *options, const double *distribution,
+                           uint64_t *randomState);
+static void _startTimer(BenchTimer *timer);
+static void _stopTimer(BenchTimer *timer);
+static void _printResult(const BenchOptions *options, const char *operation,
+                         const BenchTimer *timer, double itemCount, double byteCount);
+static const char * _keyTypeName(KeyType keyType);
+
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+	KeyStream keyStream;
+	CmsMatrix matrix;
+	CmsMatrix otherMatrix;
+	BenchTimer timer;
+	size_t matrixSize = 0;
+	char *sendBuffer = NULL;
+	char *recvBuffer = NULL;
+	uint64_t itemIndex = 0;
+	uint32_t repeatIndex = 0;
+	CmsCounter checksum = 0;
+
+	_parseOptions(argc, argv, &options);
+	CmsSetSimdLevel(options.simdLevel);
+	_generateKeyStream(&options, &keyStream);
+
+	matrixSize = CmsMatrixSize(options.depth, options.width);
+	matrix.depth = otherMatrix.depth = options.depth;
+	matrix.width = otherMatrix.width = options.width;
+	matrix.counters = calloc(1, matrixSize);
+	otherMatrix.counters = calloc(1, matrixSize);
+	sendBuffer = malloc(matrixSize);
+	recvBuffer = malloc(matrixSize);
+	if (matrix.counters == NULL || otherMatrix.counters == NULL ||
+	    sendBuffer == NULL || recvBuffer == NULL)
+	{
+		fprintf(stderr, "could not allocate sketch of %zu bytes\n", matrixSize);
+		return EXIT_FAILURE;
+	}
+
+	/* add: hash every item and update the sketch like cms_add does */
+	_startTimer(&timer);
+	for (itemIndex = 0; itemIndex < keyStream.itemCount; itemIndex++)
+	{
+		uint64_t hashValueArray[2] = {0, 0};
+
+		CmsHashBytes(keyStream.keyData + keyStream.keyOffsets[itemIndex],
+		             keyStream.keyLengths[itemIndex], hashValueArray);
+		CmsUpdateHashed(&matrix, hashValueArray, 1);
+	}
+	_stopTimer(&timer);
+	_printResult(&options, "add", &timer, keyStream.itemCount, keyStream.keyBytes);
+
+	/* buffered_add: the same adds through an update buffer, including the flush */
+	if (options.bufferSlotCount > 0)
+	{
+		CmsMatrix bufferedMatrix = matrix;
+		CmsBufferEntry *bufferEntries = NULL;
+		CmsUpdateBuffer buffer;
+
+		bufferedMatrix.counters = calloc(1, matrixSize);
+		bufferEntries = malloc(sizeof(CmsBufferEntry) * options.bufferSlotCount);
+		if (bufferedMatrix.counters == NULL || bufferEntries == NULL)
+		{
+			fprintf(stderr, "could not allocate update buffer\n");
+			return EXIT_FAILURE;
+		}
+
+		CmsInitBuffer(&buffer, bufferEntries, options.bufferSlotCount);
+
+		_startTimer(&timer);
+		for (itemIndex = 0; itemIndex < keyStream.itemCount; itemIndex++)
+		{
+			uint64_t hashValueArray[2] = {0, 0};
+
+			CmsHashBytes(keyStream.keyData + keyStream.keyOffsets[itemIndex],
+			             keyStream.keyLengths[itemIndex], hashValueArray);
+			CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, 1);
+		}
+		CmsFlushBuffer(&bufferedMatrix, &buffer);
+		_stopTimer(&timer);
+		_printResult(&options, "buffered_add", &timer, keyStream.itemCount,
+		             keyStream.keyBytes);
+
+		free(bufferEntries);
+		free(bufferedMatrix.counters);
+	}
+
+	/* batched_add: the same adds through an update batch, including the flush */
+	if (options.batchCapacity > 0)
+	{
+		CmsMatrix batchedMatrix = matrix;
+		void *batchMemory = NULL;
+		CmsUpdateBatch batch;
+
+		batchedMatrix.counters = calloc(1, matrixSize);
+		batchMemory = malloc(CmsBatchMemorySize(options.batchCapacity, options.depth));
+		if (batchedMatrix.counters == NULL || batchMemory == NULL)
+		{
+			fprintf(stderr, "could not allocate update batch\n");
+			return EXIT_FAILURE;
+		}
+
+		CmsInitBatch(&batch, batchMemory, options.batchCapacity, options.depth);
+
+		_startTimer(&timer);
+		for (itemIndex = 0; itemIndex < keyStream.itemCount; itemIndex++)
+		{
+			uint64_t hashValueArray[2] = {0, 0};
+
+			CmsHashBytes(keyStream.keyData + keyStream.keyOffsets[itemIndex],
+			             keyStream.keyLengths[itemIndex], hashValueArray);
+			CmsBatchUpdateHashed(&batchedMatrix, &batch, hashValueArray, 1);
+		}
+		CmsFlushBatch(&batchedMatrix, &batch);
+		_stopTimer(&timer);
+		_printResult(&options, "batched_add", &timer, keyStream.itemCount,
+		             keyStream.keyBytes);
+
+		free(batchMemory);
+		free(batchedMatrix.counters);
+	}
+
+	/* estimate: hash every item and read its frequency like cms_get_frequency */
+	_startTimer(&timer);
+	for (itemIndex = 0; itemIndex < keyStream.itemCount; itemIndex++)
+	{
+		uint64_t hashValueArray[2] = {0, 0};
+
+		CmsHashBytes(keyStream.keyData + keyStream.keyOffsets[itemIndex],
+		             keyStream.keyLengths[itemIndex], hashValueArray);
+		checksum += CmsEstimateHashed(&matrix, hashValueArray);
+	}
+	_stopTimer(&timer);
+	_printResult(&options, "estimate", &timer, keyStream.itemCount,
+	             keyStream.keyBytes);
+
+	/* union: merge the filled sketch into another one, counting bytes read */
+	_startTimer(&timer);
+	for (repeatIndex = 0; repeatIndex < options.repeatCount; repeatIndex++)
+	{
+		CmsMergeMatrix(&otherMatrix, &matrix);
+	}
+	_stopTimer(&timer);
+	_printResult(&options, "union", &timer,
+	             (double) options.repeatCount * options.depth * options.width,
+	             (double) options.repeatCount * matrixSize);
+
+	/* inner_product: multiply the filled sketch with the merged one row by row */
+	_startTimer(&timer);
+	for (repeatIndex = 0; repeatIndex < options.repeatCount; repeatIndex++)
+	{
+		checksum += (CmsCounter) CmsInnerProduct(&matrix, &otherMatrix);
+	}
+	_stopTimer(&timer);
+	_printResult(&options, "inner_product", &timer,
+	             (double) options.repeatCount * options.depth * options.width,
+	             (double) options.repeatCount * 2 * matrixSize);
+
+	/*
+	 * send/recv: cms_send and cms_recv copy the sketch between the varlena and
+	 * the protocol buffer, so we measure copying the matrix out and back.
+	 */
+	_startTimer(&timer);
+	for (repeatIndex = 0; repeatIndex < options.repeatCount; repeatIndex++)
+	{
+		memcpy(sendBuffer, matrix.counters, matrixSize);
+		memcpy(recvBuffer, sendBuffer, matrixSize);
+		checksum += ((CmsCounter *) recvBuffer)[repeatIndex % (matrixSize /
+		                                                       sizeof(CmsCounter))];
+	}
+	_stopTimer(&timer);
+	_printResult(&options, "send_recv", &timer, options.repeatCount,
+	             (double) options.repeatCount * matrixSize);
+
+	/* keep the compiler from dropping the estimate, product and copy loops */
+	if (checksum == 1)
+	{
+		fprintf(stderr, "checksum %lu\n", (unsigned long) checksum);
+	}
+
+	free(recvBuffer);
+	free(sendBuffer);
+	free(otherMatrix.counters);
+	free(matrix.counters);
+	free(keyStream.keyLengths);
+	free(keyStream.keyOffsets);
+	free(keyStream.keyData);
+
+	return EXIT_SUCCESS;
+}
+
+
+/* _parseOptions fills the benchmark options from the command line. */
+static void _parseOptions(int argc, char **argv, BenchOptions *options)
+{
+	int option = 0;
+	uint32_t depth = 0;
+	uint32_t width = 0;
+
+	options->errorBound = 0.001;
+	options->confidenceInterval = 0.99;
+	options->depth = 0;
+	options->width = 0;
+	options->keyType = KEY_INT8;
+	options->maxKeyLength = 16;
+	options->distinctKeyCount = 1000000;
+	options->zipfExponent = 0.0;
+	options->itemCount = 10000000;
+	options->repeatCount = 100;
+	options->seed = 304837963;
+	options->simdLevel = CmsDetectSimdLevel();
+	options->bufferSlotCount = 0;
+	options->batchCapacity = 0;
+
+	while ((option = getopt(argc, argv, "e:c:d:w:k:l:u:z:n:r:s:x:b:B:")) != -1)
+	{
+		switch (option)
+		{
+			case 'e': options->errorBound = atof(optarg); break;
+			case 'c': options->confidenceInterval = atof(optarg); break;
+			case 'd': options->depth = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'w': options->width = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'l': options->maxKeyLength = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'u': options->distinctKeyCount = strtoull(optarg, NULL, 10); break;
+			case 'z': options->zipfExponent = atof(optarg); break;
+			case 'n': options->itemCount = strtoull(optarg, NULL, 10); break;
+			case 'r': options->repeatCount = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 's': options->seed = strtoull(optarg, NULL, 10); break;
+			case 'b':
+				options->bufferSlotCount =
+					CmsBufferSlotCount((uint32_t) strtoul(optarg, NULL, 10));
+				break;
+			case 'B': options->batchCapacity = (uint32_t) strtoul(optarg, NULL, 10); break;
+			case 'k':
+			{
+				if (strcmp(optarg, "int4") == 0)
+				{
+					options->keyType = KEY_INT4;
+				}
+				else if (strcmp(optarg, "int8") == 0)
+				{
+					options->keyType = KEY_INT8;
+				}
+				else if (strcmp(optarg, "text") == 0)
+				{
+					options->keyType = KEY_TEXT;
+				}
+				else
+				{
+					fprintf(stderr, "unknown key type \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'x':
+			{
+				CmsSimdLevel simdLevel = CMS_SIMD_SCALAR;
+
+				for (simdLevel = CMS_SIMD_SCALAR; simdLevel <= CMS_SIMD_NEON; simdLevel++)
+				{
+					if (strcmp(optarg, CmsSimdLevelName(simdLevel)) == 0)
+					{
+						break;
+					}
+				}
+
+				if (simdLevel > CMS_SIMD_NEON || !CmsSimdLevelSupported(simdLevel))
+				{
+					fprintf(stderr, "kernel level \"%s\" is not supported\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				options->simdLevel = simdLevel;
+				break;
+			}
+			default:
+			{
+				fprintf(stderr, "usage: %s [-e error] [-c confidence] [-d depth] "
+				        "[-w width] [-k int4|int8|text] [-l length] [-u keys] "
+				        "[-z exponent] [-n items] [-r repeat] [-s seed] "
+				        "[-x level] [-b slots] [-B items]\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (CmsComputeDimensions(options->errorBound, options->confidenceInterval,
+	                         &depth, &width) != CMS_OK)
+	{
+		fprintf(stderr, "error bound and confidence interval have to be between "
+		        "0 and 1\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (options->depth == 0)
+	{
+		options->depth = depth;
+	}
+	if (options->width == 0)
+	{
+		options->width = width;
+	}
+	if (options->distinctKeyCount == 0 || options->itemCount == 0 ||
+	    options->maxKeyLength == 0)
+	{
+		fprintf(stderr, "keys, items and key length have to be positive\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * _generateKeyStream draws the key of every item from the configured key
+ * distribution and serializes it the way the extension converts datums to
+ * bytes: integers by value, text as its bytes without the varlena header.
+ */
+static void _generateKeyStream(const BenchOptions *options, KeyStream *keyStream)
+{
+	uint64_t randomState = options->seed;
+	double *distribution = NULL;
+	size_t keyDataSize = 0;
+	size_t maxKeySize = 0;
+	uint64_t itemIndex = 0;
+
+	if (options->zipfExponent > 0)
+	{
+		distribution = _zipfDistribution(options->distinctKeyCount,
+		                                 options->zipfExponent);
+	}
+
+	switch (options->keyType)
+	{
+		case KEY_INT4: maxKeySize = sizeof(int32_t); break;
+		case KEY_INT8: maxKeySize = sizeof(int64_t); break;
+		case KEY_TEXT: maxKeySize = options->maxKeyLength; break;
+	}
+
+	keyDataSize = maxKeySize * options->itemCount;
+	keyStream->keyData = malloc(keyDataSize);
+	keyStream->keyOffsets = malloc(sizeof(size_t) * options->itemCount);
+	keyStream->keyLengths = malloc(sizeof(uint32_t) * options->itemCount);
+	keyStream->itemCount = options->itemCount;
+	keyStream->keyBytes = 0;
+	if (keyStream->keyData == NULL || keyStream->keyOffsets == NULL ||
+	    keyStream->keyLengths == NULL)
+	{
+		fprintf(stderr, "could not allocate key stream\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (itemIndex = 0; itemIndex < options->itemCount; itemIndex++)
+	{
+		uint64_t key = _sampleKey(options, distribution, &randomState);
+		char *keyBytes = keyStream->keyData + keyStream->keyBytes;
+		uint32_t keyLength = 0;
+
+		if (options->keyType == KEY_INT4)
+		{
+			int32_t intKey = (int32_t) key;
+			keyLength = sizeof(intKey);
+			memcpy(keyBytes, &intKey, keyLength);
+		}
+		else if (options->keyType == KEY_INT8)
+		{
+			int64_t intKey = (int64_t) key;
+			keyLength = sizeof(intKey);
+			memcpy(keyBytes, &intKey, keyLength);
+		}
+		else
+		{
+			/* the length and the bytes of a text key are derived from the key */
+			uint64_t keyState = key + 1;
+			uint32_t byteIndex = 0;
+
+			keyLength = 1 + (uint32_t) (_nextRandom(&keyState) % options->maxKeyLength);
+			for (byteIndex = 0; byteIndex < keyLength; byteIndex++)
+			{
+				keyBytes[byteIndex] = 'a' + (char) (_nextRandom(&keyState) % 26);
+			}
+		}
+
+		keyStream->keyOffsets[itemIndex] = keyStream->keyBytes;
+		keyStream->keyLengths[itemIndex] = keyLength;
+		keyStream->keyBytes += keyLength;
+	}
+
+	free(distribution);
+}
+
+
+/* _nextRandom returns the next value of a xorshift64* generator. */
+static uint64_t _nextRandom(uint64_t *state)
+{
+	uint64_t value = *state;
+
+	if (value == 0)
+	{
+		value = 0x9E3779B97F4A7C15ULL;
+	}
+
+	value ^= value >> 12;
+	value ^= value << 25;
+	value ^= value >> 27;
+	*state = value;
+
+	return value * 0x2545F4914F6CDD1DULL;
+}
+
+
+/*
+ * _zipfDistribution returns the cumulative distribution of a Zipf distribution
+ * with the given exponent over the given number of keys.
+ */
+static double *_zipfDistribution(uint64_t distinctKeyCount, double exponent)
+{
+	double *distribution = malloc(sizeof(double) * distinctKeyCount);
+	double total = 0.0;
+	uint64_t keyIndex = 0;
+
+	if (distribution == NULL)
+	{
+		fprintf(stderr, "could not allocate Zipf distribution\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (keyIndex = 0; keyIndex < distinctKeyCount; keyIndex++)
+	{
+		total += 1.0 / pow((double) (keyIndex + 1), exponent);
+		distribution[keyIndex] = total;
+	}
+
+	for (keyIndex = 0; keyIndex < distinctKeyCount; keyIndex++)
+	{
+		distribution[keyIndex] /= total;
+	}
+
+	return distribution;
+}
+
+
+/*
+ * _sampleKey returns a key uniformly at random, or from the Zipf distribution
+ * with a binary search over its cumulative distribution.
+ */
+static uint64_t _sampleKey(const BenchOptions *options, const double *distribution,
+                           uint64_t *randomState)
+{
+	uint64_t randomValue = _nextRandom(randomState);
+	double probability = 0.0;
+	uint64_t lowIndex = 0;
+	uint64_t highIndex = 0;
+
+	if (distribution == NULL)
+	{
+		return randomValue % options->distinctKeyCount;
+	}
+
+	probability = (randomValue >> 11) * (1.0 / 9007199254740992.0);
+	highIndex = options->distinctKeyCount - 1;
+	while (lowIndex < highIndex)
+	{
+		uint64_t middleIndex = lowIndex + (highIndex - lowIndex) / 2;
+		if (distribution[middleIndex] < probability)
+		{
+			lowIndex = middleIndex + 1;
+		}
+		else
+		{
+			highIndex = middleIndex;
+		}
+	}
+
+	return lowIndex;
+}
+
+
+static void _startTimer(BenchTimer *timer)
+{
+	clock_gettime(CLOCK_MONOTONIC, &timer->startTime);
+#ifdef HAVE_CYCLE_COUNTER
+	timer->startCycles = __rdtsc();
+#else
+	timer->startCycles = 0;
+#endif
+}
+
+
+static void _stopTimer(BenchTimer *timer)
+{
+	struct timespec stopTime;
+
+#ifdef HAVE_CYCLE_COUNTER
+	timer->cycles = (double) (__rdtsc() - timer->startCycles);
+#else
+	timer->cycles = -1;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &stopTime);
+	timer->seconds = (stopTime.tv_sec - timer->startTime.tv_sec) +
+	                 (stopTime.tv_nsec - timer->startTime.tv_nsec) / 1e9;
+}
+
+
+/*
+ * _printResult prints one measurement as a JSON object on a single line. Cycle
+ * numbers are null on platforms without a cycle counter.
+ */
+static void _printResult(const BenchOptions *options, const char *operation,
+                         const BenchTimer *timer, double itemCount, double byteCount)
+{
+	double seconds = timer->seconds > 0 ? timer->seconds : 1e-9;
+
+	printf("{\"operation\": \"%s\", \"simd_level\": \"%s\", "
+	       "\"depth\": %u, \"width\": %u, "
+	       "\"sketch_bytes\": %zu, \"counter_bytes\": %zu, \"key_type\": \"%s\", "
+	       "\"max_key_length\": %u, \"distinct_keys\": %lu, \"zipf_exponent\": %g, "
+	       "\"items\": %.0f, \"seconds\": %.6f, \"items_per_second\": %.1f, "
+	       "\"gb_per_second\": %.3f, ",
+	       operation, CmsSimdLevelName(options->simdLevel), options->depth,
+	       options->width,
+	       CmsMatrixSize(options->depth, options->width), sizeof(CmsCounter),
+	       _keyTypeName(options->keyType), options->maxKeyLength,
+	       (unsigned long) options->distinctKeyCount, options->zipfExponent,
+	       itemCount, timer->seconds, itemCount / seconds, byteCount / seconds / 1e9);
+
+	if (timer->cycles >= 0)
+	{
+		printf("\"cycles_per_item\": %.2f}\n", timer->cycles / itemCount);
+	}
+	else
+	{
+		printf("\"cycles_per_item\": null}\n");
+	}
+}
+
+
+static const char * _keyTypeName(KeyType keyType)
+{
+	switch (keyType)
+	{
+		case KEY_INT4: return "int4";
+		case KEY_INT8: return "int8";
+		case KEY_TEXT: return "text";
+	}
+
+	return "unknown";
+}
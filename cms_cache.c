@@ -0,0 +1,468 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_cache.c
+ *
+ * This file contains the shared cache of detoasted sketches and the
+ * cms_prewarm function which loads sketches into it.
+ *
+ * Large sketches are stored out of line, so every query probing them fetches
+ * and decompresses their toast chunks again. When many backends probe the same
+ * reference sketches, the cache keeps the detoasted sketches in shared memory
+ * and backends copy them from there instead. Toasted values are never changed
+ * in place, so a sketch is identified by the toast pointer it is stored under.
+ * A toast pointer only names the same value until its identifier is reused,
+ * which takes the toast relation to be truncated, dropped or rewritten, or the
+ * value to be vacuumed away before the OID counter wraps around. These update
+ * the toast relation in pg_class and so invalidate its relcache entry, and every
+ * backend then drops the cached sketches of that relation.
+ *
+ * The cache is divided into slots of cms_mms.shared_cache_sketch_size. Sketches
+ * which don't fit a slot are not cached, and the least recently used sketch is
+ * evicted when all slots are taken. Like the statistics, the cache is only
+ * available when the extension is loaded through shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+
+#include "cms_cache.h"
+#include "cms_stat.h"
+
+
+/* CmsCacheKey identifies a sketch by its toast pointer. */
+typedef struct CmsCacheKey
+{
+	Oid databaseId;
+	Oid toastRelationId;
+	Oid valueId;
+} CmsCacheKey;
+
+/* CmsCacheEntry maps a sketch to the slot it is copied to. */
+typedef struct CmsCacheEntry
+{
+	CmsCacheKey key;
+	int slotIndex;
+	int32 rawSize;
+	pg_atomic_uint64 lastUsed;
+} CmsCacheEntry;
+
+/*
+ * CmsCacheSharedState is followed by the indexes of the free slots and then the
+ * slots in shared memory.
+ */
+typedef struct CmsCacheSharedState
+{
+	LWLock *lock;
+	pg_atomic_uint64 useCounter;
+	int freeSlotCount;
+} CmsCacheSharedState;
+
+/* GUC variables */
+int CmsCacheSize = 0;
+int CmsCacheSketchSize = 256;
+
+static CmsCacheSharedState *SharedState = NULL;
+static HTAB *SharedEntries = NULL;
+static int *SharedFreeSlots = NULL;
+static char *SharedSlots = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type PreviousShmemRequestHook = NULL;
+#endif
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+
+/* Local functions forward declarations */
+static void _requestSharedMemory(void);
+static void _initSharedMemory(void);
+static Size _sharedStateSize(void);
+static int _slotCount(void);
+static Size _slotSize(void);
+static void _cacheKey(struct varlena *externalValue, CmsCacheKey *key);
+static CmsCacheEntry * _leastRecentlyUsedEntry(void);
+static void _invalidateToastRelation(Datum argument, Oid relationId);
+
+/* Declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(cms_prewarm);
+
+
+/*
+ * CmsCacheInit defines the settings of the cache and, if the extension is being
+ * preloaded and the cache is enabled, requests shared memory for it. It is
+ * called from _PG_init.
+ */
+void CmsCacheInit(void)
+{
+	DefineCustomIntVariable("cms_mms.shared_cache_size",
+	                        "Sets the amount of shared memory used to cache "
+	                        "detoasted sketches.",
+	                        "Backends probing a sketch which is stored out of line "
+	                        "copy it from the cache instead of fetching and "
+	                        "decompressing it again. Zero disables the cache.",
+	                        &CmsCacheSize, 0, 0, MAX_KILOBYTES,
+	                        PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.shared_cache_sketch_size",
+	                        "Sets the size of the largest sketch which is cached.",
+	                        "The cache is divided into slots of this size, so "
+	                        "it holds shared_cache_size / shared_cache_sketch_size "
+	                        "sketches.",
+	                        &CmsCacheSketchSize, 256, 8, MAX_KILOBYTES,
+	                        PGC_POSTMASTER, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || _slotCount() == 0)
+	{
+		return;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	PreviousShmemRequestHook = shmem_request_hook;
+	shmem_request_hook = _requestSharedMemory;
+#else
+	_requestSharedMemory();
+#endif
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = _initSharedMemory;
+
+	CacheRegisterRelcacheCallback(_invalidateToastRelation, (Datum) 0);
+}
+
+
+/*
+ * CmsCacheLookup returns a copy of the detoasted sketch stored under the given
+ * toast pointer if it is cached, and NULL otherwise.
+ */
+struct varlena * CmsCacheLookup(struct varlena *externalValue)
+{
+	CmsCacheKey key;
+	CmsCacheEntry *entry = NULL;
+	struct varlena *value = NULL;
+
+	if (SharedState == NULL || !VARATT_IS_EXTERNAL_ONDISK(externalValue))
+	{
+		return NULL;
+	}
+
+	_cacheKey(externalValue, &key);
+
+	LWLockAcquire(SharedState->lock, LW_SHARED);
+
+	entry = (CmsCacheEntry *) hash_search(SharedEntries, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		value = (struct varlena *) palloc(entry->rawSize);
+		memcpy(value, SharedSlots + entry->slotIndex * _slotSize(), entry->rawSize);
+
+		pg_atomic_write_u64(&entry->lastUsed,
+		                    pg_atomic_fetch_add_u64(&SharedState->useCounter, 1));
+	}
+
+	LWLockRelease(SharedState->lock);
+
+	return value;
+}
+
+
+/*
+ * CmsCacheInsert copies the detoasted sketch stored under the given toast
+ * pointer to the cache, evicting the least recently used sketch if the cache
+ * is full. It returns whether the sketch is cached.
+ */
+bool CmsCacheInsert(struct varlena *externalValue, struct varlena *value)
+{
+	CmsCacheKey key;
+	CmsCacheEntry *entry = NULL;
+	bool found = false;
+
+	if (SharedState == NULL || !VARATT_IS_EXTERNAL_ONDISK(externalValue) ||
+	    VARSIZE(value) > _slotSize())
+	{
+		return false;
+	}
+
+	_cacheKey(externalValue, &key);
+
+	LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+	entry = (CmsCacheEntry *) hash_search(SharedEntries, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		int slotIndex = 0;
+
+		if (SharedState->freeSlotCount > 0)
+		{
+			SharedState->freeSlotCount--;
+			slotIndex = SharedFreeSlots[SharedState->freeSlotCount];
+		}
+		else
+		{
+			CmsCacheEntry *evictedEntry = _leastRecentlyUsedEntry();
+			CmsCacheKey evictedKey = evictedEntry->key;
+
+			slotIndex = evictedEntry->slotIndex;
+			hash_search(SharedEntries, &evictedKey, HASH_REMOVE, NULL);
+		}
+
+		entry = (CmsCacheEntry *) hash_search(SharedEntries, &key, HASH_ENTER, &found);
+		entry->slotIndex = slotIndex;
+		entry->rawSize = VARSIZE(value);
+		pg_atomic_init_u64(&entry->lastUsed, 0);
+
+		memcpy(SharedSlots + slotIndex * _slotSize(), value, VARSIZE(value));
+	}
+
+	pg_atomic_write_u64(&entry->lastUsed,
+	                    pg_atomic_fetch_add_u64(&SharedState->useCounter, 1));
+
+	LWLockRelease(SharedState->lock);
+
+	return true;
+}
+
+
+/*
+ * cms_prewarm loads the given sketch into the cache, so the first queries
+ * probing it after a restart don't have to fetch it. It returns whether the
+ * sketch is cached, which is false for sketches stored inline, sketches larger
+ * than a slot, or if the cache is disabled.
+ */
+Datum cms_prewarm(PG_FUNCTION_ARGS)
+{
+	struct varlena *externalValue = (struct varlena *) PG_GETARG_POINTER(0);
+	struct varlena *value = NULL;
+	bool cached = false;
+
+	CmsStatBeginCall(CMS_STAT_CMS_PREWARM);
+
+	if (SharedState == NULL || !VARATT_IS_EXTERNAL_ONDISK(externalValue))
+	{
+		PG_RETURN_BOOL(false);
+	}
+
+	value = CmsCacheLookup(externalValue);
+	if (value != NULL)
+	{
+		cached = true;
+	}
+	else
+	{
+		value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+		CmsStatPending->detoastedBytes += VARSIZE(value);
+
+		cached = CmsCacheInsert(externalValue, value);
+	}
+
+	pfree(value);
+
+	PG_RETURN_BOOL(cached);
+}
+
+
+/* _requestSharedMemory reserves shared memory and a lock for the cache. */
+static void _requestSharedMemory(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (PreviousShmemRequestHook != NULL)
+	{
+		PreviousShmemRequestHook();
+	}
+#endif
+
+	RequestAddinShmemSpace(_sharedStateSize());
+	RequestAddinShmemSpace(hash_estimate_size(_slotCount(), sizeof(CmsCacheEntry)));
+	RequestNamedLWLockTranche("cms_mms cache", 1);
+}
+
+
+/*
+ * _initSharedMemory attaches to the cache, and initializes it if this is the
+ * first process to do so.
+ */
+static void _initSharedMemory(void)
+{
+	Size freeSlotsSize = MAXALIGN(sizeof(int) * _slotCount());
+	HASHCTL hashInfo;
+	bool found = false;
+
+	if (PreviousShmemStartupHook != NULL)
+	{
+		PreviousShmemStartupHook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	SharedState = ShmemInitStruct("cms_mms cache", _sharedStateSize(), &found);
+	SharedFreeSlots = (int *) ((char *) SharedState + MAXALIGN(sizeof(CmsCacheSharedState)));
+	SharedSlots = (char *) SharedFreeSlots + freeSlotsSize;
+
+	if (!found)
+	{
+		int slotIndex = 0;
+
+		SharedState->lock = &(GetNamedLWLockTranche("cms_mms cache"))->lock;
+		pg_atomic_init_u64(&SharedState->useCounter, 1);
+
+		/* slots are taken from the end of the list, so in index order */
+		SharedState->freeSlotCount = _slotCount();
+		for (slotIndex = 0; slotIndex < _slotCount(); slotIndex++)
+		{
+			SharedFreeSlots[slotIndex] = _slotCount() - 1 - slotIndex;
+		}
+	}
+
+	memset(&hashInfo, 0, sizeof(hashInfo));
+	hashInfo.keysize = sizeof(CmsCacheKey);
+	hashInfo.entrysize = sizeof(CmsCacheEntry);
+
+	SharedEntries = ShmemInitHash("cms_mms cache entries", _slotCount(), _slotCount(),
+	                              &hashInfo, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * _sharedStateSize returns the size of the shared state together with the list
+ * of free slots and the slots.
+ */
+static Size _sharedStateSize(void)
+{
+	Size stateSize = MAXALIGN(sizeof(CmsCacheSharedState));
+
+	stateSize = add_size(stateSize, MAXALIGN(sizeof(int) * _slotCount()));
+	stateSize = add_size(stateSize, mul_size(_slotCount(), _slotSize()));
+
+	return stateSize;
+}
+
+
+/* _slotCount returns the number of sketches the cache holds. */
+static int _slotCount(void)
+{
+	return CmsCacheSize / CmsCacheSketchSize;
+}
+
+
+/* _slotSize returns the size of the largest sketch which is cached in bytes. */
+static Size _slotSize(void)
+{
+	return (Size) CmsCacheSketchSize * 1024;
+}
+
+
+/* _cacheKey sets the key of the sketch stored under the given toast pointer. */
+static void _cacheKey(struct varlena *externalValue, CmsCacheKey *key)
+{
+	struct varatt_external toastPointer;
+
+	VARATT_EXTERNAL_GET_POINTER(toastPointer, externalValue);
+
+	memset(key, 0, sizeof(CmsCacheKey));
+	key->databaseId = MyDatabaseId;
+	key->toastRelationId = toastPointer.va_toastrelid;
+	key->valueId = toastPointer.va_valueid;
+}
+
+
+/*
+ * _leastRecentlyUsedEntry returns the entry which was looked up or inserted
+ * longest ago. It is only called when the cache is full and the caller holds
+ * the lock exclusively.
+ */
+static CmsCacheEntry * _leastRecentlyUsedEntry(void)
+{
+	HASH_SEQ_STATUS status;
+	CmsCacheEntry *entry = NULL;
+	CmsCacheEntry *oldestEntry = NULL;
+	uint64 oldestUse = PG_UINT64_MAX;
+
+	hash_seq_init(&status, SharedEntries);
+	while ((entry = (CmsCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		uint64 lastUsed = pg_atomic_read_u64(&entry->lastUsed);
+
+		if (lastUsed < oldestUse)
+		{
+			oldestUse = lastUsed;
+			oldestEntry = entry;
+		}
+	}
+
+	return oldestEntry;
+}
+
+
+/*
+ * _invalidateToastRelation drops the cached sketches of the given toast relation
+ * of the current database, or of all its relations if the relcache was reset.
+ * It is called for every relcache invalidation, so it only takes the lock
+ * exclusively if it finds sketches to drop. Sketches of other databases can't
+ * be dropped from here, since relation identifiers are per database.
+ */
+static void _invalidateToastRelation(Datum argument, Oid relationId)
+{
+	HASH_SEQ_STATUS status;
+	CmsCacheEntry *entry = NULL;
+	bool haveEntries = false;
+
+	if (SharedState == NULL || !OidIsValid(MyDatabaseId))
+	{
+		return;
+	}
+
+	LWLockAcquire(SharedState->lock, LW_SHARED);
+
+	hash_seq_init(&status, SharedEntries);
+	while ((entry = (CmsCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.databaseId == MyDatabaseId &&
+		    (!OidIsValid(relationId) || entry->key.toastRelationId == relationId))
+		{
+			haveEntries = true;
+			hash_seq_term(&status);
+			break;
+		}
+	}
+
+	LWLockRelease(SharedState->lock);
+
+	if (!haveEntries)
+	{
+		return;
+	}
+
+	LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+	/* removing the entry which was just returned is allowed during a scan */
+	hash_seq_init(&status, SharedEntries);
+	while ((entry = (CmsCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.databaseId == MyDatabaseId &&
+		    (!OidIsValid(relationId) || entry->key.toastRelationId == relationId))
+		{
+			CmsCacheKey removedKey = entry->key;
+
+			SharedFreeSlots[SharedState->freeSlotCount] = entry->slotIndex;
+			SharedState->freeSlotCount++;
+			hash_search(SharedEntries, &removedKey, HASH_REMOVE, NULL);
+		}
+	}
+
+	LWLockRelease(SharedState->lock);
+}
@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_cache.h
+ *
+ * Declarations for the shared cache of detoasted sketches. Sketches which are
+ * stored out of line are kept in shared memory after they are first fetched,
+ * so other backends probing the same sketch copy it from there instead of
+ * reading and decompressing its toast chunks again.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_CACHE_H
+#define CMS_CACHE_H
+
+#include "fmgr.h"
+
+
+/* GUC variables */
+extern int CmsCacheSize;
+extern int CmsCacheSketchSize;
+
+
+extern void CmsCacheInit(void);
+extern struct varlena * CmsCacheLookup(struct varlena *externalValue);
+extern bool CmsCacheInsert(struct varlena *externalValue, struct varlena *value);
+
+#endif /* CMS_CACHE_H */
@@ -0,0 +1,333 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_changes.c
+ *
+ * This file contains the output plugin and the background worker which
+ * maintain sketches from logical decoding.
+ *
+ * Slots created with pg_create_logical_replication_slot(slot_name, 'cms_mms')
+ * decode with this library. The plugin writes nothing unless it is asked for
+ * the rows of a table with the table option, and then writes every row inserted
+ * into that table as a JSON object, which maps the names of its columns to the
+ * text form of their values. The column option limits the object to the given
+ * columns. cms_consume_changes reads the item and key columns of these rows from
+ * the slot and folds them into the sketch tables of cms_change_sources, so the
+ * transactions which insert the rows never touch a sketch. Since columns are
+ * looked up by name, columns can be added to and dropped from the tables while
+ * their rows are decoded.
+ *
+ * The worker calls cms_consume_changes for the slot in cms_mms.change_slot in
+ * a loop, one transaction per batch, and sleeps once a batch folds no rows and
+ * doesn't fill up.
+ * It needs the extension to be loaded through shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include <limits.h>
+
+#include "access/htup_details.h"
+#include "access/xlogdefs.h"
+#include "miscadmin.h"
+#include "replication/logical.h"
+#include "replication/output_plugin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/json.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "cms_changes.h"
+#include "cms_worker.h"
+
+
+/* CmsChangesDecodingState keeps the options of a decoding session. */
+typedef struct CmsChangesDecodingState
+{
+	MemoryContext rowContext;
+	List *tableIds;
+	List *columnNames;
+} CmsChangesDecodingState;
+
+/* GUC variables */
+char *CmsChangesSlotName = NULL;
+char *CmsChangesDatabaseName = NULL;
+int CmsChangesNaptime = 1000;
+
+/* Local functions forward declarations */
+static void _startupDecoding(LogicalDecodingContext *context, OutputPluginOptions *options,
+                             bool isInit);
+static void _beginTransaction(LogicalDecodingContext *context, ReorderBufferTXN *transaction);
+static void _decodeChange(LogicalDecodingContext *context, ReorderBufferTXN *transaction,
+                          Relation relation, ReorderBufferChange *change);
+static void _commitTransaction(LogicalDecodingContext *context, ReorderBufferTXN *transaction,
+                               XLogRecPtr commitLsn);
+static void _appendColumnValue(StringInfo out, HeapTuple tuple, TupleDesc tupleDescriptor,
+                               int attributeIndex);
+static char *_consumeChangesQuery(const char *schemaName);
+
+
+/*
+ * CmsChangesInit defines the settings of the change worker and, if the
+ * extension is being preloaded and a slot is set, registers the worker. It is
+ * called from _PG_init.
+ */
+void CmsChangesInit(void)
+{
+	DefineCustomStringVariable("cms_mms.change_slot",
+	                           "Sets the logical replication slot whose inserted "
+	                           "rows the background worker folds into sketches.",
+	                           "The slot has to decode with the cms_mms output "
+	                           "plugin, and rows are folded as cms_change_sources "
+	                           "describes. An empty string disables the worker.",
+	                           &CmsChangesSlotName, "",
+	                           PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("cms_mms.change_database",
+	                           "Sets the database the background worker connects to.",
+	                           NULL,
+	                           &CmsChangesDatabaseName, "postgres",
+	                           PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.change_naptime",
+	                        "Sets the time the background worker sleeps after it "
+	                        "caught up with the slot.",
+	                        NULL,
+	                        &CmsChangesNaptime, 1000, 1, INT_MAX,
+	                        PGC_SIGHUP, GUC_UNIT_MS, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || CmsChangesSlotName[0] == '\0')
+	{
+		return;
+	}
+
+	CmsWorkerRegister("CmsChangesWorkerMain", "cms_mms change worker");
+}
+
+
+/*
+ * _PG_output_plugin_init is called when a slot decodes with this library, and
+ * returns the callbacks of the output plugin.
+ */
+void _PG_output_plugin_init(OutputPluginCallbacks *callbacks)
+{
+	callbacks->startup_cb = _startupDecoding;
+	callbacks->begin_cb = _beginTransaction;
+	callbacks->change_cb = _decodeChange;
+	callbacks->commit_cb = _commitTransaction;
+}
+
+
+/*
+ * _startupDecoding reads the options of a decoding session. The table option
+ * may be given several times, and every time adds the table with the given oid
+ * to the tables whose inserted rows are decoded. The column option may be given
+ * several times as well, and every time adds a column which is written. Without
+ * it, all columns are written.
+ */
+static void _startupDecoding(LogicalDecodingContext *context, OutputPluginOptions *options,
+                             bool isInit)
+{
+	CmsChangesDecodingState *state = palloc0(sizeof(CmsChangesDecodingState));
+	ListCell *optionCell = NULL;
+
+	state->rowContext = AllocSetContextCreate(context->context, "cms_mms decoded rows",
+	                                          ALLOCSET_DEFAULT_SIZES);
+	options->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	foreach(optionCell, context->output_plugin_options)
+	{
+		DefElem *option = (DefElem *) lfirst(optionCell);
+		Oid tableId = InvalidOid;
+
+		if (option->arg == NULL ||
+		    (strcmp(option->defname, "table") != 0 && strcmp(option->defname, "column") != 0))
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_mms decoding"),
+			                errhint("Options are table, which is the oid of a table whose "
+			                        "inserted rows are decoded, and column, which is the "
+			                        "name of a column which is written")));
+		}
+
+		if (strcmp(option->defname, "column") == 0)
+		{
+			state->columnNames = lappend(state->columnNames, pstrdup(strVal(option->arg)));
+			continue;
+		}
+
+		tableId = DatumGetObjectId(DirectFunctionCall1(oidin,
+		                                               CStringGetDatum(strVal(option->arg))));
+		state->tableIds = lappend_oid(state->tableIds, tableId);
+	}
+
+	context->output_plugin_private = state;
+}
+
+
+/* _beginTransaction writes nothing, since only rows are decoded. */
+static void _beginTransaction(LogicalDecodingContext *context, ReorderBufferTXN *transaction)
+{
+}
+
+
+/*
+ * _decodeChange writes a row inserted into one of the decoded tables as a JSON
+ * object of its columns, or of the requested ones. The row is decoded with the
+ * columns the table had when the row was inserted, and a requested column which
+ * the row doesn't have is an error, since its value in the row is unknown. Other
+ * changes are skipped, since sketches only count inserted rows.
+ */
+static void _decodeChange(LogicalDecodingContext *context, ReorderBufferTXN *transaction,
+                          Relation relation, ReorderBufferChange *change)
+{
+	CmsChangesDecodingState *state = (CmsChangesDecodingState *) context->output_plugin_private;
+	TupleDesc tupleDescriptor = RelationGetDescr(relation);
+	HeapTuple newTuple = NULL;
+	ListCell *columnCell = NULL;
+	int attributeIndex = 0;
+	bool firstColumn = true;
+	MemoryContext oldContext = NULL;
+
+	if (change->action != REORDER_BUFFER_CHANGE_INSERT ||
+	    change->data.tp.newtuple == NULL ||
+	    !list_member_oid(state->tableIds, RelationGetRelid(relation)))
+	{
+		return;
+	}
+
+#if PG_VERSION_NUM >= 170000
+	newTuple = change->data.tp.newtuple;
+#else
+	newTuple = &change->data.tp.newtuple->tuple;
+#endif
+
+	oldContext = MemoryContextSwitchTo(state->rowContext);
+
+	OutputPluginPrepareWrite(context, true);
+	appendStringInfoChar(context->out, '{');
+
+	if (state->columnNames == NIL)
+	{
+		for (attributeIndex = 0; attributeIndex < tupleDescriptor->natts; attributeIndex++)
+		{
+			if (TupleDescAttr(tupleDescriptor, attributeIndex)->attisdropped)
+			{
+				continue;
+			}
+
+			if (!firstColumn)
+			{
+				appendStringInfoChar(context->out, ',');
+			}
+
+			_appendColumnValue(context->out, newTuple, tupleDescriptor, attributeIndex);
+			firstColumn = false;
+		}
+	}
+
+	foreach(columnCell, state->columnNames)
+	{
+		char *columnName = (char *) lfirst(columnCell);
+
+		for (attributeIndex = 0; attributeIndex < tupleDescriptor->natts; attributeIndex++)
+		{
+			Form_pg_attribute attribute = TupleDescAttr(tupleDescriptor, attributeIndex);
+
+			if (!attribute->attisdropped && strcmp(NameStr(attribute->attname), columnName) == 0)
+			{
+				break;
+			}
+		}
+
+		if (attributeIndex == tupleDescriptor->natts)
+		{
+			ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+			                errmsg("row of table \"%s\" decoded from replication slot \"%s\" "
+			                       "has no column \"%s\"",
+			                       RelationGetRelationName(relation),
+			                       NameStr(context->slot->data.name), columnName),
+			                errhint("The row was inserted before the column was added or "
+			                        "renamed, so the slot and its position in "
+			                        "cms_change_progress have to be advanced past it")));
+		}
+
+		if (!firstColumn)
+		{
+			appendStringInfoChar(context->out, ',');
+		}
+
+		_appendColumnValue(context->out, newTuple, tupleDescriptor, attributeIndex);
+		firstColumn = false;
+	}
+
+	appendStringInfoChar(context->out, '}');
+	OutputPluginWrite(context, true);
+
+	MemoryContextSwitchTo(oldContext);
+	MemoryContextReset(state->rowContext);
+}
+
+
+/* _commitTransaction writes nothing, since only rows are decoded. */
+static void _commitTransaction(LogicalDecodingContext *context, ReorderBufferTXN *transaction,
+                               XLogRecPtr commitLsn)
+{
+}
+
+
+/*
+ * _appendColumnValue appends the name of the given column and the text form of
+ * its value in the tuple to a JSON object. Null values are written as null.
+ */
+static void _appendColumnValue(StringInfo out, HeapTuple tuple, TupleDesc tupleDescriptor,
+                               int attributeIndex)
+{
+	Form_pg_attribute attribute = TupleDescAttr(tupleDescriptor, attributeIndex);
+	Datum value = 0;
+	bool isNull = false;
+	Oid outputFunctionId = InvalidOid;
+	bool isVarlena = false;
+
+	escape_json(out, NameStr(attribute->attname));
+	appendStringInfoChar(out, ':');
+
+	value = heap_getattr(tuple, attributeIndex + 1, tupleDescriptor, &isNull);
+	if (isNull)
+	{
+		appendStringInfoString(out, "null");
+		return;
+	}
+
+	getTypeOutputInfo(attribute->atttypid, &outputFunctionId, &isVarlena);
+	escape_json(out, OidOutputFunctionCall(outputFunctionId, value));
+}
+
+
+/*
+ * CmsChangesWorkerMain is the entry point of the change worker. It folds the
+ * rows of the slot into sketches until it caught up, then sleeps for the nap
+ * time or until its latch is set.
+ */
+void CmsChangesWorkerMain(Datum mainArg)
+{
+	CmsWorkerMain(CmsChangesDatabaseName, "folding decoded rows into sketches",
+	              _consumeChangesQuery, &CmsChangesNaptime, 1L);
+}
+
+
+/*
+ * _consumeChangesQuery returns the query which calls cms_consume_changes for the
+ * slot of the worker, and returns whether the call folded rows or left changes
+ * behind in a full batch.
+ */
+static char *_consumeChangesQuery(const char *schemaName)
+{
+	/* committing a batch writes WAL, so the position alone never settles */
+	return psprintf("SELECT folded_rows > 0 OR batch_full FROM %s.cms_consume_changes(%s)",
+	                schemaName, quote_literal_cstr(CmsChangesSlotName));
+}
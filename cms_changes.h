@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_changes.h
+ *
+ * Declarations for maintaining sketches from logical decoding. The library is
+ * also an output plugin which decodes the rows inserted into source tables, and
+ * a background worker folds them into sketch tables in batches, outside of the
+ * transactions which inserted them.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_CHANGES_H
+#define CMS_CHANGES_H
+
+#include "fmgr.h"
+
+
+/* GUC variables */
+extern char *CmsChangesSlotName;
+extern char *CmsChangesDatabaseName;
+extern int CmsChangesNaptime;
+
+
+extern void CmsChangesInit(void);
+extern PGDLLEXPORT void CmsChangesWorkerMain(Datum mainArg);
+
+#endif /* CMS_CHANGES_H */
@@ -0,0 +1,1793 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_core.c
+ *
+ * This file contains the PostgreSQL independent kernels of the count-min sketch
+ * and the min-mask sketch: sizing, hashing, updating, estimating and merging
+ * counter matrices. Memory management and error reporting are left to callers.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "cms_core.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number of items whose counters are prefetched ahead of the item being updated
+ * by CmsUpdateHashedArray. With a typical depth of five, this keeps a few dozen
+ * cache misses in flight.
+ */
+#define CMS_PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__)
+#define CMS_PREFETCH_WRITE(address) __builtin_prefetch((address), 1, 3)
+#else
+#define CMS_PREFETCH_WRITE(address) ((void) (address))
+#endif
+
+
+static size_t _batchWeightsOffset(uint32_t capacity);
+static size_t _batchColumnsOffset(uint32_t capacity);
+static void _prefetchItemCounters(const CmsMatrix *matrix, const uint32_t *columns,
+                                  size_t itemCount, size_t itemIndex);
+static CmsFilterEntry * _findFilterEntry(const CmsFilterEntry *entries, uint32_t entryCount,
+                                         const uint64_t *hashValueArray);
+static CmsCounter _addCountersSaturating(CmsCounter counter, CmsCounter addend);
+static int _compareFilterEntries(const void *leftEntry, const void *rightEntry);
+static CmsCounter * _windowCellCounters(const CmsWindowMatrix *window, uint32_t row,
+                                        const uint64_t *hashValueArray);
+static CmsMatrix _dyadicLevelMatrix(const CmsDyadicMatrix *dyadic, uint32_t level);
+static int _dyadicLevelIsExact(const CmsDyadicMatrix *dyadic, uint32_t level);
+static void _hashRangeNode(const CmsRangeNode *node, uint64_t *hashValueArray);
+static CmsMatrix _prefixLevelMatrix(const CmsPrefixMatrix *matrix, uint32_t level);
+static void _offerPrefixCandidate(CmsPrefixCandidate *candidates, uint32_t candidateCount,
+                                  const uint64_t *prefix, CmsCounter frequency);
+static int _prefixContains(const uint64_t *prefix, uint32_t prefixLength,
+                           const uint64_t *otherPrefix);
+
+
+/*
+ * CmsComputeDimensions calculates the depth and width of a sketch for the given
+ * error bound and confidence interval according to formula in this paper:
+ * http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf.
+ */
+CmsStatus CmsComputeDimensions(double errorBound, double confidenceInterval,
+                               uint32_t *depth, uint32_t *width)
+{
+	if (errorBound <= 0 || errorBound >= 1)
+	{
+		return CMS_INVALID_ERROR_BOUND;
+	}
+	else if (confidenceInterval <= 0 || confidenceInterval >= 1)
+	{
+		return CMS_INVALID_CONFIDENCE_INTERVAL;
+	}
+
+	*width = (uint32_t) ceil(exp(1) / errorBound);
+	*depth = (uint32_t) ceil(log(1 / (1 - confidenceInterval)));
+
+	return CMS_OK;
+}
+
+
+/* CmsMatrixSize returns the number of bytes needed for the counter matrix. */
+size_t CmsMatrixSize(uint32_t depth, uint32_t width)
+{
+	return sizeof(CmsCounter) * (size_t) depth * (size_t) width;
+}
+
+
+/* CmsHashBytes calculates the two hash values used to index the sketch rows. */
+void CmsHashBytes(const void *bytes, size_t length, uint64_t *hashValueArray)
+{
+	CMS_HASH_128(bytes, length, CMS_HASH_SEED, hashValueArray);
+}
+
+
+/*
+ * CmsEstimateHashed returns the frequency estimate of an item from
+ * its hashed values, which is the minimum of its counters over all rows.
+ */
+CmsCounter CmsEstimateHashed(const CmsMatrix *matrix, const uint64_t *hashValueArray)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minFrequency = CMS_COUNTER_MAX;
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		CmsCounter counterFrequency = matrix->counters[counterIndex];
+		if (counterFrequency < minFrequency)
+		{
+			minFrequency = counterFrequency;
+		}
+	}
+
+	return minFrequency;
+}
+
+
+/*
+ * CmsUpdateHashed adds the given weight to the item with the given hashed values
+ * and returns the new frequency estimate of the item. The new frequency saturates
+ * at the largest value the counter type can hold.
+ */
+CmsCounter CmsUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                           CmsCounter weight)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minFrequency = CmsEstimateHashed(matrix, hashValueArray);
+	CmsCounter newFrequency = minFrequency + weight;
+
+	if (newFrequency < minFrequency)
+	{
+		newFrequency = CMS_COUNTER_MAX;
+	}
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		/*
+		 * Selective update to decrease effect of collisions. We only update
+		 * counters less than new frequency because other counters are bigger
+		 * due to collisions.
+		 */
+		CmsCounter counterFrequency = matrix->counters[counterIndex];
+		if (newFrequency > counterFrequency)
+		{
+			matrix->counters[counterIndex] = newFrequency;
+		}
+	}
+
+	return newFrequency;
+}
+
+
+/*
+ * CmsMergeMatrix adds the counters of the source matrix to the counters of the
+ * target matrix. Both matrices must have the same dimensions; checking that is
+ * left to the caller. Sums saturate at the largest counter value.
+ */
+void CmsMergeMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix)
+{
+	size_t cellCount = (size_t) targetMatrix->depth * targetMatrix->width;
+
+	CmsMergeCounters(targetMatrix->counters, sourceMatrix->counters, cellCount);
+}
+
+
+/*
+ * CmsLinearUpdateHashed adds the given weight to every counter of the item and
+ * returns its new frequency estimate. Unlike the conservative update of
+ * CmsUpdateHashed, the counters are a linear function of the added items, so
+ * items can be removed again and sketches can be subtracted from each other.
+ * Counters saturate at the largest value and stay there.
+ */
+CmsCounter CmsLinearUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                 CmsCounter weight)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minFrequency = CMS_COUNTER_MAX;
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+		CmsCounter newFrequency = _addCountersSaturating(matrix->counters[counterIndex],
+		                                                 weight);
+
+		matrix->counters[counterIndex] = newFrequency;
+		if (newFrequency < minFrequency)
+		{
+			minFrequency = newFrequency;
+		}
+	}
+
+	return minFrequency;
+}
+
+
+/*
+ * CmsLinearRemoveHashed subtracts the given weight from every counter of the
+ * item, undoing CmsLinearUpdateHashed. If a counter is smaller than the weight,
+ * the item wasn't added with that weight; the matrix is left unchanged and
+ * CMS_COUNTER_UNDERFLOW is returned. Saturated counters don't know their true
+ * value anymore, so they stay saturated.
+ */
+CmsStatus CmsLinearRemoveHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                CmsCounter weight)
+{
+	uint32_t hashIndex = 0;
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		if (matrix->counters[counterIndex] < weight)
+		{
+			return CMS_COUNTER_UNDERFLOW;
+		}
+	}
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		if (matrix->counters[counterIndex] != CMS_COUNTER_MAX)
+		{
+			matrix->counters[counterIndex] -= weight;
+		}
+	}
+
+	return CMS_OK;
+}
+
+
+/*
+ * CmsSubtractMatrix subtracts the counters of the source matrix from the counters
+ * of the target matrix. For linear sketches the result counts the items which
+ * were added to the target but not to the source. If some target counter is
+ * smaller than its source counter, the source isn't contained in the target; the
+ * target is left unchanged and CMS_COUNTER_UNDERFLOW is returned. Saturated
+ * target counters stay saturated. Both matrices must have the same dimensions.
+ */
+CmsStatus CmsSubtractMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix)
+{
+	size_t cellCount = (size_t) targetMatrix->depth * targetMatrix->width;
+	CmsCounter *targetCounters = targetMatrix->counters;
+	const CmsCounter *sourceCounters = sourceMatrix->counters;
+	size_t cellIndex = 0;
+
+	for (cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		if (targetCounters[cellIndex] < sourceCounters[cellIndex])
+		{
+			return CMS_COUNTER_UNDERFLOW;
+		}
+	}
+
+	for (cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		if (targetCounters[cellIndex] != CMS_COUNTER_MAX)
+		{
+			targetCounters[cellIndex] -= sourceCounters[cellIndex];
+		}
+	}
+
+	return CMS_OK;
+}
+
+
+/*
+ * CmsFoldMatrix adds the counters of the source matrix to the counters of the
+ * narrower target matrix, so that source column c lands in target column
+ * c % targetWidth. Since the target width divides the source width, an item's
+ * column in the target is its source column folded the same way, and the target
+ * is a sketch of the same items with the error bound of its width. Sums saturate
+ * at the largest counter value. Both matrices must have the same depth and the
+ * target width has to divide the source width; checking that is left to the
+ * caller.
+ */
+void CmsFoldMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix)
+{
+	uint32_t targetWidth = targetMatrix->width;
+	uint32_t row = 0;
+
+	for (row = 0; row < targetMatrix->depth; row++)
+	{
+#ifdef CMS_LAYOUT_COLUMN_MAJOR
+		uint32_t column = 0;
+
+		for (column = 0; column < sourceMatrix->width; column++)
+		{
+			size_t sourceIndex = CMS_CELL_INDEX(sourceMatrix->depth, sourceMatrix->width,
+			                                    row, column);
+			size_t targetIndex = CMS_CELL_INDEX(targetMatrix->depth, targetWidth,
+			                                    row, column % targetWidth);
+
+			targetMatrix->counters[targetIndex] =
+				CmsAddSaturating(targetMatrix->counters[targetIndex],
+				                 sourceMatrix->counters[sourceIndex]);
+		}
+#else
+		uint32_t foldFactor = sourceMatrix->width / targetWidth;
+		uint32_t fold = 0;
+		CmsCounter *targetRow = targetMatrix->counters +
+		                        CMS_CELL_INDEX(targetMatrix->depth, targetWidth, row, 0);
+
+		for (fold = 0; fold < foldFactor; fold++)
+		{
+			const CmsCounter *sourceRow =
+				sourceMatrix->counters +
+				CMS_CELL_INDEX(sourceMatrix->depth, sourceMatrix->width, row,
+				               (size_t) fold * targetWidth);
+
+			CmsMergeCounters(targetRow, sourceRow, targetWidth);
+		}
+#endif
+	}
+}
+
+
+/*
+ * CmsInnerProduct estimates the inner product of the frequency vectors counted by
+ * two matrices, which is the size of the equi-join between their items. Every
+ * row gives an estimate as the dot product of its counters, and the smallest one
+ * is returned. For linear sketches the estimate never falls below the inner
+ * product and exceeds it by at most the error bound times the product of the
+ * total counts with the usual confidence. Rows are contiguous in row-major
+ * layout and are multiplied with the vectorized kernel. Both matrices must have
+ * the same dimensions; checking that is left to the caller.
+ */
+double CmsInnerProduct(const CmsMatrix *firstMatrix, const CmsMatrix *secondMatrix)
+{
+	double innerProduct = 0.0;
+	uint32_t row = 0;
+
+	for (row = 0; row < firstMatrix->depth; row++)
+	{
+		double rowProduct = 0.0;
+#ifdef CMS_LAYOUT_COLUMN_MAJOR
+		uint32_t column = 0;
+
+		for (column = 0; column < firstMatrix->width; column++)
+		{
+			size_t counterIndex = CMS_CELL_INDEX(firstMatrix->depth, firstMatrix->width,
+			                                     row, column);
+
+			rowProduct += (double) firstMatrix->counters[counterIndex] *
+			              (double) secondMatrix->counters[counterIndex];
+		}
+#else
+		size_t rowOffset = CMS_CELL_INDEX(firstMatrix->depth, firstMatrix->width, row, 0);
+
+		rowProduct = CmsDotCounters(firstMatrix->counters + rowOffset,
+		                            secondMatrix->counters + rowOffset,
+		                            firstMatrix->width);
+#endif
+
+		if (row == 0 || rowProduct < innerProduct)
+		{
+			innerProduct = rowProduct;
+		}
+	}
+
+	return innerProduct;
+}
+
+
+/*
+ * CmsBufferSlotCount rounds the requested number of buffer slots up to a power
+ * of two, which lets slots be picked by masking hash values.
+ */
+uint32_t CmsBufferSlotCount(uint32_t requestedSlotCount)
+{
+	uint32_t slotCount = 1;
+
+	while (slotCount < requestedSlotCount && slotCount < (UINT32_C(1) << 31))
+	{
+		slotCount <<= 1;
+	}
+
+	return slotCount;
+}
+
+
+/*
+ * CmsInitBuffer sets up an empty update buffer on the given entry array, which
+ * must hold slotCount entries. The slot count must be a power of two.
+ */
+void CmsInitBuffer(CmsUpdateBuffer *buffer, CmsBufferEntry *entries, uint32_t slotCount)
+{
+	buffer->slotCount = slotCount;
+	buffer->entryCount = 0;
+	buffer->entries = entries;
+
+	memset(entries, 0, sizeof(CmsBufferEntry) * slotCount);
+}
+
+
+/*
+ * CmsBufferUpdateHashed adds the weight of an item to its buffer entry. Slots are
+ * probed linearly, and empty slots have zero weight. Once three quarters of the
+ * slots are used, the buffer is flushed before a new item is inserted, which
+ * keeps probe sequences short.
+ */
+void CmsBufferUpdateHashed(CmsMatrix *matrix, CmsUpdateBuffer *buffer,
+                           const uint64_t *hashValueArray, CmsCounter weight)
+{
+	uint32_t slotMask = buffer->slotCount - 1;
+	uint32_t slotIndex = (uint32_t) hashValueArray[0] & slotMask;
+	CmsBufferEntry *entry = NULL;
+
+	if (weight == 0)
+	{
+		return;
+	}
+
+	for (;;)
+	{
+		entry = &buffer->entries[slotIndex];
+
+		if (entry->weight == 0)
+		{
+			break;
+		}
+		else if (entry->hashValueArray[0] == hashValueArray[0] &&
+		         entry->hashValueArray[1] == hashValueArray[1])
+		{
+			CmsCounter newWeight = entry->weight + weight;
+
+			entry->weight = (newWeight < weight) ? CMS_COUNTER_MAX : newWeight;
+			return;
+		}
+
+		slotIndex = (slotIndex + 1) & slotMask;
+	}
+
+	if ((uint64_t) (buffer->entryCount + 1) * 4 > (uint64_t) buffer->slotCount * 3)
+	{
+		CmsFlushBuffer(matrix, buffer);
+		entry = &buffer->entries[(uint32_t) hashValueArray[0] & slotMask];
+	}
+
+	entry->hashValueArray[0] = hashValueArray[0];
+	entry->hashValueArray[1] = hashValueArray[1];
+	entry->weight = weight;
+	buffer->entryCount++;
+}
+
+
+/*
+ * CmsFlushBuffer applies every buffered item to the sketch as one weighted
+ * conservative update and empties the buffer.
+ */
+void CmsFlushBuffer(CmsMatrix *matrix, CmsUpdateBuffer *buffer)
+{
+	uint32_t slotIndex = 0;
+
+	if (buffer->entryCount == 0)
+	{
+		return;
+	}
+
+	for (slotIndex = 0; slotIndex < buffer->slotCount; slotIndex++)
+	{
+		CmsBufferEntry *entry = &buffer->entries[slotIndex];
+
+		if (entry->weight != 0)
+		{
+			CmsUpdateHashed(matrix, entry->hashValueArray, entry->weight);
+		}
+	}
+
+	memset(buffer->entries, 0, sizeof(CmsBufferEntry) * buffer->slotCount);
+	buffer->entryCount = 0;
+}
+
+
+/*
+ * CmsBatchMemorySize returns the number of bytes CmsInitBatch needs for a batch
+ * of the given capacity on a sketch of the given depth.
+ */
+size_t CmsBatchMemorySize(uint32_t capacity, uint32_t depth)
+{
+	return _batchColumnsOffset(capacity) + sizeof(uint32_t) * capacity * depth;
+}
+
+
+/*
+ * CmsInitBatch sets up an empty update batch in the given memory, which must be
+ * at least CmsBatchMemorySize bytes and aligned for 64-bit values. The batch can
+ * only be used with sketches of at most the given depth.
+ */
+void CmsInitBatch(CmsUpdateBatch *batch, void *memory, uint32_t capacity, uint32_t depth)
+{
+	char *batchMemory = (char *) memory;
+
+	batch->capacity = capacity;
+	batch->depth = depth;
+	batch->itemCount = 0;
+	batch->hashValueArrays = (uint64_t *) batchMemory;
+	batch->weights = (CmsCounter *) (batchMemory + _batchWeightsOffset(capacity));
+	batch->columns = (uint32_t *) (batchMemory + _batchColumnsOffset(capacity));
+}
+
+
+/*
+ * CmsBatchUpdateHashed appends an item to the batch, and applies the batch to the
+ * sketch once it is full.
+ */
+void CmsBatchUpdateHashed(CmsMatrix *matrix, CmsUpdateBatch *batch,
+                          const uint64_t *hashValueArray, CmsCounter weight)
+{
+	uint32_t itemIndex = batch->itemCount;
+
+	assert(matrix->depth <= batch->depth);
+
+	batch->hashValueArrays[2 * itemIndex] = hashValueArray[0];
+	batch->hashValueArrays[2 * itemIndex + 1] = hashValueArray[1];
+	batch->weights[itemIndex] = weight;
+	batch->itemCount++;
+
+	if (batch->itemCount == batch->capacity)
+	{
+		CmsFlushBatch(matrix, batch);
+	}
+}
+
+
+/* CmsFlushBatch applies the items of the batch to the sketch and empties it. */
+void CmsFlushBatch(CmsMatrix *matrix, CmsUpdateBatch *batch)
+{
+	if (batch->itemCount == 0)
+	{
+		return;
+	}
+
+	assert(matrix->depth <= batch->depth);
+
+	CmsUpdateHashedArray(matrix, batch->hashValueArrays, batch->weights,
+	                     batch->itemCount, batch->columns);
+	batch->itemCount = 0;
+}
+
+
+/*
+ * CmsUpdateHashedArray conservatively updates the sketch with a run of items,
+ * whose hash values are stored as consecutive pairs. Weights may be NULL, in
+ * which case every item has weight one. The columns array must hold depth *
+ * itemCount entries and is used as scratch space.
+ *
+ * The columns of all items are computed row by row first. This uses the scalar
+ * column index rather than CmsComputeColumns, which measured slower in this loop.
+ * The items are then updated in order, exactly like CmsUpdateHashed does,
+ * but the counters of the item CMS_PREFETCH_DISTANCE positions ahead are
+ * prefetched before each update. This overlaps the cache misses of different
+ * items instead of taking them one after the other. Sorting or partitioning the
+ * updates by cache line would improve locality further, but would change the
+ * order of conservative updates and therefore the resulting counters.
+ */
+void CmsUpdateHashedArray(CmsMatrix *matrix, const uint64_t *hashValueArrays,
+                          const CmsCounter *weights, size_t itemCount, uint32_t *columns)
+{
+	uint32_t depth = matrix->depth;
+	uint32_t width = matrix->width;
+	uint32_t row = 0;
+	size_t itemIndex = 0;
+
+	for (row = 0; row < depth; row++)
+	{
+		uint32_t *rowColumns = columns + (size_t) row * itemCount;
+
+		for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+		{
+			rowColumns[itemIndex] = CmsColumnIndex(hashValueArrays + 2 * itemIndex, row,
+			                                       width);
+		}
+	}
+
+	for (itemIndex = 0; itemIndex < itemCount && itemIndex < CMS_PREFETCH_DISTANCE;
+	     itemIndex++)
+	{
+		_prefetchItemCounters(matrix, columns, itemCount, itemIndex);
+	}
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		CmsCounter weight = (weights != NULL) ? weights[itemIndex] : 1;
+		CmsCounter minFrequency = CMS_COUNTER_MAX;
+		CmsCounter newFrequency = 0;
+
+		if (itemIndex + CMS_PREFETCH_DISTANCE < itemCount)
+		{
+			_prefetchItemCounters(matrix, columns, itemCount,
+			                      itemIndex + CMS_PREFETCH_DISTANCE);
+		}
+
+		for (row = 0; row < depth; row++)
+		{
+			uint32_t column = columns[(size_t) row * itemCount + itemIndex];
+			CmsCounter counterFrequency =
+				matrix->counters[CMS_CELL_INDEX(depth, width, row, column)];
+
+			if (counterFrequency < minFrequency)
+			{
+				minFrequency = counterFrequency;
+			}
+		}
+
+		newFrequency = minFrequency + weight;
+		if (newFrequency < minFrequency)
+		{
+			newFrequency = CMS_COUNTER_MAX;
+		}
+
+		for (row = 0; row < depth; row++)
+		{
+			uint32_t column = columns[(size_t) row * itemCount + itemIndex];
+			size_t counterIndex = CMS_CELL_INDEX(depth, width, row, column);
+
+			if (newFrequency > matrix->counters[counterIndex])
+			{
+				matrix->counters[counterIndex] = newFrequency;
+			}
+		}
+	}
+}
+
+
+/*
+ * CmsFilterEstimateHashed returns the frequency estimate of an item in a sketch
+ * with a hot-item filter. Filtered items are answered from the filter, all other
+ * items from the counter matrix.
+ */
+CmsCounter CmsFilterEstimateHashed(const CmsMatrix *matrix, const CmsFilter *filter,
+                                   const uint64_t *hashValueArray)
+{
+	CmsFilterEntry *entry = _findFilterEntry(filter->entries, filter->size,
+	                                         hashValueArray);
+
+	if (entry != NULL)
+	{
+		return entry->newCount;
+	}
+
+	return CmsEstimateHashed(matrix, hashValueArray);
+}
+
+
+/*
+ * CmsFilterUpdateHashed adds the given weight to an item of a sketch with a
+ * hot-item filter and returns the new frequency estimate of the item. Filtered
+ * items are counted in the filter. Other items take an empty entry if there is
+ * one, starting from their current estimate. Otherwise they update the counter
+ * matrix, and if their new estimate exceeds the smallest filtered estimate, they
+ * replace that item in the filter. The replaced item first adds the weight it
+ * gathered in the filter to the counter matrix.
+ */
+CmsCounter CmsFilterUpdateHashed(CmsMatrix *matrix, CmsFilter *filter,
+                                 const uint64_t *hashValueArray, CmsCounter weight)
+{
+	CmsFilterEntry *emptyEntry = NULL;
+	CmsFilterEntry *minEntry = NULL;
+	CmsCounter newFrequency = 0;
+	uint32_t entryIndex = 0;
+
+	for (entryIndex = 0; entryIndex < filter->size; entryIndex++)
+	{
+		CmsFilterEntry *entry = &filter->entries[entryIndex];
+
+		if (entry->newCount == 0)
+		{
+			if (emptyEntry == NULL)
+			{
+				emptyEntry = entry;
+			}
+		}
+		else if (entry->hashValueArray[0] == hashValueArray[0] &&
+		         entry->hashValueArray[1] == hashValueArray[1])
+		{
+			entry->newCount = _addCountersSaturating(entry->newCount, weight);
+			return entry->newCount;
+		}
+		else if (minEntry == NULL || entry->newCount < minEntry->newCount)
+		{
+			minEntry = entry;
+		}
+	}
+
+	if (weight == 0)
+	{
+		return CmsEstimateHashed(matrix, hashValueArray);
+	}
+	else if (emptyEntry != NULL)
+	{
+		CmsCounter currentFrequency = CmsEstimateHashed(matrix, hashValueArray);
+
+		emptyEntry->hashValueArray[0] = hashValueArray[0];
+		emptyEntry->hashValueArray[1] = hashValueArray[1];
+		emptyEntry->oldCount = currentFrequency;
+		emptyEntry->newCount = _addCountersSaturating(currentFrequency, weight);
+		return emptyEntry->newCount;
+	}
+
+	newFrequency = CmsUpdateHashed(matrix, hashValueArray, weight);
+
+	if (minEntry != NULL && newFrequency > minEntry->newCount)
+	{
+		CmsCounter filteredWeight = minEntry->newCount - minEntry->oldCount;
+
+		if (filteredWeight > 0)
+		{
+			CmsUpdateHashed(matrix, minEntry->hashValueArray, filteredWeight);
+		}
+
+		minEntry->hashValueArray[0] = hashValueArray[0];
+		minEntry->hashValueArray[1] = hashValueArray[1];
+		minEntry->newCount = newFrequency;
+		minEntry->oldCount = newFrequency;
+	}
+
+	return newFrequency;
+}
+
+
+/*
+ * CmsMergeFilters merges the source sketch into the target sketch when both have
+ * a hot-item filter of the same size, and reconciles their filters. Items of both
+ * filters become candidates. Their new estimate is the smaller one of two upper
+ * bounds: the sum of their estimates in either sketch, and their estimate from
+ * the merged counter matrix plus the weight they gathered in either filter. The
+ * most frequent candidates form the new target filter, and the others add what
+ * the merged matrix doesn't reflect yet to it. The scratch array must hold twice
+ * as many entries as a filter.
+ */
+void CmsMergeFilters(CmsMatrix *targetMatrix, CmsFilter *targetFilter,
+                     const CmsMatrix *sourceMatrix, const CmsFilter *sourceFilter,
+                     CmsFilterEntry *scratchEntries)
+{
+	const CmsFilter *filters[2] = {targetFilter, sourceFilter};
+	uint32_t candidateCount = 0;
+	uint32_t candidateIndex = 0;
+	uint32_t filterIndex = 0;
+	uint32_t entryIndex = 0;
+
+	/*
+	 * Collect the candidates, with the sum of their estimates in newCount and the
+	 * sum of the weights they gathered in the filters in oldCount for now.
+	 */
+	for (filterIndex = 0; filterIndex < 2; filterIndex++)
+	{
+		const CmsFilter *filter = filters[filterIndex];
+
+		for (entryIndex = 0; entryIndex < filter->size; entryIndex++)
+		{
+			const CmsFilterEntry *entry = &filter->entries[entryIndex];
+			const CmsFilterEntry *targetEntry = NULL;
+			const CmsFilterEntry *sourceEntry = NULL;
+			CmsFilterEntry *candidate = NULL;
+			CmsCounter targetFrequency = 0;
+			CmsCounter sourceFrequency = 0;
+			CmsCounter filteredWeight = 0;
+
+			if (entry->newCount == 0 ||
+			    (filterIndex == 1 && _findFilterEntry(targetFilter->entries,
+			                                          targetFilter->size,
+			                                          entry->hashValueArray) != NULL))
+			{
+				continue;
+			}
+
+			targetEntry = _findFilterEntry(targetFilter->entries, targetFilter->size,
+			                               entry->hashValueArray);
+			sourceEntry = _findFilterEntry(sourceFilter->entries, sourceFilter->size,
+			                               entry->hashValueArray);
+
+			if (targetEntry != NULL)
+			{
+				targetFrequency = targetEntry->newCount;
+				filteredWeight = targetEntry->newCount - targetEntry->oldCount;
+			}
+			else
+			{
+				targetFrequency = CmsEstimateHashed(targetMatrix, entry->hashValueArray);
+			}
+
+			if (sourceEntry != NULL)
+			{
+				sourceFrequency = sourceEntry->newCount;
+				filteredWeight = _addCountersSaturating(filteredWeight,
+				                                        sourceEntry->newCount -
+				                                        sourceEntry->oldCount);
+			}
+			else
+			{
+				sourceFrequency = CmsEstimateHashed(sourceMatrix, entry->hashValueArray);
+			}
+
+			candidate = &scratchEntries[candidateCount++];
+			candidate->hashValueArray[0] = entry->hashValueArray[0];
+			candidate->hashValueArray[1] = entry->hashValueArray[1];
+			candidate->newCount = _addCountersSaturating(targetFrequency, sourceFrequency);
+			candidate->oldCount = filteredWeight;
+		}
+	}
+
+	CmsMergeMatrix(targetMatrix, sourceMatrix);
+
+	for (candidateIndex = 0; candidateIndex < candidateCount; candidateIndex++)
+	{
+		CmsFilterEntry *candidate = &scratchEntries[candidateIndex];
+		CmsCounter mergedFrequency = CmsEstimateHashed(targetMatrix,
+		                                               candidate->hashValueArray);
+		CmsCounter filteredFrequency = _addCountersSaturating(mergedFrequency,
+		                                                      candidate->oldCount);
+
+		if (filteredFrequency < candidate->newCount)
+		{
+			candidate->newCount = filteredFrequency;
+		}
+
+		candidate->oldCount = (mergedFrequency < candidate->newCount) ?
+		                      mergedFrequency : candidate->newCount;
+	}
+
+	qsort(scratchEntries, candidateCount, sizeof(CmsFilterEntry), _compareFilterEntries);
+
+	memset(targetFilter->entries, 0, sizeof(CmsFilterEntry) * targetFilter->size);
+	for (candidateIndex = 0; candidateIndex < candidateCount; candidateIndex++)
+	{
+		CmsFilterEntry *candidate = &scratchEntries[candidateIndex];
+
+		if (candidateIndex < targetFilter->size && candidate->newCount > 0)
+		{
+			targetFilter->entries[candidateIndex] = *candidate;
+		}
+		else if (candidate->newCount > candidate->oldCount)
+		{
+			CmsUpdateHashed(targetMatrix, candidate->hashValueArray,
+			                candidate->newCount - candidate->oldCount);
+		}
+	}
+}
+
+
+/*
+ * CmsFlushFilter adds the weight the filtered items gathered in the filter to the
+ * counter matrix, so that the matrix alone counts all items. The items stay in
+ * the filter, which now starts counting from their current estimates.
+ */
+void CmsFlushFilter(CmsMatrix *matrix, CmsFilter *filter)
+{
+	uint32_t entryIndex = 0;
+
+	for (entryIndex = 0; entryIndex < filter->size; entryIndex++)
+	{
+		CmsFilterEntry *entry = &filter->entries[entryIndex];
+
+		if (entry->newCount > entry->oldCount)
+		{
+			CmsUpdateHashed(matrix, entry->hashValueArray,
+			                entry->newCount - entry->oldCount);
+			entry->oldCount = entry->newCount;
+		}
+	}
+}
+
+
+/*
+ * CmsWindowMatrixSize returns the number of bytes needed for the counters of a
+ * sliding-window sketch with the given number of buckets.
+ */
+size_t CmsWindowMatrixSize(uint32_t depth, uint32_t width, uint32_t bucketCount)
+{
+	return CmsMatrixSize(depth, width) * (size_t) bucketCount;
+}
+
+
+/*
+ * CmsWindowEstimateHashed returns the frequency estimate of an item over the
+ * whole window, which is the sum of its estimates in every bucket. Taking the
+ * minimum over rows per bucket before summing gives a tighter estimate than the
+ * minimum of per-row sums. The bucket counters of the item's cell in each row are
+ * contiguous and are reduced with the vectorized minimum and sum kernels. The
+ * window can't have more than CMS_WINDOW_MAX_BUCKETS buckets.
+ */
+CmsCounter CmsWindowEstimateHashed(const CmsWindowMatrix *window,
+                                   const uint64_t *hashValueArray)
+{
+	CmsCounter bucketFrequencies[CMS_WINDOW_MAX_BUCKETS];
+	size_t bucketSize = sizeof(CmsCounter) * window->bucketCount;
+	uint32_t hashIndex = 0;
+
+	if (window->depth == 0)
+	{
+		return CMS_COUNTER_MAX;
+	}
+
+	memcpy(bucketFrequencies, _windowCellCounters(window, 0, hashValueArray), bucketSize);
+
+	for (hashIndex = 1; hashIndex < window->depth; hashIndex++)
+	{
+		CmsMinCounters(bucketFrequencies,
+		               _windowCellCounters(window, hashIndex, hashValueArray),
+		               window->bucketCount);
+	}
+
+	return CmsSumCounters(bucketFrequencies, window->bucketCount);
+}
+
+
+/*
+ * CmsWindowBucketEstimateHashed returns the frequency estimate of an item in the
+ * given bucket, which is the minimum of its counters in that bucket over all rows.
+ */
+CmsCounter CmsWindowBucketEstimateHashed(const CmsWindowMatrix *window, uint32_t bucket,
+                                         const uint64_t *hashValueArray)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minFrequency = CMS_COUNTER_MAX;
+
+	for (hashIndex = 0; hashIndex < window->depth; hashIndex++)
+	{
+		CmsCounter counterFrequency =
+			_windowCellCounters(window, hashIndex, hashValueArray)[bucket];
+
+		if (counterFrequency < minFrequency)
+		{
+			minFrequency = counterFrequency;
+		}
+	}
+
+	return minFrequency;
+}
+
+
+/*
+ * CmsWindowUpdateHashed adds the given weight to the item in the given bucket and
+ * returns the new frequency estimate of the item in that bucket. Like
+ * CmsUpdateHashed, it only raises the counters which are below the new estimate.
+ */
+CmsCounter CmsWindowUpdateHashed(CmsWindowMatrix *window, uint32_t bucket,
+                                 const uint64_t *hashValueArray, CmsCounter weight)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minFrequency = CmsWindowBucketEstimateHashed(window, bucket,
+	                                                        hashValueArray);
+	CmsCounter newFrequency = _addCountersSaturating(minFrequency, weight);
+
+	for (hashIndex = 0; hashIndex < window->depth; hashIndex++)
+	{
+		CmsCounter *cellCounters = _windowCellCounters(window, hashIndex, hashValueArray);
+
+		if (newFrequency > cellCounters[bucket])
+		{
+			cellCounters[bucket] = newFrequency;
+		}
+	}
+
+	return newFrequency;
+}
+
+
+/*
+ * CmsWindowAdvance moves the current bucket of the window forward by the given
+ * number of steps and returns the new current bucket. Every bucket the window
+ * moves onto held the oldest interval, so its counters are zeroed in place. If
+ * the window moves by its whole length or more, all counters are zeroed.
+ */
+uint32_t CmsWindowAdvance(CmsWindowMatrix *window, uint32_t currentBucket,
+                          uint64_t stepCount)
+{
+	size_t cellCount = (size_t) window->depth * window->width;
+	size_t cellIndex = 0;
+	uint32_t bucketCount = window->bucketCount;
+	uint32_t firstBucket = 0;
+	uint32_t firstRunLength = 0;
+	uint32_t secondRunLength = 0;
+
+	if (stepCount == 0)
+	{
+		return currentBucket;
+	}
+	else if (stepCount >= bucketCount)
+	{
+		memset(window->counters, 0,
+		       CmsWindowMatrixSize(window->depth, window->width, bucketCount));
+
+		return (uint32_t) ((currentBucket + stepCount) % bucketCount);
+	}
+
+	/* the expired buckets form one run, or two if they wrap around the ring */
+	firstBucket = (currentBucket + 1) % bucketCount;
+	firstRunLength = (uint32_t) stepCount;
+	if (firstBucket + firstRunLength > bucketCount)
+	{
+		secondRunLength = firstBucket + firstRunLength - bucketCount;
+		firstRunLength = bucketCount - firstBucket;
+	}
+
+	for (cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		CmsCounter *cellCounters = window->counters + cellIndex * bucketCount;
+
+		memset(cellCounters + firstBucket, 0, sizeof(CmsCounter) * firstRunLength);
+		memset(cellCounters, 0, sizeof(CmsCounter) * secondRunLength);
+	}
+
+	return (uint32_t) ((currentBucket + stepCount) % bucketCount);
+}
+
+
+/*
+ * CmsNextRangeNode returns the next node which covers the slot range from
+ * *nextSlot up to and including lastSlot, and moves *nextSlot past it. Nodes are
+ * returned from the start of the range, each the largest aligned node of at most
+ * maxLevel which fits into the rest of the range, so together they are the fewest
+ * nodes which cover it. The function returns 0 once the range is covered.
+ * lastSlot has to be smaller than UINT64_MAX and maxLevel can't be larger than
+ * CMS_RANGE_MAX_LEVEL.
+ */
+int CmsNextRangeNode(uint64_t *nextSlot, uint64_t lastSlot, uint32_t maxLevel,
+                     CmsRangeNode *node)
+{
+	uint64_t firstSlot = *nextSlot;
+	uint32_t level = 0;
+
+	if (firstSlot > lastSlot)
+	{
+		return 0;
+	}
+
+	/* grow the node while it stays aligned and inside the range */
+	while (level < maxLevel)
+	{
+		uint64_t largerNodeSize = (uint64_t) 1 << (level + 1);
+
+		if ((firstSlot & (largerNodeSize - 1)) != 0 ||
+		    lastSlot - firstSlot < largerNodeSize - 1)
+		{
+			break;
+		}
+
+		level++;
+	}
+
+	node->level = level;
+	node->index = firstSlot >> level;
+	*nextSlot = firstSlot + ((uint64_t) 1 << level);
+
+	return 1;
+}
+
+
+/*
+ * CmsDyadicMatrixSize returns the number of bytes needed for the counters of a
+ * dyadic range sketch with the given number of levels.
+ */
+size_t CmsDyadicMatrixSize(uint32_t depth, uint32_t width, uint32_t levelCount)
+{
+	return CmsMatrixSize(depth, width) * levelCount;
+}
+
+
+/*
+ * CmsDyadicUpdate adds the given weight to the slot on every level of the dyadic
+ * sketch, that is to every range node which contains the slot, and returns the
+ * new frequency estimate of the slot itself. Hashed levels are updated
+ * conservatively like CmsUpdateHashed, and exact levels saturate at the largest
+ * counter value.
+ */
+CmsCounter CmsDyadicUpdate(CmsDyadicMatrix *dyadic, uint64_t slot, CmsCounter weight)
+{
+	uint32_t level = 0;
+	CmsCounter slotFrequency = 0;
+
+	for (level = 0; level < dyadic->levelCount; level++)
+	{
+		CmsMatrix levelMatrix = _dyadicLevelMatrix(dyadic, level);
+		CmsRangeNode node;
+		CmsCounter nodeFrequency = 0;
+
+		node.level = level;
+		node.index = slot >> level;
+
+		if (_dyadicLevelIsExact(dyadic, level))
+		{
+			size_t counterIndex = CMS_CELL_INDEX(levelMatrix.depth, levelMatrix.width,
+			                                     0, (uint32_t) node.index);
+
+			nodeFrequency = _addCountersSaturating(levelMatrix.counters[counterIndex],
+			                                       weight);
+			levelMatrix.counters[counterIndex] = nodeFrequency;
+		}
+		else
+		{
+			uint64_t hashValueArray[2] = {0, 0};
+
+			_hashRangeNode(&node, hashValueArray);
+			nodeFrequency = CmsUpdateHashed(&levelMatrix, hashValueArray, weight);
+		}
+
+		if (level == 0)
+		{
+			slotFrequency = nodeFrequency;
+		}
+	}
+
+	return slotFrequency;
+}
+
+
+/*
+ * CmsDyadicEstimateNode returns the estimated number of items in the slots of the
+ * given range node. The node's level has to be below the level count.
+ */
+CmsCounter CmsDyadicEstimateNode(const CmsDyadicMatrix *dyadic, const CmsRangeNode *node)
+{
+	CmsMatrix levelMatrix = _dyadicLevelMatrix(dyadic, node->level);
+	uint64_t hashValueArray[2] = {0, 0};
+
+	if (_dyadicLevelIsExact(dyadic, node->level))
+	{
+		size_t counterIndex = CMS_CELL_INDEX(levelMatrix.depth, levelMatrix.width,
+		                                     0, (uint32_t) node->index);
+
+		return levelMatrix.counters[counterIndex];
+	}
+
+	_hashRangeNode(node, hashValueArray);
+
+	return CmsEstimateHashed(&levelMatrix, hashValueArray);
+}
+
+
+/*
+ * CmsDyadicEstimateRange returns the estimated number of items in the slots from
+ * firstSlot up to and including lastSlot. The range is covered by at most two
+ * nodes per level, so the estimate sums O(levelCount) node estimates and its
+ * error grows with the number of levels instead of the length of the range.
+ * lastSlot has to be inside the domain of the sketch.
+ */
+CmsCounter CmsDyadicEstimateRange(const CmsDyadicMatrix *dyadic, uint64_t firstSlot,
+                                  uint64_t lastSlot)
+{
+	uint64_t nextSlot = firstSlot;
+	CmsRangeNode node;
+	CmsCounter rangeFrequency = 0;
+
+	while (CmsNextRangeNode(&nextSlot, lastSlot, dyadic->levelCount - 1, &node))
+	{
+		rangeFrequency = _addCountersSaturating(rangeFrequency,
+		                                        CmsDyadicEstimateNode(dyadic, &node));
+	}
+
+	return rangeFrequency;
+}
+
+
+/*
+ * CmsDyadicQuantile returns the slot which holds the item of the given rank, one
+ * being the smallest item. It walks down from the node which covers the whole
+ * domain and moves to the left child if its estimate reaches the remaining rank,
+ * and to the right child with the left child's items subtracted otherwise. As
+ * estimates never undercount, the walk may turn left too early, so the returned
+ * slot can be smaller than the exact one but not larger. Ranks above the
+ * estimated number of items return the last slot.
+ */
+uint64_t CmsDyadicQuantile(const CmsDyadicMatrix *dyadic, CmsCounter rank)
+{
+	uint32_t level = dyadic->levelCount;
+	uint64_t index = 0;
+
+	while (level > 0)
+	{
+		CmsRangeNode leftChild;
+		CmsCounter leftFrequency = 0;
+
+		level--;
+		leftChild.level = level;
+		leftChild.index = index << 1;
+		leftFrequency = CmsDyadicEstimateNode(dyadic, &leftChild);
+
+		if (rank <= leftFrequency)
+		{
+			index = leftChild.index;
+		}
+		else
+		{
+			rank -= leftFrequency;
+			index = leftChild.index + 1;
+		}
+	}
+
+	return index;
+}
+
+
+/*
+ * _dyadicLevelMatrix returns a view of the counters of the given level of the
+ * dyadic sketch.
+ */
+static CmsMatrix _dyadicLevelMatrix(const CmsDyadicMatrix *dyadic, uint32_t level)
+{
+	CmsMatrix levelMatrix;
+	size_t levelCounterCount = (size_t) dyadic->depth * dyadic->width;
+
+	levelMatrix.depth = dyadic->depth;
+	levelMatrix.width = dyadic->width;
+	levelMatrix.counters = dyadic->counters + level * levelCounterCount;
+
+	return levelMatrix;
+}
+
+
+/*
+ * _dyadicLevelIsExact returns whether the given level has no more nodes than the
+ * sketch has columns, so that every node can have a counter of its own.
+ */
+static int _dyadicLevelIsExact(const CmsDyadicMatrix *dyadic, uint32_t level)
+{
+	uint32_t nodeBits = dyadic->levelCount - level;
+
+	return nodeBits < 32 && (UINT32_C(1) << nodeBits) <= dyadic->width;
+}
+
+
+/*
+ * _hashRangeNode hashes the level and index of the given range node. Nodes of
+ * different levels get independent hash values, so the levels of a dyadic sketch
+ * don't collide in the same way.
+ */
+static void _hashRangeNode(const CmsRangeNode *node, uint64_t *hashValueArray)
+{
+	uint64_t nodeKey[2];
+
+	nodeKey[0] = node->index;
+	nodeKey[1] = node->level;
+
+	CmsHashBytes(nodeKey, sizeof(nodeKey), hashValueArray);
+}
+
+/*
+ * CmsPrefixMatrixSize returns the number of bytes needed for the counters and
+ * the candidate tables of a prefix sketch with the given number of levels.
+ */
+size_t CmsPrefixMatrixSize(uint32_t depth, uint32_t width, uint32_t levelCount,
+                           uint32_t candidateCount)
+{
+	return (CmsMatrixSize(depth, width) +
+	        sizeof(CmsPrefixCandidate) * candidateCount) * levelCount;
+}
+
+
+/*
+ * CmsMaskPrefix keeps the first prefixLength bits of the given address and
+ * clears the others, which gives the network prefix of that length.
+ */
+void CmsMaskPrefix(const uint64_t *address, uint32_t prefixLength, uint64_t *prefix)
+{
+	if (prefixLength >= 64)
+	{
+		prefix[0] = address[0];
+		prefix[1] = (prefixLength >= 128) ? address[1] :
+		            address[1] & ~(UINT64_MAX >> (prefixLength - 64));
+	}
+	else
+	{
+		prefix[0] = (prefixLength == 0) ? 0 : address[0] & ~(UINT64_MAX >> prefixLength);
+		prefix[1] = 0;
+	}
+}
+
+
+/*
+ * CmsHashPrefix hashes the given prefix together with its length, so prefixes of
+ * different lengths get independent hash values even if their bits are equal.
+ */
+void CmsHashPrefix(const uint64_t *prefix, uint32_t prefixLength, uint64_t *hashValueArray)
+{
+	uint64_t prefixKey[3];
+
+	prefixKey[0] = prefix[0];
+	prefixKey[1] = prefix[1];
+	prefixKey[2] = prefixLength;
+
+	CmsHashBytes(prefixKey, sizeof(prefixKey), hashValueArray);
+}
+
+
+/*
+ * CmsPrefixUpdateHashed adds the given weight to the prefixes of one address on
+ * levelCount consecutive levels, starting at firstLevel. The prefixes and their
+ * hash values are stored as consecutive pairs, one per level. The columns of all
+ * levels are computed row by row with the vectorized CmsComputeColumns, and the
+ * columns array must hold depth * levelCount entries for that. Every level is
+ * then updated conservatively like CmsUpdateHashed, and the prefix is offered to
+ * the candidate table of the level with its new estimate. A prefix replaces the
+ * candidate with the smallest count once its estimate exceeds that count.
+ */
+void CmsPrefixUpdateHashed(CmsPrefixMatrix *matrix, uint32_t firstLevel,
+                           uint32_t levelCount, const uint64_t *prefixes,
+                           const uint64_t *hashValueArrays, CmsCounter weight,
+                           uint32_t *columns)
+{
+	uint32_t depth = matrix->depth;
+	uint32_t width = matrix->width;
+	uint32_t row = 0;
+	uint32_t levelIndex = 0;
+
+	for (row = 0; row < depth; row++)
+	{
+		CmsComputeColumns(hashValueArrays, levelCount, row, width,
+		                  columns + (size_t) row * levelCount);
+	}
+
+	for (levelIndex = 0; levelIndex < levelCount; levelIndex++)
+	{
+		uint32_t level = firstLevel + levelIndex;
+		CmsMatrix levelMatrix = _prefixLevelMatrix(matrix, level);
+		CmsCounter minFrequency = CMS_COUNTER_MAX;
+		CmsCounter newFrequency = 0;
+
+		for (row = 0; row < depth; row++)
+		{
+			uint32_t column = columns[(size_t) row * levelCount + levelIndex];
+			CmsCounter counterFrequency =
+				levelMatrix.counters[CMS_CELL_INDEX(depth, width, row, column)];
+
+			if (counterFrequency < minFrequency)
+			{
+				minFrequency = counterFrequency;
+			}
+		}
+
+		newFrequency = _addCountersSaturating(minFrequency, weight);
+
+		for (row = 0; row < depth; row++)
+		{
+			uint32_t column = columns[(size_t) row * levelCount + levelIndex];
+			size_t counterIndex = CMS_CELL_INDEX(depth, width, row, column);
+
+			if (newFrequency > levelMatrix.counters[counterIndex])
+			{
+				levelMatrix.counters[counterIndex] = newFrequency;
+			}
+		}
+
+		_offerPrefixCandidate(matrix->candidates + (size_t) level * matrix->candidateCount,
+		                      matrix->candidateCount, prefixes + 2 * levelIndex,
+		                      newFrequency);
+	}
+}
+
+
+/*
+ * CmsPrefixEstimateHashed returns the frequency estimate of the prefix with the
+ * given hash values on the given level.
+ */
+CmsCounter CmsPrefixEstimateHashed(const CmsPrefixMatrix *matrix, uint32_t level,
+                                   const uint64_t *hashValueArray)
+{
+	CmsMatrix levelMatrix = _prefixLevelMatrix(matrix, level);
+
+	return CmsEstimateHashed(&levelMatrix, hashValueArray);
+}
+
+
+/*
+ * CmsPrefixHeavyHitters finds the hierarchical heavy hitters among the candidates
+ * of levelCount consecutive levels, starting at firstLevel, whose prefix lengths
+ * have to be increasing. Levels are visited from the longest prefixes up. A
+ * candidate is a heavy hitter if its estimate, less the estimates of the heavy
+ * hitters below it which no other heavy hitter below it contains, reaches the
+ * threshold. This conditioned frequency keeps a single heavy address from making
+ * all of its prefixes heavy. The hitters array must hold levelCount *
+ * candidateCount entries, and the number of heavy hitters is returned.
+ */
+uint32_t CmsPrefixHeavyHitters(const CmsPrefixMatrix *matrix, const uint8_t *prefixLengths,
+                               uint32_t firstLevel, uint32_t levelCount,
+                               CmsCounter threshold, CmsPrefixHitter *hitters)
+{
+	uint32_t hitterCount = 0;
+	uint32_t levelIndex = levelCount;
+
+	while (levelIndex > 0)
+	{
+		uint32_t level = firstLevel + (--levelIndex);
+		uint32_t prefixLength = prefixLengths[level];
+		const CmsPrefixCandidate *candidates =
+			matrix->candidates + (size_t) level * matrix->candidateCount;
+		uint32_t longerHitterCount = hitterCount;
+		uint32_t candidateIndex = 0;
+
+		for (candidateIndex = 0; candidateIndex < matrix->candidateCount; candidateIndex++)
+		{
+			const CmsPrefixCandidate *candidate = &candidates[candidateIndex];
+			uint64_t hashValueArray[2] = {0, 0};
+			CmsCounter frequency = 0;
+			CmsCounter hitterFrequency = 0;
+			CmsPrefixHitter *hitter = NULL;
+			uint32_t hitterIndex = 0;
+
+			if (candidate->count == 0)
+			{
+				continue;
+			}
+
+			CmsHashPrefix(candidate->prefix, prefixLength, hashValueArray);
+			frequency = CmsPrefixEstimateHashed(matrix, level, hashValueArray);
+			if (frequency < threshold)
+			{
+				continue;
+			}
+
+			for (hitterIndex = 0; hitterIndex < longerHitterCount; hitterIndex++)
+			{
+				if (!hitters[hitterIndex].covered &&
+				    _prefixContains(candidate->prefix, prefixLength,
+				                    hitters[hitterIndex].prefix))
+				{
+					hitterFrequency = _addCountersSaturating(hitterFrequency,
+					                                         hitters[hitterIndex].frequency);
+				}
+			}
+
+			if (frequency <= hitterFrequency || frequency - hitterFrequency < threshold)
+			{
+				continue;
+			}
+
+			for (hitterIndex = 0; hitterIndex < longerHitterCount; hitterIndex++)
+			{
+				if (_prefixContains(candidate->prefix, prefixLength,
+				                    hitters[hitterIndex].prefix))
+				{
+					hitters[hitterIndex].covered = 1;
+				}
+			}
+
+			hitter = &hitters[hitterCount++];
+			hitter->level = level;
+			hitter->covered = 0;
+			hitter->prefix[0] = candidate->prefix[0];
+			hitter->prefix[1] = candidate->prefix[1];
+			hitter->frequency = frequency;
+			hitter->conditionedFrequency = frequency - hitterFrequency;
+		}
+	}
+
+	return hitterCount;
+}
+
+
+/*
+ * _prefixLevelMatrix returns a view of the counters of the given level of the
+ * prefix sketch.
+ */
+static CmsMatrix _prefixLevelMatrix(const CmsPrefixMatrix *matrix, uint32_t level)
+{
+	CmsMatrix levelMatrix;
+	size_t levelCounterCount = (size_t) matrix->depth * matrix->width;
+
+	levelMatrix.depth = matrix->depth;
+	levelMatrix.width = matrix->width;
+	levelMatrix.counters = matrix->counters + level * levelCounterCount;
+
+	return levelMatrix;
+}
+
+
+/*
+ * _offerPrefixCandidate records the new frequency estimate of a prefix in the
+ * candidate table of its level. The prefix updates its own entry if it has one,
+ * takes an empty entry otherwise, and replaces the candidate with the smallest
+ * count if there is no empty entry and its estimate is larger.
+ */
+static void _offerPrefixCandidate(CmsPrefixCandidate *candidates, uint32_t candidateCount,
+                                  const uint64_t *prefix, CmsCounter frequency)
+{
+	CmsPrefixCandidate *emptyCandidate = NULL;
+	CmsPrefixCandidate *minCandidate = NULL;
+	CmsPrefixCandidate *newCandidate = NULL;
+	uint32_t candidateIndex = 0;
+
+	for (candidateIndex = 0; candidateIndex < candidateCount; candidateIndex++)
+	{
+		CmsPrefixCandidate *candidate = &candidates[candidateIndex];
+
+		if (candidate->count == 0)
+		{
+			if (emptyCandidate == NULL)
+			{
+				emptyCandidate = candidate;
+			}
+		}
+		else if (candidate->prefix[0] == prefix[0] && candidate->prefix[1] == prefix[1])
+		{
+			if (frequency > candidate->count)
+			{
+				candidate->count = frequency;
+			}
+
+			return;
+		}
+		else if (minCandidate == NULL || candidate->count < minCandidate->count)
+		{
+			minCandidate = candidate;
+		}
+	}
+
+	if (emptyCandidate != NULL)
+	{
+		newCandidate = emptyCandidate;
+	}
+	else if (minCandidate != NULL && frequency > minCandidate->count)
+	{
+		newCandidate = minCandidate;
+	}
+
+	if (newCandidate != NULL)
+	{
+		newCandidate->prefix[0] = prefix[0];
+		newCandidate->prefix[1] = prefix[1];
+		newCandidate->count = frequency;
+	}
+}
+
+
+/*
+ * _prefixContains returns whether the network of the given prefix contains the
+ * other prefix, which has to be at least as long.
+ */
+static int _prefixContains(const uint64_t *prefix, uint32_t prefixLength,
+                           const uint64_t *otherPrefix)
+{
+	uint64_t maskedPrefix[2] = {0, 0};
+
+	CmsMaskPrefix(otherPrefix, prefixLength, maskedPrefix);
+
+	return maskedPrefix[0] == prefix[0] && maskedPrefix[1] == prefix[1];
+}
+
+/*
+ * CmsCountRowZeroCounters returns the number of zero counters in the given row.
+ * Rows are contiguous in row-major layout and are scanned with the vectorized
+ * kernel.
+ */
+size_t CmsCountRowZeroCounters(const CmsMatrix *matrix, uint32_t row)
+{
+#ifdef CMS_LAYOUT_COLUMN_MAJOR
+	size_t zeroCount = 0;
+	uint32_t column = 0;
+
+	for (column = 0; column < matrix->width; column++)
+	{
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width, row, column);
+		zeroCount += (matrix->counters[counterIndex] == 0);
+	}
+
+	return zeroCount;
+#else
+	const CmsCounter *rowCounters = matrix->counters +
+	                                CMS_CELL_INDEX(matrix->depth, matrix->width, row, 0);
+
+	return CmsCountZeroCounters(rowCounters, matrix->width);
+#endif
+}
+
+
+/* CmsCountSaturatedCounters returns the number of counters at their maximum. */
+size_t CmsCountSaturatedCounters(const CmsMatrix *matrix)
+{
+	size_t cellCount = (size_t) matrix->depth * matrix->width;
+	size_t saturatedCount = 0;
+	size_t cellIndex = 0;
+
+	for (cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		saturatedCount += (matrix->counters[cellIndex] == CMS_COUNTER_MAX);
+	}
+
+	return saturatedCount;
+}
+
+
+/*
+ * CmsAdditiveError returns the additive error e*N of frequency estimates, where
+ * N is the total count of the sketch and e is the error bound its width was
+ * chosen for.
+ */
+double CmsAdditiveError(const CmsMatrix *matrix, uint64_t totalCount)
+{
+	double errorBound = exp(1) / matrix->width;
+
+	return errorBound * (double) totalCount;
+}
+
+
+/*
+ * CmsEstimateDistinctItems estimates the number of distinct items added to the
+ * sketch with linear counting: a row with z zero counters out of w has seen
+ * about w * ln(w / z) distinct items. We return the mean over all rows, or -1
+ * if some row has no zero counters left and the estimate is undefined.
+ */
+double CmsEstimateDistinctItems(const CmsMatrix *matrix)
+{
+	double estimateSum = 0.0;
+	uint32_t row = 0;
+
+	for (row = 0; row < matrix->depth; row++)
+	{
+		size_t zeroCount = CmsCountRowZeroCounters(matrix, row);
+		if (zeroCount == 0)
+		{
+			return -1;
+		}
+
+		estimateSum += matrix->width * log((double) matrix->width / zeroCount);
+	}
+
+	return estimateSum / matrix->depth;
+}
+
+
+/*
+ * MmsEstimateHashed returns the bitmask of an item from its hashed values, which
+ * is the mask with the fewest set bits over all rows.
+ */
+CmsCounter MmsEstimateHashed(const CmsMatrix *matrix, const uint64_t *hashValueArray)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minMask = CMS_COUNTER_MAX;
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		CmsCounter counterMask = matrix->counters[counterIndex];
+		if (MmsCountSetBits(counterMask) < MmsCountSetBits(minMask))
+		{
+			minMask = counterMask;
+		}
+	}
+
+	return minMask;
+}
+
+
+/*
+ * MmsUpdateHashed adds the given mask to the item with the given hashed values
+ * and returns the new mask of the item.
+ */
+CmsCounter MmsUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                           CmsCounter newItemMask)
+{
+	uint32_t hashIndex = 0;
+	CmsCounter minMask = MmsEstimateHashed(matrix, hashValueArray);
+	CmsCounter newMask = minMask | newItemMask;
+	uint32_t newMaskBits = MmsCountSetBits(newMask);
+
+	for (hashIndex = 0; hashIndex < matrix->depth; hashIndex++)
+	{
+		uint32_t widthIndex = CmsColumnIndex(hashValueArray, hashIndex, matrix->width);
+		size_t counterIndex = CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                     hashIndex, widthIndex);
+
+		CmsCounter counterMask = matrix->counters[counterIndex];
+		if (newMaskBits > MmsCountSetBits(counterMask))
+		{
+			matrix->counters[counterIndex] = newMask;
+		}
+	}
+
+	return newMask;
+}
+
+
+/*
+ * _batchWeightsOffset and _batchColumnsOffset return the offsets of the weight
+ * and column arrays in the memory of an update batch. Offsets are rounded up to
+ * eight bytes, so every array is aligned whatever the counter type is.
+ */
+static size_t _batchWeightsOffset(uint32_t capacity)
+{
+	return sizeof(uint64_t) * 2 * capacity;
+}
+
+
+static size_t _batchColumnsOffset(uint32_t capacity)
+{
+	size_t weightsEnd = _batchWeightsOffset(capacity) + sizeof(CmsCounter) * capacity;
+
+	return (weightsEnd + 7) & ~((size_t) 7);
+}
+
+
+/* _prefetchItemCounters prefetches the counters of the given item in every row. */
+static void _prefetchItemCounters(const CmsMatrix *matrix, const uint32_t *columns,
+                                  size_t itemCount, size_t itemIndex)
+{
+	uint32_t row = 0;
+
+	for (row = 0; row < matrix->depth; row++)
+	{
+		uint32_t column = columns[(size_t) row * itemCount + itemIndex];
+
+		CMS_PREFETCH_WRITE(&matrix->counters[CMS_CELL_INDEX(matrix->depth, matrix->width,
+		                                                    row, column)]);
+	}
+}
+
+
+/*
+ * _findFilterEntry returns the used filter entry of the item with the given hash
+ * values, or NULL if the item isn't filtered.
+ */
+static CmsFilterEntry * _findFilterEntry(const CmsFilterEntry *entries, uint32_t entryCount,
+                                         const uint64_t *hashValueArray)
+{
+	uint32_t entryIndex = 0;
+
+	for (entryIndex = 0; entryIndex < entryCount; entryIndex++)
+	{
+		const CmsFilterEntry *entry = &entries[entryIndex];
+
+		if (entry->newCount != 0 &&
+		    entry->hashValueArray[0] == hashValueArray[0] &&
+		    entry->hashValueArray[1] == hashValueArray[1])
+		{
+			return (CmsFilterEntry *) entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* _addCountersSaturating adds two counters, saturating at the largest value. */
+static CmsCounter _addCountersSaturating(CmsCounter counter, CmsCounter addend)
+{
+	CmsCounter sum = counter + addend;
+
+	return (sum < counter) ? CMS_COUNTER_MAX : sum;
+}
+
+
+/*
+ * _compareFilterEntries orders filter entries by decreasing frequency estimate,
+ * and entries with equal estimates by their hash values, so that merges don't
+ * depend on the sort implementation.
+ */
+static int _compareFilterEntries(const void *leftEntry, const void *rightEntry)
+{
+	const CmsFilterEntry *left = (const CmsFilterEntry *) leftEntry;
+	const CmsFilterEntry *right = (const CmsFilterEntry *) rightEntry;
+
+	if (left->newCount != right->newCount)
+	{
+		return (left->newCount > right->newCount) ? -1 : 1;
+	}
+	else if (left->hashValueArray[0] != right->hashValueArray[0])
+	{
+		return (left->hashValueArray[0] < right->hashValueArray[0]) ? -1 : 1;
+	}
+	else if (left->hashValueArray[1] != right->hashValueArray[1])
+	{
+		return (left->hashValueArray[1] < right->hashValueArray[1]) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * _windowCellCounters returns the bucket counters of the item's cell in the given
+ * row of the window.
+ */
+static CmsCounter * _windowCellCounters(const CmsWindowMatrix *window, uint32_t row,
+                                        const uint64_t *hashValueArray)
+{
+	uint32_t widthIndex = CmsColumnIndex(hashValueArray, row, window->width);
+	size_t cellIndex = CMS_CELL_INDEX(window->depth, window->width, row, widthIndex);
+
+	return window->counters + cellIndex * window->bucketCount;
+}
@@ -0,0 +1,417 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_core.h
+ *
+ * Declarations for the sketch core which implements the count-min sketch and
+ * min-mask sketch kernels without any dependency on PostgreSQL. The extension
+ * wraps these functions in fmgr functions, while benchmarks and unit tests link
+ * against them directly through the static core library.
+ *
+ * The core can be specialized at compile time by defining the macros below
+ * before building it:
+ *
+ *   CMS_COUNTER_TYPE          unsigned integer type of a single counter
+ *   CMS_LAYOUT_COLUMN_MAJOR   store the depth counters of a column together
+ *   CMS_HASH_128              128-bit hash function with MurmurHash3's signature
+ *
+ * The extension uses the defaults, which match its on-disk format.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_CORE_H
+#define CMS_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#ifndef CMS_COUNTER_TYPE
+#define CMS_COUNTER_TYPE uint64_t
+#endif
+
+typedef CMS_COUNTER_TYPE CmsCounter;
+
+#define CMS_COUNTER_MAX ((CmsCounter) ~((CmsCounter) 0))
+
+/*
+ * CMS_CELL_INDEX maps a (row, column) pair of the sketch to its position in the
+ * counter array. Row-major layout keeps every hash row contiguous.
+ */
+#ifdef CMS_LAYOUT_COLUMN_MAJOR
+#define CMS_CELL_INDEX(depth, width, row, column) \
+	((size_t) (column) * (depth) + (row))
+#else
+#define CMS_CELL_INDEX(depth, width, row, column) \
+	((size_t) (row) * (width) + (column))
+#endif
+
+#ifndef CMS_HASH_128
+#include "MurmurHash3.h"
+#define CMS_HASH_128(key, length, seed, out) \
+	MurmurHash3_x64_128((key), (length), (seed), (out))
+#endif
+
+#define CMS_HASH_SEED 304837963
+
+
+/*
+ * CmsStatus is returned by core functions which can fail. The caller decides how
+ * to report the failure, for example the extension converts it into an ereport.
+ */
+typedef enum CmsStatus
+{
+	CMS_OK = 0,
+	CMS_INVALID_ERROR_BOUND,
+	CMS_INVALID_CONFIDENCE_INTERVAL,
+	CMS_UNSUPPORTED_SIMD_LEVEL,
+	CMS_COUNTER_UNDERFLOW
+} CmsStatus;
+
+/*
+ * CmsSimdLevel identifies a set of kernel implementations. The hot kernels are
+ * compiled for every level and dispatched at runtime, see cms_simd.c.
+ */
+typedef enum CmsSimdLevel
+{
+	CMS_SIMD_SCALAR = 0,
+	CMS_SIMD_SSE42,
+	CMS_SIMD_AVX2,
+	CMS_SIMD_AVX512,
+	CMS_SIMD_NEON
+} CmsSimdLevel;
+
+/*
+ * CmsMatrix describes the counter matrix of a sketch. It doesn't own the counter
+ * array, so it can point into a varlena sketch or any other buffer.
+ */
+typedef struct CmsMatrix
+{
+	uint32_t depth;
+	uint32_t width;
+	CmsCounter *counters;
+} CmsMatrix;
+
+/*
+ * CmsUpdateBuffer counts repeated items exactly before they reach a count-min
+ * sketch, so a frequent item costs one weighted update instead of one update per
+ * occurrence. It is an open-addressing hash table keyed by the hash values of
+ * items and stored in an entry array provided by the caller. Items with equal
+ * hash values map to the same counters anyway, so aggregating by hash values
+ * doesn't change what reaches the sketch.
+ */
+typedef struct CmsBufferEntry
+{
+	uint64_t hashValueArray[2];
+	CmsCounter weight;
+} CmsBufferEntry;
+
+typedef struct CmsUpdateBuffer
+{
+	uint32_t slotCount;
+	uint32_t entryCount;
+	CmsBufferEntry *entries;
+} CmsUpdateBuffer;
+
+/*
+ * CmsUpdateBatch collects hashed items and applies them to a count-min sketch
+ * together. On sketches much larger than the CPU caches, almost every counter of
+ * a single update misses the cache, and each update waits for the previous one.
+ * A batch computes the columns of all its items row by row first, and then
+ * prefetches the counters of items further down the batch while it updates the
+ * current one. Items are applied in their original order, so the result is the
+ * same as updating them one by one. The arrays are provided by the caller, see
+ * CmsBatchMemorySize, and the columns array only has room for sketches up to the
+ * depth of the batch.
+ */
+typedef struct CmsUpdateBatch
+{
+	uint32_t capacity;
+	uint32_t depth;
+	uint32_t itemCount;
+	uint64_t *hashValueArrays;
+	CmsCounter *weights;
+	uint32_t *columns;
+} CmsUpdateBatch;
+
+/*
+ * CmsFilter describes the hot-item filter of an augmented count-min sketch, a
+ * small array of the most frequent items which is checked before the counter
+ * matrix. Frequent items are counted in the filter, so their adds and lookups
+ * touch a few cache lines instead of one counter per row, and they don't raise
+ * the counters of colliding items. For more information you can check this paper:
+ * https://dl.acm.org/doi/10.1145/2882903.2882948
+ *
+ * newCount is the frequency estimate of a filtered item, and oldCount is the part
+ * of it which the counter matrix already reflects. Empty entries have a zero
+ * newCount. Like CmsMatrix, the descriptor doesn't own the entry array.
+ */
+typedef struct CmsFilterEntry
+{
+	uint64_t hashValueArray[2];
+	CmsCounter newCount;
+	CmsCounter oldCount;
+} CmsFilterEntry;
+
+typedef struct CmsFilter
+{
+	uint32_t size;
+	CmsFilterEntry *entries;
+} CmsFilter;
+
+/*
+ * CmsWindowMatrix describes the counters of a sliding-window sketch, a ring of
+ * count-min sketches with the same dimensions where each bucket counts the items
+ * of one time interval. The counters of all buckets for one cell are stored next
+ * to each other, so the window estimate of an item reads one contiguous vector
+ * per row instead of one counter per row and bucket. Like CmsMatrix, the
+ * descriptor doesn't own the counter array.
+ */
+typedef struct CmsWindowMatrix
+{
+	uint32_t depth;
+	uint32_t width;
+	uint32_t bucketCount;
+	CmsCounter *counters;
+} CmsWindowMatrix;
+
+#define CMS_WINDOW_MAX_BUCKETS 1024
+
+/*
+ * CmsRangeNode identifies a node of a dyadic range tree over consecutive slots,
+ * for example the hours of sketches stored in a table. Nodes of level zero are
+ * single slots, and node (level, index) covers the 2^level slots starting at
+ * slot index * 2^level. Any range of slots is covered by at most two nodes per
+ * level, so a tree of pre-merged sketches answers range unions with a logarithmic
+ * number of merges.
+ */
+typedef struct CmsRangeNode
+{
+	uint32_t level;
+	uint64_t index;
+} CmsRangeNode;
+
+#define CMS_RANGE_MAX_LEVEL 62
+
+/*
+ * CmsDyadicMatrix describes the counters of a dyadic range sketch over the slots
+ * 0 to 2^levelCount - 1. Level l is a count-min sketch of the range nodes
+ * (l, slot >> l), see CmsRangeNode, and the levels are stored one after another.
+ * Levels with no more nodes than columns count every node exactly in their first
+ * row. Like CmsMatrix, the descriptor doesn't own the counter array.
+ */
+typedef struct CmsDyadicMatrix
+{
+	uint32_t depth;
+	uint32_t width;
+	uint32_t levelCount;
+	CmsCounter *counters;
+} CmsDyadicMatrix;
+
+#define CMS_DYADIC_MAX_LEVELS CMS_RANGE_MAX_LEVEL
+
+/*
+ * CmsPrefixCandidate is a network prefix which may be a heavy hitter at its level
+ * of a prefix sketch, with the largest frequency estimate seen for it. Addresses
+ * and prefixes are two 64-bit words with the most significant bits first, and
+ * IPv4 addresses take the top 32 bits of the first word. Entries with a zero
+ * count are empty.
+ */
+typedef struct CmsPrefixCandidate
+{
+	uint64_t prefix[2];
+	CmsCounter count;
+} CmsPrefixCandidate;
+
+/*
+ * CmsPrefixMatrix describes the counters of a prefix sketch, which has one level
+ * per prefix length. Every level is a count-min sketch of the prefixes of that
+ * length and a table of candidateCount heavy prefix candidates. The levels of
+ * counters are stored one after another, followed by the candidate tables. Like
+ * CmsMatrix, the descriptor doesn't own the arrays.
+ */
+typedef struct CmsPrefixMatrix
+{
+	uint32_t depth;
+	uint32_t width;
+	uint32_t levelCount;
+	uint32_t candidateCount;
+	CmsCounter *counters;
+	CmsPrefixCandidate *candidates;
+} CmsPrefixMatrix;
+
+/*
+ * CmsPrefixHitter is a hierarchical heavy hitter found by CmsPrefixHeavyHitters,
+ * with the frequency estimate of its prefix and the conditioned frequency, which
+ * leaves out the heavy hitters found below it. covered is set once a heavy
+ * hitter with a shorter prefix contains it.
+ */
+typedef struct CmsPrefixHitter
+{
+	uint32_t level;
+	int covered;
+	uint64_t prefix[2];
+	CmsCounter frequency;
+	CmsCounter conditionedFrequency;
+} CmsPrefixHitter;
+
+#define CMS_PREFIX_MAX_LEVELS 32
+
+
+/* Sketch sizing */
+extern CmsStatus CmsComputeDimensions(double errorBound, double confidenceInterval,
+                                      uint32_t *depth, uint32_t *width);
+extern size_t CmsMatrixSize(uint32_t depth, uint32_t width);
+
+/* Hashing */
+extern void CmsHashBytes(const void *bytes, size_t length, uint64_t *hashValueArray);
+
+/* Count-min sketch kernels */
+extern CmsCounter CmsEstimateHashed(const CmsMatrix *matrix,
+                                    const uint64_t *hashValueArray);
+extern CmsCounter CmsUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                  CmsCounter weight);
+extern void CmsMergeMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix);
+extern void CmsFoldMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix);
+extern double CmsInnerProduct(const CmsMatrix *firstMatrix, const CmsMatrix *secondMatrix);
+
+/* Linear count-min sketch kernels */
+extern CmsCounter CmsLinearUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                        CmsCounter weight);
+extern CmsStatus CmsLinearRemoveHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                       CmsCounter weight);
+extern CmsStatus CmsSubtractMatrix(CmsMatrix *targetMatrix, const CmsMatrix *sourceMatrix);
+
+/* Update buffer */
+extern uint32_t CmsBufferSlotCount(uint32_t requestedSlotCount);
+extern void CmsInitBuffer(CmsUpdateBuffer *buffer, CmsBufferEntry *entries,
+                          uint32_t slotCount);
+extern void CmsBufferUpdateHashed(CmsMatrix *matrix, CmsUpdateBuffer *buffer,
+                                  const uint64_t *hashValueArray, CmsCounter weight);
+extern void CmsFlushBuffer(CmsMatrix *matrix, CmsUpdateBuffer *buffer);
+
+/* Update batch */
+extern size_t CmsBatchMemorySize(uint32_t capacity, uint32_t depth);
+extern void CmsInitBatch(CmsUpdateBatch *batch, void *memory, uint32_t capacity,
+                         uint32_t depth);
+extern void CmsBatchUpdateHashed(CmsMatrix *matrix, CmsUpdateBatch *batch,
+                                 const uint64_t *hashValueArray, CmsCounter weight);
+extern void CmsFlushBatch(CmsMatrix *matrix, CmsUpdateBatch *batch);
+extern void CmsUpdateHashedArray(CmsMatrix *matrix, const uint64_t *hashValueArrays,
+                                 const CmsCounter *weights, size_t itemCount,
+                                 uint32_t *columns);
+
+/* Hot-item filter */
+extern CmsCounter CmsFilterEstimateHashed(const CmsMatrix *matrix, const CmsFilter *filter,
+                                          const uint64_t *hashValueArray);
+extern CmsCounter CmsFilterUpdateHashed(CmsMatrix *matrix, CmsFilter *filter,
+                                        const uint64_t *hashValueArray, CmsCounter weight);
+extern void CmsMergeFilters(CmsMatrix *targetMatrix, CmsFilter *targetFilter,
+                            const CmsMatrix *sourceMatrix, const CmsFilter *sourceFilter,
+                            CmsFilterEntry *scratchEntries);
+extern void CmsFlushFilter(CmsMatrix *matrix, CmsFilter *filter);
+
+/* Sliding-window sketch */
+extern size_t CmsWindowMatrixSize(uint32_t depth, uint32_t width, uint32_t bucketCount);
+extern CmsCounter CmsWindowEstimateHashed(const CmsWindowMatrix *window,
+                                          const uint64_t *hashValueArray);
+extern CmsCounter CmsWindowBucketEstimateHashed(const CmsWindowMatrix *window,
+                                                uint32_t bucket,
+                                                const uint64_t *hashValueArray);
+extern CmsCounter CmsWindowUpdateHashed(CmsWindowMatrix *window, uint32_t bucket,
+                                        const uint64_t *hashValueArray, CmsCounter weight);
+extern uint32_t CmsWindowAdvance(CmsWindowMatrix *window, uint32_t currentBucket,
+                                 uint64_t stepCount);
+
+/* Range trees */
+extern int CmsNextRangeNode(uint64_t *nextSlot, uint64_t lastSlot, uint32_t maxLevel,
+                            CmsRangeNode *node);
+
+/* Dyadic range sketches */
+extern size_t CmsDyadicMatrixSize(uint32_t depth, uint32_t width, uint32_t levelCount);
+extern CmsCounter CmsDyadicUpdate(CmsDyadicMatrix *dyadic, uint64_t slot, CmsCounter weight);
+extern CmsCounter CmsDyadicEstimateNode(const CmsDyadicMatrix *dyadic,
+                                        const CmsRangeNode *node);
+extern CmsCounter CmsDyadicEstimateRange(const CmsDyadicMatrix *dyadic, uint64_t firstSlot,
+                                         uint64_t lastSlot);
+extern uint64_t CmsDyadicQuantile(const CmsDyadicMatrix *dyadic, CmsCounter rank);
+
+/* Prefix sketches */
+extern size_t CmsPrefixMatrixSize(uint32_t depth, uint32_t width, uint32_t levelCount,
+                                  uint32_t candidateCount);
+extern void CmsMaskPrefix(const uint64_t *address, uint32_t prefixLength, uint64_t *prefix);
+extern void CmsHashPrefix(const uint64_t *prefix, uint32_t prefixLength,
+                          uint64_t *hashValueArray);
+extern void CmsPrefixUpdateHashed(CmsPrefixMatrix *matrix, uint32_t firstLevel,
+                                  uint32_t levelCount, const uint64_t *prefixes,
+                                  const uint64_t *hashValueArrays, CmsCounter weight,
+                                  uint32_t *columns);
+extern CmsCounter CmsPrefixEstimateHashed(const CmsPrefixMatrix *matrix, uint32_t level,
+                                          const uint64_t *hashValueArray);
+extern uint32_t CmsPrefixHeavyHitters(const CmsPrefixMatrix *matrix,
+                                      const uint8_t *prefixLengths, uint32_t firstLevel,
+                                      uint32_t levelCount, CmsCounter threshold,
+                                      CmsPrefixHitter *hitters);
+
+/* Sketch statistics */
+extern size_t CmsCountRowZeroCounters(const CmsMatrix *matrix, uint32_t row);
+extern size_t CmsCountSaturatedCounters(const CmsMatrix *matrix);
+extern double CmsAdditiveError(const CmsMatrix *matrix, uint64_t totalCount);
+extern double CmsEstimateDistinctItems(const CmsMatrix *matrix);
+
+/* Kernels dispatched by CPU feature level */
+extern CmsSimdLevel CmsDetectSimdLevel(void);
+extern int CmsSimdLevelSupported(CmsSimdLevel simdLevel);
+extern CmsStatus CmsSetSimdLevel(CmsSimdLevel simdLevel);
+extern CmsSimdLevel CmsActiveSimdLevel(void);
+extern const char * CmsSimdLevelName(CmsSimdLevel simdLevel);
+extern void CmsComputeColumns(const uint64_t *hashValueArrays, size_t itemCount,
+                              uint32_t row, uint32_t width, uint32_t *columns);
+extern void CmsMergeCounters(CmsCounter *targetCounters,
+                             const CmsCounter *sourceCounters, size_t counterCount);
+extern size_t CmsCountZeroCounters(const CmsCounter *counters, size_t counterCount);
+extern void CmsMinCounters(CmsCounter *targetCounters, const CmsCounter *sourceCounters,
+                           size_t counterCount);
+extern CmsCounter CmsSumCounters(const CmsCounter *counters, size_t counterCount);
+extern double CmsDotCounters(const CmsCounter *firstCounters,
+                             const CmsCounter *secondCounters, size_t counterCount);
+
+/* Min-mask sketch kernels */
+extern CmsCounter MmsEstimateHashed(const CmsMatrix *matrix,
+                                    const uint64_t *hashValueArray);
+extern CmsCounter MmsUpdateHashed(CmsMatrix *matrix, const uint64_t *hashValueArray,
+                                  CmsCounter newItemMask);
+extern uint32_t MmsCountSetBits(CmsCounter mask);
+
+
+/*
+ * CmsColumnIndex returns the column of the given row for an item with the given
+ * hash values. We can create an independent hash function for each row by using
+ * two hash values from the Murmur Hash function. This is a standard technique from
+ * the hashing literature for the additional hash functions of the form
+ * g(x) = h1(x) + i * h2(x) and does not hurt the independence between hash
+ * function. For more information you can check this paper:
+ * http://www.eecs.harvard.edu/~kirsch/pubs/bbbf/esa06.pdf
+ */
+static inline uint32_t
+CmsColumnIndex(const uint64_t *hashValueArray, uint32_t row, uint32_t width)
+{
+	uint64_t hashValue = hashValueArray[0] + (row * hashValueArray[1]);
+
+	return (uint32_t) (hashValue % width);
+}
+
+
+/*
+ * CmsAddSaturating returns the sum of two 64-bit values, or the largest value if
+ * the sum doesn't fit. Sketch headers use it to maintain total counts.
+ */
+static inline uint64_t
+CmsAddSaturating(uint64_t value, uint64_t addend)
+{
+	uint64_t sum = value + addend;
+
+	return (sum < value) ? UINT64_MAX : sum;
+}
+
+#endif /* CMS_CORE_H */
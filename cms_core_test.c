@@ -0,0 +1,931 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_core_test.c
+ *
+ * Unit tests for the sketch core. They link against the static core library
+ * only, so they run without a PostgreSQL server. Every check prints one line
+ * and the program exits with a non-zero status if any check failed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "cms_core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static int failedCheckCount = 0;
+static int checkCount = 0;
+
+#define lengthof(array) (sizeof(array) / sizeof((array)[0]))
+#define CHECK(condition) _check((condition), #condition, __FILE__, __LINE__)
+
+static CmsMatrix _createMatrix(uint32_t depth, uint32_t width);
+static void _hashInteger(uint32_t item, uint64_t *hashValueArray);
+
+
+static void _check(int condition, const char *conditionText, const char *fileName,
+                   int lineNumber)
+{
+	checkCount++;
+	if (!condition)
+	{
+		failedCheckCount++;
+		printf("not ok %d - %s (%s:%d)\n", checkCount, conditionText, fileName,
+		       lineNumber);
+	}
+	else
+	{
+		printf("ok %d - %s\n", checkCount, conditionText);
+	}
+}
+
+
+/* Dimensions must match the values the extension reports through cms_info. */
+static void TestComputeDimensions(void)
+{
+	uint32_t depth = 0;
+	uint32_t width = 0;
+
+	CHECK(CmsComputeDimensions(0.001, 0.99, &depth, &width) == CMS_OK);
+	CHECK(depth == 5 && width == 2719);
+
+	CHECK(CmsComputeDimensions(0.01, 0.99, &depth, &width) == CMS_OK);
+	CHECK(depth == 5 && width == 272);
+
+	CHECK(CmsComputeDimensions(0.1, 0.9, &depth, &width) == CMS_OK);
+	CHECK(depth == 3 && width == 28);
+
+	CHECK(CmsComputeDimensions(0, 0.99, &depth, &width) == CMS_INVALID_ERROR_BOUND);
+	CHECK(CmsComputeDimensions(1.5, 0.99, &depth, &width) == CMS_INVALID_ERROR_BOUND);
+	CHECK(CmsComputeDimensions(0.01, -0.5, &depth, &width) ==
+	      CMS_INVALID_CONFIDENCE_INTERVAL);
+	CHECK(CmsComputeDimensions(0.01, 1.1, &depth, &width) ==
+	      CMS_INVALID_CONFIDENCE_INTERVAL);
+
+	CHECK(CmsMatrixSize(5, 2719) == sizeof(CmsCounter) * 5 * 2719);
+}
+
+
+static void TestHashBytes(void)
+{
+	uint64_t firstHash[2] = {0, 0};
+	uint64_t secondHash[2] = {0, 0};
+	uint64_t otherHash[2] = {0, 0};
+
+	CmsHashBytes("count-min", 9, firstHash);
+	CmsHashBytes("count-min", 9, secondHash);
+	CmsHashBytes("min-mask", 8, otherHash);
+
+	CHECK(firstHash[0] == secondHash[0] && firstHash[1] == secondHash[1]);
+	CHECK(firstHash[0] != otherHash[0] || firstHash[1] != otherHash[1]);
+}
+
+
+/* Estimates never fall below the real frequency and equal it without collisions. */
+static void TestUpdateAndEstimate(void)
+{
+	CmsMatrix matrix = _createMatrix(5, 2719);
+	uint64_t hashValueArray[2] = {0, 0};
+	uint32_t item = 0;
+	int underestimated = 0;
+
+	_hashInteger(42, hashValueArray);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArray) == 0);
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, 1) == 1);
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, 1) == 2);
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, 3) == 5);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArray) == 5);
+
+	for (item = 0; item < 1000; item++)
+	{
+		uint32_t repeat = 0;
+
+		_hashInteger(item + 1000, hashValueArray);
+		for (repeat = 0; repeat <= item % 7; repeat++)
+		{
+			CmsUpdateHashed(&matrix, hashValueArray, 1);
+		}
+	}
+
+	for (item = 0; item < 1000; item++)
+	{
+		_hashInteger(item + 1000, hashValueArray);
+		if (CmsEstimateHashed(&matrix, hashValueArray) < (CmsCounter) (item % 7 + 1))
+		{
+			underestimated++;
+		}
+	}
+	CHECK(underestimated == 0);
+
+	free(matrix.counters);
+}
+
+
+/* Conservative update only raises the counters which are below the new estimate. */
+static void TestConservativeUpdate(void)
+{
+	CmsMatrix matrix = _createMatrix(4, 64);
+	uint64_t hashValueArray[2] = {0, 0};
+	uint32_t column = 0;
+	size_t cellIndex = 0;
+	size_t cellCount = (size_t) matrix.depth * matrix.width;
+	CmsCounter counterSum = 0;
+
+	_hashInteger(7, hashValueArray);
+	column = CmsColumnIndex(hashValueArray, 0, matrix.width);
+	matrix.counters[CMS_CELL_INDEX(matrix.depth, matrix.width, 0, column)] = 10;
+
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, 1) == 1);
+	CHECK(matrix.counters[CMS_CELL_INDEX(matrix.depth, matrix.width, 0, column)] == 10);
+
+	for (cellIndex = 0; cellIndex < cellCount; cellIndex++)
+	{
+		counterSum += matrix.counters[cellIndex];
+	}
+	CHECK(counterSum == 10 + (matrix.depth - 1));
+
+	free(matrix.counters);
+}
+
+
+static void TestCounterSaturation(void)
+{
+	CmsMatrix matrix = _createMatrix(3, 16);
+	uint64_t hashValueArray[2] = {0, 0};
+
+	_hashInteger(1, hashValueArray);
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, CMS_COUNTER_MAX - 1) ==
+	      CMS_COUNTER_MAX - 1);
+	CHECK(CmsUpdateHashed(&matrix, hashValueArray, 5) == CMS_COUNTER_MAX);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArray) == CMS_COUNTER_MAX);
+
+	free(matrix.counters);
+}
+
+
+static void TestMergeMatrix(void)
+{
+	CmsMatrix firstMatrix = _createMatrix(5, 272);
+	CmsMatrix secondMatrix = _createMatrix(5, 272);
+	uint64_t firstHash[2] = {0, 0};
+	uint64_t secondHash[2] = {0, 0};
+
+	_hashInteger(1, firstHash);
+	_hashInteger(2, secondHash);
+	CmsUpdateHashed(&firstMatrix, firstHash, 3);
+	CmsUpdateHashed(&secondMatrix, firstHash, 2);
+	CmsUpdateHashed(&secondMatrix, secondHash, 4);
+
+	CmsMergeMatrix(&firstMatrix, &secondMatrix);
+	CHECK(CmsEstimateHashed(&firstMatrix, firstHash) >= 5);
+	CHECK(CmsEstimateHashed(&firstMatrix, secondHash) >= 4);
+
+	free(firstMatrix.counters);
+	free(secondMatrix.counters);
+}
+
+
+/*
+ * Folding a linear sketch gives the sketch its items would have built at the
+ * narrower width, and folding a conservative sketch never underestimates.
+ */
+static void TestFoldMatrix(void)
+{
+	CmsMatrix wideMatrix = _createMatrix(3, 272);
+	CmsMatrix narrowMatrix = _createMatrix(3, 68);
+	CmsMatrix foldedMatrix = _createMatrix(3, 68);
+	uint64_t hashValueArray[2] = {0, 0};
+	uint32_t item = 0;
+	int underestimated = 0;
+
+	for (item = 1; item <= 200; item++)
+	{
+		_hashInteger(item, hashValueArray);
+		CmsLinearUpdateHashed(&wideMatrix, hashValueArray, item % 7 + 1);
+		CmsLinearUpdateHashed(&narrowMatrix, hashValueArray, item % 7 + 1);
+	}
+
+	CmsFoldMatrix(&foldedMatrix, &wideMatrix);
+	CHECK(memcmp(foldedMatrix.counters, narrowMatrix.counters,
+	             CmsMatrixSize(3, 68)) == 0);
+
+	memset(wideMatrix.counters, 0, CmsMatrixSize(3, 272));
+	memset(foldedMatrix.counters, 0, CmsMatrixSize(3, 68));
+	for (item = 1; item <= 200; item++)
+	{
+		_hashInteger(item, hashValueArray);
+		CmsUpdateHashed(&wideMatrix, hashValueArray, item % 7 + 1);
+	}
+
+	CmsFoldMatrix(&foldedMatrix, &wideMatrix);
+	for (item = 1; item <= 200; item++)
+	{
+		_hashInteger(item, hashValueArray);
+		underestimated |= CmsEstimateHashed(&foldedMatrix, hashValueArray) < item % 7 + 1;
+	}
+	CHECK(!underestimated);
+	CHECK(CmsSumCounters(foldedMatrix.counters, 3 * 68) ==
+	      CmsSumCounters(wideMatrix.counters, 3 * 272));
+
+	free(wideMatrix.counters);
+	free(narrowMatrix.counters);
+	free(foldedMatrix.counters);
+}
+
+
+/*
+ * Inner products of linear sketches never fall below the inner product of the
+ * counted frequencies, and are exact when no items collide.
+ */
+static void TestInnerProduct(void)
+{
+	CmsMatrix firstMatrix = _createMatrix(3, 28);
+	CmsMatrix secondMatrix = _createMatrix(3, 28);
+	CmsMatrix emptyMatrix = _createMatrix(3, 28);
+	uint64_t hashValueArray[2] = {0, 0};
+	double innerProduct = 0.0;
+	uint32_t item = 0;
+
+	for (item = 1; item <= 20; item++)
+	{
+		_hashInteger(item, hashValueArray);
+		CmsLinearUpdateHashed(&firstMatrix, hashValueArray, item);
+		if (item % 2 == 0)
+		{
+			CmsLinearUpdateHashed(&secondMatrix, hashValueArray, 3);
+		}
+	}
+
+	/* the even items join: 3 * (2 + 4 + ... + 20) */
+	innerProduct = CmsInnerProduct(&firstMatrix, &secondMatrix);
+	CHECK(innerProduct >= 330.0);
+	CHECK(innerProduct <= 330.0 + 0.1 * 210.0 * 30.0);
+	CHECK(CmsInnerProduct(&firstMatrix, &emptyMatrix) == 0.0);
+
+	memset(firstMatrix.counters, 0, CmsMatrixSize(3, 28));
+	_hashInteger(1, hashValueArray);
+	CmsLinearUpdateHashed(&firstMatrix, hashValueArray, 5);
+	CmsLinearUpdateHashed(&emptyMatrix, hashValueArray, 7);
+	CHECK(CmsInnerProduct(&firstMatrix, &emptyMatrix) == 35.0);
+	CHECK(CmsInnerProduct(&emptyMatrix, &emptyMatrix) == 49.0);
+
+	free(firstMatrix.counters);
+	free(secondMatrix.counters);
+	free(emptyMatrix.counters);
+}
+
+
+/*
+ * Buffered updates reach the sketch as weighted updates, both when the buffer
+ * fills and when it is flushed explicitly, and never lose weight.
+ */
+static void TestUpdateBuffer(void)
+{
+	CmsMatrix bufferedMatrix = _createMatrix(5, 2719);
+	CmsMatrix directMatrix = _createMatrix(5, 2719);
+	CmsBufferEntry entries[8];
+	CmsUpdateBuffer buffer;
+	uint64_t hashValueArray[2] = {0, 0};
+	uint32_t item = 0;
+	int mismatched = 0;
+
+	CHECK(CmsBufferSlotCount(0) == 1);
+	CHECK(CmsBufferSlotCount(100) == 128);
+	CHECK(CmsBufferSlotCount(256) == 256);
+
+	CmsInitBuffer(&buffer, entries, lengthof(entries));
+
+	_hashInteger(1, hashValueArray);
+	CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, 1);
+	CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, 4);
+	CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, 0);
+	CHECK(buffer.entryCount == 1);
+	CHECK(CmsEstimateHashed(&bufferedMatrix, hashValueArray) == 0);
+
+	CmsFlushBuffer(&bufferedMatrix, &buffer);
+	CHECK(buffer.entryCount == 0);
+	CHECK(CmsEstimateHashed(&bufferedMatrix, hashValueArray) == 5);
+
+	/* the seventh distinct item passes the load limit of 8 slots */
+	for (item = 0; item < 7; item++)
+	{
+		_hashInteger(item + 100, hashValueArray);
+		CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, item + 1);
+		CmsUpdateHashed(&directMatrix, hashValueArray, item + 1);
+	}
+	CHECK(buffer.entryCount == 1);
+
+	CmsFlushBuffer(&bufferedMatrix, &buffer);
+	for (item = 0; item < 7; item++)
+	{
+		_hashInteger(item + 100, hashValueArray);
+		if (CmsEstimateHashed(&bufferedMatrix, hashValueArray) !=
+		    CmsEstimateHashed(&directMatrix, hashValueArray))
+		{
+			mismatched++;
+		}
+	}
+	CHECK(mismatched == 0);
+
+	_hashInteger(1000, hashValueArray);
+	CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, CMS_COUNTER_MAX);
+	CmsBufferUpdateHashed(&bufferedMatrix, &buffer, hashValueArray, 1);
+	CmsFlushBuffer(&bufferedMatrix, &buffer);
+	CHECK(CmsEstimateHashed(&bufferedMatrix, hashValueArray) == CMS_COUNTER_MAX);
+
+	free(bufferedMatrix.counters);
+	free(directMatrix.counters);
+}
+
+
+/*
+ * Batched updates leave exactly the counters sequential updates leave, also on a
+ * narrow sketch where the order of conservative updates matters, and whether the
+ * batch is flushed because it is full or explicitly.
+ */
+static void TestUpdateBatch(void)
+{
+	CmsMatrix batchedMatrix = _createMatrix(3, 28);
+	CmsMatrix arrayMatrix = _createMatrix(3, 28);
+	CmsMatrix directMatrix = _createMatrix(3, 28);
+	size_t matrixSize = CmsMatrixSize(3, 28);
+	void *batchMemory = malloc(CmsBatchMemorySize(7, 3));
+	uint64_t hashValueArrays[2 * 100];
+	uint32_t columns[3 * 100];
+	CmsUpdateBatch batch;
+	uint32_t item = 0;
+
+	CmsInitBatch(&batch, batchMemory, 7, 3);
+	CHECK(batch.depth == 3);
+
+	for (item = 0; item < 100; item++)
+	{
+		uint32_t key = (item * item) % 37;
+
+		_hashInteger(key, hashValueArrays + 2 * item);
+		CmsBatchUpdateHashed(&batchedMatrix, &batch, hashValueArrays + 2 * item,
+		                     item % 3 + 1);
+		CmsUpdateHashed(&directMatrix, hashValueArrays + 2 * item, item % 3 + 1);
+	}
+	CHECK(batch.itemCount == 100 % 7);
+
+	CmsFlushBatch(&batchedMatrix, &batch);
+	CHECK(batch.itemCount == 0);
+	CHECK(memcmp(batchedMatrix.counters, directMatrix.counters, matrixSize) == 0);
+
+	memset(directMatrix.counters, 0, matrixSize);
+	for (item = 0; item < 100; item++)
+	{
+		CmsUpdateHashed(&directMatrix, hashValueArrays + 2 * item, 1);
+	}
+	CmsUpdateHashedArray(&arrayMatrix, hashValueArrays, NULL, 100, columns);
+	CHECK(memcmp(arrayMatrix.counters, directMatrix.counters, matrixSize) == 0);
+
+	free(batchMemory);
+	free(batchedMatrix.counters);
+	free(arrayMatrix.counters);
+	free(directMatrix.counters);
+}
+
+
+/*
+ * Filtered items are counted exactly until they are replaced, items replacing
+ * them start from their matrix estimate, and replaced items keep their weight in
+ * the matrix. Merged filters keep the most frequent items of both sketches and
+ * never underestimate.
+ */
+static void TestHotItemFilter(void)
+{
+	CmsMatrix matrix = _createMatrix(3, 28);
+	CmsMatrix otherMatrix = _createMatrix(3, 28);
+	CmsFilterEntry entries[2];
+	CmsFilterEntry otherEntries[2];
+	CmsFilterEntry scratchEntries[4];
+	CmsFilter filter = {2, entries};
+	CmsFilter otherFilter = {2, otherEntries};
+	uint64_t hashValueArrays[4][2];
+	uint32_t item = 0;
+	int underestimated = 0;
+
+	memset(entries, 0, sizeof(entries));
+	memset(otherEntries, 0, sizeof(otherEntries));
+	for (item = 0; item < 4; item++)
+	{
+		_hashInteger(item, hashValueArrays[item]);
+	}
+
+	/* items 0 and 1 take the empty entries and are counted in the filter only */
+	CHECK(CmsFilterUpdateHashed(&matrix, &filter, hashValueArrays[0], 2) == 2);
+	CHECK(CmsFilterUpdateHashed(&matrix, &filter, hashValueArrays[1], 1) == 1);
+	CHECK(CmsFilterUpdateHashed(&matrix, &filter, hashValueArrays[0], 3) == 5);
+	CHECK(CmsCountZeroCounters(matrix.counters, 3 * 28) == 3 * 28);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[0]) == 5);
+
+	/* item 2 reaches 3 in the matrix and replaces item 1, which moves there */
+	CHECK(CmsFilterUpdateHashed(&matrix, &filter, hashValueArrays[2], 1) == 1);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[1]) == 1);
+	CHECK(CmsFilterUpdateHashed(&matrix, &filter, hashValueArrays[2], 2) >= 3);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[2]) >= 3);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[1]) >= 1);
+	CHECK(entries[0].newCount == 5 && entries[1].newCount >= 3);
+
+	/* item 3 fills the other filter, item 0 is in both */
+	CmsFilterUpdateHashed(&otherMatrix, &otherFilter, hashValueArrays[3], 4);
+	CmsFilterUpdateHashed(&otherMatrix, &otherFilter, hashValueArrays[0], 1);
+
+	CmsMergeFilters(&matrix, &filter, &otherMatrix, &otherFilter, scratchEntries);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[0]) == 6);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[3]) == 4);
+
+	for (item = 0; item < 4; item++)
+	{
+		CmsCounter trueFrequency[4] = {6, 1, 3, 4};
+
+		if (CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[item]) <
+		    trueFrequency[item])
+		{
+			underestimated++;
+		}
+	}
+	CHECK(underestimated == 0);
+
+	/* flushing moves the filtered weight into the matrix and keeps estimates */
+	CmsFlushFilter(&matrix, &filter);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[0]) >= 6);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[3]) >= 4);
+	CHECK(CmsFilterEstimateHashed(&matrix, &filter, hashValueArrays[0]) == 6);
+	CHECK(entries[0].oldCount == entries[0].newCount);
+
+	free(matrix.counters);
+	free(otherMatrix.counters);
+}
+
+
+/*
+ * Linear updates add the weight to every counter, so removing items and
+ * subtracting sketches restore the counters exactly, and both refuse to go below
+ * zero.
+ */
+static void TestLinearSketch(void)
+{
+	CmsMatrix matrix = _createMatrix(3, 28);
+	CmsMatrix otherMatrix = _createMatrix(3, 28);
+	uint64_t hashValueArrays[2][2];
+	size_t counterIndex = 0;
+	CmsCounter counterSum = 0;
+
+	_hashInteger(1, hashValueArrays[0]);
+	_hashInteger(2, hashValueArrays[1]);
+
+	CHECK(CmsLinearUpdateHashed(&matrix, hashValueArrays[0], 3) == 3);
+	CHECK(CmsLinearUpdateHashed(&matrix, hashValueArrays[1], 2) >= 2);
+	CHECK(CmsLinearUpdateHashed(&matrix, hashValueArrays[0], 1) == 4);
+	for (counterIndex = 0; counterIndex < 3 * 28; counterIndex++)
+	{
+		counterSum += matrix.counters[counterIndex];
+	}
+	CHECK(counterSum == 3 * 6);
+
+	/* removing an item undoes its updates, removing too much changes nothing */
+	CHECK(CmsLinearRemoveHashed(&matrix, hashValueArrays[0], 5) == CMS_COUNTER_UNDERFLOW);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[0]) == 4);
+	CHECK(CmsLinearRemoveHashed(&matrix, hashValueArrays[0], 4) == CMS_OK);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[1]) == 2);
+
+	/* subtracting a sketch of the same items empties the matrix */
+	CmsLinearUpdateHashed(&otherMatrix, hashValueArrays[1], 3);
+	CHECK(CmsSubtractMatrix(&matrix, &otherMatrix) == CMS_COUNTER_UNDERFLOW);
+	CHECK(CmsEstimateHashed(&matrix, hashValueArrays[1]) == 2);
+	CmsLinearRemoveHashed(&otherMatrix, hashValueArrays[1], 1);
+	CHECK(CmsSubtractMatrix(&matrix, &otherMatrix) == CMS_OK);
+	CHECK(CmsCountZeroCounters(matrix.counters, 3 * 28) == 3 * 28);
+
+	free(matrix.counters);
+	free(otherMatrix.counters);
+}
+
+
+/*
+ * Window estimates sum an item over the buckets of the ring, and advancing the
+ * window zeroes the buckets it moves onto, wrapping around the ring.
+ */
+static void TestSlidingWindow(void)
+{
+	CmsWindowMatrix window = {3, 28, 4, NULL};
+	uint64_t hashValueArray[2] = {0, 0};
+	uint64_t otherHashValueArray[2] = {0, 0};
+	uint32_t currentBucket = 0;
+
+	window.counters = calloc(1, CmsWindowMatrixSize(3, 28, 4));
+	CHECK(CmsWindowMatrixSize(3, 28, 4) == 4 * CmsMatrixSize(3, 28));
+
+	_hashInteger(1, hashValueArray);
+	_hashInteger(2, otherHashValueArray);
+
+	/* one weight per bucket: 1, 2, 3 and 4 */
+	for (currentBucket = 0; currentBucket < 4; currentBucket++)
+	{
+		CHECK(CmsWindowUpdateHashed(&window, currentBucket, hashValueArray,
+		                            currentBucket + 1) == currentBucket + 1);
+	}
+	currentBucket = 3;
+	CHECK(CmsWindowEstimateHashed(&window, hashValueArray) == 10);
+	CHECK(CmsWindowBucketEstimateHashed(&window, 2, hashValueArray) == 3);
+	CHECK(CmsWindowEstimateHashed(&window, otherHashValueArray) <= 10);
+
+	/* bucket 0 is the oldest and expires first */
+	currentBucket = CmsWindowAdvance(&window, currentBucket, 1);
+	CHECK(currentBucket == 0);
+	CHECK(CmsWindowEstimateHashed(&window, hashValueArray) == 9);
+
+	/* two more steps expire buckets 1 and 2 */
+	CmsWindowUpdateHashed(&window, currentBucket, hashValueArray, 5);
+	currentBucket = CmsWindowAdvance(&window, currentBucket, 2);
+	CHECK(currentBucket == 2);
+	CHECK(CmsWindowEstimateHashed(&window, hashValueArray) == 9);
+
+	/* steps wrapping around the ring expire buckets 3 and 0 */
+	currentBucket = CmsWindowAdvance(&window, currentBucket, 2);
+	CHECK(currentBucket == 0);
+	CHECK(CmsWindowEstimateHashed(&window, hashValueArray) == 0);
+
+	CmsWindowUpdateHashed(&window, currentBucket, hashValueArray, 7);
+	CHECK(CmsWindowAdvance(&window, currentBucket, 0) == 0);
+	CHECK(CmsWindowEstimateHashed(&window, hashValueArray) == 7);
+	CHECK(CmsWindowAdvance(&window, currentBucket, 9) == 1);
+	CHECK(CmsCountZeroCounters(window.counters, 4 * 3 * 28) == 4 * 3 * 28);
+
+	free(window.counters);
+}
+
+
+/*
+ * Ranges are covered by the largest aligned nodes which fit, from left to right,
+ * and nodes never go above the maximum level.
+ */
+static void TestRangeNodes(void)
+{
+	CmsRangeNode node;
+	uint64_t nextSlot = 3;
+	uint64_t coveredSlots = 0;
+	uint32_t nodeCount = 0;
+
+	/* slots 3 to 17 are covered by 3, 4-7, 8-15 and 16-17 */
+	CHECK(CmsNextRangeNode(&nextSlot, 17, 16, &node) && node.level == 0 && node.index == 3);
+	CHECK(CmsNextRangeNode(&nextSlot, 17, 16, &node) && node.level == 2 && node.index == 1);
+	CHECK(CmsNextRangeNode(&nextSlot, 17, 16, &node) && node.level == 3 && node.index == 1);
+	CHECK(CmsNextRangeNode(&nextSlot, 17, 16, &node) && node.level == 1 && node.index == 8);
+	CHECK(!CmsNextRangeNode(&nextSlot, 17, 16, &node));
+	CHECK(nextSlot == 18);
+
+	/* the maximum level limits node sizes */
+	nextSlot = 0;
+	while (CmsNextRangeNode(&nextSlot, 99, 3, &node))
+	{
+		CHECK(node.level <= 3 && (node.index << node.level) == coveredSlots);
+		coveredSlots += (uint64_t) 1 << node.level;
+		nodeCount++;
+	}
+	CHECK(coveredSlots == 100 && nodeCount == 13);
+
+	/* ranges far from zero need at most two nodes per level */
+	nextSlot = 1000001;
+	nodeCount = 0;
+	while (CmsNextRangeNode(&nextSlot, 1000001 + 2159, 16, &node))
+	{
+		nodeCount++;
+	}
+	CHECK(nodeCount <= 2 * 17);
+
+	nextSlot = (uint64_t) INT64_MAX;
+	CHECK(CmsNextRangeNode(&nextSlot, (uint64_t) INT64_MAX, 62, &node) && node.level == 0);
+	CHECK(!CmsNextRangeNode(&nextSlot, (uint64_t) INT64_MAX, 62, &node));
+}
+
+
+/* Dyadic sketches answer range counts and quantiles from a few node estimates. */
+static void TestDyadicSketch(void)
+{
+	CmsDyadicMatrix dyadic = {4, 272, 10, NULL};
+	CmsRangeNode node = {9, 1};
+	uint64_t slot = 0;
+
+	dyadic.counters = calloc(1, CmsDyadicMatrixSize(4, 272, 10));
+	CHECK(CmsDyadicMatrixSize(4, 272, 10) == 10 * CmsMatrixSize(4, 272));
+
+	/* slots 100 to 899 once, and slot 500 another 200 times */
+	for (slot = 100; slot < 900; slot++)
+	{
+		CmsDyadicUpdate(&dyadic, slot, 1);
+	}
+	CHECK(CmsDyadicUpdate(&dyadic, 500, 200) >= 201);
+
+	/* levels two and above have a counter per node, so these ranges are exact */
+	CHECK(CmsDyadicEstimateNode(&dyadic, &node) == 388);
+	CHECK(CmsDyadicEstimateRange(&dyadic, 0, 1023) == 1000);
+	CHECK(CmsDyadicEstimateRange(&dyadic, 100, 899) == 1000);
+	CHECK(CmsDyadicEstimateRange(&dyadic, 512, 1023) == 388);
+	CHECK(CmsDyadicEstimateRange(&dyadic, 101, 101) >= 1);
+	CHECK(CmsDyadicEstimateRange(&dyadic, 0, 99) == 0);
+
+	/* quantiles never move right of the exact slot */
+	CHECK(CmsDyadicQuantile(&dyadic, 1) <= 100);
+	CHECK(CmsDyadicQuantile(&dyadic, 401) <= 500 && CmsDyadicQuantile(&dyadic, 401) >= 490);
+	CHECK(CmsDyadicQuantile(&dyadic, 601) <= 500 && CmsDyadicQuantile(&dyadic, 601) >= 490);
+	CHECK(CmsDyadicQuantile(&dyadic, 1000) <= 899 && CmsDyadicQuantile(&dyadic, 1000) >= 890);
+	CHECK(CmsDyadicQuantile(&dyadic, 2000) == 1023);
+
+	free(dyadic.counters);
+}
+
+/*
+ * _addPrefixes adds an IPv4 address to the levels of a prefix sketch with the
+ * prefix lengths 8, 16, 24 and 32.
+ */
+static void _addPrefixes(CmsPrefixMatrix *matrix, uint32_t address, CmsCounter weight)
+{
+	static const uint8_t prefixLengths[4] = {8, 16, 24, 32};
+	uint64_t addressWords[2] = {0, 0};
+	uint64_t prefixes[8];
+	uint64_t hashValueArrays[8];
+	uint32_t columns[3 * 4];
+	uint32_t level = 0;
+
+	addressWords[0] = (uint64_t) address << 32;
+	for (level = 0; level < 4; level++)
+	{
+		CmsMaskPrefix(addressWords, prefixLengths[level], prefixes + 2 * level);
+		CmsHashPrefix(prefixes + 2 * level, prefixLengths[level], hashValueArrays + 2 * level);
+	}
+
+	CmsPrefixUpdateHashed(matrix, 0, 4, prefixes, hashValueArrays, weight, columns);
+}
+
+
+/* Heavy prefixes are reported once, at the longest prefix which makes them heavy. */
+static void TestPrefixSketch(void)
+{
+	static const uint8_t prefixLengths[4] = {8, 16, 24, 32};
+	uint64_t address[2] = {UINT64_C(0x0a01020300000000), UINT64_C(0x0102030405060708)};
+	uint64_t prefix[2] = {0, 0};
+	uint64_t hashValueArray[2] = {0, 0};
+	CmsPrefixMatrix matrix = {3, 64, 4, 4, NULL, NULL};
+	CmsPrefixHitter hitters[16];
+	uint32_t hitterCount = 0;
+	uint32_t host = 0;
+
+	/* prefixes keep their leading bits */
+	CmsMaskPrefix(address, 24, prefix);
+	CHECK(prefix[0] == UINT64_C(0x0a01020000000000) && prefix[1] == 0);
+	CmsMaskPrefix(address, 72, prefix);
+	CHECK(prefix[0] == address[0] && prefix[1] == UINT64_C(0x0100000000000000));
+	CmsMaskPrefix(address, 128, prefix);
+	CHECK(prefix[0] == address[0] && prefix[1] == address[1]);
+	CmsMaskPrefix(address, 0, prefix);
+	CHECK(prefix[0] == 0 && prefix[1] == 0);
+
+	matrix.counters = calloc(1, CmsPrefixMatrixSize(3, 64, 4, 4));
+	matrix.candidates = (CmsPrefixCandidate *) (matrix.counters + 4 * 3 * 64);
+
+	/* 100 hosts of 10.1.1.0/24, 10.2.0.1 30 times and 192.168.0.1 5 times */
+	for (host = 0; host < 100; host++)
+	{
+		_addPrefixes(&matrix, 0x0a010100 + host, 1);
+	}
+	_addPrefixes(&matrix, 0x0a020001, 30);
+	_addPrefixes(&matrix, 0xc0a80001, 5);
+
+	prefix[0] = UINT64_C(0x0a00000000000000);
+	prefix[1] = 0;
+	CmsHashPrefix(prefix, 8, hashValueArray);
+	CHECK(CmsPrefixEstimateHashed(&matrix, 0, hashValueArray) == 130);
+
+	hitterCount = CmsPrefixHeavyHitters(&matrix, prefixLengths, 0, 4, 20, hitters);
+	CHECK(hitterCount == 2);
+	CHECK(hitters[0].level == 3 && hitters[0].prefix[0] == UINT64_C(0x0a02000100000000));
+	CHECK(hitters[0].frequency >= 30 && hitters[0].covered == 0);
+	CHECK(hitters[1].level == 2 && hitters[1].prefix[0] == UINT64_C(0x0a01010000000000));
+	CHECK(hitters[1].frequency == 100 && hitters[1].conditionedFrequency == 100);
+
+	/* 10.0.0.0/8 has nothing left once the heavy hitters below it are left out */
+	hitterCount = CmsPrefixHeavyHitters(&matrix, prefixLengths, 0, 4, 5, hitters);
+	CHECK(hitterCount == 3);
+	CHECK(hitters[1].level == 3 && hitters[1].prefix[0] == UINT64_C(0xc0a8000100000000));
+	CHECK(hitters[2].level == 2);
+	CHECK(CmsPrefixHeavyHitters(&matrix, prefixLengths, 0, 4, 131, hitters) == 0);
+
+	free(matrix.counters);
+}
+
+/* Zero counters give linear counting estimates and the fill ratio of each row. */
+static void TestSketchStatistics(void)
+{
+	CmsMatrix matrix = _createMatrix(5, 2719);
+	uint64_t hashValueArray[2] = {0, 0};
+	uint32_t item = 0;
+	double distinctItems = 0;
+
+	CHECK(CmsCountRowZeroCounters(&matrix, 0) == 2719);
+	CHECK(CmsEstimateDistinctItems(&matrix) == 0);
+	CHECK(CmsAdditiveError(&matrix, 0) == 0);
+
+	for (item = 0; item < 500; item++)
+	{
+		_hashInteger(item, hashValueArray);
+		CmsUpdateHashed(&matrix, hashValueArray, 2);
+	}
+
+	CHECK(CmsCountRowZeroCounters(&matrix, 4) < 2719 - 400);
+	distinctItems = CmsEstimateDistinctItems(&matrix);
+	CHECK(distinctItems > 450 && distinctItems < 550);
+	CHECK(CmsAdditiveError(&matrix, 1000) > 0.99 && CmsAdditiveError(&matrix, 1000) < 1.01);
+	CHECK(CmsCountSaturatedCounters(&matrix) == 0);
+
+	CmsUpdateHashed(&matrix, hashValueArray, CMS_COUNTER_MAX);
+	CHECK(CmsCountSaturatedCounters(&matrix) == 5);
+
+	CHECK(CmsAddSaturating(UINT64_MAX - 1, 5) == UINT64_MAX);
+	CHECK(CmsAddSaturating(40, 2) == 42);
+
+	free(matrix.counters);
+}
+
+
+static void TestMinMaskSketch(void)
+{
+	CmsMatrix matrix = _createMatrix(5, 272);
+	uint64_t hashValueArray[2] = {0, 0};
+
+	CHECK(MmsCountSetBits(0) == 0);
+	CHECK(MmsCountSetBits(0xF0) == 4);
+	CHECK(MmsCountSetBits(CMS_COUNTER_MAX) == sizeof(CmsCounter) * 8);
+
+	_hashInteger(3, hashValueArray);
+	CHECK(MmsEstimateHashed(&matrix, hashValueArray) == 0);
+	CHECK(MmsUpdateHashed(&matrix, hashValueArray, 0x1) == 0x1);
+	CHECK(MmsUpdateHashed(&matrix, hashValueArray, 0x4) == 0x5);
+	CHECK(MmsEstimateHashed(&matrix, hashValueArray) == 0x5);
+
+	free(matrix.counters);
+}
+
+
+/* Every kernel level the CPU supports must give the same results as scalar code. */
+static void TestSimdKernels(void)
+{
+	static const uint32_t widths[] = {1, 7, 28, 272, 2719, 65537, 4294967291U};
+	CmsSimdLevel simdLevel = CMS_SIMD_SCALAR;
+	uint64_t hashValueArrays[2 * 101];
+	uint32_t scalarColumns[101];
+	uint32_t columns[101];
+	CmsCounter scalarCounters[37];
+	CmsCounter counters[37];
+	CmsCounter sourceCounters[37];
+	CmsCounter scalarMinCounters[37];
+	CmsCounter scalarSum = 0;
+	double scalarDot = 0.0;
+	size_t scalarZeroCount = 0;
+	uint32_t itemIndex = 0;
+	uint32_t widthIndex = 0;
+	uint32_t counterIndex = 0;
+
+	CHECK(CmsSimdLevelSupported(CMS_SIMD_SCALAR));
+	CHECK(CmsSimdLevelSupported(CmsDetectSimdLevel()));
+
+	for (itemIndex = 0; itemIndex < 101; itemIndex++)
+	{
+		_hashInteger(itemIndex, hashValueArrays + 2 * itemIndex);
+	}
+
+	/* edge cases for the reduction: all bits set and exact multiples */
+	hashValueArrays[0] = UINT64_MAX;
+	hashValueArrays[1] = UINT64_MAX;
+	hashValueArrays[2] = (uint64_t) 2719 * 1000003;
+	hashValueArrays[3] = 0;
+
+	for (counterIndex = 0; counterIndex < 37; counterIndex++)
+	{
+		counters[counterIndex] = (counterIndex % 3 == 0) ? 0 : counterIndex * 1000;
+		sourceCounters[counterIndex] = (counterIndex % 5 == 0) ? CMS_COUNTER_MAX : counterIndex;
+	}
+
+	CmsSetSimdLevel(CMS_SIMD_SCALAR);
+	memcpy(scalarCounters, counters, sizeof(counters));
+	CmsMergeCounters(scalarCounters, sourceCounters, 37);
+	scalarZeroCount = CmsCountZeroCounters(counters, 37);
+	CHECK(scalarZeroCount == 13);
+	CHECK(scalarCounters[5] == CMS_COUNTER_MAX && scalarCounters[1] == 1001);
+	memcpy(scalarMinCounters, counters, sizeof(counters));
+	CmsMinCounters(scalarMinCounters, sourceCounters, 37);
+	scalarSum = CmsSumCounters(counters, 37);
+	CHECK(scalarMinCounters[1] == 1 && scalarMinCounters[3] == 0 &&
+	      scalarMinCounters[5] == 5000);
+	CHECK(scalarSum == 432000);
+	CHECK(CmsSumCounters(sourceCounters, 37) == CMS_COUNTER_MAX);
+	scalarDot = CmsDotCounters(counters, scalarMinCounters, 37);
+	CHECK(scalarDot == 2382981000.0);
+
+	for (simdLevel = CMS_SIMD_SCALAR; simdLevel <= CMS_SIMD_NEON; simdLevel++)
+	{
+		CmsCounter mergedCounters[37];
+		CmsCounter minCounters[37];
+		int columnsMatch = 1;
+
+		if (!CmsSimdLevelSupported(simdLevel))
+		{
+			CHECK(CmsSetSimdLevel(simdLevel) == CMS_UNSUPPORTED_SIMD_LEVEL);
+			continue;
+		}
+
+		printf("# kernel level %s\n", CmsSimdLevelName(simdLevel));
+
+		for (widthIndex = 0; widthIndex < lengthof(widths); widthIndex++)
+		{
+			uint32_t row = 0;
+
+			for (row = 0; row < 5; row++)
+			{
+				CmsSetSimdLevel(CMS_SIMD_SCALAR);
+				CmsComputeColumns(hashValueArrays, 101, row, widths[widthIndex],
+				                  scalarColumns);
+				CmsSetSimdLevel(simdLevel);
+				CmsComputeColumns(hashValueArrays, 101, row, widths[widthIndex], columns);
+
+				if (memcmp(scalarColumns, columns, sizeof(columns)) != 0)
+				{
+					columnsMatch = 0;
+				}
+			}
+		}
+		CHECK(columnsMatch);
+
+		CHECK(CmsSetSimdLevel(simdLevel) == CMS_OK);
+		CHECK(CmsActiveSimdLevel() == simdLevel);
+
+		memcpy(mergedCounters, counters, sizeof(counters));
+		CmsMergeCounters(mergedCounters, sourceCounters, 37);
+		CHECK(memcmp(mergedCounters, scalarCounters, sizeof(scalarCounters)) == 0);
+		CHECK(CmsCountZeroCounters(counters, 37) == scalarZeroCount);
+		CHECK(MmsCountSetBits(0xF0F0) == 8);
+
+		memcpy(minCounters, counters, sizeof(counters));
+		CmsMinCounters(minCounters, sourceCounters, 37);
+		CHECK(memcmp(minCounters, scalarMinCounters, sizeof(scalarMinCounters)) == 0);
+		CHECK(CmsSumCounters(counters, 37) == scalarSum);
+		CHECK(CmsSumCounters(sourceCounters, 37) == CMS_COUNTER_MAX);
+		CHECK(CmsDotCounters(counters, scalarMinCounters, 37) == scalarDot);
+	}
+
+	CmsSetSimdLevel(CmsDetectSimdLevel());
+}
+
+
+/* _createMatrix allocates a zeroed counter matrix with the given dimensions. */
+static CmsMatrix _createMatrix(uint32_t depth, uint32_t width)
+{
+	CmsMatrix matrix;
+
+	matrix.depth = depth;
+	matrix.width = width;
+	matrix.counters = calloc(1, CmsMatrixSize(depth, width));
+
+	return matrix;
+}
+
+
+/* _hashInteger hashes the bytes of the given integer like the extension does. */
+static void _hashInteger(uint32_t item, uint64_t *hashValueArray)
+{
+	CmsHashBytes(&item, sizeof(item), hashValueArray);
+}
+
+
+int main(void)
+{
+	TestComputeDimensions();
+	TestHashBytes();
+	TestUpdateAndEstimate();
+	TestConservativeUpdate();
+	TestCounterSaturation();
+	TestMergeMatrix();
+	TestFoldMatrix();
+	TestInnerProduct();
+	TestUpdateBuffer();
+	TestUpdateBatch();
+	TestHotItemFilter();
+	TestLinearSketch();
+	TestSlidingWindow();
+	TestRangeNodes();
+	TestDyadicSketch();
+	TestPrefixSketch();
+	TestSketchStatistics();
+	TestMinMaskSketch();
+	TestSimdKernels();
+
+	printf("%d of %d checks failed\n", failedCheckCount, checkCount);
+
+	return failedCheckCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
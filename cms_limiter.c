@@ -0,0 +1,436 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_limiter.c
+ *
+ * This file contains the rate limiters behind cms_rate_check.
+ *
+ * Every rate limiter is a sliding-window sketch in shared memory, a ring of
+ * count-min sketches where each bucket counts the calls of one interval of the
+ * window. The ring rotates on the wall clock: the interval of a call is the
+ * current time divided by the bucket length, and buckets of intervals which left
+ * the window are zeroed before they are reused. Keys are counted with
+ * conservative updates, so memory doesn't grow with the number of keys and a
+ * key is never counted below its real number of calls.
+ *
+ * Limiters are claimed by name on their first call and keep their name and
+ * window until the server restarts. Each limiter has its own lock, which is held
+ * while its window rotates and while a key is checked and counted, so checks of
+ * one key never undercount each other. Limiters need the extension to be loaded
+ * through shared_preload_libraries with cms_mms.rate_limiters above zero.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "cms_core.h"
+#include "cms_limiter.h"
+#include "cms_stat.h"
+
+
+/* CmsLimiter keeps the window state of one rate limiter. */
+typedef struct CmsLimiter
+{
+	char name[NAMEDATALEN];
+	int64 windowLength;
+	int64 bucketLength;
+	int64 currentInterval;
+	uint32 currentBucket;
+	LWLock *lock;
+} CmsLimiter;
+
+/*
+ * CmsLimiterSharedState is followed by the limiters, and then by their window
+ * counters, in shared memory. Limiters are claimed in order, so the first
+ * limiterCount limiters have names.
+ */
+typedef struct CmsLimiterSharedState
+{
+	LWLock *lock;
+	int limiterCount;
+	uint32 sketchDepth;
+	uint32 sketchWidth;
+} CmsLimiterSharedState;
+
+/* CmsLimiterIndexEntry remembers which limiter has the given name. */
+typedef struct CmsLimiterIndexEntry
+{
+	char name[NAMEDATALEN];
+	int limiterIndex;
+} CmsLimiterIndexEntry;
+
+/* GUC variables */
+int CmsLimiterCount = 0;
+int CmsLimiterBucketCount = 10;
+double CmsLimiterErrorBound = 0.001;
+double CmsLimiterConfidenceInterval = 0.99;
+
+static CmsLimiterSharedState *SharedState = NULL;
+static CmsLimiter *SharedLimiters = NULL;
+static CmsCounter *SharedCounters = NULL;
+
+/* Limiters which this backend has looked up by name */
+static HTAB *LimiterIndex = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type PreviousShmemRequestHook = NULL;
+#endif
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+
+/* Local functions forward declarations */
+static void _requestSharedMemory(void);
+static void _initSharedMemory(void);
+static Size _limiterStateSize(void);
+static Size _limiterCountersSize(void);
+static CmsLimiter * _findLimiter(const char *limiterName, int64 windowLength);
+static CmsLimiter * _claimLimiter(const char *limiterName, int64 windowLength);
+static CmsWindowMatrix _limiterMatrix(CmsLimiter *limiter);
+
+
+/*
+ * CmsLimiterInit defines the settings of the rate limiters and, if the extension
+ * is being preloaded and limiters are enabled, requests shared memory for them.
+ * It is called from _PG_init.
+ */
+void CmsLimiterInit(void)
+{
+	DefineCustomIntVariable("cms_mms.rate_limiters",
+	                        "Sets the number of rate limiters cms_rate_check can use.",
+	                        "Every limiter is a sliding-window sketch in shared "
+	                        "memory, claimed by the name of its first call. Zero "
+	                        "disables rate limiters.",
+	                        &CmsLimiterCount, 0, 0, 1024,
+	                        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.rate_limiter_buckets",
+	                        "Sets the number of buckets the window of a rate "
+	                        "limiter is divided into.",
+	                        "The window slides by one bucket at a time, so calls "
+	                        "are forgotten at most one bucket length late. More "
+	                        "buckets take more shared memory.",
+	                        &CmsLimiterBucketCount, 10, 1, CMS_WINDOW_MAX_BUCKETS,
+	                        PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("cms_mms.rate_limiter_error_bound",
+	                         "Sets the error bound of the rate limiter sketches.",
+	                         "Call counts of a key may be overestimated by this "
+	                         "fraction of all calls in the window.",
+	                         &CmsLimiterErrorBound, 0.001, 0.000001, 0.5,
+	                         PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomRealVariable("cms_mms.rate_limiter_confidence_interval",
+	                         "Sets the confidence interval of the rate limiter "
+	                         "sketches.",
+	                         "Call counts stay within the error bound with this "
+	                         "probability.",
+	                         &CmsLimiterConfidenceInterval, 0.99, 0.01, 0.999999,
+	                         PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || CmsLimiterCount == 0)
+	{
+		return;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	PreviousShmemRequestHook = shmem_request_hook;
+	shmem_request_hook = _requestSharedMemory;
+#else
+	_requestSharedMemory();
+#endif
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = _initSharedMemory;
+}
+
+
+/*
+ * CmsLimiterCheck checks a call of the key with the given hash values against
+ * the rate limiter of the given name, and counts the call if the key made fewer
+ * than callLimit calls within the window. It returns whether the call is
+ * allowed. The window length is in microseconds; the first call of a limiter
+ * sets it, and later calls have to pass the same window.
+ */
+bool CmsLimiterCheck(const char *limiterName, const uint64 *hashValueArray,
+                     int64 callLimit, int64 windowLength)
+{
+	CmsLimiter *limiter = NULL;
+	CmsWindowMatrix matrix;
+	int64 currentInterval = 0;
+	CmsCounter frequency = 0;
+	bool allowed = false;
+	instr_time startTime;
+
+	if (SharedState == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		                errmsg("rate limiters are not enabled"),
+		                errhint("Add cms_mms to shared_preload_libraries and set "
+		                        "cms_mms.rate_limiters above zero")));
+	}
+
+	limiter = _findLimiter(limiterName, windowLength);
+	matrix = _limiterMatrix(limiter);
+	currentInterval = GetCurrentTimestamp() / limiter->bucketLength;
+
+	LWLockAcquire(limiter->lock, LW_EXCLUSIVE);
+
+	/* move the window to the interval of this call, the clock may go back a bit */
+	if (currentInterval > limiter->currentInterval)
+	{
+		limiter->currentBucket = CmsWindowAdvance(&matrix, limiter->currentBucket,
+		                                          (uint64) (currentInterval -
+		                                                    limiter->currentInterval));
+		limiter->currentInterval = currentInterval;
+	}
+
+	CmsStatTimerStart(&startTime);
+	frequency = CmsWindowEstimateHashed(&matrix, hashValueArray);
+	allowed = (frequency < (uint64) callLimit);
+	if (allowed)
+	{
+		CmsWindowUpdateHashed(&matrix, limiter->currentBucket, hashValueArray, 1);
+	}
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	LWLockRelease(limiter->lock);
+
+	CmsStatPending->items++;
+
+	return allowed;
+}
+
+
+/* _requestSharedMemory reserves shared memory and locks for the rate limiters. */
+static void _requestSharedMemory(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (PreviousShmemRequestHook != NULL)
+	{
+		PreviousShmemRequestHook();
+	}
+#endif
+
+	RequestAddinShmemSpace(add_size(_limiterStateSize(), _limiterCountersSize()));
+	RequestNamedLWLockTranche("cms_mms rate limiters", CmsLimiterCount + 1);
+}
+
+
+/*
+ * _initSharedMemory attaches to the rate limiters, and initializes them if this
+ * is the first process to do so.
+ */
+static void _initSharedMemory(void)
+{
+	bool found = false;
+
+	if (PreviousShmemStartupHook != NULL)
+	{
+		PreviousShmemStartupHook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	SharedState = ShmemInitStruct("cms_mms rate limiters",
+	                              add_size(_limiterStateSize(), _limiterCountersSize()),
+	                              &found);
+	SharedLimiters = (CmsLimiter *) ((char *) SharedState +
+	                                 MAXALIGN(sizeof(CmsLimiterSharedState)));
+	SharedCounters = (CmsCounter *) ((char *) SharedState + _limiterStateSize());
+
+	if (!found)
+	{
+		LWLockPadded *locks = GetNamedLWLockTranche("cms_mms rate limiters");
+		int limiterIndex = 0;
+
+		SharedState->lock = &locks[0].lock;
+		SharedState->limiterCount = 0;
+		CmsComputeDimensions(CmsLimiterErrorBound, CmsLimiterConfidenceInterval,
+		                     &SharedState->sketchDepth, &SharedState->sketchWidth);
+
+		for (limiterIndex = 0; limiterIndex < CmsLimiterCount; limiterIndex++)
+		{
+			CmsLimiter *limiter = &SharedLimiters[limiterIndex];
+
+			memset(limiter, 0, sizeof(CmsLimiter));
+			limiter->lock = &locks[limiterIndex + 1].lock;
+		}
+
+		memset(SharedCounters, 0, _limiterCountersSize());
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/* _limiterStateSize returns the size of the shared state and the limiters. */
+static Size _limiterStateSize(void)
+{
+	return MAXALIGN(add_size(MAXALIGN(sizeof(CmsLimiterSharedState)),
+	                         mul_size(CmsLimiterCount, sizeof(CmsLimiter))));
+}
+
+
+/* _limiterCountersSize returns the size of the window counters of all limiters. */
+static Size _limiterCountersSize(void)
+{
+	uint32 sketchDepth = 0;
+	uint32 sketchWidth = 0;
+
+	CmsComputeDimensions(CmsLimiterErrorBound, CmsLimiterConfidenceInterval,
+	                     &sketchDepth, &sketchWidth);
+
+	return mul_size(CmsLimiterCount,
+	                CmsWindowMatrixSize(sketchDepth, sketchWidth, CmsLimiterBucketCount));
+}
+
+
+/*
+ * _findLimiter returns the rate limiter of the given name, and claims a new one
+ * if there is none yet. Names are looked up in shared memory once per backend,
+ * since limiters keep their names until the server restarts.
+ */
+static CmsLimiter * _findLimiter(const char *limiterName, int64 windowLength)
+{
+	CmsLimiterIndexEntry *indexEntry = NULL;
+	char name[NAMEDATALEN];
+	CmsLimiter *limiter = NULL;
+	bool found = false;
+
+	if (strlen(limiterName) >= NAMEDATALEN)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_rate_check"),
+		                errhint("Limiter name has to be shorter than %d bytes",
+		                        NAMEDATALEN)));
+	}
+
+	if (LimiterIndex == NULL)
+	{
+		HASHCTL hashInfo;
+
+		memset(&hashInfo, 0, sizeof(hashInfo));
+		hashInfo.keysize = NAMEDATALEN;
+		hashInfo.entrysize = sizeof(CmsLimiterIndexEntry);
+		hashInfo.hcxt = TopMemoryContext;
+
+		LimiterIndex = hash_create("cms_mms rate limiter index", 16, &hashInfo,
+		                           HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	memset(name, 0, NAMEDATALEN);
+	strlcpy(name, limiterName, NAMEDATALEN);
+
+	indexEntry = (CmsLimiterIndexEntry *) hash_search(LimiterIndex, name, HASH_FIND, NULL);
+	if (indexEntry != NULL)
+	{
+		limiter = &SharedLimiters[indexEntry->limiterIndex];
+	}
+	else
+	{
+		limiter = _claimLimiter(name, windowLength);
+
+		indexEntry = (CmsLimiterIndexEntry *) hash_search(LimiterIndex, name,
+		                                                  HASH_ENTER, &found);
+		indexEntry->limiterIndex = (int) (limiter - SharedLimiters);
+	}
+
+	if (limiter->windowLength != windowLength)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_rate_check"),
+		                errhint("Rate limiter \"%s\" was created with another window",
+		                        limiterName)));
+	}
+
+	return limiter;
+}
+
+
+/*
+ * _claimLimiter returns the rate limiter of the given name from shared memory.
+ * If no limiter has the name yet, it gives the next free limiter the name and
+ * window, and starts its window at the current interval.
+ */
+static CmsLimiter * _claimLimiter(const char *limiterName, int64 windowLength)
+{
+	CmsLimiter *limiter = NULL;
+	int limiterIndex = 0;
+
+	LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+
+	for (limiterIndex = 0; limiterIndex < SharedState->limiterCount; limiterIndex++)
+	{
+		if (strcmp(SharedLimiters[limiterIndex].name, limiterName) == 0)
+		{
+			limiter = &SharedLimiters[limiterIndex];
+			break;
+		}
+	}
+
+	if (limiter == NULL)
+	{
+		int64 bucketLength = windowLength / CmsLimiterBucketCount;
+
+		if (SharedState->limiterCount >= CmsLimiterCount)
+		{
+			LWLockRelease(SharedState->lock);
+
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_rate_check"),
+			                errhint("All %d rate limiters are in use, raise "
+			                        "cms_mms.rate_limiters to add more",
+			                        CmsLimiterCount)));
+		}
+
+		if (bucketLength <= 0)
+		{
+			LWLockRelease(SharedState->lock);
+
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_rate_check"),
+			                errhint("Window has to be at least %d microseconds",
+			                        CmsLimiterBucketCount)));
+		}
+
+		limiter = &SharedLimiters[SharedState->limiterCount];
+		strlcpy(limiter->name, limiterName, NAMEDATALEN);
+		limiter->windowLength = windowLength;
+		limiter->bucketLength = bucketLength;
+		limiter->currentInterval = GetCurrentTimestamp() / bucketLength;
+		limiter->currentBucket = 0;
+
+		SharedState->limiterCount++;
+	}
+
+	LWLockRelease(SharedState->lock);
+
+	return limiter;
+}
+
+
+/* _limiterMatrix returns a view of the window counters of the given limiter. */
+static CmsWindowMatrix _limiterMatrix(CmsLimiter *limiter)
+{
+	CmsWindowMatrix matrix;
+	size_t windowSize = CmsWindowMatrixSize(SharedState->sketchDepth,
+	                                        SharedState->sketchWidth,
+	                                        CmsLimiterBucketCount);
+
+	matrix.depth = SharedState->sketchDepth;
+	matrix.width = SharedState->sketchWidth;
+	matrix.bucketCount = (uint32) CmsLimiterBucketCount;
+	matrix.counters = (CmsCounter *) ((char *) SharedCounters +
+	                                  windowSize * (size_t) (limiter - SharedLimiters));
+
+	return matrix;
+}
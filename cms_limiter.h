@@ -0,0 +1,29 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_limiter.h
+ *
+ * Declarations for the rate limiters of the extension. A rate limiter is a
+ * sliding-window sketch in shared memory which counts calls per key, so limits
+ * are checked without a row per key and without row locks.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_LIMITER_H
+#define CMS_LIMITER_H
+
+#include "fmgr.h"
+
+
+/* GUC variables */
+extern int CmsLimiterCount;
+extern int CmsLimiterBucketCount;
+extern double CmsLimiterErrorBound;
+extern double CmsLimiterConfidenceInterval;
+
+
+extern void CmsLimiterInit(void);
+extern bool CmsLimiterCheck(const char *limiterName, const uint64 *hashValueArray,
+                            int64 callLimit, int64 windowLength);
+
+#endif /* CMS_LIMITER_H */
@@ -0,0 +1,750 @@
+/* cms_mms/cms_mms--2.0.0.sql */
+
+/* ----- Count-min sketch functions / types ----- */
+
+CREATE TYPE cms;
+
+CREATE FUNCTION cms_in(cstring)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_out(cms)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_recv(internal)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+   
+CREATE FUNCTION cms_send(cms)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE TYPE cms (
+	input = cms_in,
+	output = cms_out,
+	receive = cms_recv,
+	send = cms_send,
+	storage = extended
+);
+
+CREATE FUNCTION cms( double precision default 0.001, double precision default 0.99,
+                     integer default 0, boolean default false)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+	    
+CREATE FUNCTION cms_add(cms, anyelement)
+	RETURNS cms
+	AS 'MODULE_PATHNAME', 'cms_add'
+	LANGUAGE C IMMUTABLE;	
+	
+CREATE FUNCTION cms_add_array(cms, anyarray)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_add_agg(internal, anyelement)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'cms_add_agg'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_add_agg_final(internal)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_add_agg(anyelement)(
+	STYPE = internal,
+	SFUNC = cms_add_agg,
+	FINALFUNC = cms_add_agg_final,
+	FINALFUNC_MODIFY = READ_WRITE
+);
+
+CREATE FUNCTION cms_add_agg_with_parameters(internal, anyelement, double precision, double precision)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'cms_add_agg_with_parameters'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_add_agg(anyelement, double precision, double precision)(
+	STYPE = internal,
+	SFUNC = cms_add_agg_with_parameters,
+	FINALFUNC = cms_add_agg_final,
+	FINALFUNC_MODIFY = READ_WRITE
+);
+
+CREATE FUNCTION cms_add_agg_with_parameters(internal, anyelement, double precision, double precision,
+                                            integer)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'cms_add_agg_with_parameters'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_add_agg(anyelement, double precision, double precision, integer)(
+	STYPE = internal,
+	SFUNC = cms_add_agg_with_parameters,
+	FINALFUNC = cms_add_agg_final,
+	FINALFUNC_MODIFY = READ_WRITE
+);
+
+CREATE FUNCTION cms_linear_agg(internal, anyelement)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_linear_agg_inverse(internal, anyelement)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_linear_agg_final(internal)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_linear_agg(anyelement)(
+	STYPE = internal,
+	SFUNC = cms_linear_agg,
+	FINALFUNC = cms_linear_agg_final,
+	MSTYPE = internal,
+	MSFUNC = cms_linear_agg,
+	MINVFUNC = cms_linear_agg_inverse,
+	MFINALFUNC = cms_linear_agg_final,
+	FINALFUNC_MODIFY = READ_ONLY,
+	MFINALFUNC_MODIFY = READ_ONLY
+);
+
+CREATE FUNCTION cms_linear_agg_with_parameters(internal, anyelement, double precision,
+                                               double precision)
+	RETURNS internal
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_linear_agg_inverse(internal, anyelement, double precision,
+                                       double precision)
+	RETURNS internal
+	AS 'MODULE_PATHNAME', 'cms_linear_agg_inverse'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_linear_agg(anyelement, double precision, double precision)(
+	STYPE = internal,
+	SFUNC = cms_linear_agg_with_parameters,
+	FINALFUNC = cms_linear_agg_final,
+	MSTYPE = internal,
+	MSFUNC = cms_linear_agg_with_parameters,
+	MINVFUNC = cms_linear_agg_inverse,
+	MFINALFUNC = cms_linear_agg_final,
+	FINALFUNC_MODIFY = READ_ONLY,
+	MFINALFUNC_MODIFY = READ_ONLY
+);
+
+CREATE FUNCTION cms_subtract(cms, cms)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_fold(cms, integer)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_union(cms, cms)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_union_agg(cms, cms)
+	RETURNS cms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_union_agg(cms)(
+	STYPE = cms,
+	SFUNC = cms_union_agg
+);
+
+CREATE FUNCTION cms_inner_product(cms, cms)
+	RETURNS double precision
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_get_frequency(cms, anyelement)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_increment(cms, anyelement, weight integer default 1,
+                              OUT sketch cms, OUT estimate bigint)
+	RETURNS record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_info(cms)
+	RETURNS text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_stats(cms,
+                          OUT total_count bigint,
+                          OUT zero_cell_fraction double precision[],
+                          OUT saturated_cells bigint,
+                          OUT additive_error double precision,
+                          OUT distinct_items double precision)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+/* ----- Sliding-window sketch functions / types ----- */
+
+CREATE TYPE cms_window;
+
+CREATE FUNCTION cms_window_in(cstring)
+	RETURNS cms_window
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_window_out(cms_window)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_window_recv(internal)
+	RETURNS cms_window
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_window_send(cms_window)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE TYPE cms_window (
+	input = cms_window_in,
+	output = cms_window_out,
+	receive = cms_window_recv,
+	send = cms_window_send,
+	storage = extended
+);
+
+CREATE FUNCTION cms_window(integer, double precision default 0.001,
+                           double precision default 0.99)
+	RETURNS cms_window
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_window_add(cms_window, anyelement)
+	RETURNS cms_window
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_window_advance(cms_window, integer default 1)
+	RETURNS cms_window
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_window_get_frequency(cms_window, anyelement)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_window_info(cms_window)
+	RETURNS text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+/* ----- Dyadic range sketch functions / types ----- */
+
+CREATE TYPE cms_dyadic;
+
+CREATE FUNCTION cms_dyadic_in(cstring)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_out(cms_dyadic)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_recv(internal)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_send(cms_dyadic)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE TYPE cms_dyadic (
+	input = cms_dyadic_in,
+	output = cms_dyadic_out,
+	receive = cms_dyadic_recv,
+	send = cms_dyadic_send,
+	storage = extended
+);
+
+CREATE FUNCTION cms_dyadic(integer, double precision default 0.001,
+                           double precision default 0.99)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_add(cms_dyadic, bigint)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_agg(cms_dyadic, bigint, integer)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_dyadic_agg(bigint, integer)(
+	STYPE = cms_dyadic,
+	SFUNC = cms_dyadic_agg
+);
+
+CREATE FUNCTION cms_dyadic_agg_with_parameters(cms_dyadic, bigint, integer,
+                                               double precision, double precision)
+	RETURNS cms_dyadic
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_dyadic_agg(bigint, integer, double precision, double precision)(
+	STYPE = cms_dyadic,
+	SFUNC = cms_dyadic_agg_with_parameters
+);
+
+CREATE FUNCTION cms_range_frequency(cms_dyadic, bigint, bigint)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_quantile(cms_dyadic, double precision)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_dyadic_info(cms_dyadic)
+	RETURNS text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+/* ----- Prefix sketch functions / types ----- */
+
+CREATE TYPE cms_prefix;
+
+CREATE FUNCTION cms_prefix_in(cstring)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_out(cms_prefix)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_recv(internal)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_send(cms_prefix)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE TYPE cms_prefix (
+	input = cms_prefix_in,
+	output = cms_prefix_out,
+	receive = cms_prefix_recv,
+	send = cms_prefix_send,
+	storage = extended
+);
+
+CREATE FUNCTION cms_prefix(integer[] default '{8,16,24,32}',
+                           integer[] default '{32,48,64,128}', integer default 16,
+                           double precision default 0.001,
+                           double precision default 0.99)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_add(cms_prefix, inet)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_agg(cms_prefix, inet)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_prefix_agg(inet)(
+	STYPE = cms_prefix,
+	SFUNC = cms_prefix_agg
+);
+
+CREATE FUNCTION cms_prefix_agg_with_parameters(cms_prefix, inet, double precision,
+                                               double precision)
+	RETURNS cms_prefix
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE cms_prefix_agg(inet, double precision, double precision)(
+	STYPE = cms_prefix,
+	SFUNC = cms_prefix_agg_with_parameters
+);
+
+CREATE FUNCTION cms_prefix_get_frequency(cms_prefix, inet)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_hhh(cms_prefix, bigint,
+                        OUT prefix cidr,
+                        OUT frequency bigint,
+                        OUT conditioned_frequency bigint)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_prefix_info(cms_prefix)
+	RETURNS text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+/* ----- Range tree functions ----- */
+
+/*
+ * A range tree is a table of pre-merged count-min sketches over consecutive slots,
+ * for example hours. Level zero holds the sketch of every slot, and the node at
+ * (level, slot) holds the union of the 2^level slots starting at slot * 2^level.
+ * All functions of a tree have to use the same maximum level.
+ */
+CREATE FUNCTION cms_range_nodes(bigint, bigint, integer default 16,
+                                OUT level integer, OUT slot bigint)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION cms_range_create(tree_name text)
+	RETURNS void
+	AS $$
+BEGIN
+	EXECUTE format('CREATE TABLE %I (level integer NOT NULL, slot bigint NOT NULL, '
+	               'sketch cms NOT NULL, PRIMARY KEY (level, slot))', tree_name);
+END;
+$$ LANGUAGE plpgsql STRICT VOLATILE;
+
+/* cms_range_add merges the sketch of a slot into the slot and all its ancestors */
+CREATE FUNCTION cms_range_add(tree regclass, slot bigint, sketch cms,
+                              max_level integer default 16)
+	RETURNS void
+	AS $$
+BEGIN
+	IF slot < 0 OR max_level < 0 OR max_level > 62 THEN
+		RAISE EXCEPTION 'invalid parameters for cms_range_add'
+		USING ERRCODE = 'invalid_parameter_value',
+		      HINT = 'Slots can''t be negative and the maximum level has to be '
+		             'between 0 and 62';
+	END IF;
+
+	EXECUTE format('INSERT INTO %s AS tree (level, slot, sketch) '
+	               'SELECT level, $1 >> level, $2 FROM generate_series(0, $3) level '
+	               'ON CONFLICT (level, slot) DO UPDATE '
+	               'SET sketch = cms_union(tree.sketch, excluded.sketch)', tree)
+	USING slot, sketch, max_level;
+END;
+$$ LANGUAGE plpgsql STRICT VOLATILE;
+
+/* cms_range_build recomputes all levels above zero, for example after bulk loads */
+CREATE FUNCTION cms_range_build(tree regclass, max_level integer default 16)
+	RETURNS void
+	AS $$
+BEGIN
+	EXECUTE format('DELETE FROM %s WHERE level > 0', tree);
+
+	FOR parent_level IN 1..max_level LOOP
+		EXECUTE format('INSERT INTO %s (level, slot, sketch) '
+		               'SELECT $1, slot >> 1, cms_union_agg(sketch ORDER BY slot) '
+		               'FROM %s WHERE level = $1 - 1 GROUP BY slot >> 1', tree, tree)
+		USING parent_level;
+	END LOOP;
+END;
+$$ LANGUAGE plpgsql STRICT VOLATILE;
+
+/* cms_union_range returns the union of the slots from first to last, both included */
+CREATE FUNCTION cms_union_range(tree regclass, first bigint, last bigint,
+                                max_level integer default 16)
+	RETURNS cms
+	AS $$
+DECLARE
+	range_union cms;
+BEGIN
+	EXECUTE format('SELECT cms_union_agg(tree.sketch ORDER BY nodes.slot << nodes.level) '
+	               'FROM cms_range_nodes($1, $2, $3) nodes '
+	               'JOIN %s tree ON tree.level = nodes.level AND tree.slot = nodes.slot',
+	               tree)
+	INTO range_union
+	USING first, last, max_level;
+
+	RETURN range_union;
+END;
+$$ LANGUAGE plpgsql STRICT STABLE;
+
+/* ----- Sketch maintenance functions ----- */
+
+/*
+ * cms_add_new_rows is an AFTER INSERT ... REFERENCING NEW TABLE ... FOR EACH
+ * STATEMENT trigger which adds the items of the new rows to the sketch table,
+ * once per group. The trigger arguments are the sketch table, its sketch
+ * column, the item column and the key columns, which have the same names in
+ * both tables. Groups without a sketch row get a default sketch. Concurrent
+ * statements may create the same group, so the key columns should be a unique
+ * key of the sketch table; otherwise every statement locks its groups first.
+ */
+CREATE FUNCTION cms_add_new_rows()
+	RETURNS trigger
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C;
+
+/*
+ * Sketches can also be maintained from logical decoding, outside of the
+ * transactions which insert the rows. Slots created with
+ * pg_create_logical_replication_slot(slot_name, 'cms_mms') decode with the
+ * extension library, and cms_consume_changes folds the rows inserted into the
+ * source tables of cms_change_sources into their sketch tables like
+ * cms_add_new_rows. Only the item and key columns are decoded, by name, so
+ * other columns of the source tables can be added and dropped. The position up
+ * to which a slot was folded is kept in cms_change_progress and committed with
+ * the sketches, so every row is folded once. Each call folds one batch, and
+ * callers repeat it while it folded rows or the batch was full. With
+ * cms_mms.change_slot set, a background worker consumes the slot.
+ */
+CREATE TABLE cms_change_sources (
+	source_table regclass NOT NULL,
+	sketch_table regclass NOT NULL,
+	sketch_column name NOT NULL,
+	item_column name NOT NULL,
+	key_columns name[] NOT NULL DEFAULT '{}',
+	PRIMARY KEY (source_table, sketch_table, sketch_column)
+);
+
+CREATE TABLE cms_change_progress (
+	slot_name name PRIMARY KEY,
+	applied_lsn pg_lsn NOT NULL
+);
+
+SELECT pg_catalog.pg_extension_config_dump('cms_change_sources', '');
+SELECT pg_catalog.pg_extension_config_dump('cms_change_progress', '');
+
+CREATE FUNCTION cms_consume_changes(slot_name name, batch_size bigint default 16777216,
+                                    OUT applied_lsn pg_lsn,
+                                    OUT folded_rows bigint,
+                                    OUT batch_full boolean)
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+/*
+ * Rollups fold fine-grained sketch rows, for example minutely ones, into the
+ * row of their coarser period in the same table. cms_compact_rollups unions the
+ * rows whose time isn't aligned to the rollup unit into the aligned row of
+ * their keys, once the whole period is older than the rollup delay, and deletes
+ * them. Each call folds one batch per rollup and returns the number of rows it
+ * folded. With cms_mms.rollup_worker on, a background worker calls it.
+ */
+CREATE TABLE cms_rollups (
+	sketch_table regclass NOT NULL,
+	sketch_column name NOT NULL,
+	time_column name NOT NULL,
+	rollup_unit text NOT NULL
+		CHECK (rollup_unit IN ('minute', 'hour', 'day', 'week', 'month', 'quarter', 'year')),
+	rollup_delay interval NOT NULL DEFAULT '1 hour',
+	key_columns name[] NOT NULL DEFAULT '{}',
+	PRIMARY KEY (sketch_table, sketch_column, rollup_unit)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('cms_rollups', '');
+
+CREATE FUNCTION cms_compact_rollups(batch_memory integer default 65536)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+/* ----- Rate limiter functions ----- */
+
+CREATE FUNCTION cms_rate_check(limiter_name text, key anyelement, call_limit bigint,
+                               time_window interval)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+/* ----- Column statistics functions ----- */
+
+/*
+ * Column statistics are count-min sketches of table columns, which estimate how
+ * many rows equal a constant. cms_analyze builds the sketch of a column, and
+ * cms_eq_selectivity uses it once it is the restriction estimator of an equality
+ * operator, for example after
+ * ALTER OPERATOR = (text, text) SET (RESTRICT = cms_eq_selectivity).
+ * Columns without a sketch are estimated by eqsel.
+ */
+CREATE TABLE cms_column_statistics (
+	relation regclass NOT NULL,
+	attribute_number smallint NOT NULL,
+	row_count bigint NOT NULL,
+	sketch cms NOT NULL,
+	PRIMARY KEY (relation, attribute_number)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('cms_column_statistics', '');
+
+CREATE FUNCTION cms_column_statistics_changed()
+	RETURNS trigger
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C;
+
+CREATE TRIGGER cms_column_statistics_changed
+	AFTER INSERT OR UPDATE OR DELETE ON cms_column_statistics
+	FOR EACH ROW EXECUTE PROCEDURE cms_column_statistics_changed();
+
+CREATE FUNCTION cms_eq_selectivity(internal, oid, internal, integer)
+	RETURNS double precision
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT STABLE;
+
+/* cms_analyze builds the sketch of a column from all of its rows */
+CREATE FUNCTION cms_analyze(relation regclass, column_name name,
+                            error_bound double precision default 0.001,
+                            confidence_interval double precision default 0.99)
+	RETURNS void
+	AS $$
+DECLARE
+	column_number smallint;
+BEGIN
+	SELECT attnum INTO column_number
+	FROM pg_attribute
+	WHERE attrelid = relation AND attname = column_name AND attnum > 0
+	      AND NOT attisdropped;
+
+	IF column_number IS NULL THEN
+		RAISE EXCEPTION 'invalid parameters for cms_analyze'
+		USING ERRCODE = 'invalid_parameter_value',
+		      HINT = format('Relation %s has no column %I', relation, column_name);
+	END IF;
+
+	EXECUTE format('INSERT INTO cms_column_statistics AS statistics '
+	               '(relation, attribute_number, row_count, sketch) '
+	               'SELECT $1, $2, count(*), '
+	               'coalesce(cms_add_agg(%I, $3, $4), cms($3, $4)) FROM %s '
+	               'ON CONFLICT (relation, attribute_number) DO UPDATE '
+	               'SET row_count = excluded.row_count, sketch = excluded.sketch',
+	               column_name, relation)
+	USING relation, column_number, error_bound, confidence_interval;
+END;
+$$ LANGUAGE plpgsql STRICT VOLATILE;
+
+/* ----- Min-mask sketch functions / types ----- */
+
+CREATE TYPE mms;
+
+CREATE FUNCTION mms_in(cstring)
+	RETURNS mms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION mms_out(mms)
+	RETURNS cstring
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE FUNCTION mms_recv(internal)
+	RETURNS mms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+   
+CREATE FUNCTION mms_send(mms)
+	RETURNS bytea
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+CREATE TYPE mms (
+	input = mms_in,
+	output = mms_out,
+	receive = mms_recv,
+	send = mms_send,
+	storage = extended
+);
+
+CREATE FUNCTION mms(double precision default 0.001, double precision default 0.99)
+	RETURNS mms
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION mms_add(mms, anyelement, integer)
+	RETURNS mms
+	AS 'MODULE_PATHNAME', 'mms_add'
+	LANGUAGE C IMMUTABLE;	
+
+CREATE FUNCTION mms_get_mask(mms, anyelement)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT IMMUTABLE;
+
+/* ----- Utility functions ----- */
+
+CREATE FUNCTION cms_simd_level()
+	RETURNS text
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION cms_prewarm(cms)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME', 'cms_prewarm'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION cms_prewarm(cms_window)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME', 'cms_prewarm'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION cms_prewarm(cms_dyadic)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME', 'cms_prewarm'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION cms_prewarm(cms_prefix)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME', 'cms_prewarm'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION cms_prewarm(mms)
+	RETURNS boolean
+	AS 'MODULE_PATHNAME', 'cms_prewarm'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_stat_cms(OUT function_name text, OUT calls bigint, OUT items bigint,
+                            OUT detoasted_bytes bigint, OUT toast_bytes bigint,
+                            OUT unions bigint, OUT union_bytes bigint,
+                            OUT hash_time double precision,
+                            OUT update_time double precision,
+                            OUT estimate_time double precision)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION pg_stat_cms_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME'
+	LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_stat_cms_reset() FROM PUBLIC;
+
+CREATE VIEW pg_stat_cms AS
+	SELECT * FROM pg_stat_cms();
+
+GRANT SELECT ON pg_stat_cms TO PUBLIC;
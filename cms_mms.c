@@ -19,21 +19,75 @@
 #include <math.h>
 #include <limits.h>
 
+#include "access/genam.h"
 #include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "access/table.h"
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "access/xlogdefs.h"
 #include "catalog/pg_type.h"
+#include "commands/explain.h"
+#include "commands/trigger.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
 #include "funcapi.h"
 #include "lib/stringinfo.h"
-#include "MurmurHash3.h"
+#include "nodes/extensible.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planner.h"
+#include "optimizer/tlist.h"
 #include "utils/array.h"
 #include "utils/bytea.h"
 #include "utils/builtins.h"
 #include "utils/datum.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/fmgroids.h"
+#include "utils/inet.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/selfuncs.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
 #include "utils/typcache.h"
 
+#include "cms_cache.h"
+#include "cms_changes.h"
+#include "cms_core.h"
+#include "cms_limiter.h"
+#include "cms_probes.h"
+#include "cms_rollup.h"
+#include "cms_stat.h"
 
 #define DEFAULT_ERROR_BOUND 0.001
 #define DEFAULT_CONFIDENCE_INTERVAL 0.99
-#define MURMUR_SEED 304837963
+#define SIMD_LEVEL_AUTO -1
+#define ARRAY_BATCH_SIZE 1024
+#define MAX_FILTER_SIZE 1024
+#define CMS_FLAG_LINEAR 0x0001
+#define CMS_FORMAT_VERSION 2
+#define MAX_WINDOW_BUCKETS CMS_WINDOW_MAX_BUCKETS
+#define MAX_RANGE_LEVEL CMS_RANGE_MAX_LEVEL
+#define MAX_DYADIC_LEVELS CMS_DYADIC_MAX_LEVELS
+#define MAX_PREFIX_LEVELS CMS_PREFIX_MAX_LEVELS
+#define MAX_PREFIX_CANDIDATES 1024
+#define DEFAULT_PREFIX_CANDIDATES 16
+#define MAX_TOP_K_ITEMS 1024
+#define COUNT_STAR_FUNCTION_OID 2803
+#define STATISTICS_TABLE_NAME "cms_column_statistics"
+#define STATISTICS_RELATION_COLUMN 1
+#define STATISTICS_ATTRIBUTE_COLUMN 2
+#define STATISTICS_ROW_COUNT_COLUMN 3
+#define STATISTICS_SKETCH_COLUMN 4
 
 /*
  * CountMinSketch is the main struct for the count-min sketch top-n implementation and
@@ -42,15 +96,234 @@
  * keeping the most frequent n items. It is not possible to lay out two variable
  * width fields consecutively in memory. So we are using pointer arithmetic to
  * reach and handle ArrayType for the most frequent n items.
+ *
+ * totalCount keeps the total weight of the items added to the sketch, which is
+ * the N in the e*N error bound of frequency estimates.
+ *
+ * filterSize is the number of entries of the hot-item filter, which follows the
+ * counter matrix. Sketches without a filter have zero entries and behave like
+ * plain count-min sketches.
+ *
+ * flags records how the sketch is updated. Sketches with CMS_FLAG_LINEAR add every
+ * item to all of its counters instead of updating them conservatively. Their
+ * estimates are looser, but items can be removed and sketches subtracted.
+ *
+ * formatVersion is CMS_FORMAT_VERSION for sketches with this layout. Sketches of
+ * version 1.0.0 of the extension have the layout of CountMinSketchV1 and are
+ * converted when they are read, while other versions and values whose size
+ * doesn't match their header are rejected.
  */
 typedef struct CountMinSketch
 {
 	char length[4];
 	uint32 sketchDepth;
 	uint32 sketchWidth;
-	uint64 sketch[1];
+	uint16 filterSize;
+	uint8 flags;
+	uint8 formatVersion;
+	uint64 totalCount;
+	CmsCounter sketch[1];
 } CountMinSketch;
 
+/*
+ * CountMinSketchV1 is the layout of count-min sketches of version 1.0.0 of the
+ * extension. The padding after the width, where formatVersion now is, was always
+ * zero, and the size of a sketch included one counter after the counter matrix.
+ */
+typedef struct CountMinSketchV1
+{
+	char length[4];
+	uint32 sketchDepth;
+	uint32 sketchWidth;
+	uint32 padding;
+	uint64 sketch[1];
+} CountMinSketchV1;
+
+/* Sketch arguments are checked against their header after they are detoasted */
+#define CMS_GETARG_CMS_P(n) _checkCms((CountMinSketch*) CMS_GETARG_SKETCH_P(n))
+#define CMS_GETARG_CMS_P_COPY(n) _checkCms((CountMinSketch*) CMS_GETARG_SKETCH_P_COPY(n))
+#define CMS_GETARG_WINDOW_P(n) \
+	_checkCmsWindow((CountMinSketchWindow*) CMS_GETARG_SKETCH_P(n))
+#define CMS_GETARG_WINDOW_P_COPY(n) \
+	_checkCmsWindow((CountMinSketchWindow*) CMS_GETARG_SKETCH_P_COPY(n))
+#define CMS_GETARG_DYADIC_P(n) \
+	_checkCmsDyadic((CountMinSketchDyadic*) CMS_GETARG_SKETCH_P(n))
+#define CMS_GETARG_DYADIC_P_COPY(n) \
+	_checkCmsDyadic((CountMinSketchDyadic*) CMS_GETARG_SKETCH_P_COPY(n))
+#define CMS_GETARG_PREFIX_P(n) \
+	_checkCmsPrefix((CountMinSketchPrefix*) CMS_GETARG_SKETCH_P(n))
+#define CMS_GETARG_PREFIX_P_COPY(n) \
+	_checkCmsPrefix((CountMinSketchPrefix*) CMS_GETARG_SKETCH_P_COPY(n))
+#define CMS_GETARG_MMS_P(n) _checkMms((MinMaskSketch*) CMS_GETARG_SKETCH_P(n))
+
+
+/*
+ * CmsAggState is the transition state of cms_add_agg. Besides the sketch it may
+ * keep an update buffer, which counts repeated items exactly and adds them to the
+ * sketch as weighted updates when it fills and when the aggregate is finalized.
+ * It may also keep an update batch, which collects hashed items and applies them
+ * together with prefetching. The buffer has no slots and the batch has no
+ * capacity when they are disabled. Both are disabled for sketches with a hot-item
+ * filter, which counts frequent items itself.
+ */
+typedef struct CmsAggState
+{
+	CountMinSketch* cms;
+	CmsUpdateBuffer buffer;
+	CmsUpdateBatch batch;
+} CmsAggState;
+
+
+/*
+ * CountMinSketchWindow is a sliding-window count-min sketch. It keeps a ring of
+ * bucketCount sketches with the same dimensions, each counting the items of one
+ * time interval. New items are added to the current bucket, and advancing the
+ * window zeroes the oldest bucket in place and makes it the current one. The
+ * bucket counters of a cell are stored next to each other, see CmsWindowMatrix.
+ */
+typedef struct CountMinSketchWindow
+{
+	char length[4];
+	uint32 sketchDepth;
+	uint32 sketchWidth;
+	uint32 bucketCount;
+	uint32 currentBucket;
+	CmsCounter sketch[1];
+} CountMinSketchWindow;
+
+
+/*
+ * CountMinSketchDyadic is a dyadic range sketch over a domain of integers. Values
+ * from -2^(domainBits - 1) up to 2^(domainBits - 1) - 1 are shifted to the slots
+ * from zero to 2^domainBits - 1, and each of the domainBits levels is a count-min
+ * sketch of the range nodes of one granularity, see CmsDyadicMatrix. A range
+ * count or a quantile combines a few node estimates per level instead of
+ * scanning the items.
+ */
+typedef struct CountMinSketchDyadic
+{
+	char length[4];
+	uint32 sketchDepth;
+	uint32 sketchWidth;
+	uint32 domainBits;
+	uint64 totalCount;
+	CmsCounter sketch[1];
+} CountMinSketchDyadic;
+
+
+/*
+ * CountMinSketchPrefix is a prefix sketch for inet and cidr items. It has one
+ * level per configured prefix length, the ipv4LevelCount IPv4 lengths first and
+ * the IPv6 lengths after them, both in increasing order. Every level is a
+ * count-min sketch of the network prefixes of its length with a table of
+ * candidateCount heavy prefix candidates, see CmsPrefixMatrix. Adding an item
+ * updates every level of its family whose length isn't longer than its netmask.
+ */
+typedef struct CountMinSketchPrefix
+{
+	char length[4];
+	uint32 sketchDepth;
+	uint32 sketchWidth;
+	uint16 candidateCount;
+	uint8 levelCount;
+	uint8 ipv4LevelCount;
+	uint64 totalCount;
+	uint8 prefixLengths[MAX_PREFIX_LEVELS];
+	CmsCounter sketch[1];
+} CountMinSketchPrefix;
+
+
+/*
+ * CmsRangeNodesState keeps the part of the slot range which cms_range_nodes
+ * hasn't covered yet between calls.
+ */
+typedef struct CmsRangeNodesState
+{
+	uint64 nextSlot;
+	uint64 lastSlot;
+	uint32 maxLevel;
+} CmsRangeNodesState;
+
+
+/*
+ * CmsHhhState keeps the heavy hitters which cms_hhh found, and the prefix lengths
+ * of their levels, between calls.
+ */
+typedef struct CmsHhhState
+{
+	CmsPrefixHitter* hitters;
+	uint32 hitterCount;
+	uint32 nextHitter;
+	uint32 ipv4LevelCount;
+	uint8 prefixLengths[MAX_PREFIX_LEVELS];
+} CmsHhhState;
+
+
+/*
+ * CmsTopKCandidate is an item which may be one of the most frequent items of an
+ * approximate top-k scan, with the frequency estimate it had when it was last
+ * seen. Candidates are keyed by the hash values of the item.
+ */
+typedef struct CmsTopKCandidate
+{
+	uint64 hashValueArray[2];
+	Datum item;
+	bool itemIsNull;
+	uint64 frequency;
+} CmsTopKCandidate;
+
+
+/*
+ * CmsTopKScanState is the executor state of an approximate top-k scan. The scan
+ * adds the grouped column of every input row to a count-min sketch and keeps the
+ * itemCount items with the largest estimates in a candidate table, so it needs
+ * constant memory however many groups there are. minFrequency is a lower bound of
+ * the smallest candidate estimate, which lets most infrequent items skip the
+ * search for the smallest candidate. Null items are counted exactly. Once the
+ * input is consumed, the candidates are returned in descending frequency order.
+ */
+typedef struct CmsTopKScanState
+{
+	CustomScanState customScanState;
+	AttrNumber childItemNumber;
+	int itemIndex;
+	int countIndex;
+	int32 itemCount;
+	TypeCacheEntry* itemTypeCacheEntry;
+	MemoryContext rowContext;
+	MemoryContext candidateContext;
+	CountMinSketch* cms;
+	HTAB* candidateTable;
+	uint64 minFrequency;
+	uint64 nullFrequency;
+	bool inputDone;
+	CmsTopKCandidate** results;
+	int32 resultCount;
+	int32 nextResult;
+} CmsTopKScanState;
+
+
+/*
+ * CmsColumnStatistics is the sketch of a table column from the cms_column_statistics
+ * table, cached per backend so that estimates don't read and detoast it every
+ * time. Columns without a sketch are cached with a null sketch. Entries become
+ * invalid when the relcache entry of their table is invalidated, which the
+ * trigger on cms_column_statistics causes, and are read again on their next use.
+ */
+typedef struct CmsColumnStatisticsKey
+{
+	Oid relationId;
+	int32 attributeNumber;
+} CmsColumnStatisticsKey;
+
+typedef struct CmsColumnStatistics
+{
+	CmsColumnStatisticsKey key;
+	bool valid;
+	int64 rowCount;
+	CountMinSketch* cms;
+} CmsColumnStatistics;
+
 
 /* 
  * MinMaskSketch is a similar data structure as the CountMinSketch but doesn't bother
@@ -61,26 +334,175 @@ typedef struct MinMaskSketch
 	char length[4];
 	uint32 sketchDepth;
 	uint32 sketchWidth;
-	uint64 sketch[1];
+	CmsCounter sketch[1];
 } MinMaskSketch;
 
+/* Options of the cms_mms.simd_level setting */
+static const struct config_enum_entry SimdLevelOptions[] = {
+	{"auto", SIMD_LEVEL_AUTO, false},
+	{"scalar", CMS_SIMD_SCALAR, false},
+	{"sse4.2", CMS_SIMD_SSE42, false},
+	{"avx2", CMS_SIMD_AVX2, false},
+	{"avx512", CMS_SIMD_AVX512, false},
+	{"neon", CMS_SIMD_NEON, false},
+	{NULL, 0, false}
+};
+
+/* GUC variables */
+static int SimdLevel = SIMD_LEVEL_AUTO;
+static int AggBufferSize = 0;
+static int AggBatchSize = 0;
+static int WidthMultiple = 1;
+static bool ApproximateTopK = false;
+
+static create_upper_paths_hook_type PreviousCreateUpperPathsHook = NULL;
+
+/* Sketches of table columns which this backend has used for estimates */
+static HTAB* ColumnStatisticsCache = NULL;
+
 /* Local functions forward declarations */
-static CountMinSketch* _createCms(float8 errorBound, float8 confidenceInterval);
-static CountMinSketch* _updateCms(CountMinSketch* currentCms, Datum newItem, TypeCacheEntry* newItemTypeCacheEntry);
-static uint64 _updateCmsInPlace(CountMinSketch* cms, Datum newItem, TypeCacheEntry* newItemTypeCacheEntry);
+static CountMinSketch* _createCms(float8 errorBound, float8 confidenceInterval,
+                                  int32 filterSize, bool linear);
+static CountMinSketch* _checkCms(CountMinSketch* cms);
+static bool _isCmsV1(CountMinSketch* cms);
+static CountMinSketch* _convertCmsV1(CountMinSketchV1* cmsV1);
+static CountMinSketch* _updateCms(CountMinSketch* currentCms, CmsUpdateBuffer* buffer,
+                                  CmsUpdateBatch* batch, Datum newItem,
+                                  TypeCacheEntry* newItemTypeCacheEntry);
+static void _updateCmsArray(CountMinSketch* cms, Datum* items, bool* itemNulls,
+                            int itemCount, TypeCacheEntry* itemTypeCacheEntry);
+static Datum _cmsAddAgg(FunctionCallInfo fcinfo, float8 errorBound, float8 confidenceInterval,
+                        int32 filterSize, bool linear);
+static CmsAggState* _createCmsAggState(MemoryContext aggregateContext, float8 errorBound,
+                                       float8 confidenceInterval, int32 filterSize,
+                                       bool linear);
+static CountMinSketch* _unionCms(CountMinSketch* targetCms, CountMinSketch* sourceCms);
+static CountMinSketch* _foldCms(CountMinSketch* cms, uint32 foldFactor);
+static CmsMatrix _cmsCountingMatrix(CountMinSketch* cms, uint32 width);
+static uint64 _updateCmsInPlace(CountMinSketch* cms, CmsUpdateBuffer* buffer,
+                                CmsUpdateBatch* batch, Datum newItem,
+                                TypeCacheEntry* newItemTypeCacheEntry, CmsCounter weight,
+                                uint64* hashValueArray);
+static void _removeCmsInPlace(CountMinSketch* cms, Datum item,
+                              TypeCacheEntry* itemTypeCacheEntry);
 static void _convertDatumToBytes(Datum datum, TypeCacheEntry* datumTypeCacheEntry, StringInfo datumString);
 static uint64 _cmsEstimateHashedItemFrequency(CountMinSketch* cms, uint64* hashValueArray);
 static uint64 _cmsEstimateItemFrequency(CountMinSketch* cms, Datum item, TypeCacheEntry* itemTypeCacheEntry);
+static CmsMatrix _cmsMatrix(CountMinSketch* cms);
+static CmsFilter _cmsFilter(CountMinSketch* cms);
+static void _computeDimensions(float8 errorBound, float8 confidenceInterval, const char* sketchName,
+                               uint32* sketchDepth, uint32* sketchWidth);
+static bool _hasValidDimensions(uint32 sketchDepth, uint32 sketchWidth);
+static void _checkSketchSize(struct varlena* sketch, Size expectedSize, const char* sketchName);
+static CountMinSketchWindow* _checkCmsWindow(CountMinSketchWindow* window);
+static CountMinSketchWindow* _createCmsWindow(int32 bucketCount, float8 errorBound,
+                                              float8 confidenceInterval);
+static Datum _detoastItem(Datum item, TypeCacheEntry* itemTypeCacheEntry);
+static uint64 _updateCmsWindowInPlace(CountMinSketchWindow* window, Datum newItem,
+                                      TypeCacheEntry* newItemTypeCacheEntry);
+static uint64 _cmsWindowEstimateItemFrequency(CountMinSketchWindow* window, Datum item,
+                                              TypeCacheEntry* itemTypeCacheEntry);
+static CmsWindowMatrix _cmsWindowMatrix(CountMinSketchWindow* window);
+static Datum _cmsDyadicAgg(FunctionCallInfo fcinfo, float8 errorBound,
+                           float8 confidenceInterval);
+static CountMinSketchDyadic* _createCmsDyadic(int32 domainBits, float8 errorBound,
+                                              float8 confidenceInterval);
+static CountMinSketchDyadic* _checkCmsDyadic(CountMinSketchDyadic* dyadic);
+static uint64 _updateCmsDyadicInPlace(CountMinSketchDyadic* dyadic, int64 value);
+static uint64 _cmsDyadicSlot(CountMinSketchDyadic* dyadic, int64 value);
+static CmsDyadicMatrix _cmsDyadicMatrix(CountMinSketchDyadic* dyadic);
+static Datum _cmsPrefixAgg(FunctionCallInfo fcinfo, float8 errorBound,
+                           float8 confidenceInterval);
+static CountMinSketchPrefix* _createCmsPrefix(ArrayType* ipv4LengthArray,
+                                              ArrayType* ipv6LengthArray,
+                                              int32 candidateCount, float8 errorBound,
+                                              float8 confidenceInterval);
+static CountMinSketchPrefix* _checkCmsPrefix(CountMinSketchPrefix* prefixSketch);
+static uint32 _readPrefixLengths(ArrayType* lengthArray, int32 maxLength,
+                                 uint8* prefixLengths, uint32 lengthCount);
+static uint64 _updateCmsPrefixInPlace(CountMinSketchPrefix* prefixSketch, inet* item);
+static void _prefixFamilyLevels(CountMinSketchPrefix* prefixSketch, int family,
+                                uint32* firstLevel, uint32* levelCount);
+static void _inetAddressWords(inet* item, uint64* addressWords);
+static inet* _prefixInet(const uint64* prefix, int family, uint32 prefixLength);
+static CmsPrefixMatrix _cmsPrefixMatrix(CountMinSketchPrefix* prefixSketch);
 static MinMaskSketch* _createMms(float8 errorBound, float8 confidenceInterval);
+static MinMaskSketch* _checkMms(MinMaskSketch* mms);
 static MinMaskSketch* _updateMms(MinMaskSketch* currentMms, Datum newItem, TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask);
 static uint64 _updateMmsInPlace(MinMaskSketch* mms, Datum newItem, TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask);
 static uint64 _mmsEstimateHashedItemMask(MinMaskSketch* mms, uint64* hashValueArray);
 static uint64 _mmsEstimateItemMask(MinMaskSketch* mms, Datum item, TypeCacheEntry* itemTypeCacheEntry);
-static uint64 _countSetBits(uint64 mask);
+static CmsMatrix _mmsMatrix(MinMaskSketch* mms);
+static void _createCmsTopKPaths(PlannerInfo* root, UpperRelationKind stage,
+                                RelOptInfo* inputRel, RelOptInfo* outputRel,
+                                void* extra);
+static bool _isCmsTopKQuery(PlannerInfo* root, Index* scanRelationIndex,
+                            int* itemIndex, int* countIndex, int32* itemCount);
+static bool _hasImageEquality(Oid typeId, Oid collationId, Oid equalityOperator);
+static Plan* _planCmsTopKPath(PlannerInfo* root, RelOptInfo* rel, CustomPath* bestPath,
+                              List* tlist, List* clauses, List* customPlans);
+static Node* _createCmsTopKScanState(CustomScan* customScan);
+static void _beginCmsTopKScan(CustomScanState* node, EState* estate, int eflags);
+static TupleTableSlot* _execCmsTopKScan(CustomScanState* node);
+static TupleTableSlot* _nextCmsTopKItem(ScanState* node);
+static bool _recheckCmsTopKItem(ScanState* node, TupleTableSlot* slot);
+static void _endCmsTopKScan(CustomScanState* node);
+static void _rescanCmsTopKScan(CustomScanState* node);
+static void _explainCmsTopKScan(CustomScanState* node, List* ancestors, ExplainState* es);
+static void _resetCmsTopKScan(CmsTopKScanState* topKState);
+static void _consumeCmsTopKInput(CmsTopKScanState* topKState);
+static void _offerCmsTopKCandidate(CmsTopKScanState* topKState, uint64* hashValueArray,
+                                   Datum item, uint64 frequency);
+static int _compareCmsTopKCandidates(const void* first, const void* second);
+static int64 _updateSketches(const char* functionName, const char* newRows, Oid sketchTableId,
+                             const char* sketchColumn, const char* itemColumn,
+                             char** keyColumns, int keyCount, const char* functionSchemaName,
+                             int argumentCount, Oid* argumentTypes, Datum* arguments);
+static bool _hasUniqueKey(Oid relationId, char** keyColumns, int keyCount);
+static void _appendSketchUpdateQuery(StringInfo query, const char* newRows,
+                                     const char* sketchTableName, const char* sketchColumn,
+                                     const char* itemColumn, char** keyColumns, int keyCount,
+                                     bool uniqueKey, const char* functionSchemaName);
+static void _appendDecodedColumn(StringInfo columnList, StringInfo optionList, Oid sourceTableId,
+                                 const char* columnName, Name slotName);
+static char* _qualifiedRelationName(Oid relationId);
+static char** _readNameArray(ArrayType* nameArray, int* nameCount);
+static CmsColumnStatistics* _cmsColumnStatistics(Oid relationId, AttrNumber attributeNumber,
+                                                 Oid namespaceId);
+static CountMinSketch* _readCmsColumnStatistics(Oid relationId, AttrNumber attributeNumber,
+                                                Oid namespaceId, int64* rowCount);
+static void _invalidateCmsColumnStatistics(Datum argument, Oid relationId);
+static void _invalidateStatisticsRelation(HeapTuple statisticsTuple,
+                                          TupleDesc statisticsTupleDescriptor);
+
+static bool _checkSimdLevel(int* newValue, void** extra, GucSource source);
+static void _assignSimdLevel(int newValue, void* extra);
+
+/* Callbacks of the approximate top-k scan */
+static const CustomPathMethods CmsTopKPathMethods = {
+	.CustomName = "CmsTopK",
+	.PlanCustomPath = _planCmsTopKPath
+};
+
+static const CustomScanMethods CmsTopKScanMethods = {
+	.CustomName = "CmsTopK",
+	.CreateCustomScanState = _createCmsTopKScanState
+};
+
+static const CustomExecMethods CmsTopKExecMethods = {
+	.CustomName = "CmsTopK",
+	.BeginCustomScan = _beginCmsTopKScan,
+	.ExecCustomScan = _execCmsTopKScan,
+	.EndCustomScan = _endCmsTopKScan,
+	.ReScanCustomScan = _rescanCmsTopKScan,
+	.ExplainCustomScan = _explainCmsTopKScan
+};
 
 /* Declarations for dynamic loading */
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
 /* Count-min Sketch functions */
 PG_FUNCTION_INFO_V1(cms_in);
 PG_FUNCTION_INFO_V1(cms_out);
@@ -88,8 +510,63 @@ PG_FUNCTION_INFO_V1(cms_recv);
 PG_FUNCTION_INFO_V1(cms_send);
 PG_FUNCTION_INFO_V1(cms);
 PG_FUNCTION_INFO_V1(cms_add);
+PG_FUNCTION_INFO_V1(cms_add_array);
 PG_FUNCTION_INFO_V1(cms_get_frequency);
+PG_FUNCTION_INFO_V1(cms_increment);
+PG_FUNCTION_INFO_V1(cms_add_agg);
+PG_FUNCTION_INFO_V1(cms_add_agg_with_parameters);
+PG_FUNCTION_INFO_V1(cms_add_agg_final);
+PG_FUNCTION_INFO_V1(cms_linear_agg);
+PG_FUNCTION_INFO_V1(cms_linear_agg_with_parameters);
+PG_FUNCTION_INFO_V1(cms_linear_agg_inverse);
+PG_FUNCTION_INFO_V1(cms_linear_agg_final);
+PG_FUNCTION_INFO_V1(cms_subtract);
+PG_FUNCTION_INFO_V1(cms_fold);
+PG_FUNCTION_INFO_V1(cms_union);
+PG_FUNCTION_INFO_V1(cms_union_agg);
+PG_FUNCTION_INFO_V1(cms_inner_product);
 PG_FUNCTION_INFO_V1(cms_info);
+PG_FUNCTION_INFO_V1(cms_stats);
+
+/* Sliding-window sketch functions */
+PG_FUNCTION_INFO_V1(cms_window_in);
+PG_FUNCTION_INFO_V1(cms_window_out);
+PG_FUNCTION_INFO_V1(cms_window_recv);
+PG_FUNCTION_INFO_V1(cms_window_send);
+PG_FUNCTION_INFO_V1(cms_window);
+PG_FUNCTION_INFO_V1(cms_window_add);
+PG_FUNCTION_INFO_V1(cms_window_advance);
+PG_FUNCTION_INFO_V1(cms_window_get_frequency);
+PG_FUNCTION_INFO_V1(cms_window_info);
+
+/* Range tree functions */
+PG_FUNCTION_INFO_V1(cms_range_nodes);
+
+/* Dyadic range sketch functions */
+PG_FUNCTION_INFO_V1(cms_dyadic_in);
+PG_FUNCTION_INFO_V1(cms_dyadic_out);
+PG_FUNCTION_INFO_V1(cms_dyadic_recv);
+PG_FUNCTION_INFO_V1(cms_dyadic_send);
+PG_FUNCTION_INFO_V1(cms_dyadic);
+PG_FUNCTION_INFO_V1(cms_dyadic_add);
+PG_FUNCTION_INFO_V1(cms_dyadic_agg);
+PG_FUNCTION_INFO_V1(cms_dyadic_agg_with_parameters);
+PG_FUNCTION_INFO_V1(cms_range_frequency);
+PG_FUNCTION_INFO_V1(cms_quantile);
+PG_FUNCTION_INFO_V1(cms_dyadic_info);
+
+/* Prefix sketch functions */
+PG_FUNCTION_INFO_V1(cms_prefix_in);
+PG_FUNCTION_INFO_V1(cms_prefix_out);
+PG_FUNCTION_INFO_V1(cms_prefix_recv);
+PG_FUNCTION_INFO_V1(cms_prefix_send);
+PG_FUNCTION_INFO_V1(cms_prefix);
+PG_FUNCTION_INFO_V1(cms_prefix_add);
+PG_FUNCTION_INFO_V1(cms_prefix_agg);
+PG_FUNCTION_INFO_V1(cms_prefix_agg_with_parameters);
+PG_FUNCTION_INFO_V1(cms_prefix_get_frequency);
+PG_FUNCTION_INFO_V1(cms_hhh);
+PG_FUNCTION_INFO_V1(cms_prefix_info);
 
 /* Min-mask sketch functions */
 PG_FUNCTION_INFO_V1(mms_in);
@@ -100,6 +577,93 @@ PG_FUNCTION_INFO_V1(mms);
 PG_FUNCTION_INFO_V1(mms_add);
 PG_FUNCTION_INFO_V1(mms_get_mask);
 
+/* Sketch maintenance functions */
+PG_FUNCTION_INFO_V1(cms_add_new_rows);
+PG_FUNCTION_INFO_V1(cms_consume_changes);
+PG_FUNCTION_INFO_V1(cms_compact_rollups);
+
+/* Rate limiter functions */
+PG_FUNCTION_INFO_V1(cms_rate_check);
+
+/* Column statistics functions */
+PG_FUNCTION_INFO_V1(cms_eq_selectivity);
+PG_FUNCTION_INFO_V1(cms_column_statistics_changed);
+
+/* Utility functions */
+PG_FUNCTION_INFO_V1(cms_simd_level);
+
+
+/*
+ * _PG_init is called when the module is loaded. It defines the settings of the
+ * extension, which also selects the sketch kernels for this CPU, installs the
+ * planner hook of approximate top-k scans, and sets up the runtime counters,
+ * the shared sketch cache, the rate limiters, and the change and rollup
+ * workers.
+ */
+void _PG_init(void)
+{
+	DefineCustomEnumVariable("cms_mms.simd_level",
+	                         "Selects the instruction set used by the sketch kernels.",
+	                         "The default, auto, uses the best instruction set the "
+	                         "CPU supports. Other values force a level, for example "
+	                         "to compare kernels with each other.",
+	                         &SimdLevel, SIMD_LEVEL_AUTO, SimdLevelOptions,
+	                         PGC_USERSET, 0, _checkSimdLevel, _assignSimdLevel, NULL);
+
+	DefineCustomIntVariable("cms_mms.agg_buffer_size",
+	                        "Sets the number of distinct items cms_add_agg counts "
+	                        "exactly before adding them to the sketch.",
+	                        "Buffering helps on skewed data, where a frequent item "
+	                        "updates the sketch once per flush instead of once per "
+	                        "row. The size is rounded up to a power of two. Zero "
+	                        "disables the buffer.",
+	                        &AggBufferSize, 0, 0, 1048576,
+	                        PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.agg_batch_size",
+	                        "Sets the number of items cms_add_agg collects before "
+	                        "adding them to the sketch together.",
+	                        "Batching helps on sketches larger than the CPU caches, "
+	                        "where the counters of several items can be fetched "
+	                        "from memory at the same time. It doesn't change the "
+	                        "resulting sketch. Zero disables batching. If the "
+	                        "update buffer is enabled as well, items go through "
+	                        "the buffer.",
+	                        &AggBatchSize, 0, 0, 65536,
+	                        PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.width_multiple",
+	                        "Rounds the width of new count-min sketches up to a "
+	                        "multiple of this value.",
+	                        "A sketch can only be folded by factors which divide its "
+	                        "width. A multiple of 16, for example, lets sketches be "
+	                        "folded by 2, 4, 8 and 16 later, and lets sketches folded "
+	                        "by different factors be merged.",
+	                        &WidthMultiple, 1, 1, 1024,
+	                        PGC_USERSET, 0, NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("cms_mms.approximate_top_k",
+	                         "Answers top-k group counts with a count-min sketch.",
+	                         "Queries of the form SELECT column, count(*) FROM table "
+	                         "GROUP BY column ORDER BY 2 DESC LIMIT k are planned as "
+	                         "a scan which streams the column into a sketch instead "
+	                         "of aggregating and sorting every group. Counts may be "
+	                         "overestimated, and items with close counts may be "
+	                         "ranked differently.",
+	                         &ApproximateTopK, false,
+	                         PGC_USERSET, 0, NULL, NULL, NULL);
+
+	PreviousCreateUpperPathsHook = create_upper_paths_hook;
+	create_upper_paths_hook = _createCmsTopKPaths;
+	RegisterCustomScanMethods(&CmsTopKScanMethods);
+
+	CmsStatInit();
+	CmsCacheInit();
+	CmsLimiterInit();
+	CmsChangesInit();
+	CmsRollupInit();
+}
+
 
 /* ----- Count-min sketch functionality ----- */
 
@@ -111,7 +675,7 @@ Datum cms_in(PG_FUNCTION_ARGS)
 {
 	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
 
-	return datum;
+	PG_RETURN_POINTER(_checkCms((CountMinSketch*) DatumGetPointer(datum)));
 }
 
 
@@ -120,7 +684,12 @@ Datum cms_in(PG_FUNCTION_ARGS)
  */
 Datum cms_out(PG_FUNCTION_ARGS)
 {
-	Datum datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             strlen(DatumGetCString(datum)));
 
 	PG_RETURN_CSTRING(datum);
 }
@@ -133,7 +702,7 @@ Datum cms_recv(PG_FUNCTION_ARGS)
 {
 	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
 
-	return datum;
+	PG_RETURN_POINTER(_checkCms((CountMinSketch*) DatumGetPointer(datum)));
 }
 
 
@@ -142,7 +711,12 @@ Datum cms_recv(PG_FUNCTION_ARGS)
  */
 Datum cms_send(PG_FUNCTION_ARGS)
 {
-	Datum datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             VARSIZE(DatumGetPointer(datum)));
 
 	return datum;
 }
@@ -155,15 +729,22 @@ Datum cms_send(PG_FUNCTION_ARGS)
  * estimated frequency can be at most (e*||a||) more than real frequency with the
  * probability p while ||a|| is the sum of frequencies of all items according to
  * this paper: http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf.
+ * The third parameter is the number of hot items the sketch counts in its filter,
+ * zero for a plain count-min sketch. The last one selects linear instead of
+ * conservative updates.
  */
 Datum cms(PG_FUNCTION_ARGS)
 {
 	float8 errorBound = PG_GETARG_FLOAT8(0);
 	float8 confidenceInterval =  PG_GETARG_FLOAT8(1);
+	int32 filterSize = PG_GETARG_INT32(2);
+	bool linear = PG_GETARG_BOOL(3);
+	CountMinSketch* cms = NULL;
 
-	CountMinSketch* cms = _createCms(errorBound, confidenceInterval);
+	CmsStatBeginCall(CMS_STAT_CMS);
+	cms = _createCms(errorBound, confidenceInterval, filterSize, linear);
 
-	PG_RETURN_POINTER(cms);
+	PG_RETURN_DATUM(CmsStatReturnSketch(cms));
 }
 
 
@@ -180,6 +761,8 @@ Datum cms_add(PG_FUNCTION_ARGS)
 	TypeCacheEntry* newItemTypeCacheEntry = NULL;
 	Oid newItemType = InvalidOid;
 
+	CmsStatBeginCall(CMS_STAT_CMS_ADD);
+
 	/* Check whether cms is null */
 	if (PG_ARGISNULL(0))
 	{
@@ -187,13 +770,13 @@ Datum cms_add(PG_FUNCTION_ARGS)
 	}
 	else
 	{
-		currentCms = (CountMinSketch*) PG_GETARG_VARLENA_P(0);
+		currentCms = CMS_GETARG_CMS_P(0);
 	}
 
 	/* If new item is null, then return current CountMinSketch */
 	if (PG_ARGISNULL(1))
 	{
-		PG_RETURN_POINTER(currentCms);
+		PG_RETURN_DATUM(CmsStatReturnSketch(currentCms));
 	}
 
 	/* Get item type and check if it is valid */
@@ -206,9 +789,57 @@ Datum cms_add(PG_FUNCTION_ARGS)
 
 	newItem = PG_GETARG_DATUM(1);
 	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
-	updatedCms = _updateCms(currentCms, newItem, newItemTypeCacheEntry);
+	updatedCms = _updateCms(currentCms, NULL, NULL, newItem, newItemTypeCacheEntry);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(updatedCms));
+}
+
+
+/*
+ * cms_add_array is a user-facing UDF which adds every non-null element of the
+ * given array to the given CountMinSketch and returns the updated sketch. The
+ * elements are hashed first and then applied to the sketch in batches, which is
+ * faster than adding them one by one when the sketch doesn't fit into the CPU
+ * caches.
+ */
+Datum cms_add_array(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* currentCms = NULL;
+	ArrayType* itemArray = NULL;
+	Oid itemType = InvalidOid;
+	TypeCacheEntry* itemTypeCacheEntry = NULL;
+	Datum* items = NULL;
+	bool* itemNulls = NULL;
+	int itemCount = 0;
+
+	CmsStatBeginCall(CMS_STAT_CMS_ADD_ARRAY);
+
+	/* Check whether cms is null */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		currentCms = CMS_GETARG_CMS_P_COPY(0);
+	}
+
+	/* If the array is null, then return current CountMinSketch */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(currentCms));
+	}
 
-	PG_RETURN_POINTER(updatedCms);
+	itemArray = PG_GETARG_ARRAYTYPE_P(1);
+	itemType = ARR_ELEMTYPE(itemArray);
+	itemTypeCacheEntry = lookup_type_cache(itemType, 0);
+
+	deconstruct_array(itemArray, itemType, itemTypeCacheEntry->typlen,
+	                  itemTypeCacheEntry->typbyval, itemTypeCacheEntry->typalign,
+	                  &items, &itemNulls, &itemCount);
+	_updateCmsArray(currentCms, items, itemNulls, itemCount, itemTypeCacheEntry);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(currentCms));
 }
 
 
@@ -219,12 +850,15 @@ Datum cms_add(PG_FUNCTION_ARGS)
  */
 Datum cms_get_frequency(PG_FUNCTION_ARGS)
 {
-	CountMinSketch* cms = (CountMinSketch*) PG_GETARG_VARLENA_P(0);
+	CountMinSketch* cms = NULL;
 	Datum item = PG_GETARG_DATUM(1);
 	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
 	TypeCacheEntry *itemTypeCacheEntry = NULL;
 	uint64 frequency = 0;
 
+	CmsStatBeginCall(CMS_STAT_CMS_GET_FREQUENCY);
+	cms = CMS_GETARG_CMS_P(0);
+
 	if (itemType == InvalidOid)
 	{
 		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
@@ -239,538 +873,4886 @@ Datum cms_get_frequency(PG_FUNCTION_ARGS)
 
 
 /*
- * cms_info returns summary about the given CountMinSketch structure.
+ * cms_increment is a user-facing UDF which adds the given item with the given
+ * weight to the given CountMinSketch like cms_add, and also returns the new
+ * frequency estimate of the item. Callers which act on the count, for example
+ * threshold checks or filters which keep the first occurrences of items, so
+ * hash the item and visit its counters once instead of calling cms_add and
+ * cms_get_frequency one after the other. Estimates are exact or overestimated
+ * like the ones of cms_get_frequency.
  */
-Datum cms_info(PG_FUNCTION_ARGS)
+Datum cms_increment(PG_FUNCTION_ARGS)
 {
-	CountMinSketch* cms = NULL;
-	StringInfo cmsInfoString = makeStringInfo();
+	CountMinSketch* currentCms = NULL;
+	Datum newItem = 0;
+	TypeCacheEntry* newItemTypeCacheEntry = NULL;
+	Oid newItemType = InvalidOid;
+	int32 weight = 0;
+	uint64 hashValueArray[2] = {0, 0};
+	uint64 frequency = 0;
+	TupleDesc tupleDescriptor = NULL;
+	HeapTuple incrementTuple = NULL;
+	Datum values[2];
+	bool nulls[2] = {false, false};
 
-	cms = (CountMinSketch*) PG_GETARG_VARLENA_P(0);
-	appendStringInfo(cmsInfoString, "Sketch depth = %d, Sketch width = %d, "
-	                 "Size = %ukB", cms->sketchDepth, cms->sketchWidth,
-	                 VARSIZE(cms) / 1024);
+	CmsStatBeginCall(CMS_STAT_CMS_INCREMENT);
 
-	PG_RETURN_TEXT_P(CStringGetTextDatum(cmsInfoString->data));
-}
+	/* Check whether cms is null */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
 
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("function returning record called in context "
+		                       "that cannot accept type record")));
+	}
 
-/*
- * _createCms creates CountMinSketch structure with given parameters. The first parameter
- * is for the number of frequent items, other two specifies error bound and confidence
- * interval for this error bound. Size of the sketch is determined with the given
- * error bound and confidence interval according to formula in this paper:
- * http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf.
- *
- * Note that here we also allocate initial memory for the ArrayType which keeps
- * the frequent items. This allocation includes ArrayType overhead for one dimensional
- * array and additional memory according to number of top-n items and default size
- * for an individual item.
- */
-static CountMinSketch* _createCms(float8 errorBound, float8 confidenceInterval)
-{
-	CountMinSketch* cms = NULL;
-	uint32 sketchWidth = 0;
-	uint32 sketchDepth = 0;
-	Size staticStructSize = 0;
-	Size sketchSize = 0;
-	Size totalCmsSize = 0;
-	
-	if (errorBound <= 0 || errorBound >= 1)
+	tupleDescriptor = BlessTupleDesc(tupleDescriptor);
+	currentCms = CMS_GETARG_CMS_P_COPY(0);
+
+	/* If new item or weight is null, return current CountMinSketch without estimate */
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		values[0] = CmsStatReturnSketch(currentCms);
+		values[1] = (Datum) 0;
+		nulls[1] = true;
+
+		incrementTuple = heap_form_tuple(tupleDescriptor, values, nulls);
+		PG_RETURN_DATUM(HeapTupleGetDatum(incrementTuple));
+	}
+
+	weight = PG_GETARG_INT32(2);
+	if (weight <= 0)
 	{
 		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-		                errmsg("invalid parameters for cms"),
-		                errhint("Error bound has to be between 0 and 1")));
+		                errmsg("invalid parameters for cms_increment"),
+		                errhint("Weight has to be positive")));
 	}
-	else if (confidenceInterval <= 0 || confidenceInterval >= 1)
+
+	/* Get item type and check if it is valid */
+	newItemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (newItemType == InvalidOid)
 	{
 		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-		                errmsg("invalid parameters for cms"),
-		                errhint("Confidence interval has to be between 0 and 1")));
+		                errmsg("could not determine input data type")));
 	}
 
-	sketchWidth = (uint32) ceil(exp(1) / errorBound);
-	sketchDepth = (uint32) ceil(log(1 / (1 - confidenceInterval)));
-	sketchSize =  sizeof(uint64) * sketchDepth * sketchWidth;
-	staticStructSize = sizeof(CountMinSketch);
-	totalCmsSize = staticStructSize + sketchSize;
+	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
+	newItem = _detoastItem(PG_GETARG_DATUM(1), newItemTypeCacheEntry);
+	frequency = _updateCmsInPlace(currentCms, NULL, NULL, newItem, newItemTypeCacheEntry,
+	                              (CmsCounter) weight, hashValueArray);
 
-	cms = palloc0(totalCmsSize);
-	cms->sketchDepth = sketchDepth;
-	cms->sketchWidth = sketchWidth;
+	values[0] = CmsStatReturnSketch(currentCms);
+	values[1] = Int64GetDatum((int64) Min(frequency, PG_INT64_MAX));
 
-	SET_VARSIZE(cms, totalCmsSize);
+	incrementTuple = heap_form_tuple(tupleDescriptor, values, nulls);
 
-	return cms;
+	PG_RETURN_DATUM(HeapTupleGetDatum(incrementTuple));
 }
 
 
 /*
- * _updateCms is a helper function to add new item to CountMinSketch structure. It
- * adds the item to the sketch, calculates its frequency, and updates the top-n
- * array. Finally it forms new CountMinSketch from updated sketch and updated top-n array.
+ * cms_add_agg is the aggregate transition function of cms_add_agg(anyelement).
+ * It creates a CountMinSketch with default parameters for the first row and then
+ * adds every non-null item to it in-place, possibly through the update buffer.
  */
-static CountMinSketch* _updateCms(CountMinSketch* currentCms, Datum newItem,
-              TypeCacheEntry* newItemTypeCacheEntry)
+Datum cms_add_agg(PG_FUNCTION_ARGS)
 {
-	Datum detoastedItem = 0;
-
-	/* If datum is toasted, detoast it */
-	if (newItemTypeCacheEntry->typlen == -1)
-	{
-		detoastedItem = PointerGetDatum(PG_DETOAST_DATUM(newItem));
-	}
-	else
-	{
-		detoastedItem = newItem;
-	}
-
-	_updateCmsInPlace(currentCms, detoastedItem, newItemTypeCacheEntry);
-
-	return currentCms;
+	return _cmsAddAgg(fcinfo, DEFAULT_ERROR_BOUND, DEFAULT_CONFIDENCE_INTERVAL, 0, false);
 }
 
 
 /*
- * _updateCmsInPlace updates sketch inside CountMinSketch in-place with given item
- * and returns new estimated frequency for the given item.
+ * cms_add_agg_with_parameters is the aggregate transition function of
+ * cms_add_agg(anyelement, double precision, double precision) and of
+ * cms_add_agg(anyelement, double precision, double precision, integer). The
+ * parameters after the item are the error bound, confidence interval and number
+ * of hot items of the new sketch.
  */
-static uint64 _updateCmsInPlace(CountMinSketch* cms, Datum newItem,
-                    TypeCacheEntry* newItemTypeCacheEntry)
+Datum cms_add_agg_with_parameters(PG_FUNCTION_ARGS)
 {
-	uint32 hashIndex = 0;
-	uint64 hashValueArray[2] = {0, 0};
-	StringInfo newItemString = makeStringInfo();
-	uint64 newFrequency = 0;
-	uint64 minFrequency = UINT64_MAX;
+	float8 errorBound = PG_GETARG_FLOAT8(2);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(3);
+	int32 filterSize = 0;
 
-	/* Get hashed values for the given item */
-	_convertDatumToBytes(newItem, newItemTypeCacheEntry, newItemString);
-	MurmurHash3_x64_128(newItemString->data, newItemString->len, MURMUR_SEED,
-	                    &hashValueArray);
-
-	/*
-	 * Estimate frequency of the given item from hashed values and calculate new
-	 * frequency for this item.
-	 */
-	minFrequency = _cmsEstimateHashedItemFrequency(cms, hashValueArray);
-	newFrequency = minFrequency + 1;
-
-	/*
-	 * We can create an independent hash function for each index by using two hash
-	 * values from the Murmur Hash function. This is a standard technique from the
-	 * hashing literature for the additional hash functions of the form
-	 * g(x) = h1(x) + i * h2(x) and does not hurt the independence between hash
-	 * function. For more information you can check this paper:
-	 * http://www.eecs.harvard.edu/~kirsch/pubs/bbbf/esa06.pdf
-	 */
-	for (hashIndex = 0; hashIndex < cms->sketchDepth; hashIndex++)
+	if (PG_NARGS() > 4)
 	{
-		uint64 hashValue = hashValueArray[0] + (hashIndex * hashValueArray[1]);
-		uint32 widthIndex = hashValue % cms->sketchWidth;
-		uint32 depthOffset = hashIndex * cms->sketchWidth;
-		uint32 counterIndex = depthOffset + widthIndex;
-
-		/*
-		 * Selective update to decrease effect of collisions. We only update
-		 * counters less than new frequency because other counters are bigger
-		 * due to collisions.
-		 */
-		uint64 counterFrequency = cms->sketch[counterIndex];
-		if (newFrequency > counterFrequency)
-		{
-			cms->sketch[counterIndex] = newFrequency;
-		}
+		filterSize = PG_GETARG_INT32(4);
 	}
 
-	return newFrequency;
+	return _cmsAddAgg(fcinfo, errorBound, confidenceInterval, filterSize, false);
 }
 
 
 /*
- * _convertDatumToBytes converts datum to byte array and saves it in the given
- * datum string.
+ * cms_add_agg_final is the final function of the cms_add_agg aggregates. It
+ * flushes the update buffer and the update batch into the sketch of the state and
+ * returns that sketch. Since it changes the state in place, the aggregates declare
+ * it with FINALFUNC_MODIFY = READ_WRITE, so PostgreSQL neither shares the state
+ * with other aggregates nor uses the aggregates as window functions.
  */
-static void _convertDatumToBytes(Datum datum, TypeCacheEntry* datumTypeCacheEntry,
-                    StringInfo datumString)
+Datum cms_add_agg_final(PG_FUNCTION_ARGS)
 {
-	int16 datumTypeLength = datumTypeCacheEntry->typlen;
-	bool datumTypeByValue = datumTypeCacheEntry->typbyval;
-	Size datumSize = 0;
+	CmsAggState* aggState = NULL;
+	CmsMatrix matrix;
 
-	if (datumTypeLength == -1)
-	{
-		datumSize = VARSIZE_ANY_EXHDR(DatumGetPointer(datum));
-	}
-	else
+	if (PG_ARGISNULL(0))
 	{
-		datumSize = datumGetSize(datum, datumTypeByValue, datumTypeLength);
+		PG_RETURN_NULL();
 	}
 
-	if (datumTypeByValue)
+	aggState = (CmsAggState*) PG_GETARG_POINTER(0);
+	matrix = _cmsMatrix(aggState->cms);
+
+	if (aggState->buffer.slotCount > 0)
 	{
-		appendBinaryStringInfo(datumString, (char *) &datum, datumSize);
+		CmsFlushBuffer(&matrix, &aggState->buffer);
 	}
-	else
+
+	if (aggState->batch.capacity > 0)
 	{
-		appendBinaryStringInfo(datumString, VARDATA_ANY(datum), datumSize);
+		CmsFlushBatch(&matrix, &aggState->batch);
 	}
+
+	PG_RETURN_POINTER(aggState->cms);
 }
 
 
 /*
- * _cmsEstimateHashedItemFrequency is a helper function to get frequency
- * estimate of an item from it's hashed values.
+ * cms_linear_agg is the aggregate transition function of
+ * cms_linear_agg(anyelement). It works like cms_add_agg, but creates a sketch with
+ * linear updates, so the aggregate can also remove items when it is used as a
+ * moving aggregate in a window.
  */
-static uint64 _cmsEstimateHashedItemFrequency(CountMinSketch* cms, uint64* hashValueArray)
+Datum cms_linear_agg(PG_FUNCTION_ARGS)
 {
-	uint32 hashIndex = 0;
-	uint64 minFrequency = UINT64_MAX;
+	return _cmsAddAgg(fcinfo, DEFAULT_ERROR_BOUND, DEFAULT_CONFIDENCE_INTERVAL, 0, true);
+}
 
-	for (hashIndex = 0; hashIndex < cms->sketchDepth; hashIndex++)
-	{
-		uint64 hashValue = hashValueArray[0] + (hashIndex * hashValueArray[1]);
-		uint32 widthIndex = hashValue % cms->sketchWidth;
-		uint32 depthOffset = hashIndex * cms->sketchWidth;
-		uint32 counterIndex = depthOffset + widthIndex;
 
-		uint64 counterFrequency = cms->sketch[counterIndex];
-		if (counterFrequency < minFrequency)
-		{
-			minFrequency = counterFrequency;
-		}
-	}
+/*
+ * cms_linear_agg_with_parameters is the aggregate transition function of
+ * cms_linear_agg(anyelement, double precision, double precision). The parameters
+ * after the item are the error bound and confidence interval of the new sketch.
+ */
+Datum cms_linear_agg_with_parameters(PG_FUNCTION_ARGS)
+{
+	float8 errorBound = PG_GETARG_FLOAT8(2);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(3);
 
-	return minFrequency;
+	return _cmsAddAgg(fcinfo, errorBound, confidenceInterval, 0, true);
 }
 
+
 /*
- * _cmsEstimateItemFrequency calculates estimated frequency for the given
- * item and returns it.
+ * cms_linear_agg_inverse is the inverse transition function of both
+ * cms_linear_agg aggregates. PostgreSQL calls it for the rows which leave a
+ * sliding window frame, so the frame's sketch is maintained incrementally instead
+ * of being recomputed for every row. The parameters after the item are ignored.
  */
-static uint64 _cmsEstimateItemFrequency(CountMinSketch* cms, Datum item,
-                             TypeCacheEntry* itemTypeCacheEntry)
+Datum cms_linear_agg_inverse(PG_FUNCTION_ARGS)
 {
-	uint64 hashValueArray[2] = {0, 0};
-	StringInfo itemString = makeStringInfo();
-	uint64 frequency = 0;
+	CmsAggState* aggState = NULL;
+	Datum item = 0;
+	TypeCacheEntry* itemTypeCacheEntry = NULL;
+	Oid itemType = InvalidOid;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("cms_linear_agg called in non-aggregate context")));
+	}
+
+	CmsStatBeginCall(CMS_STAT_CMS_LINEAR_AGG);
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+
+	aggState = (CmsAggState*) PG_GETARG_POINTER(0);
+
+	/* Null items were skipped when they were added */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(aggState);
+	}
+
+	itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (itemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data type")));
+	}
+
+	itemTypeCacheEntry = lookup_type_cache(itemType, 0);
+	item = _detoastItem(PG_GETARG_DATUM(1), itemTypeCacheEntry);
+	_removeCmsInPlace(aggState->cms, item, itemTypeCacheEntry);
+
+	PG_RETURN_POINTER(aggState);
+}
+
+
+/*
+ * cms_linear_agg_final is the final and moving final function of both
+ * cms_linear_agg aggregates. Their transition states have no update buffer and
+ * no update batch, so the sketch of the state is already complete and is returned
+ * without changing the state. PostgreSQL can therefore call the function again
+ * after rows were added to or removed from a window frame.
+ */
+Datum cms_linear_agg_final(PG_FUNCTION_ARGS)
+{
+	CmsAggState* aggState = NULL;
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+
+	aggState = (CmsAggState*) PG_GETARG_POINTER(0);
+	Assert(aggState->buffer.slotCount == 0 && aggState->batch.capacity == 0);
+
+	PG_RETURN_POINTER(aggState->cms);
+}
+
+
+/*
+ * cms_subtract is a user-facing UDF which subtracts the second CountMinSketch from
+ * the first one and returns the result. Both sketches need linear updates and the
+ * same parameters, and the second one has to count a subset of the items of the
+ * first one, for example an earlier snapshot of it. The result then counts the
+ * remaining items as if they had been added to an empty sketch.
+ */
+Datum cms_subtract(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* targetCms = NULL;
+	CountMinSketch* sourceCms = NULL;
+	CmsMatrix targetMatrix;
+	CmsMatrix sourceMatrix;
+	CmsStatus status = CMS_OK;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_SUBTRACT);
+	targetCms = CMS_GETARG_CMS_P_COPY(0);
+	sourceCms = CMS_GETARG_CMS_P(1);
+
+	if (targetCms->sketchDepth != sourceCms->sketchDepth ||
+	    targetCms->sketchWidth != sourceCms->sketchWidth ||
+	    targetCms->filterSize != sourceCms->filterSize ||
+	    targetCms->flags != sourceCms->flags)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot subtract cmss with different parameters")));
+	}
+	else if ((targetCms->flags & CMS_FLAG_LINEAR) == 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot subtract cmss with conservative updates"),
+		                errhint("Create the sketches with linear updates.")));
+	}
+
+	targetMatrix = _cmsMatrix(targetCms);
+	sourceMatrix = _cmsMatrix(sourceCms);
+
+	CmsStatTimerStart(&startTime);
+	status = CmsSubtractMatrix(&targetMatrix, &sourceMatrix);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	if (status == CMS_COUNTER_UNDERFLOW)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot subtract a cms which counts items the other "
+		                       "cms doesn't count")));
+	}
+
+	if (targetCms->totalCount != PG_UINT64_MAX)
+	{
+		targetCms->totalCount -= Min(targetCms->totalCount, sourceCms->totalCount);
+	}
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(targetCms));
+}
+
+
+/*
+ * cms_fold is a user-facing UDF which shrinks the width of a CountMinSketch by the
+ * given factor, adding up the columns that map to the same column of the narrower
+ * sketch. The factor has to divide the width. The folded sketch counts the same
+ * items with the error bound of its width and takes a factor less space, which
+ * suits old sketches that only need coarse estimates.
+ */
+Datum cms_fold(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* cms = NULL;
+	int32 foldFactor = 0;
+	CountMinSketch* foldedCms = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_FOLD);
+	cms = CMS_GETARG_CMS_P(0);
+	foldFactor = PG_GETARG_INT32(1);
+
+	if (foldFactor < 1 || cms->sketchWidth % foldFactor != 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_fold"),
+		                errhint("Fold factor has to divide the sketch width %u",
+		                        cms->sketchWidth)));
+	}
+
+	foldedCms = _foldCms(cms, (uint32) foldFactor);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(foldedCms));
+}
+
+
+/*
+ * cms_union is a user-facing UDF which returns the union of two CountMinSketch
+ * structures. If one of them is null, the other one is returned. If the width of
+ * one sketch divides the width of the other, the wider one is folded first.
+ */
+Datum cms_union(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* firstCms = NULL;
+	CountMinSketch* secondCms = NULL;
+	CountMinSketch* newCms = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_UNION);
+
+	if (PG_ARGISNULL(0) && PG_ARGISNULL(1))
+	{
+		PG_RETURN_NULL();
+	}
+	else if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(CMS_GETARG_CMS_P(1)));
+	}
+	else if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(CMS_GETARG_CMS_P(0)));
+	}
+
+	firstCms = CMS_GETARG_CMS_P_COPY(0);
+	secondCms = CMS_GETARG_CMS_P(1);
+	newCms = _unionCms(firstCms, secondCms);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(newCms));
+}
+
+
+/*
+ * cms_union_agg is the aggregate transition function of cms_union_agg(cms). The
+ * first non-null sketch is copied into the state and the following ones are
+ * merged into it in-place.
+ */
+Datum cms_union_agg(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* currentCms = NULL;
+	CountMinSketch* newCms = NULL;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("cms_union_agg called in non-aggregate context")));
+	}
+
+	CmsStatBeginCall(CMS_STAT_CMS_UNION_AGG);
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+		{
+			PG_RETURN_NULL();
+		}
+
+		PG_RETURN_POINTER(PG_GETARG_VARLENA_P(0));
+	}
+
+	if (PG_ARGISNULL(0))
+	{
+		currentCms = CMS_GETARG_CMS_P_COPY(1);
+		PG_RETURN_POINTER(currentCms);
+	}
+
+	currentCms = (CountMinSketch*) PG_GETARG_VARLENA_P(0);
+	newCms = CMS_GETARG_CMS_P(1);
+	currentCms = _unionCms(currentCms, newCms);
+
+	PG_RETURN_POINTER(currentCms);
+}
+
+
+/*
+ * cms_inner_product is a user-facing UDF which estimates the inner product of the
+ * frequencies counted by two CountMinSketch structures, which is the size of the
+ * equi-join between their streams. Comparing it with the inner products of each
+ * sketch with itself gives their similarity. The sketches need the same depth,
+ * and if their widths differ, one has to divide the other so that the wider
+ * sketch can be folded. Estimates never fall below the join size for linear
+ * sketches; conservative updates give smaller but less predictable estimates.
+ */
+Datum cms_inner_product(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* firstCms = NULL;
+	CountMinSketch* secondCms = NULL;
+	CmsMatrix firstMatrix;
+	CmsMatrix secondMatrix;
+	uint32 width = 0;
+	float8 innerProduct = 0.0;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_INNER_PRODUCT);
+	firstCms = CMS_GETARG_CMS_P(0);
+	secondCms = CMS_GETARG_CMS_P(1);
+
+	if (firstCms->sketchDepth != secondCms->sketchDepth ||
+	    (firstCms->sketchWidth % secondCms->sketchWidth != 0 &&
+	     secondCms->sketchWidth % firstCms->sketchWidth != 0))
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot multiply cmss with different dimensions")));
+	}
+
+	width = Min(firstCms->sketchWidth, secondCms->sketchWidth);
+	firstMatrix = _cmsCountingMatrix(firstCms, width);
+	secondMatrix = _cmsCountingMatrix(secondCms, width);
+
+	CmsStatTimerStart(&startTime);
+	innerProduct = CmsInnerProduct(&firstMatrix, &secondMatrix);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+
+	PG_RETURN_FLOAT8(innerProduct);
+}
+
+
+/*
+ * cms_info returns summary about the given CountMinSketch structure.
+ */
+Datum cms_info(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* cms = NULL;
+	StringInfo cmsInfoString = makeStringInfo();
+
+	cms = CMS_GETARG_CMS_P(0);
+	appendStringInfo(cmsInfoString, "Sketch depth = %d, Sketch width = %d, "
+	                 "Size = %ukB", cms->sketchDepth, cms->sketchWidth,
+	                 VARSIZE(cms) / 1024);
+
+	if (cms->filterSize > 0)
+	{
+		appendStringInfo(cmsInfoString, ", Hot items = %u", (uint32) cms->filterSize);
+	}
+
+	if (cms->flags & CMS_FLAG_LINEAR)
+	{
+		appendStringInfoString(cmsInfoString, ", Linear updates");
+	}
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(cmsInfoString->data));
+}
+
+
+/*
+ * cms_stats returns statistics which tell how loaded the given CountMinSketch is:
+ * its total count, the fraction of zero counters in every row, the number of
+ * saturated counters, the additive error of frequency estimates and the number
+ * of distinct items estimated from zero counters. The distinct item estimate is
+ * null once a row has no zero counters left.
+ */
+Datum cms_stats(PG_FUNCTION_ARGS)
+{
+	CountMinSketch* cms = CMS_GETARG_CMS_P(0);
+	CmsMatrix matrix = _cmsMatrix(cms);
+	TupleDesc tupleDescriptor = NULL;
+	HeapTuple statsTuple = NULL;
+	Datum* zeroFractionDatums = NULL;
+	ArrayType* zeroFractionArray = NULL;
+	Datum values[5];
+	bool nulls[5] = {false, false, false, false, false};
+	float8 distinctItems = 0;
+	uint32 row = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("function returning record called in context "
+		                       "that cannot accept type record")));
+	}
+
+	tupleDescriptor = BlessTupleDesc(tupleDescriptor);
+
+	zeroFractionDatums = palloc(sizeof(Datum) * cms->sketchDepth);
+	for (row = 0; row < cms->sketchDepth; row++)
+	{
+		size_t zeroCount = CmsCountRowZeroCounters(&matrix, row);
+		float8 zeroFraction = (float8) zeroCount / cms->sketchWidth;
+
+		zeroFractionDatums[row] = Float8GetDatum(zeroFraction);
+	}
+
+	zeroFractionArray = construct_array(zeroFractionDatums, cms->sketchDepth, FLOAT8OID,
+	                                    sizeof(float8), FLOAT8PASSBYVAL, 'd');
+
+	values[0] = Int64GetDatum((int64) Min(cms->totalCount, PG_INT64_MAX));
+	values[1] = PointerGetDatum(zeroFractionArray);
+	values[2] = Int64GetDatum((int64) CmsCountSaturatedCounters(&matrix));
+	values[3] = Float8GetDatum(CmsAdditiveError(&matrix, cms->totalCount));
+
+	distinctItems = CmsEstimateDistinctItems(&matrix);
+	if (distinctItems < 0)
+	{
+		nulls[4] = true;
+		values[4] = (Datum) 0;
+	}
+	else
+	{
+		values[4] = Float8GetDatum(distinctItems);
+	}
+
+	statsTuple = heap_form_tuple(tupleDescriptor, values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(statsTuple));
+}
+
+
+/*
+ * _createCms creates CountMinSketch structure with given parameters. The first parameter
+ * is for the number of frequent items, other two specifies error bound and confidence
+ * interval for this error bound. Size of the sketch is determined with the given
+ * error bound and confidence interval according to formula in this paper:
+ * http://dimacs.rutgers.edu/~graham/pubs/papers/cm-full.pdf.
+ *
+ * Note that here we also allocate initial memory for the ArrayType which keeps
+ * the frequent items. This allocation includes ArrayType overhead for one dimensional
+ * array and additional memory according to number of top-n items and default size
+ * for an individual item.
+ *
+ * If filterSize is positive, the sketch is an augmented sketch whose hot-item
+ * filter of that many entries follows the counter matrix. If linear is set, the
+ * sketch uses linear instead of conservative updates; the filter can't be
+ * combined with them.
+ */
+static CountMinSketch* _createCms(float8 errorBound, float8 confidenceInterval,
+                                  int32 filterSize, bool linear)
+{
+	CountMinSketch* cms = NULL;
+	uint32 sketchWidth = 0;
+	uint32 sketchDepth = 0;
+	Size staticStructSize = 0;
+	Size sketchSize = 0;
+	Size filterSizeInBytes = 0;
+	Size totalCmsSize = 0;
+
+	if (filterSize < 0 || filterSize > MAX_FILTER_SIZE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms"),
+		                errhint("Number of hot items has to be between 0 and %d",
+		                        MAX_FILTER_SIZE)));
+	}
+	else if (filterSize > 0 && linear)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms"),
+		                errhint("Sketches with hot items can't use linear updates")));
+	}
+
+	_computeDimensions(errorBound, confidenceInterval, "cms", &sketchDepth, &sketchWidth);
+	sketchWidth = (sketchWidth + WidthMultiple - 1) / WidthMultiple * WidthMultiple;
+	sketchSize = CmsMatrixSize(sketchDepth, sketchWidth);
+	filterSizeInBytes = sizeof(CmsFilterEntry) * filterSize;
+	staticStructSize = sizeof(CountMinSketch);
+	totalCmsSize = staticStructSize + sketchSize + filterSizeInBytes;
+
+	cms = palloc0(totalCmsSize);
+	cms->sketchDepth = sketchDepth;
+	cms->sketchWidth = sketchWidth;
+	cms->filterSize = (uint16) filterSize;
+	cms->flags = linear ? CMS_FLAG_LINEAR : 0;
+	cms->formatVersion = CMS_FORMAT_VERSION;
+
+	SET_VARSIZE(cms, totalCmsSize);
+
+	return cms;
+}
+
+
+/*
+ * _checkCms returns the given value if it is a count-min sketch of the current
+ * format. Sketches of version 1.0.0 of the extension are converted to a new
+ * sketch, which is returned instead. Other values are an error, since values
+ * whose size doesn't match their dimensions would make the sketch functions read
+ * past their end.
+ */
+static CountMinSketch* _checkCms(CountMinSketch* cms)
+{
+	Size expectedSize = 0;
+
+	if (_isCmsV1(cms))
+	{
+		return _convertCmsV1((CountMinSketchV1*) cms);
+	}
+
+	if (VARSIZE(cms) >= sizeof(CountMinSketch) && cms->formatVersion != CMS_FORMAT_VERSION)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		                errmsg("unsupported cms format"),
+		                errhint("Format version %u isn't supported by this version of cms_mms",
+		                        cms->formatVersion)));
+	}
+
+	if (VARSIZE(cms) >= sizeof(CountMinSketch) &&
+	    _hasValidDimensions(cms->sketchDepth, cms->sketchWidth) &&
+	    cms->filterSize <= MAX_FILTER_SIZE && (cms->flags & ~CMS_FLAG_LINEAR) == 0)
+	{
+		expectedSize = sizeof(CountMinSketch) +
+		               CmsMatrixSize(cms->sketchDepth, cms->sketchWidth) +
+		               sizeof(CmsFilterEntry) * cms->filterSize;
+	}
+
+	_checkSketchSize((struct varlena*) cms, expectedSize, "cms");
+
+	return cms;
+}
+
+
+/*
+ * _isCmsV1 returns whether the given value is a count-min sketch of version 1.0.0
+ * of the extension. Such sketches have a zero padding where the current header
+ * has its format version, and their size matches their dimensions.
+ */
+static bool _isCmsV1(CountMinSketch* cms)
+{
+	CountMinSketchV1* cmsV1 = (CountMinSketchV1*) cms;
+
+	return VARSIZE(cms) >= sizeof(CountMinSketchV1) && cmsV1->padding == 0 &&
+	       _hasValidDimensions(cmsV1->sketchDepth, cmsV1->sketchWidth) &&
+	       VARSIZE(cms) == sizeof(CountMinSketchV1) +
+	                       sizeof(uint64) * cmsV1->sketchDepth * cmsV1->sketchWidth;
+}
+
+
+/*
+ * _convertCmsV1 converts a count-min sketch of version 1.0.0 of the extension to
+ * the current format. The counters keep their layout, and the sketch gets no
+ * hot-item filter and conservative updates like the sketches of that version.
+ * Their total count wasn't kept, so the largest sum of a row stands in for it.
+ * Conservative updates raise the counters of a row by at most the weight of the
+ * item, so this sum is only a lower bound of the total count, and the error
+ * bounds which cms_stats derives from it may be too tight.
+ */
+static CountMinSketch* _convertCmsV1(CountMinSketchV1* cmsV1)
+{
+	uint32 sketchDepth = cmsV1->sketchDepth;
+	uint32 sketchWidth = cmsV1->sketchWidth;
+	Size matrixSize = CmsMatrixSize(sketchDepth, sketchWidth);
+	Size totalCmsSize = sizeof(CountMinSketch) + matrixSize;
+	CountMinSketch* cms = palloc0(totalCmsSize);
+	uint32 rowIndex = 0;
+	uint32 columnIndex = 0;
+
+	cms->sketchDepth = sketchDepth;
+	cms->sketchWidth = sketchWidth;
+	cms->formatVersion = CMS_FORMAT_VERSION;
+	memcpy(cms->sketch, cmsV1->sketch, matrixSize);
+
+	for (rowIndex = 0; rowIndex < sketchDepth; rowIndex++)
+	{
+		uint64 rowSum = 0;
+
+		for (columnIndex = 0; columnIndex < sketchWidth; columnIndex++)
+		{
+			rowSum = CmsAddSaturating(rowSum, cms->sketch[CMS_CELL_INDEX(sketchDepth, sketchWidth,
+			                                                             rowIndex, columnIndex)]);
+		}
+
+		cms->totalCount = Max(cms->totalCount, rowSum);
+	}
+
+	SET_VARSIZE(cms, totalCmsSize);
+
+	return cms;
+}
+
+
+/*
+ * _updateCms is a helper function to add new item to CountMinSketch structure. It
+ * adds the item to the sketch, calculates its frequency, and updates the top-n
+ * array. Finally it forms new CountMinSketch from updated sketch and updated top-n array.
+ * If an update buffer or an update batch is given, the item goes through it.
+ */
+static CountMinSketch* _updateCms(CountMinSketch* currentCms, CmsUpdateBuffer* buffer,
+              CmsUpdateBatch* batch, Datum newItem, TypeCacheEntry* newItemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	Datum detoastedItem = 0;
+
+	/* If datum is toasted, detoast it */
+	if (newItemTypeCacheEntry->typlen == -1)
+	{
+		detoastedItem = PointerGetDatum(CmsStatDetoastItem(newItem));
+	}
+	else
+	{
+		detoastedItem = newItem;
+	}
+
+	_updateCmsInPlace(currentCms, buffer, batch, detoastedItem, newItemTypeCacheEntry, 1,
+	                  hashValueArray);
+
+	return currentCms;
+}
+
+
+/*
+ * _updateCmsArray adds the non-null items of an array to CountMinSketch in-place.
+ * It hashes the items into an update batch of at most ARRAY_BATCH_SIZE items,
+ * which applies them to the sketch whenever it is full. Sketches with a hot-item
+ * filter are updated item by item, because every item may change the filter, and
+ * so are linear sketches, whose updates don't depend on the counters.
+ */
+static void _updateCmsArray(CountMinSketch* cms, Datum* items, bool* itemNulls,
+                            int itemCount, TypeCacheEntry* itemTypeCacheEntry)
+{
+	CmsMatrix matrix = _cmsMatrix(cms);
+	CmsFilter filter = _cmsFilter(cms);
+	uint32 batchCapacity = (uint32) Min(itemCount, ARRAY_BATCH_SIZE);
+	CmsUpdateBatch batch;
+	StringInfo itemString = makeStringInfo();
+	uint64 addedCount = 0;
+	instr_time startTime;
+	int itemIndex = 0;
+
+	if (batchCapacity == 0)
+	{
+		return;
+	}
+
+	CmsInitBatch(&batch, palloc(CmsBatchMemorySize(batchCapacity, matrix.depth)),
+	             batchCapacity, matrix.depth);
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		uint64 hashValueArray[2] = {0, 0};
+		Datum item = items[itemIndex];
+
+		if (itemNulls[itemIndex])
+		{
+			continue;
+		}
+
+		/* If datum is toasted, detoast it */
+		if (itemTypeCacheEntry->typlen == -1)
+		{
+			item = PointerGetDatum(CmsStatDetoastItem(item));
+		}
+
+		CmsStatTimerStart(&startTime);
+		resetStringInfo(itemString);
+		_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+		TRACE_CMS_MMS_ADD_START(matrix.depth, matrix.width, (size_t) itemString->len);
+		CmsHashBytes(itemString->data, itemString->len, hashValueArray);
+		CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+		if (cms->flags & CMS_FLAG_LINEAR)
+		{
+			CmsLinearUpdateHashed(&matrix, hashValueArray, 1);
+		}
+		else if (filter.size > 0)
+		{
+			CmsFilterUpdateHashed(&matrix, &filter, hashValueArray, 1);
+		}
+		else
+		{
+			CmsBatchUpdateHashed(&matrix, &batch, hashValueArray, 1);
+		}
+		CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+		TRACE_CMS_MMS_ADD_DONE(matrix.depth, matrix.width, (size_t) itemString->len,
+		                       (uint64) 0);
+		addedCount++;
+	}
+
+	CmsStatTimerStart(&startTime);
+	CmsFlushBatch(&matrix, &batch);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	cms->totalCount = CmsAddSaturating(cms->totalCount, addedCount);
+	CmsStatPending->items += addedCount;
+}
+
+
+/*
+ * _updateCmsInPlace updates sketch inside CountMinSketch in-place with given item
+ * and weight, and returns new estimated frequency for the given item. If the given update
+ * buffer has slots, the item is added to the buffer instead and zero is returned.
+ * Otherwise, if the given update batch has capacity, the item is added to the
+ * batch and zero is returned. The hash values of the item are stored in the given
+ * array, so callers can keep track of the item without hashing it again.
+ */
+static uint64 _updateCmsInPlace(CountMinSketch* cms, CmsUpdateBuffer* buffer,
+                    CmsUpdateBatch* batch, Datum newItem,
+                    TypeCacheEntry* newItemTypeCacheEntry, CmsCounter weight,
+                    uint64* hashValueArray)
+{
+	StringInfo newItemString = makeStringInfo();
+	CmsMatrix matrix = _cmsMatrix(cms);
+	CmsFilter filter = _cmsFilter(cms);
+	uint64 newFrequency = 0;
+	instr_time startTime;
+
+	/* Get hashed values for the given item */
+	CmsStatTimerStart(&startTime);
+	_convertDatumToBytes(newItem, newItemTypeCacheEntry, newItemString);
+	TRACE_CMS_MMS_ADD_START(matrix.depth, matrix.width, (size_t) newItemString->len);
+	CmsHashBytes(newItemString->data, newItemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+	/*
+	 * Conservatively update the counters of the item in every row and get its new
+	 * frequency estimate. Buffered and batched items reach the counters when the
+	 * buffer or batch is flushed, but they are part of the total count right away.
+	 * Sketches with a hot-item filter count frequent items in the filter, and
+	 * linear sketches add the item to all of its counters.
+	 */
+	if (cms->flags & CMS_FLAG_LINEAR)
+	{
+		newFrequency = CmsLinearUpdateHashed(&matrix, hashValueArray, weight);
+	}
+	else if (filter.size > 0)
+	{
+		newFrequency = CmsFilterUpdateHashed(&matrix, &filter, hashValueArray, weight);
+	}
+	else if (buffer != NULL && buffer->slotCount > 0)
+	{
+		CmsBufferUpdateHashed(&matrix, buffer, hashValueArray, weight);
+	}
+	else if (batch != NULL && batch->capacity > 0)
+	{
+		CmsBatchUpdateHashed(&matrix, batch, hashValueArray, weight);
+	}
+	else
+	{
+		newFrequency = CmsUpdateHashed(&matrix, hashValueArray, weight);
+	}
+	cms->totalCount = CmsAddSaturating(cms->totalCount, weight);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	CmsStatPending->items++;
+	TRACE_CMS_MMS_ADD_DONE(matrix.depth, matrix.width, (size_t) newItemString->len,
+	                       newFrequency);
+
+	return newFrequency;
+}
+
+
+/*
+ * _removeCmsInPlace removes one occurrence of the given item from a linear
+ * CountMinSketch in-place. It errors out if the item can't have been added.
+ */
+static void _removeCmsInPlace(CountMinSketch* cms, Datum item,
+                              TypeCacheEntry* itemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo itemString = makeStringInfo();
+	CmsMatrix matrix = _cmsMatrix(cms);
+	CmsStatus status = CMS_OK;
+	instr_time startTime;
+
+	CmsStatTimerStart(&startTime);
+	_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+	CmsHashBytes(itemString->data, itemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+	status = CmsLinearRemoveHashed(&matrix, hashValueArray, 1);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	if (status == CMS_COUNTER_UNDERFLOW)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot remove an item which wasn't added to the cms")));
+	}
+
+	if (cms->totalCount > 0 && cms->totalCount != PG_UINT64_MAX)
+	{
+		cms->totalCount--;
+	}
+	CmsStatPending->items++;
+}
+
+
+/*
+ * _cmsAddAgg contains the shared logic of the cms_add_agg and cms_linear_agg
+ * transition functions.
+ * The transition state is only created and modified by these functions, so it is
+ * safe to update it in-place.
+ */
+static Datum _cmsAddAgg(FunctionCallInfo fcinfo, float8 errorBound,
+                        float8 confidenceInterval, int32 filterSize, bool linear)
+{
+	CmsAggState* aggState = NULL;
+	MemoryContext aggregateContext = NULL;
+	Datum newItem = 0;
+	TypeCacheEntry* newItemTypeCacheEntry = NULL;
+	Oid newItemType = InvalidOid;
+
+	if (!AggCheckCallContext(fcinfo, &aggregateContext))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("%s called in non-aggregate context",
+		                       linear ? "cms_linear_agg" : "cms_add_agg")));
+	}
+
+	CmsStatBeginCall(linear ? CMS_STAT_CMS_LINEAR_AGG : CMS_STAT_CMS_ADD_AGG);
+
+	/* Create CountMinSketch for the first row */
+	if (PG_ARGISNULL(0))
+	{
+		aggState = _createCmsAggState(aggregateContext, errorBound, confidenceInterval,
+		                              filterSize, linear);
+	}
+	else
+	{
+		aggState = (CmsAggState*) PG_GETARG_POINTER(0);
+	}
+
+	/* If new item is null, then return current state */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(aggState);
+	}
+
+	newItemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (newItemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data type")));
+	}
+
+	newItem = PG_GETARG_DATUM(1);
+	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
+	_updateCms(aggState->cms, &aggState->buffer, &aggState->batch, newItem,
+	           newItemTypeCacheEntry);
+
+	PG_RETURN_POINTER(aggState);
+}
+
+
+/*
+ * _createCmsAggState creates the transition state of cms_add_agg in the given
+ * aggregate memory context, with an update buffer of cms_mms.agg_buffer_size
+ * slots and an update batch of cms_mms.agg_batch_size items if those are set and
+ * the sketch has neither a hot-item filter nor linear updates.
+ */
+static CmsAggState* _createCmsAggState(MemoryContext aggregateContext, float8 errorBound,
+                                       float8 confidenceInterval, int32 filterSize,
+                                       bool linear)
+{
+	MemoryContext oldContext = MemoryContextSwitchTo(aggregateContext);
+	CmsAggState* aggState = palloc0(sizeof(CmsAggState));
+
+	aggState->cms = _createCms(errorBound, confidenceInterval, filterSize, linear);
+
+	if (filterSize > 0 || linear)
+	{
+		MemoryContextSwitchTo(oldContext);
+		return aggState;
+	}
+
+	if (AggBufferSize > 0)
+	{
+		uint32 slotCount = CmsBufferSlotCount((uint32) AggBufferSize);
+		CmsBufferEntry* entries = palloc(sizeof(CmsBufferEntry) * slotCount);
+
+		CmsInitBuffer(&aggState->buffer, entries, slotCount);
+	}
+
+	if (AggBatchSize > 0)
+	{
+		uint32 batchCapacity = (uint32) AggBatchSize;
+		uint32 sketchDepth = aggState->cms->sketchDepth;
+		void* batchMemory = palloc(CmsBatchMemorySize(batchCapacity, sketchDepth));
+
+		CmsInitBatch(&aggState->batch, batchMemory, batchCapacity, sketchDepth);
+	}
+
+	MemoryContextSwitchTo(oldContext);
+
+	return aggState;
+}
+
+
+/*
+ * _unionCms merges the source CountMinSketch into the target CountMinSketch
+ * in-place by adding their counters, and returns the target. Both sketches must
+ * have been created with the same parameters, except that the width of one may
+ * divide the width of the other. The wider sketch is then folded to the narrower
+ * width first; if that is the target, a new sketch is returned.
+ */
+static CountMinSketch* _unionCms(CountMinSketch* targetCms, CountMinSketch* sourceCms)
+{
+	CmsMatrix targetMatrix;
+	CmsMatrix sourceMatrix;
+	CmsFilter targetFilter;
+	CmsFilter sourceFilter;
+	instr_time startTime;
+
+	if (targetCms->sketchDepth != sourceCms->sketchDepth ||
+	    (targetCms->sketchWidth % sourceCms->sketchWidth != 0 &&
+	     sourceCms->sketchWidth % targetCms->sketchWidth != 0) ||
+	    targetCms->filterSize != sourceCms->filterSize ||
+	    targetCms->flags != sourceCms->flags)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("cannot merge cmss with different parameters")));
+	}
+
+	if (targetCms->sketchWidth > sourceCms->sketchWidth)
+	{
+		targetCms = _foldCms(targetCms, targetCms->sketchWidth / sourceCms->sketchWidth);
+	}
+	else if (sourceCms->sketchWidth > targetCms->sketchWidth)
+	{
+		sourceCms = _foldCms(sourceCms, sourceCms->sketchWidth / targetCms->sketchWidth);
+	}
+
+	targetMatrix = _cmsMatrix(targetCms);
+	sourceMatrix = _cmsMatrix(sourceCms);
+	targetFilter = _cmsFilter(targetCms);
+	sourceFilter = _cmsFilter(sourceCms);
+
+	TRACE_CMS_MMS_UNION_START(targetMatrix.depth, targetMatrix.width);
+	CmsStatTimerStart(&startTime);
+	if (targetFilter.size > 0)
+	{
+		CmsFilterEntry* scratchEntries = palloc(sizeof(CmsFilterEntry) * 2 *
+		                                        targetFilter.size);
+
+		CmsMergeFilters(&targetMatrix, &targetFilter, &sourceMatrix, &sourceFilter,
+		                scratchEntries);
+		pfree(scratchEntries);
+	}
+	else
+	{
+		CmsMergeMatrix(&targetMatrix, &sourceMatrix);
+	}
+	targetCms->totalCount = CmsAddSaturating(targetCms->totalCount,
+	                                         sourceCms->totalCount);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	TRACE_CMS_MMS_UNION_DONE(targetMatrix.depth, targetMatrix.width);
+
+	CmsStatPending->unions++;
+	CmsStatPending->unionBytes += CmsMatrixSize(sourceMatrix.depth, sourceMatrix.width);
+
+	return targetCms;
+}
+
+
+/*
+ * _foldCms returns a copy of the given CountMinSketch whose width is smaller by
+ * the given factor, which has to divide the width. The hot-item filter is copied
+ * as it is, since its entries keep hash values rather than columns.
+ */
+static CountMinSketch* _foldCms(CountMinSketch* cms, uint32 foldFactor)
+{
+	CountMinSketch* foldedCms = NULL;
+	uint32 foldedWidth = cms->sketchWidth / foldFactor;
+	Size filterSizeInBytes = sizeof(CmsFilterEntry) * cms->filterSize;
+	Size foldedCmsSize = sizeof(CountMinSketch) +
+	                     CmsMatrixSize(cms->sketchDepth, foldedWidth) + filterSizeInBytes;
+	CmsMatrix matrix = _cmsMatrix(cms);
+	CmsMatrix foldedMatrix;
+	instr_time startTime;
+
+	foldedCms = palloc0(foldedCmsSize);
+	foldedCms->sketchDepth = cms->sketchDepth;
+	foldedCms->sketchWidth = foldedWidth;
+	foldedCms->filterSize = cms->filterSize;
+	foldedCms->flags = cms->flags;
+	foldedCms->formatVersion = cms->formatVersion;
+	foldedCms->totalCount = cms->totalCount;
+	SET_VARSIZE(foldedCms, foldedCmsSize);
+
+	foldedMatrix = _cmsMatrix(foldedCms);
+	memcpy(_cmsFilter(foldedCms).entries, _cmsFilter(cms).entries, filterSizeInBytes);
+
+	CmsStatTimerStart(&startTime);
+	CmsFoldMatrix(&foldedMatrix, &matrix);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	return foldedCms;
+}
+
+
+/*
+ * _cmsCountingMatrix returns a counter matrix of the given width which counts all
+ * items of the given CountMinSketch; the width has to divide the sketch width.
+ * Unless the sketch already has that width and no hot-item filter, the matrix
+ * belongs to a folded copy whose filter has been flushed into it.
+ */
+static CmsMatrix _cmsCountingMatrix(CountMinSketch* cms, uint32 width)
+{
+	CmsMatrix matrix;
+	CmsFilter filter;
+
+	if (cms->sketchWidth != width || cms->filterSize > 0)
+	{
+		cms = _foldCms(cms, cms->sketchWidth / width);
+	}
+
+	matrix = _cmsMatrix(cms);
+	filter = _cmsFilter(cms);
+	CmsFlushFilter(&matrix, &filter);
+
+	return matrix;
+}
+
+
+/*
+ * _convertDatumToBytes converts datum to byte array and saves it in the given
+ * datum string.
+ */
+static void _convertDatumToBytes(Datum datum, TypeCacheEntry* datumTypeCacheEntry,
+                    StringInfo datumString)
+{
+	int16 datumTypeLength = datumTypeCacheEntry->typlen;
+	bool datumTypeByValue = datumTypeCacheEntry->typbyval;
+	Size datumSize = 0;
+
+	if (datumTypeLength == -1)
+	{
+		datumSize = VARSIZE_ANY_EXHDR(DatumGetPointer(datum));
+	}
+	else
+	{
+		datumSize = datumGetSize(datum, datumTypeByValue, datumTypeLength);
+	}
+
+	if (datumTypeByValue)
+	{
+		appendBinaryStringInfo(datumString, (char *) &datum, datumSize);
+	}
+	else
+	{
+		appendBinaryStringInfo(datumString, VARDATA_ANY(datum), datumSize);
+	}
+}
+
+
+/*
+ * _cmsEstimateHashedItemFrequency is a helper function to get frequency
+ * estimate of an item from it's hashed values.
+ */
+static uint64 _cmsEstimateHashedItemFrequency(CountMinSketch* cms, uint64* hashValueArray)
+{
+	CmsMatrix matrix = _cmsMatrix(cms);
+	CmsFilter filter = _cmsFilter(cms);
+
+	if (filter.size > 0)
+	{
+		return CmsFilterEstimateHashed(&matrix, &filter, hashValueArray);
+	}
+
+	return CmsEstimateHashed(&matrix, hashValueArray);
+}
+
+/*
+ * _cmsEstimateItemFrequency calculates estimated frequency for the given
+ * item and returns it.
+ */
+static uint64 _cmsEstimateItemFrequency(CountMinSketch* cms, Datum item,
+                             TypeCacheEntry* itemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo itemString = makeStringInfo();
+	uint64 frequency = 0;
+	instr_time startTime;
 
 	/* If datum is toasted, detoast it */
 	if (itemTypeCacheEntry->typlen == -1)
 	{
-		Datum detoastedItem =  PointerGetDatum(PG_DETOAST_DATUM(item));
-		_convertDatumToBytes(detoastedItem, itemTypeCacheEntry, itemString);
+		Datum detoastedItem =  PointerGetDatum(CmsStatDetoastItem(item));
+		_convertDatumToBytes(detoastedItem, itemTypeCacheEntry, itemString);
+	}
+	else
+	{
+		_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+	}
+
+	/*
+	 * Calculate hash values for the given item and then get frequency estimate
+	 * with these hashed values.
+	 */
+	TRACE_CMS_MMS_ESTIMATE_START(cms->sketchDepth, cms->sketchWidth,
+	                             (size_t) itemString->len);
+	CmsStatTimerStart(&startTime);
+	CmsHashBytes(itemString->data, itemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+	frequency = _cmsEstimateHashedItemFrequency(cms, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+	TRACE_CMS_MMS_ESTIMATE_DONE(cms->sketchDepth, cms->sketchWidth,
+	                            (size_t) itemString->len, frequency);
+
+	return frequency;
+}
+
+
+/*
+ * _cmsMatrix returns a view of the counter matrix of the given CountMinSketch
+ * which can be passed to the sketch core.
+ */
+static CmsMatrix _cmsMatrix(CountMinSketch* cms)
+{
+	CmsMatrix matrix;
+
+	matrix.depth = cms->sketchDepth;
+	matrix.width = cms->sketchWidth;
+	matrix.counters = cms->sketch;
+
+	return matrix;
+}
+
+
+/*
+ * _cmsFilter returns a descriptor of the hot-item filter of the given sketch,
+ * which starts right after the counter matrix.
+ */
+static CmsFilter _cmsFilter(CountMinSketch* cms)
+{
+	CmsFilter filter;
+	char* matrixEnd = (char*) cms->sketch + CmsMatrixSize(cms->sketchDepth,
+	                                                       cms->sketchWidth);
+
+	filter.size = cms->filterSize;
+	filter.entries = (CmsFilterEntry*) matrixEnd;
+
+	return filter;
+}
+
+
+/*
+ * _computeDimensions calculates sketch depth and width for the given error bound
+ * and confidence interval, and errors out if they are not valid. The sketch name
+ * is only used in the error message.
+ */
+static void _computeDimensions(float8 errorBound, float8 confidenceInterval,
+                               const char* sketchName, uint32* sketchDepth,
+                               uint32* sketchWidth)
+{
+	CmsStatus status = CmsComputeDimensions(errorBound, confidenceInterval,
+	                                        sketchDepth, sketchWidth);
+
+	if (status == CMS_INVALID_ERROR_BOUND)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for %s", sketchName),
+		                errhint("Error bound has to be between 0 and 1")));
+	}
+	else if (status == CMS_INVALID_CONFIDENCE_INTERVAL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for %s", sketchName),
+		                errhint("Confidence interval has to be between 0 and 1")));
+	}
+}
+
+
+/*
+ * _hasValidDimensions returns whether the given sketch depth and width are
+ * positive and small enough for the size of the counter matrix to be computed.
+ */
+static bool _hasValidDimensions(uint32 sketchDepth, uint32 sketchWidth)
+{
+	return sketchDepth > 0 && sketchWidth > 0 &&
+	       (uint64) sketchDepth * sketchWidth <= MaxAllocSize / sizeof(CmsCounter);
+}
+
+
+/*
+ * _checkSketchSize errors out if the size of the given sketch value differs from
+ * the size its header implies. Values read through the input and receive
+ * functions could otherwise make the sketch functions read past their end. An
+ * expected size of zero marks a header which is not valid.
+ */
+static void _checkSketchSize(struct varlena* sketch, Size expectedSize, const char* sketchName)
+{
+	if (expectedSize == 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		                errmsg("invalid %s value", sketchName),
+		                errdetail("Value has no valid header")));
+	}
+	else if (VARSIZE(sketch) != expectedSize)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+		                errmsg("invalid %s value", sketchName),
+		                errdetail("Value has %u bytes, while its header implies %zu",
+		                          (uint32) VARSIZE(sketch), expectedSize)));
+	}
+}
+
+/* ----- Sliding-window sketch functionality ----- */
+
+
+/* cms_window_in creates cms_window from printable representation */
+Datum cms_window_in(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	_checkCmsWindow((CountMinSketchWindow*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_window_out converts cms_window to printable representation */
+Datum cms_window_out(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             strlen(DatumGetCString(datum)));
+
+	PG_RETURN_CSTRING(datum);
+}
+
+
+/* cms_window_recv creates cms_window from external binary format */
+Datum cms_window_recv(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+
+	_checkCmsWindow((CountMinSketchWindow*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_window_send converts cms_window to external binary format */
+Datum cms_window_send(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             VARSIZE(DatumGetPointer(datum)));
+
+	return datum;
+}
+
+
+/*
+ * cms_window is a user-facing UDF which creates a sliding-window sketch with the
+ * given number of buckets. Every bucket is a count-min sketch sized for the given
+ * error bound and confidence interval, which have default values and are optional
+ * parameters. The first bucket is the current one.
+ */
+Datum cms_window(PG_FUNCTION_ARGS)
+{
+	int32 bucketCount = PG_GETARG_INT32(0);
+	float8 errorBound = PG_GETARG_FLOAT8(1);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(2);
+	CountMinSketchWindow* window = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_WINDOW);
+	window = _createCmsWindow(bucketCount, errorBound, confidenceInterval);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(window));
+}
+
+
+/*
+ * cms_window_add is a user-facing UDF which adds an item to the current bucket of
+ * the given sliding-window sketch and returns the updated sketch.
+ */
+Datum cms_window_add(PG_FUNCTION_ARGS)
+{
+	CountMinSketchWindow* window = NULL;
+	Datum newItem = 0;
+	TypeCacheEntry* newItemTypeCacheEntry = NULL;
+	Oid newItemType = InvalidOid;
+
+	CmsStatBeginCall(CMS_STAT_CMS_WINDOW_ADD);
+
+	/* Check whether the window is null */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		window = CMS_GETARG_WINDOW_P_COPY(0);
+	}
+
+	/* If new item is null, then return the current window */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(window));
+	}
+
+	newItemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (newItemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data type")));
+	}
+
+	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
+	newItem = _detoastItem(PG_GETARG_DATUM(1), newItemTypeCacheEntry);
+	_updateCmsWindowInPlace(window, newItem, newItemTypeCacheEntry);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(window));
+}
+
+
+/*
+ * cms_window_advance is a user-facing UDF which moves the given sliding-window
+ * sketch forward by the given number of buckets, one by default. The buckets it
+ * moves onto held the oldest items of the window, so they are zeroed and the last
+ * of them becomes the current bucket. Advancing by the number of buckets or more
+ * empties the window.
+ */
+Datum cms_window_advance(PG_FUNCTION_ARGS)
+{
+	CountMinSketchWindow* window = NULL;
+	int32 stepCount = PG_GETARG_INT32(1);
+	CmsWindowMatrix matrix;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_WINDOW_ADVANCE);
+
+	if (stepCount < 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_window"),
+		                errhint("Number of steps can't be negative")));
+	}
+
+	window = CMS_GETARG_WINDOW_P_COPY(0);
+	matrix = _cmsWindowMatrix(window);
+
+	CmsStatTimerStart(&startTime);
+	window->currentBucket = CmsWindowAdvance(&matrix, window->currentBucket,
+	                                         (uint64) stepCount);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(window));
+}
+
+
+/*
+ * cms_window_get_frequency is a user-facing UDF which returns the estimated
+ * frequency of an item over all buckets of the given sliding-window sketch.
+ */
+Datum cms_window_get_frequency(PG_FUNCTION_ARGS)
+{
+	CountMinSketchWindow* window = NULL;
+	Datum item = PG_GETARG_DATUM(1);
+	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	TypeCacheEntry* itemTypeCacheEntry = NULL;
+	uint64 frequency = 0;
+
+	CmsStatBeginCall(CMS_STAT_CMS_WINDOW_GET_FREQUENCY);
+	window = CMS_GETARG_WINDOW_P(0);
+
+	if (itemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data types")));
+	}
+
+	itemTypeCacheEntry = lookup_type_cache(itemType, 0);
+	item = _detoastItem(item, itemTypeCacheEntry);
+	frequency = _cmsWindowEstimateItemFrequency(window, item, itemTypeCacheEntry);
+
+	PG_RETURN_INT64(frequency);
+}
+
+
+/* cms_window_info returns summary about the given sliding-window sketch. */
+Datum cms_window_info(PG_FUNCTION_ARGS)
+{
+	CountMinSketchWindow* window = NULL;
+	StringInfo windowInfoString = makeStringInfo();
+
+	window = (CountMinSketchWindow*) PG_GETARG_VARLENA_P(0);
+	appendStringInfo(windowInfoString, "Sketch depth = %d, Sketch width = %d, "
+	                 "Buckets = %u, Current bucket = %u, Size = %ukB",
+	                 window->sketchDepth, window->sketchWidth, window->bucketCount,
+	                 window->currentBucket, VARSIZE(window) / 1024);
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(windowInfoString->data));
+}
+
+
+/*
+ * _createCmsWindow creates a sliding-window sketch with the given number of
+ * buckets, each of them a count-min sketch with the dimensions computed from the
+ * given parameters. All counters start at zero.
+ */
+static CountMinSketchWindow* _createCmsWindow(int32 bucketCount, float8 errorBound,
+                                              float8 confidenceInterval)
+{
+	CountMinSketchWindow* window = NULL;
+	uint32 sketchWidth = 0;
+	uint32 sketchDepth = 0;
+	Size staticStructSize = 0;
+	Size sketchSize = 0;
+	Size totalWindowSize = 0;
+
+	if (bucketCount < 1 || bucketCount > MAX_WINDOW_BUCKETS)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_window"),
+		                errhint("Number of buckets has to be between 1 and %d",
+		                        MAX_WINDOW_BUCKETS)));
+	}
+
+	_computeDimensions(errorBound, confidenceInterval, "cms_window", &sketchDepth,
+	                   &sketchWidth);
+	sketchSize = CmsWindowMatrixSize(sketchDepth, sketchWidth, (uint32) bucketCount);
+	staticStructSize = sizeof(CountMinSketchWindow);
+	totalWindowSize = staticStructSize + sketchSize;
+
+	if (!AllocSizeIsValid(totalWindowSize))
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_window"),
+		                errhint("Sketch would need %zu bytes, use fewer buckets or a "
+		                        "larger error bound", totalWindowSize)));
+	}
+
+	window = palloc0(totalWindowSize);
+	window->sketchDepth = sketchDepth;
+	window->sketchWidth = sketchWidth;
+	window->bucketCount = (uint32) bucketCount;
+	window->currentBucket = 0;
+
+	SET_VARSIZE(window, totalWindowSize);
+
+	return window;
+}
+
+
+/*
+ * _checkCmsWindow errors out if the given value isn't a valid sliding-window
+ * sketch, and returns it otherwise.
+ */
+static CountMinSketchWindow* _checkCmsWindow(CountMinSketchWindow* window)
+{
+	Size expectedSize = 0;
+
+	if (VARSIZE(window) >= sizeof(CountMinSketchWindow) &&
+	    _hasValidDimensions(window->sketchDepth, window->sketchWidth) &&
+	    window->bucketCount > 0 && window->bucketCount <= MAX_WINDOW_BUCKETS &&
+	    window->currentBucket < window->bucketCount)
+	{
+		expectedSize = sizeof(CountMinSketchWindow) +
+		               CmsWindowMatrixSize(window->sketchDepth, window->sketchWidth,
+		                                   window->bucketCount);
+	}
+
+	_checkSketchSize((struct varlena*) window, expectedSize, "cms_window");
+
+	return window;
+}
+
+
+/* _detoastItem detoasts the given item if it has a variable length type. */
+static Datum _detoastItem(Datum item, TypeCacheEntry* itemTypeCacheEntry)
+{
+	if (itemTypeCacheEntry->typlen == -1)
+	{
+		return PointerGetDatum(CmsStatDetoastItem(item));
+	}
+
+	return item;
+}
+
+
+/*
+ * _updateCmsWindowInPlace adds the given item to the current bucket of the window
+ * in-place and returns the new frequency estimate of the item in that bucket.
+ */
+static uint64 _updateCmsWindowInPlace(CountMinSketchWindow* window, Datum newItem,
+                                      TypeCacheEntry* newItemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo newItemString = makeStringInfo();
+	CmsWindowMatrix matrix = _cmsWindowMatrix(window);
+	uint64 newFrequency = 0;
+	instr_time startTime;
+
+	CmsStatTimerStart(&startTime);
+	_convertDatumToBytes(newItem, newItemTypeCacheEntry, newItemString);
+	TRACE_CMS_MMS_ADD_START(matrix.depth, matrix.width, (size_t) newItemString->len);
+	CmsHashBytes(newItemString->data, newItemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+	newFrequency = CmsWindowUpdateHashed(&matrix, window->currentBucket, hashValueArray, 1);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	CmsStatPending->items++;
+	TRACE_CMS_MMS_ADD_DONE(matrix.depth, matrix.width, (size_t) newItemString->len,
+	                       newFrequency);
+
+	return newFrequency;
+}
+
+
+/*
+ * _cmsWindowEstimateItemFrequency calculates the estimated frequency of the given
+ * item over all buckets of the window and returns it.
+ */
+static uint64 _cmsWindowEstimateItemFrequency(CountMinSketchWindow* window, Datum item,
+                                              TypeCacheEntry* itemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo itemString = makeStringInfo();
+	CmsWindowMatrix matrix = _cmsWindowMatrix(window);
+	uint64 frequency = 0;
+	instr_time startTime;
+
+	_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+
+	TRACE_CMS_MMS_ESTIMATE_START(matrix.depth, matrix.width, (size_t) itemString->len);
+	CmsStatTimerStart(&startTime);
+	CmsHashBytes(itemString->data, itemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+	frequency = CmsWindowEstimateHashed(&matrix, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+	TRACE_CMS_MMS_ESTIMATE_DONE(matrix.depth, matrix.width, (size_t) itemString->len,
+	                            frequency);
+
+	return frequency;
+}
+
+
+/* _cmsWindowMatrix returns a view of the bucket counters of the given window. */
+static CmsWindowMatrix _cmsWindowMatrix(CountMinSketchWindow* window)
+{
+	CmsWindowMatrix matrix;
+
+	matrix.depth = window->sketchDepth;
+	matrix.width = window->sketchWidth;
+	matrix.bucketCount = window->bucketCount;
+	matrix.counters = window->sketch;
+
+	return matrix;
+}
+
+
+/* ----- Range tree functionality ----- */
+
+
+/*
+ * cms_range_nodes is a user-facing UDF which returns the nodes of a dyadic range
+ * tree that cover the slots from the first to the last one, both included. Node
+ * (level, slot) covers the 2^level slots starting at slot * 2^level, and no node
+ * is above the given maximum level. The SQL functions of range trees join these
+ * nodes with a table of pre-merged sketches, so a range union merges at most two
+ * sketches per level instead of one sketch per slot.
+ */
+Datum cms_range_nodes(PG_FUNCTION_ARGS)
+{
+	FuncCallContext* functionContext = NULL;
+	CmsRangeNodesState* rangeState = NULL;
+	CmsRangeNode node;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		int64 firstSlot = PG_GETARG_INT64(0);
+		int64 lastSlot = PG_GETARG_INT64(1);
+		int32 maxLevel = PG_GETARG_INT32(2);
+		MemoryContext oldContext = NULL;
+		TupleDesc tupleDescriptor = NULL;
+
+		if (firstSlot < 0 || lastSlot < 0)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_range_nodes"),
+			                errhint("Slots can't be negative")));
+		}
+		else if (maxLevel < 0 || maxLevel > MAX_RANGE_LEVEL)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_range_nodes"),
+			                errhint("Maximum level has to be between 0 and %d",
+			                        MAX_RANGE_LEVEL)));
+		}
+
+		functionContext = SRF_FIRSTCALL_INIT();
+		oldContext = MemoryContextSwitchTo(functionContext->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			                errmsg("function returning record called in context "
+			                       "that cannot accept type record")));
+		}
+
+		rangeState = palloc(sizeof(CmsRangeNodesState));
+		rangeState->nextSlot = (uint64) firstSlot;
+		rangeState->lastSlot = (uint64) lastSlot;
+		rangeState->maxLevel = (uint32) maxLevel;
+
+		functionContext->tuple_desc = BlessTupleDesc(tupleDescriptor);
+		functionContext->user_fctx = rangeState;
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	functionContext = SRF_PERCALL_SETUP();
+	rangeState = (CmsRangeNodesState*) functionContext->user_fctx;
+
+	if (CmsNextRangeNode(&rangeState->nextSlot, rangeState->lastSlot,
+	                     rangeState->maxLevel, &node))
+	{
+		HeapTuple nodeTuple = NULL;
+		Datum values[2];
+		bool nulls[2] = {false, false};
+
+		values[0] = Int32GetDatum((int32) node.level);
+		values[1] = Int64GetDatum((int64) node.index);
+
+		nodeTuple = heap_form_tuple(functionContext->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(functionContext, HeapTupleGetDatum(nodeTuple));
+	}
+
+	SRF_RETURN_DONE(functionContext);
+}
+
+
+/* ----- Dyadic range sketch functionality ----- */
+
+
+/* cms_dyadic_in creates cms_dyadic from printable representation */
+Datum cms_dyadic_in(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	_checkCmsDyadic((CountMinSketchDyadic*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_dyadic_out converts cms_dyadic to printable representation */
+Datum cms_dyadic_out(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             strlen(DatumGetCString(datum)));
+
+	PG_RETURN_CSTRING(datum);
+}
+
+
+/* cms_dyadic_recv creates cms_dyadic from external binary format */
+Datum cms_dyadic_recv(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+
+	_checkCmsDyadic((CountMinSketchDyadic*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_dyadic_send converts cms_dyadic to external binary format */
+Datum cms_dyadic_send(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             VARSIZE(DatumGetPointer(datum)));
+
+	return datum;
+}
+
+
+/*
+ * cms_dyadic is a user-facing UDF which creates a dyadic range sketch over the
+ * integers of the given number of domain bits. Every level is a count-min sketch
+ * sized for the given error bound and confidence interval, which have default
+ * values and are optional parameters.
+ */
+Datum cms_dyadic(PG_FUNCTION_ARGS)
+{
+	int32 domainBits = PG_GETARG_INT32(0);
+	float8 errorBound = PG_GETARG_FLOAT8(1);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(2);
+	CountMinSketchDyadic* dyadic = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_DYADIC);
+	dyadic = _createCmsDyadic(domainBits, errorBound, confidenceInterval);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(dyadic));
+}
+
+
+/*
+ * cms_dyadic_add is a user-facing UDF which adds a value to every level of the
+ * given dyadic range sketch and returns the updated sketch.
+ */
+Datum cms_dyadic_add(PG_FUNCTION_ARGS)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_DYADIC_ADD);
+
+	/* Check whether the sketch is null */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		dyadic = CMS_GETARG_DYADIC_P_COPY(0);
+	}
+
+	/* If new value is null, then return the current sketch */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(dyadic));
+	}
+
+	_updateCmsDyadicInPlace(dyadic, PG_GETARG_INT64(1));
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(dyadic));
+}
+
+
+/*
+ * cms_dyadic_agg is the aggregate transition function of
+ * cms_dyadic_agg(bigint, integer). It creates a dyadic sketch with the given
+ * number of domain bits and default error bound and confidence interval.
+ */
+Datum cms_dyadic_agg(PG_FUNCTION_ARGS)
+{
+	return _cmsDyadicAgg(fcinfo, DEFAULT_ERROR_BOUND, DEFAULT_CONFIDENCE_INTERVAL);
+}
+
+
+/*
+ * cms_dyadic_agg_with_parameters is the aggregate transition function of
+ * cms_dyadic_agg(bigint, integer, float8, float8), which also takes the error
+ * bound and confidence interval of the sketch.
+ */
+Datum cms_dyadic_agg_with_parameters(PG_FUNCTION_ARGS)
+{
+	float8 errorBound = PG_GETARG_FLOAT8(3);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(4);
+
+	return _cmsDyadicAgg(fcinfo, errorBound, confidenceInterval);
+}
+
+
+/*
+ * cms_range_frequency is a user-facing UDF which returns the estimated number of
+ * values from the first to the last value, both included, in the given dyadic
+ * range sketch. Bounds outside the domain of the sketch are moved to its edges.
+ */
+Datum cms_range_frequency(PG_FUNCTION_ARGS)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+	int64 firstValue = PG_GETARG_INT64(1);
+	int64 lastValue = PG_GETARG_INT64(2);
+	int64 halfDomain = 0;
+	CmsDyadicMatrix matrix;
+	uint64 frequency = 0;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_RANGE_FREQUENCY);
+	dyadic = CMS_GETARG_DYADIC_P(0);
+	halfDomain = (int64) 1 << (dyadic->domainBits - 1);
+
+	firstValue = (firstValue < -halfDomain) ? -halfDomain : firstValue;
+	lastValue = (lastValue > halfDomain - 1) ? halfDomain - 1 : lastValue;
+	if (firstValue > lastValue)
+	{
+		PG_RETURN_INT64(0);
+	}
+
+	matrix = _cmsDyadicMatrix(dyadic);
+
+	CmsStatTimerStart(&startTime);
+	frequency = CmsDyadicEstimateRange(&matrix, _cmsDyadicSlot(dyadic, firstValue),
+	                                   _cmsDyadicSlot(dyadic, lastValue));
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+
+	PG_RETURN_INT64(frequency);
+}
+
+
+/*
+ * cms_quantile is a user-facing UDF which returns the estimated value at the
+ * given quantile of the values in the given dyadic range sketch, for example the
+ * median for 0.5. Estimates never count too few values, so the returned value can
+ * be smaller than the exact quantile but not larger. The quantile of an empty
+ * sketch is null.
+ */
+Datum cms_quantile(PG_FUNCTION_ARGS)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+	float8 quantile = PG_GETARG_FLOAT8(1);
+	float8 rankValue = 0;
+	uint64 rank = 0;
+	uint64 slot = 0;
+	CmsDyadicMatrix matrix;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_QUANTILE);
+
+	if (!(quantile >= 0 && quantile <= 1))
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_quantile"),
+		                errhint("Quantile has to be between 0 and 1")));
+	}
+
+	dyadic = CMS_GETARG_DYADIC_P(0);
+	if (dyadic->totalCount == 0)
+	{
+		PG_RETURN_NULL();
+	}
+
+	/* the value of rank one is the smallest one */
+	rankValue = ceil(quantile * (float8) dyadic->totalCount);
+	if (rankValue < 1)
+	{
+		rank = 1;
+	}
+	else if (rankValue >= (float8) dyadic->totalCount)
+	{
+		rank = dyadic->totalCount;
+	}
+	else
+	{
+		rank = (uint64) rankValue;
+	}
+
+	matrix = _cmsDyadicMatrix(dyadic);
+
+	CmsStatTimerStart(&startTime);
+	slot = CmsDyadicQuantile(&matrix, rank);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+
+	PG_RETURN_INT64((int64) slot - ((int64) 1 << (dyadic->domainBits - 1)));
+}
+
+
+/* cms_dyadic_info returns summary about the given dyadic range sketch. */
+Datum cms_dyadic_info(PG_FUNCTION_ARGS)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+	StringInfo dyadicInfoString = makeStringInfo();
+
+	dyadic = (CountMinSketchDyadic*) PG_GETARG_VARLENA_P(0);
+	appendStringInfo(dyadicInfoString, "Sketch depth = %d, Sketch width = %d, "
+	                 "Domain bits = %u, Size = %ukB",
+	                 dyadic->sketchDepth, dyadic->sketchWidth, dyadic->domainBits,
+	                 VARSIZE(dyadic) / 1024);
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(dyadicInfoString->data));
+}
+
+
+/*
+ * _cmsDyadicAgg is the shared transition function of the cms_dyadic_agg
+ * aggregates. The sketch is created in the aggregate context for the first row
+ * and updated in-place for the following ones.
+ */
+static Datum _cmsDyadicAgg(FunctionCallInfo fcinfo, float8 errorBound,
+                           float8 confidenceInterval)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+	MemoryContext aggregateContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggregateContext))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("cms_dyadic_agg called in non-aggregate context")));
+	}
+
+	CmsStatBeginCall(CMS_STAT_CMS_DYADIC_AGG);
+
+	/* Create the sketch for the first row */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggregateContext);
+
+		dyadic = _createCmsDyadic(PG_GETARG_INT32(2), errorBound, confidenceInterval);
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		dyadic = (CountMinSketchDyadic*) PG_GETARG_VARLENA_P(0);
+	}
+
+	/* If new value is null, then return current state */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(dyadic);
+	}
+
+	_updateCmsDyadicInPlace(dyadic, PG_GETARG_INT64(1));
+
+	PG_RETURN_POINTER(dyadic);
+}
+
+
+/*
+ * _createCmsDyadic creates a dyadic range sketch over the given number of domain
+ * bits, one level per bit, with the dimensions computed from the given
+ * parameters. All counters start at zero.
+ */
+static CountMinSketchDyadic* _createCmsDyadic(int32 domainBits, float8 errorBound,
+                                              float8 confidenceInterval)
+{
+	CountMinSketchDyadic* dyadic = NULL;
+	uint32 sketchWidth = 0;
+	uint32 sketchDepth = 0;
+	Size staticStructSize = 0;
+	Size sketchSize = 0;
+	Size totalDyadicSize = 0;
+
+	if (domainBits < 1 || domainBits > MAX_DYADIC_LEVELS)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_dyadic"),
+		                errhint("Number of domain bits has to be between 1 and %d",
+		                        MAX_DYADIC_LEVELS)));
+	}
+
+	_computeDimensions(errorBound, confidenceInterval, "cms_dyadic", &sketchDepth,
+	                   &sketchWidth);
+	sketchSize = CmsDyadicMatrixSize(sketchDepth, sketchWidth, (uint32) domainBits);
+	staticStructSize = sizeof(CountMinSketchDyadic);
+	totalDyadicSize = staticStructSize + sketchSize;
+
+	if (!AllocSizeIsValid(totalDyadicSize))
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_dyadic"),
+		                errhint("Sketch would need %zu bytes, use fewer domain bits "
+		                        "or a larger error bound", totalDyadicSize)));
+	}
+
+	dyadic = palloc0(totalDyadicSize);
+	dyadic->sketchDepth = sketchDepth;
+	dyadic->sketchWidth = sketchWidth;
+	dyadic->domainBits = (uint32) domainBits;
+	dyadic->totalCount = 0;
+
+	SET_VARSIZE(dyadic, totalDyadicSize);
+
+	return dyadic;
+}
+
+
+/*
+ * _checkCmsDyadic errors out if the given value isn't a valid dyadic range
+ * sketch, and returns it otherwise.
+ */
+static CountMinSketchDyadic* _checkCmsDyadic(CountMinSketchDyadic* dyadic)
+{
+	Size expectedSize = 0;
+
+	if (VARSIZE(dyadic) >= sizeof(CountMinSketchDyadic) &&
+	    _hasValidDimensions(dyadic->sketchDepth, dyadic->sketchWidth) &&
+	    dyadic->domainBits > 0 && dyadic->domainBits <= MAX_DYADIC_LEVELS)
+	{
+		expectedSize = sizeof(CountMinSketchDyadic) +
+		               CmsDyadicMatrixSize(dyadic->sketchDepth, dyadic->sketchWidth,
+		                                   dyadic->domainBits);
+	}
+
+	_checkSketchSize((struct varlena*) dyadic, expectedSize, "cms_dyadic");
+
+	return dyadic;
+}
+
+
+/*
+ * _updateCmsDyadicInPlace adds the given value to every level of the dyadic
+ * sketch in-place and returns the new frequency estimate of the value.
+ */
+static uint64 _updateCmsDyadicInPlace(CountMinSketchDyadic* dyadic, int64 value)
+{
+	CmsDyadicMatrix matrix = _cmsDyadicMatrix(dyadic);
+	uint64 slot = _cmsDyadicSlot(dyadic, value);
+	uint64 newFrequency = 0;
+	instr_time startTime;
+
+	TRACE_CMS_MMS_ADD_START(matrix.depth, matrix.width, sizeof(int64));
+	CmsStatTimerStart(&startTime);
+	newFrequency = CmsDyadicUpdate(&matrix, slot, 1);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	dyadic->totalCount = CmsAddSaturating(dyadic->totalCount, 1);
+	CmsStatPending->items++;
+	TRACE_CMS_MMS_ADD_DONE(matrix.depth, matrix.width, sizeof(int64), newFrequency);
+
+	return newFrequency;
+}
+
+
+/*
+ * _cmsDyadicSlot returns the slot of the given value in the dyadic sketch and
+ * errors out if the value is outside the domain of the sketch.
+ */
+static uint64 _cmsDyadicSlot(CountMinSketchDyadic* dyadic, int64 value)
+{
+	int64 halfDomain = (int64) 1 << (dyadic->domainBits - 1);
+
+	if (value < -halfDomain || value > halfDomain - 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+		                errmsg("value " INT64_FORMAT " is outside the domain of the "
+		                       "cms_dyadic", value),
+		                errhint("Values have to be between " INT64_FORMAT " and "
+		                        INT64_FORMAT, -halfDomain, halfDomain - 1)));
+	}
+
+	return (uint64) (value + halfDomain);
+}
+
+
+/* _cmsDyadicMatrix returns a view of the level counters of the given sketch. */
+static CmsDyadicMatrix _cmsDyadicMatrix(CountMinSketchDyadic* dyadic)
+{
+	CmsDyadicMatrix matrix;
+
+	matrix.depth = dyadic->sketchDepth;
+	matrix.width = dyadic->sketchWidth;
+	matrix.levelCount = dyadic->domainBits;
+	matrix.counters = dyadic->sketch;
+
+	return matrix;
+}
+
+
+/* ----- Prefix sketch functionality ----- */
+
+
+/* cms_prefix_in creates cms_prefix from printable representation */
+Datum cms_prefix_in(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	_checkCmsPrefix((CountMinSketchPrefix*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_prefix_out converts cms_prefix to printable representation */
+Datum cms_prefix_out(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             strlen(DatumGetCString(datum)));
+
+	PG_RETURN_CSTRING(datum);
+}
+
+
+/* cms_prefix_recv creates cms_prefix from external binary format */
+Datum cms_prefix_recv(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+
+	_checkCmsPrefix((CountMinSketchPrefix*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* cms_prefix_send converts cms_prefix to external binary format */
+Datum cms_prefix_send(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             VARSIZE(DatumGetPointer(datum)));
+
+	return datum;
+}
+
+
+/*
+ * cms_prefix is a user-facing UDF which creates a prefix sketch that counts the
+ * given IPv4 and IPv6 prefix lengths, keeping the given number of heavy prefix
+ * candidates per length. Every level is a count-min sketch sized for the given
+ * error bound and confidence interval. All parameters have default values.
+ */
+Datum cms_prefix(PG_FUNCTION_ARGS)
+{
+	ArrayType* ipv4LengthArray = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType* ipv6LengthArray = PG_GETARG_ARRAYTYPE_P(1);
+	int32 candidateCount = PG_GETARG_INT32(2);
+	float8 errorBound = PG_GETARG_FLOAT8(3);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(4);
+	CountMinSketchPrefix* prefixSketch = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_PREFIX);
+	prefixSketch = _createCmsPrefix(ipv4LengthArray, ipv6LengthArray, candidateCount,
+	                                errorBound, confidenceInterval);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(prefixSketch));
+}
+
+
+/*
+ * cms_prefix_add is a user-facing UDF which adds an address or network to every
+ * level of the given prefix sketch which counts prefixes of its family and
+ * netmask, and returns the updated sketch.
+ */
+Datum cms_prefix_add(PG_FUNCTION_ARGS)
+{
+	CountMinSketchPrefix* prefixSketch = NULL;
+
+	CmsStatBeginCall(CMS_STAT_CMS_PREFIX_ADD);
+
+	/* Check whether the sketch is null */
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		prefixSketch = CMS_GETARG_PREFIX_P_COPY(0);
+	}
+
+	/* If new item is null, then return the current sketch */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(prefixSketch));
+	}
+
+	_updateCmsPrefixInPlace(prefixSketch, PG_GETARG_INET_PP(1));
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(prefixSketch));
+}
+
+
+/*
+ * cms_prefix_agg is the aggregate transition function of cms_prefix_agg(inet). It
+ * creates a prefix sketch with the default prefix lengths and parameters.
+ */
+Datum cms_prefix_agg(PG_FUNCTION_ARGS)
+{
+	return _cmsPrefixAgg(fcinfo, DEFAULT_ERROR_BOUND, DEFAULT_CONFIDENCE_INTERVAL);
+}
+
+
+/*
+ * cms_prefix_agg_with_parameters is the aggregate transition function of
+ * cms_prefix_agg(inet, float8, float8), which also takes the error bound and
+ * confidence interval of the sketch.
+ */
+Datum cms_prefix_agg_with_parameters(PG_FUNCTION_ARGS)
+{
+	float8 errorBound = PG_GETARG_FLOAT8(2);
+	float8 confidenceInterval = PG_GETARG_FLOAT8(3);
+
+	return _cmsPrefixAgg(fcinfo, errorBound, confidenceInterval);
+}
+
+
+/*
+ * cms_prefix_get_frequency is a user-facing UDF which returns the estimated
+ * frequency of the given network in the prefix sketch. The netmask of the network
+ * has to be one of the prefix lengths of the sketch.
+ */
+Datum cms_prefix_get_frequency(PG_FUNCTION_ARGS)
+{
+	CountMinSketchPrefix* prefixSketch = NULL;
+	inet* item = PG_GETARG_INET_PP(1);
+	uint32 prefixLength = ip_bits(item);
+	uint32 firstLevel = 0;
+	uint32 levelCount = 0;
+	uint32 level = 0;
+	uint64 addressWords[2] = {0, 0};
+	uint64 prefix[2] = {0, 0};
+	uint64 hashValueArray[2] = {0, 0};
+	CmsPrefixMatrix matrix;
+	uint64 frequency = 0;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_PREFIX_GET_FREQUENCY);
+	prefixSketch = CMS_GETARG_PREFIX_P(0);
+
+	_prefixFamilyLevels(prefixSketch, ip_family(item), &firstLevel, &levelCount);
+	for (level = firstLevel; level < firstLevel + levelCount; level++)
+	{
+		if (prefixSketch->prefixLengths[level] == prefixLength)
+		{
+			break;
+		}
+	}
+
+	if (level == firstLevel + levelCount)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_prefix_get_frequency"),
+		                errhint("Prefix length %u isn't counted by the sketch",
+		                        prefixLength)));
+	}
+
+	matrix = _cmsPrefixMatrix(prefixSketch);
+	_inetAddressWords(item, addressWords);
+
+	CmsStatTimerStart(&startTime);
+	CmsMaskPrefix(addressWords, prefixLength, prefix);
+	CmsHashPrefix(prefix, prefixLength, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+	frequency = CmsPrefixEstimateHashed(&matrix, level, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+
+	PG_RETURN_INT64(frequency);
+}
+
+
+/*
+ * cms_hhh is a user-facing UDF which returns the hierarchical heavy hitters of
+ * the given prefix sketch for the given threshold. These are the candidate
+ * prefixes whose estimated frequency reaches the threshold once the heavy hitters
+ * with longer prefixes inside them are left out, so that one heavy network
+ * doesn't make all of its supernets heavy too. Every heavy hitter is returned
+ * with its estimated frequency and this conditioned frequency, longer prefixes
+ * first.
+ */
+Datum cms_hhh(PG_FUNCTION_ARGS)
+{
+	FuncCallContext* functionContext = NULL;
+	CmsHhhState* hhhState = NULL;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		CountMinSketchPrefix* prefixSketch = NULL;
+		int64 threshold = PG_GETARG_INT64(1);
+		CmsPrefixMatrix matrix;
+		MemoryContext oldContext = NULL;
+		TupleDesc tupleDescriptor = NULL;
+		instr_time startTime;
+
+		CmsStatBeginCall(CMS_STAT_CMS_HHH);
+
+		if (threshold < 1)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_hhh"),
+			                errhint("Threshold has to be at least 1")));
+		}
+
+		functionContext = SRF_FIRSTCALL_INIT();
+		oldContext = MemoryContextSwitchTo(functionContext->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			                errmsg("function returning record called in context "
+			                       "that cannot accept type record")));
+		}
+
+		prefixSketch = CMS_GETARG_PREFIX_P(0);
+		matrix = _cmsPrefixMatrix(prefixSketch);
+
+		hhhState = palloc0(sizeof(CmsHhhState));
+		hhhState->hitters = palloc(sizeof(CmsPrefixHitter) * prefixSketch->levelCount *
+		                           prefixSketch->candidateCount);
+		hhhState->ipv4LevelCount = prefixSketch->ipv4LevelCount;
+		memcpy(hhhState->prefixLengths, prefixSketch->prefixLengths,
+		       sizeof(hhhState->prefixLengths));
+
+		/* the families have separate hierarchies */
+		CmsStatTimerStart(&startTime);
+		hhhState->hitterCount =
+			CmsPrefixHeavyHitters(&matrix, prefixSketch->prefixLengths, 0,
+			                      prefixSketch->ipv4LevelCount, (uint64) threshold,
+			                      hhhState->hitters);
+		hhhState->hitterCount +=
+			CmsPrefixHeavyHitters(&matrix, prefixSketch->prefixLengths,
+			                      prefixSketch->ipv4LevelCount,
+			                      prefixSketch->levelCount - prefixSketch->ipv4LevelCount,
+			                      (uint64) threshold,
+			                      hhhState->hitters + hhhState->hitterCount);
+		CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+		CmsStatPending->items += hhhState->hitterCount;
+
+		functionContext->tuple_desc = BlessTupleDesc(tupleDescriptor);
+		functionContext->user_fctx = hhhState;
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	functionContext = SRF_PERCALL_SETUP();
+	hhhState = (CmsHhhState*) functionContext->user_fctx;
+
+	if (hhhState->nextHitter < hhhState->hitterCount)
+	{
+		CmsPrefixHitter* hitter = &hhhState->hitters[hhhState->nextHitter++];
+		int family = (hitter->level < hhhState->ipv4LevelCount) ? PGSQL_AF_INET :
+		             PGSQL_AF_INET6;
+		HeapTuple hitterTuple = NULL;
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+
+		values[0] = InetPGetDatum(_prefixInet(hitter->prefix, family,
+		                                      hhhState->prefixLengths[hitter->level]));
+		values[1] = Int64GetDatum((int64) hitter->frequency);
+		values[2] = Int64GetDatum((int64) hitter->conditionedFrequency);
+
+		hitterTuple = heap_form_tuple(functionContext->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(functionContext, HeapTupleGetDatum(hitterTuple));
+	}
+
+	SRF_RETURN_DONE(functionContext);
+}
+
+
+/* cms_prefix_info returns summary about the given prefix sketch. */
+Datum cms_prefix_info(PG_FUNCTION_ARGS)
+{
+	CountMinSketchPrefix* prefixSketch = NULL;
+	StringInfo prefixInfoString = makeStringInfo();
+	uint32 level = 0;
+
+	prefixSketch = (CountMinSketchPrefix*) PG_GETARG_VARLENA_P(0);
+	appendStringInfo(prefixInfoString, "Sketch depth = %d, Sketch width = %d, "
+	                 "IPv4 prefixes = {", prefixSketch->sketchDepth,
+	                 prefixSketch->sketchWidth);
+	for (level = 0; level < prefixSketch->levelCount; level++)
+	{
+		if (level == prefixSketch->ipv4LevelCount)
+		{
+			appendStringInfoString(prefixInfoString, "}, IPv6 prefixes = {");
+		}
+		else if (level > 0)
+		{
+			appendStringInfoChar(prefixInfoString, ',');
+		}
+
+		appendStringInfo(prefixInfoString, "%u", prefixSketch->prefixLengths[level]);
+	}
+	if (prefixSketch->ipv4LevelCount == prefixSketch->levelCount)
+	{
+		appendStringInfoString(prefixInfoString, "}, IPv6 prefixes = {");
+	}
+	appendStringInfo(prefixInfoString, "}, Candidates = %u, Size = %ukB",
+	                 prefixSketch->candidateCount, VARSIZE(prefixSketch) / 1024);
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(prefixInfoString->data));
+}
+
+
+/*
+ * _cmsPrefixAgg is the shared transition function of the cms_prefix_agg
+ * aggregates. The sketch is created in the aggregate context for the first row
+ * with the default prefix lengths and updated in-place for the following ones.
+ */
+static Datum _cmsPrefixAgg(FunctionCallInfo fcinfo, float8 errorBound,
+                           float8 confidenceInterval)
+{
+	CountMinSketchPrefix* prefixSketch = NULL;
+	MemoryContext aggregateContext = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggregateContext))
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("cms_prefix_agg called in non-aggregate context")));
+	}
+
+	CmsStatBeginCall(CMS_STAT_CMS_PREFIX_AGG);
+
+	/* Create the sketch for the first row */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext oldContext = MemoryContextSwitchTo(aggregateContext);
+
+		prefixSketch = _createCmsPrefix(NULL, NULL, DEFAULT_PREFIX_CANDIDATES,
+		                                errorBound, confidenceInterval);
+		MemoryContextSwitchTo(oldContext);
+	}
+	else
+	{
+		prefixSketch = (CountMinSketchPrefix*) PG_GETARG_VARLENA_P(0);
+	}
+
+	/* If new item is null, then return current state */
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_POINTER(prefixSketch);
+	}
+
+	_updateCmsPrefixInPlace(prefixSketch, PG_GETARG_INET_PP(1));
+
+	PG_RETURN_POINTER(prefixSketch);
+}
+
+
+/*
+ * _createCmsPrefix creates a prefix sketch with a level for every given IPv4 and
+ * IPv6 prefix length, or for the default lengths if the arrays are null. The
+ * dimensions of the levels are computed from the given parameters, and all
+ * counters and candidates start at zero.
+ */
+static CountMinSketchPrefix* _createCmsPrefix(ArrayType* ipv4LengthArray,
+                                              ArrayType* ipv6LengthArray,
+                                              int32 candidateCount, float8 errorBound,
+                                              float8 confidenceInterval)
+{
+	static const uint8 defaultPrefixLengths[] = {8, 16, 24, 32, 32, 48, 64, 128};
+	CountMinSketchPrefix* prefixSketch = NULL;
+	uint8 prefixLengths[MAX_PREFIX_LEVELS];
+	uint32 ipv4LevelCount = 4;
+	uint32 levelCount = 8;
+	uint32 sketchWidth = 0;
+	uint32 sketchDepth = 0;
+	Size staticStructSize = 0;
+	Size sketchSize = 0;
+	Size totalPrefixSize = 0;
+
+	memcpy(prefixLengths, defaultPrefixLengths, sizeof(defaultPrefixLengths));
+	if (ipv4LengthArray != NULL && ipv6LengthArray != NULL)
+	{
+		ipv4LevelCount = _readPrefixLengths(ipv4LengthArray, 32, prefixLengths, 0);
+		levelCount = _readPrefixLengths(ipv6LengthArray, 128, prefixLengths,
+		                                ipv4LevelCount);
+	}
+
+	if (levelCount == 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_prefix"),
+		                errhint("Number of prefix lengths has to be between 1 and %d",
+		                        MAX_PREFIX_LEVELS)));
+	}
+	else if (candidateCount < 1 || candidateCount > MAX_PREFIX_CANDIDATES)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_prefix"),
+		                errhint("Number of candidates has to be between 1 and %d",
+		                        MAX_PREFIX_CANDIDATES)));
+	}
+
+	_computeDimensions(errorBound, confidenceInterval, "cms_prefix", &sketchDepth,
+	                   &sketchWidth);
+	sketchSize = CmsPrefixMatrixSize(sketchDepth, sketchWidth, levelCount,
+	                                 (uint32) candidateCount);
+	staticStructSize = sizeof(CountMinSketchPrefix);
+	totalPrefixSize = staticStructSize + sketchSize;
+
+	if (!AllocSizeIsValid(totalPrefixSize))
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_prefix"),
+		                errhint("Sketch would need %zu bytes, use fewer prefix lengths "
+		                        "or a larger error bound", totalPrefixSize)));
+	}
+
+	prefixSketch = palloc0(totalPrefixSize);
+	prefixSketch->sketchDepth = sketchDepth;
+	prefixSketch->sketchWidth = sketchWidth;
+	prefixSketch->candidateCount = (uint16) candidateCount;
+	prefixSketch->levelCount = (uint8) levelCount;
+	prefixSketch->ipv4LevelCount = (uint8) ipv4LevelCount;
+	prefixSketch->totalCount = 0;
+	memcpy(prefixSketch->prefixLengths, prefixLengths, levelCount);
+
+	SET_VARSIZE(prefixSketch, totalPrefixSize);
+
+	return prefixSketch;
+}
+
+
+/*
+ * _checkCmsPrefix errors out if the given value isn't a valid prefix sketch, and
+ * returns it otherwise. Prefix lengths are checked against the longest address
+ * of their family, since they are used to mask addresses.
+ */
+static CountMinSketchPrefix* _checkCmsPrefix(CountMinSketchPrefix* prefixSketch)
+{
+	Size expectedSize = 0;
+	bool validLengths = true;
+	uint32 levelIndex = 0;
+
+	if (VARSIZE(prefixSketch) >= sizeof(CountMinSketchPrefix) &&
+	    _hasValidDimensions(prefixSketch->sketchDepth, prefixSketch->sketchWidth) &&
+	    prefixSketch->levelCount > 0 && prefixSketch->levelCount <= MAX_PREFIX_LEVELS &&
+	    prefixSketch->ipv4LevelCount <= prefixSketch->levelCount &&
+	    prefixSketch->candidateCount > 0 &&
+	    prefixSketch->candidateCount <= MAX_PREFIX_CANDIDATES)
+	{
+		for (levelIndex = 0; levelIndex < prefixSketch->levelCount; levelIndex++)
+		{
+			uint32 maxLength = (levelIndex < prefixSketch->ipv4LevelCount) ? 32 : 128;
+
+			if (prefixSketch->prefixLengths[levelIndex] > maxLength)
+			{
+				validLengths = false;
+			}
+		}
+
+		if (validLengths)
+		{
+			expectedSize = sizeof(CountMinSketchPrefix) +
+			               CmsPrefixMatrixSize(prefixSketch->sketchDepth,
+			                                   prefixSketch->sketchWidth,
+			                                   prefixSketch->levelCount,
+			                                   prefixSketch->candidateCount);
+		}
+	}
+
+	_checkSketchSize((struct varlena*) prefixSketch, expectedSize, "cms_prefix");
+
+	return prefixSketch;
+}
+
+
+/*
+ * _readPrefixLengths appends the prefix lengths of the given integer array to
+ * the lengths which were read before, and returns the new number of lengths. The
+ * lengths have to be increasing and between 1 and the given maximum length.
+ */
+static uint32 _readPrefixLengths(ArrayType* lengthArray, int32 maxLength,
+                                 uint8* prefixLengths, uint32 lengthCount)
+{
+	Datum* lengths = NULL;
+	bool* lengthNulls = NULL;
+	int arrayLength = 0;
+	int lengthIndex = 0;
+	int32 previousLength = 0;
+
+	deconstruct_array(lengthArray, INT4OID, sizeof(int32), true, 'i', &lengths,
+	                  &lengthNulls, &arrayLength);
+
+	if (lengthCount + arrayLength > MAX_PREFIX_LEVELS)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_prefix"),
+		                errhint("Number of prefix lengths has to be between 1 and %d",
+		                        MAX_PREFIX_LEVELS)));
+	}
+
+	for (lengthIndex = 0; lengthIndex < arrayLength; lengthIndex++)
+	{
+		int32 prefixLength = lengthNulls[lengthIndex] ? 0 :
+		                     DatumGetInt32(lengths[lengthIndex]);
+
+		if (prefixLength <= previousLength || prefixLength > maxLength)
+		{
+			ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			                errmsg("invalid parameters for cms_prefix"),
+			                errhint("%s prefix lengths have to be increasing and "
+			                        "between 1 and %d",
+			                        (maxLength == 32) ? "IPv4" : "IPv6", maxLength)));
+		}
+
+		prefixLengths[lengthCount++] = (uint8) prefixLength;
+		previousLength = prefixLength;
+	}
+
+	return lengthCount;
+}
+
+
+/*
+ * _updateCmsPrefixInPlace adds the given item to the prefix sketch in-place. The
+ * address is read once, its prefixes for all levels of its family which fit into
+ * its netmask are masked and hashed, and the levels are updated together. The
+ * function returns the new frequency estimate of the longest of these prefixes,
+ * or zero if no level counts the item.
+ */
+static uint64 _updateCmsPrefixInPlace(CountMinSketchPrefix* prefixSketch, inet* item)
+{
+	CmsPrefixMatrix matrix = _cmsPrefixMatrix(prefixSketch);
+	uint64 addressWords[2] = {0, 0};
+	uint64 prefixes[2 * MAX_PREFIX_LEVELS];
+	uint64 hashValueArrays[2 * MAX_PREFIX_LEVELS];
+	uint32* columns = NULL;
+	uint32 firstLevel = 0;
+	uint32 levelCount = 0;
+	uint32 levelIndex = 0;
+	uint64 newFrequency = 0;
+	instr_time startTime;
+
+	prefixSketch->totalCount = CmsAddSaturating(prefixSketch->totalCount, 1);
+	CmsStatPending->items++;
+
+	/* levels are increasing, so those which fit into the netmask come first */
+	_prefixFamilyLevels(prefixSketch, ip_family(item), &firstLevel, &levelCount);
+	while (levelCount > 0 &&
+	       prefixSketch->prefixLengths[firstLevel + levelCount - 1] > ip_bits(item))
+	{
+		levelCount--;
+	}
+
+	if (levelCount == 0)
+	{
+		return 0;
+	}
+
+	TRACE_CMS_MMS_ADD_START(matrix.depth, matrix.width, (size_t) ip_addrsize(item));
+	CmsStatTimerStart(&startTime);
+	_inetAddressWords(item, addressWords);
+	for (levelIndex = 0; levelIndex < levelCount; levelIndex++)
+	{
+		uint32 prefixLength = prefixSketch->prefixLengths[firstLevel + levelIndex];
+
+		CmsMaskPrefix(addressWords, prefixLength, prefixes + 2 * levelIndex);
+		CmsHashPrefix(prefixes + 2 * levelIndex, prefixLength,
+		              hashValueArrays + 2 * levelIndex);
+	}
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+	columns = palloc(sizeof(uint32) * matrix.depth * levelCount);
+	CmsPrefixUpdateHashed(&matrix, firstLevel, levelCount, prefixes, hashValueArrays, 1,
+	                      columns);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	pfree(columns);
+
+	newFrequency = CmsPrefixEstimateHashed(&matrix, firstLevel + levelCount - 1,
+	                                       hashValueArrays + 2 * (levelCount - 1));
+	TRACE_CMS_MMS_ADD_DONE(matrix.depth, matrix.width, (size_t) ip_addrsize(item),
+	                       newFrequency);
+
+	return newFrequency;
+}
+
+
+/*
+ * _prefixFamilyLevels returns the first level and the number of levels of the
+ * prefix sketch which count prefixes of the given address family.
+ */
+static void _prefixFamilyLevels(CountMinSketchPrefix* prefixSketch, int family,
+                                uint32* firstLevel, uint32* levelCount)
+{
+	if (family == PGSQL_AF_INET)
+	{
+		*firstLevel = 0;
+		*levelCount = prefixSketch->ipv4LevelCount;
+	}
+	else
+	{
+		*firstLevel = prefixSketch->ipv4LevelCount;
+		*levelCount = prefixSketch->levelCount - prefixSketch->ipv4LevelCount;
+	}
+}
+
+
+/*
+ * _inetAddressWords converts the address of the given item to the two 64-bit
+ * words which prefix sketches use, most significant bits first. IPv4 addresses
+ * take the top 32 bits of the first word.
+ */
+static void _inetAddressWords(inet* item, uint64* addressWords)
+{
+	unsigned char* addressBytes = ip_addr(item);
+	int addressSize = ip_addrsize(item);
+	int byteIndex = 0;
+
+	addressWords[0] = 0;
+	addressWords[1] = 0;
+
+	for (byteIndex = 0; byteIndex < addressSize; byteIndex++)
+	{
+		addressWords[byteIndex / 8] |=
+			(uint64) addressBytes[byteIndex] << (56 - 8 * (byteIndex % 8));
+	}
+}
+
+
+/*
+ * _prefixInet converts a prefix of a prefix sketch back to a network of the
+ * given address family and prefix length.
+ */
+static inet* _prefixInet(const uint64* prefix, int family, uint32 prefixLength)
+{
+	inet* network = palloc0(sizeof(inet));
+	unsigned char* addressBytes = NULL;
+	int byteIndex = 0;
+
+	ip_family(network) = family;
+	ip_bits(network) = prefixLength;
+	addressBytes = ip_addr(network);
+
+	for (byteIndex = 0; byteIndex < ip_addrsize(network); byteIndex++)
+	{
+		addressBytes[byteIndex] =
+			(unsigned char) (prefix[byteIndex / 8] >> (56 - 8 * (byteIndex % 8)));
+	}
+
+	SET_INET_VARSIZE(network);
+
+	return network;
+}
+
+
+/*
+ * _cmsPrefixMatrix returns a view of the level counters and candidate tables of
+ * the given prefix sketch.
+ */
+static CmsPrefixMatrix _cmsPrefixMatrix(CountMinSketchPrefix* prefixSketch)
+{
+	CmsPrefixMatrix matrix;
+	size_t counterCount = (size_t) prefixSketch->levelCount * prefixSketch->sketchDepth *
+	                      prefixSketch->sketchWidth;
+
+	matrix.depth = prefixSketch->sketchDepth;
+	matrix.width = prefixSketch->sketchWidth;
+	matrix.levelCount = prefixSketch->levelCount;
+	matrix.candidateCount = prefixSketch->candidateCount;
+	matrix.counters = prefixSketch->sketch;
+	matrix.candidates = (CmsPrefixCandidate*) (prefixSketch->sketch + counterCount);
+
+	return matrix;
+}
+
+
+/* ----- Min-mask sketch functionality ----- */
+
+
+/* mms_in creates mms from printable representation */
+Datum mms_in(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+
+	_checkMms((MinMaskSketch*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* mms_out converts mms to printable representation */
+Datum mms_out(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             strlen(DatumGetCString(datum)));
+
+	PG_RETURN_CSTRING(datum);
+}
+
+
+/* mms_recv creates mms from external binary format */
+Datum mms_recv(PG_FUNCTION_ARGS)
+{
+	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+
+	_checkMms((MinMaskSketch*) DatumGetPointer(datum));
+
+	return datum;
+}
+
+
+/* mms_send converts mms to external binary format */
+Datum mms_send(PG_FUNCTION_ARGS)
+{
+	Datum datum = 0;
+
+	TRACE_CMS_MMS_SERIALIZE_START(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))));
+	datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	TRACE_CMS_MMS_SERIALIZE_DONE(VARSIZE_ANY(DatumGetPointer(PG_GETARG_DATUM(0))),
+	                             VARSIZE(DatumGetPointer(datum)));
+
+	return datum;
+}
+
+
+/* 
+ * mms is a user-facing UDF that creates a min-mask sketch structure
+ * with given paramters. Note there is no top-n parameter for this function.
+ * errorBound and confidenceInterval have default values so they are
+ * optional parameters.
+ */
+Datum mms(PG_FUNCTION_ARGS)
+{
+	float8 errorBound = PG_GETARG_FLOAT8(0);
+	float8 confidenceInterval =  PG_GETARG_FLOAT8(1);
+	MinMaskSketch* mms = NULL;
+
+	CmsStatBeginCall(CMS_STAT_MMS);
+	mms = _createMms(errorBound, confidenceInterval);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(mms));
+}
+
+
+/*
+ * mms_add is a user-facing UDF that adds an item to an existing min-mask sketch.
+ * This function differs from the cms_add counter-part because it also needs the
+ * new item's associated mask to add to the sketch.
+ */
+Datum mms_add(PG_FUNCTION_ARGS)
+{
+	MinMaskSketch* currentMms = NULL;
+	MinMaskSketch* updatedMms = NULL;
+	Datum newItem = 0;
+	TypeCacheEntry* newItemTypeCacheEntry = NULL;
+	Oid newItemType = InvalidOid;
+	uint32 newItemMask = 0;
+
+	CmsStatBeginCall(CMS_STAT_MMS_ADD);
+
+	if (PG_ARGISNULL(0))
+	{
+		PG_RETURN_NULL();
+	}
+	else
+	{
+		currentMms = CMS_GETARG_MMS_P(0);
+	}
+
+	if (PG_ARGISNULL(1))
+	{
+		PG_RETURN_DATUM(CmsStatReturnSketch(currentMms));
+	}
+
+	newItemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (newItemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data type")));
+	}
+
+	newItem = PG_GETARG_DATUM(1);
+	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
+
+	newItemMask = PG_GETARG_INT64(2);
+
+	updatedMms = _updateMms(currentMms, newItem, newItemTypeCacheEntry, newItemMask);
+
+	PG_RETURN_DATUM(CmsStatReturnSketch(updatedMms));
+}
+
+
+/* mms_get_mask is a user-facing UDF that retrieves the estimated mask of a given item. */
+Datum mms_get_mask(PG_FUNCTION_ARGS)
+{
+	MinMaskSketch* mms = NULL;
+	Datum item = PG_GETARG_DATUM(1);
+	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	TypeCacheEntry* itemTypeCacheEntry = NULL;
+	uint32 mask = 0;
+
+	CmsStatBeginCall(CMS_STAT_MMS_GET_MASK);
+	mms = CMS_GETARG_MMS_P(0);
+
+	if (itemType == InvalidOid)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("could not determine input data types")));
+	}
+
+	itemTypeCacheEntry = lookup_type_cache(itemType, 0);
+	mask = _mmsEstimateItemMask(mms, item, itemTypeCacheEntry);
+
+	PG_RETURN_INT64(mask);
+}
+
+
+/* 
+ * _createMms creates a MinMaskSketch with given parameters. Its behavior is very similar
+ * to the _createCms.
+ */
+static MinMaskSketch* _createMms(float8 errorBound, float8 confidenceInterval)
+{
+	MinMaskSketch* mms = NULL;
+	uint32 sketchWidth = 0;
+	uint32 sketchDepth = 0;
+	Size staticStructSize = 0;
+	Size sketchSize = 0;
+	Size totalMmsSize = 0;
+
+	_computeDimensions(errorBound, confidenceInterval, "mms", &sketchDepth, &sketchWidth);
+	sketchSize = CmsMatrixSize(sketchDepth, sketchWidth);
+	staticStructSize = sizeof(MinMaskSketch);
+	totalMmsSize = staticStructSize + sketchSize;
+
+	mms = palloc0(totalMmsSize);
+	mms->sketchDepth = sketchDepth;
+	mms->sketchWidth = sketchWidth;
+
+	SET_VARSIZE(mms, totalMmsSize);
+
+	return mms;
+}
+
+
+/* _checkMms errors out if the given value isn't a valid mms, and returns it otherwise. */
+static MinMaskSketch* _checkMms(MinMaskSketch* mms)
+{
+	Size expectedSize = 0;
+
+	if (VARSIZE(mms) >= sizeof(MinMaskSketch) &&
+	    _hasValidDimensions(mms->sketchDepth, mms->sketchWidth))
+	{
+		expectedSize = sizeof(MinMaskSketch) + CmsMatrixSize(mms->sketchDepth,
+		                                                     mms->sketchWidth);
+	}
+
+	_checkSketchSize((struct varlena*) mms, expectedSize, "mms");
+
+	return mms;
+}
+
+
+/*
+ * _updateMms is a helper function to add a new item to the min-mask sketch structure.
+ * It differs from _updateCms in that it needs to accept the new item's bitmask to update
+ * the sketch correctly.
+ */
+static MinMaskSketch* _updateMms(MinMaskSketch* currentMms, Datum newItem,
+              TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask)
+{
+	MinMaskSketch* updatedMms = NULL;
+	Datum detoastedItem = 0;
+	// Oid newItemType = newItemTypeCacheEntry->type_id;
+	// Oid currentItemType = InvalidOid;
+
+	/* TODO -- Check item type correctness */
+
+	if (newItemTypeCacheEntry->typlen == -1)
+	{
+		detoastedItem = PointerGetDatum(CmsStatDetoastItem(newItem));
+	}
+	else
+	{
+		detoastedItem = newItem;
+	}
+
+	newItemMask = _updateMmsInPlace(currentMms, detoastedItem,
+	                                       newItemTypeCacheEntry, newItemMask);
+	
+	updatedMms = currentMms;
+
+	return updatedMms;
+}
+
+
+/* 
+ * _updateMmsInPlace updates the sketch inside the MinMaskSketch in-place by
+ * adding the new item and returns the new mask for that item.
+ */
+static uint64 _updateMmsInPlace(MinMaskSketch* mms, Datum newItem,
+                    TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo newItemString = makeStringInfo();
+	CmsMatrix matrix = _mmsMatrix(mms);
+	uint64 newMask = 0;
+	instr_time startTime;
+
+	CmsStatTimerStart(&startTime);
+	_convertDatumToBytes(newItem, newItemTypeCacheEntry, newItemString);
+	CmsHashBytes(newItemString->data, newItemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+
+	newMask = MmsUpdateHashed(&matrix, hashValueArray, newItemMask);
+	CmsStatTimerStop(&startTime, &CmsStatPending->updateTime);
+	CmsStatPending->items++;
+
+	return newMask;
+}
+
+
+/* _mmsEstimateHashedItemMask gets the bitmask of an item from its hashed values. */
+static uint64 _mmsEstimateHashedItemMask(MinMaskSketch* mms, uint64* hashValueArray)
+{
+	CmsMatrix matrix = _mmsMatrix(mms);
+
+	return MmsEstimateHashed(&matrix, hashValueArray);
+}
+
+
+/* _mmsEstimateItemMask estimates the bitmask value for the given item and returns the bitmask. */
+static uint64 _mmsEstimateItemMask(MinMaskSketch* mms, Datum item,
+                             TypeCacheEntry* itemTypeCacheEntry)
+{
+	uint64 hashValueArray[2] = {0, 0};
+	StringInfo itemString = makeStringInfo();
+	uint64 mask = 0;
+	instr_time startTime;
+
+	if (itemTypeCacheEntry->typlen == -1)
+	{
+		Datum detoastedItem =  PointerGetDatum(CmsStatDetoastItem(item));
+		_convertDatumToBytes(detoastedItem, itemTypeCacheEntry, itemString);
+	}
+	else
+	{
+		_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+	}
+	
+	CmsStatTimerStart(&startTime);
+	CmsHashBytes(itemString->data, itemString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
+	mask = _mmsEstimateHashedItemMask(mms, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->estimateTime);
+	CmsStatPending->items++;
+
+	return mask;
+}
+
+
+/* _mmsMatrix returns a view of the mask matrix of the given MinMaskSketch. */
+static CmsMatrix _mmsMatrix(MinMaskSketch* mms)
+{
+	CmsMatrix matrix;
+
+	matrix.depth = mms->sketchDepth;
+	matrix.width = mms->sketchWidth;
+	matrix.counters = mms->sketch;
+
+	return matrix;
+}
+
+
+/* ----- Approximate top-k scan functionality ----- */
+
+
+/*
+ * _createCmsTopKPaths is the create_upper_paths_hook of the extension. If
+ * cms_mms.approximate_top_k is on and the query asks for the k most frequent
+ * values of a column, it adds an approximate top-k scan over the cheapest path of
+ * the table to the final relation. The scan returns the rows already sorted and
+ * limited, and it neither keeps nor sorts the groups, so it is cheaper than the
+ * exact plans and replaces them.
+ */
+static void _createCmsTopKPaths(PlannerInfo* root, UpperRelationKind stage,
+                                RelOptInfo* inputRel, RelOptInfo* outputRel,
+                                void* extra)
+{
+	CustomPath* topKPath = NULL;
+	RelOptInfo* scanRel = NULL;
+	Path* childPath = NULL;
+	Index scanRelationIndex = 0;
+	int itemIndex = 0;
+	int countIndex = 0;
+	int32 itemCount = 0;
+
+	if (PreviousCreateUpperPathsHook != NULL)
+	{
+		PreviousCreateUpperPathsHook(root, stage, inputRel, outputRel, extra);
+	}
+
+	if (!ApproximateTopK || stage != UPPERREL_FINAL)
+	{
+		return;
+	}
+
+	if (!_isCmsTopKQuery(root, &scanRelationIndex, &itemIndex, &countIndex, &itemCount))
+	{
+		return;
+	}
+
+	scanRel = find_base_rel(root, scanRelationIndex);
+	childPath = scanRel->cheapest_total_path;
+	if (childPath == NULL)
+	{
+		return;
+	}
+
+	/*
+	 * Every input row is hashed and added to the sketch, which costs about as much
+	 * as hashing it into a hash aggregate. Rows come out once the input is consumed.
+	 */
+	topKPath = makeNode(CustomPath);
+	topKPath->path.pathtype = T_CustomScan;
+	topKPath->path.parent = outputRel;
+	topKPath->path.pathtarget = root->upper_targets[UPPERREL_FINAL];
+	topKPath->path.param_info = NULL;
+	topKPath->path.parallel_aware = false;
+	topKPath->path.parallel_safe = false;
+	topKPath->path.parallel_workers = 0;
+	topKPath->path.rows = (double) itemCount;
+	topKPath->path.startup_cost = childPath->total_cost +
+	                              cpu_operator_cost * childPath->rows;
+	topKPath->path.total_cost = topKPath->path.startup_cost +
+	                            cpu_tuple_cost * topKPath->path.rows;
+	topKPath->path.pathkeys = root->sort_pathkeys;
+	topKPath->flags = 0;
+	topKPath->custom_paths = list_make1(childPath);
+	topKPath->custom_private = list_make3(makeInteger(itemIndex), makeInteger(countIndex),
+	                                      makeInteger(itemCount));
+	topKPath->methods = &CmsTopKPathMethods;
+
+	add_path(outputRel, (Path*) topKPath);
+}
+
+
+/*
+ * _isCmsTopKQuery returns whether the query being planned has the form
+ *
+ *   SELECT column, count(*) FROM table [WHERE ...]
+ *   GROUP BY column ORDER BY count(*) DESC LIMIT k
+ *
+ * with the two output columns in any order, a constant k of at most
+ * MAX_TOP_K_ITEMS, and a column whose equal values have equal bytes. If so, it
+ * sets the range table index of the table, the positions of the column and the
+ * count in the output, and k.
+ */
+static bool _isCmsTopKQuery(PlannerInfo* root, Index* scanRelationIndex,
+                            int* itemIndex, int* countIndex, int32* itemCount)
+{
+	Query* parse = root->parse;
+	RangeTblRef* rangeTableRef = NULL;
+	RangeTblEntry* rangeTableEntry = NULL;
+	TargetEntry* itemEntry = NULL;
+	TargetEntry* countEntry = NULL;
+	TargetEntry* sortEntry = NULL;
+	Var* itemVar = NULL;
+	Aggref* countAggref = NULL;
+	Const* limitConst = NULL;
+	TypeCacheEntry* countTypeCacheEntry = NULL;
+	int64 limitCount = 0;
+
+	if (parse->commandType != CMD_SELECT || parse->setOperations != NULL ||
+	    parse->rowMarks != NIL || parse->hasWindowFuncs || parse->hasTargetSRFs ||
+	    parse->groupingSets != NIL || parse->havingQual != NULL ||
+	    parse->distinctClause != NIL || parse->limitOffset != NULL ||
+	    list_length(parse->groupClause) != 1 || list_length(parse->sortClause) != 1 ||
+	    list_length(parse->targetList) != 2 ||
+	    list_length(parse->jointree->fromlist) != 1)
+	{
+		return false;
+	}
+
+#if PG_VERSION_NUM >= 130000
+	if (parse->limitOption != LIMIT_OPTION_COUNT)
+	{
+		return false;
+	}
+#endif
+
+	/* The limit has to be a small constant */
+	if (parse->limitCount == NULL || !IsA(parse->limitCount, Const))
+	{
+		return false;
+	}
+
+	limitConst = (Const*) parse->limitCount;
+	if (limitConst->consttype != INT8OID || limitConst->constisnull)
+	{
+		return false;
+	}
+
+	limitCount = DatumGetInt64(limitConst->constvalue);
+	if (limitCount < 1 || limitCount > MAX_TOP_K_ITEMS)
+	{
+		return false;
+	}
+
+	/* Rows have to come from a single table */
+	if (!IsA(linitial(parse->jointree->fromlist), RangeTblRef))
+	{
+		return false;
+	}
+
+	rangeTableRef = (RangeTblRef*) linitial(parse->jointree->fromlist);
+	rangeTableEntry = planner_rt_fetch(rangeTableRef->rtindex, root);
+	if (rangeTableEntry->rtekind != RTE_RELATION)
+	{
+		return false;
+	}
+
+	/* Groups have to be the values of one of its columns */
+	itemEntry = get_sortgroupclause_tle((SortGroupClause*) linitial(parse->groupClause),
+	                                    parse->targetList);
+	if (itemEntry->resjunk || !IsA(itemEntry->expr, Var))
+	{
+		return false;
+	}
+
+	itemVar = (Var*) itemEntry->expr;
+	if (itemVar->varno != rangeTableRef->rtindex || itemVar->varlevelsup != 0 ||
+	    itemVar->varattno <= 0)
+	{
+		return false;
+	}
+
+	/* Sketches hash the bytes of items, so equal items need equal bytes */
+	if (!_hasImageEquality(itemVar->vartype, itemVar->varcollid,
+	                       ((SortGroupClause*) linitial(parse->groupClause))->eqop))
+	{
+		return false;
+	}
+
+	/* The other output column has to be a plain count(*) */
+	if (itemEntry == linitial(parse->targetList))
+	{
+		countEntry = (TargetEntry*) lsecond(parse->targetList);
+	}
+	else
+	{
+		countEntry = (TargetEntry*) linitial(parse->targetList);
+	}
+
+	if (countEntry->resjunk || !IsA(countEntry->expr, Aggref))
+	{
+		return false;
+	}
+
+	countAggref = (Aggref*) countEntry->expr;
+	if (countAggref->aggfnoid != COUNT_STAR_FUNCTION_OID || countAggref->aggfilter != NULL ||
+	    countAggref->aggorder != NIL || countAggref->aggdistinct != NIL ||
+	    countAggref->agglevelsup != 0)
+	{
+		return false;
+	}
+
+	/* Rows have to be sorted by the count in descending order */
+	sortEntry = get_sortgroupclause_tle((SortGroupClause*) linitial(parse->sortClause),
+	                                    parse->targetList);
+	countTypeCacheEntry = lookup_type_cache(INT8OID, TYPECACHE_GT_OPR);
+	if (sortEntry != countEntry ||
+	    ((SortGroupClause*) linitial(parse->sortClause))->sortop !=
+	    countTypeCacheEntry->gt_opr)
+	{
+		return false;
+	}
+
+	*scanRelationIndex = rangeTableRef->rtindex;
+	*itemIndex = itemEntry->resno - 1;
+	*countIndex = countEntry->resno - 1;
+	*itemCount = (int32) limitCount;
+
+	return true;
+}
+
+
+/*
+ * _hasImageEquality returns whether values of the given type and collation which
+ * the given operator finds equal always have the same bytes, so grouping them by
+ * their hash values gives the same groups as the operator. This is what the
+ * equalimage support function of the type's btree operator class tells, which
+ * is false for types like numeric and float8 and for nondeterministic
+ * collations. Before PostgreSQL 13, only pass-by-value types other than floats
+ * are accepted.
+ */
+static bool _hasImageEquality(Oid typeId, Oid collationId, Oid equalityOperator)
+{
+	TypeCacheEntry* typeCacheEntry = lookup_type_cache(typeId, TYPECACHE_EQ_OPR |
+	                                                   TYPECACHE_BTREE_OPFAMILY);
+#if PG_VERSION_NUM >= 130000
+	Oid equalImageFunction = InvalidOid;
+#endif
+
+	if (!OidIsValid(typeCacheEntry->eq_opr) || equalityOperator != typeCacheEntry->eq_opr)
+	{
+		return false;
+	}
+
+#if PG_VERSION_NUM >= 130000
+	if (!OidIsValid(typeCacheEntry->btree_opf))
+	{
+		return false;
+	}
+
+	equalImageFunction = get_opfamily_proc(typeCacheEntry->btree_opf,
+	                                       typeCacheEntry->btree_opintype,
+	                                       typeCacheEntry->btree_opintype,
+	                                       BTEQUALIMAGE_PROC);
+	if (!OidIsValid(equalImageFunction))
+	{
+		return false;
+	}
+
+	return DatumGetBool(OidFunctionCall1Coll(equalImageFunction, collationId,
+	                                         ObjectIdGetDatum(typeCacheEntry->btree_opintype)));
+#else
+	return typeCacheEntry->typbyval && typeId != FLOAT4OID && typeId != FLOAT8OID;
+#endif
+}
+
+
+/*
+ * _planCmsTopKPath creates the CustomScan of an approximate top-k path. The scan
+ * has no relation of its own, so it describes its rows with the output columns,
+ * and the count(*) of the output is replaced by a reference to its scan column.
+ * The scan keeps where the grouped column is in the rows of its input.
+ */
+static Plan* _planCmsTopKPath(PlannerInfo* root, RelOptInfo* rel, CustomPath* bestPath,
+                              List* tlist, List* clauses, List* customPlans)
+{
+	CustomScan* customScan = makeNode(CustomScan);
+	Plan* childPlan = (Plan*) linitial(customPlans);
+	int itemIndex = intVal(linitial(bestPath->custom_private));
+	Var* itemVar = (Var*) ((TargetEntry*) list_nth(tlist, itemIndex))->expr;
+	AttrNumber childItemNumber = InvalidAttrNumber;
+	ListCell* childEntryCell = NULL;
+
+	foreach(childEntryCell, childPlan->targetlist)
+	{
+		TargetEntry* childEntry = (TargetEntry*) lfirst(childEntryCell);
+		Var* childVar = (Var*) childEntry->expr;
+
+		if (IsA(childVar, Var) && childVar->varno == itemVar->varno &&
+		    childVar->varattno == itemVar->varattno)
+		{
+			childItemNumber = childEntry->resno;
+			break;
+		}
+	}
+
+	if (childItemNumber == InvalidAttrNumber)
+	{
+		elog(ERROR, "could not find the grouped column in the input of the top-k scan");
+	}
+
+	customScan->scan.plan.targetlist = tlist;
+	customScan->scan.plan.qual = NIL;
+	customScan->scan.scanrelid = 0;
+	customScan->flags = bestPath->flags;
+	customScan->custom_plans = customPlans;
+	customScan->custom_exprs = NIL;
+	customScan->custom_private = lcons(makeInteger(childItemNumber),
+	                                   list_copy(bestPath->custom_private));
+	customScan->custom_scan_tlist = copyObject(tlist);
+	customScan->methods = &CmsTopKScanMethods;
+
+	return &customScan->scan.plan;
+}
+
+
+/* _createCmsTopKScanState allocates the executor state of an approximate top-k scan. */
+static Node* _createCmsTopKScanState(CustomScan* customScan)
+{
+	CmsTopKScanState* topKState = palloc0(sizeof(CmsTopKScanState));
+
+	NodeSetTag(topKState, T_CustomScanState);
+	topKState->customScanState.methods = &CmsTopKExecMethods;
+
+	return (Node*) topKState;
+}
+
+
+/*
+ * _beginCmsTopKScan initializes an approximate top-k scan and its input. The
+ * sketch has the default dimensions of cms, and the candidates are kept in their
+ * own memory context, which is reset when the scan starts over.
+ */
+static void _beginCmsTopKScan(CustomScanState* node, EState* estate, int eflags)
+{
+	CmsTopKScanState* topKState = (CmsTopKScanState*) node;
+	CustomScan* customScan = (CustomScan*) node->ss.ps.plan;
+	TupleDesc scanTupleDescriptor = node->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+	Oid itemType = InvalidOid;
+
+	topKState->childItemNumber = (AttrNumber) intVal(linitial(customScan->custom_private));
+	topKState->itemIndex = intVal(lsecond(customScan->custom_private));
+	topKState->countIndex = intVal(lthird(customScan->custom_private));
+	topKState->itemCount = intVal(lfourth(customScan->custom_private));
+
+	itemType = TupleDescAttr(scanTupleDescriptor, topKState->itemIndex)->atttypid;
+	topKState->itemTypeCacheEntry = lookup_type_cache(itemType, 0);
+	topKState->rowContext = AllocSetContextCreate(CurrentMemoryContext,
+	                                              "cms_top_k rows",
+	                                              ALLOCSET_DEFAULT_SIZES);
+	topKState->candidateContext = AllocSetContextCreate(CurrentMemoryContext,
+	                                                    "cms_top_k candidates",
+	                                                    ALLOCSET_DEFAULT_SIZES);
+	topKState->cms = _createCms(DEFAULT_ERROR_BOUND, DEFAULT_CONFIDENCE_INTERVAL, 0, false);
+
+	node->custom_ps = list_make1(ExecInitNode((Plan*) linitial(customScan->custom_plans),
+	                                          estate, eflags));
+
+	_resetCmsTopKScan(topKState);
+}
+
+
+/* _execCmsTopKScan returns the next row of an approximate top-k scan. */
+static TupleTableSlot* _execCmsTopKScan(CustomScanState* node)
+{
+	return ExecScan(&node->ss, _nextCmsTopKItem, _recheckCmsTopKItem);
+}
+
+
+/*
+ * _nextCmsTopKItem stores the next most frequent item and its frequency estimate
+ * in the scan slot, after consuming the input on the first call. It returns an
+ * empty slot once k items have been returned.
+ */
+static TupleTableSlot* _nextCmsTopKItem(ScanState* node)
+{
+	CmsTopKScanState* topKState = (CmsTopKScanState*) node;
+	TupleTableSlot* slot = node->ss_ScanTupleSlot;
+	CmsTopKCandidate* candidate = NULL;
+
+	if (!topKState->inputDone)
+	{
+		_consumeCmsTopKInput(topKState);
+	}
+
+	ExecClearTuple(slot);
+	if (topKState->nextResult >= topKState->resultCount)
+	{
+		return slot;
+	}
+
+	candidate = topKState->results[topKState->nextResult];
+	topKState->nextResult++;
+
+	slot->tts_values[topKState->itemIndex] = candidate->item;
+	slot->tts_isnull[topKState->itemIndex] = candidate->itemIsNull;
+	slot->tts_values[topKState->countIndex] =
+		Int64GetDatum((int64) Min(candidate->frequency, (uint64) PG_INT64_MAX));
+	slot->tts_isnull[topKState->countIndex] = false;
+	ExecStoreVirtualTuple(slot);
+
+	return slot;
+}
+
+
+/* _recheckCmsTopKItem accepts every row, since the scan has no quals of its own. */
+static bool _recheckCmsTopKItem(ScanState* node, TupleTableSlot* slot)
+{
+	return true;
+}
+
+
+/* _endCmsTopKScan shuts down the input and frees the memory of the scan. */
+static void _endCmsTopKScan(CustomScanState* node)
+{
+	CmsTopKScanState* topKState = (CmsTopKScanState*) node;
+
+	ExecEndNode((PlanState*) linitial(node->custom_ps));
+	MemoryContextDelete(topKState->rowContext);
+	MemoryContextDelete(topKState->candidateContext);
+}
+
+
+/* _rescanCmsTopKScan starts the scan over, with a new sketch of its input. */
+static void _rescanCmsTopKScan(CustomScanState* node)
+{
+	CmsTopKScanState* topKState = (CmsTopKScanState*) node;
+	PlanState* childState = (PlanState*) linitial(node->custom_ps);
+
+	if (node->ss.ps.chgParam != NULL)
+	{
+		UpdateChangedParamSet(childState, node->ss.ps.chgParam);
+	}
+
+	if (childState->chgParam == NULL)
+	{
+		ExecReScan(childState);
+	}
+
+	_resetCmsTopKScan(topKState);
+}
+
+
+/* _explainCmsTopKScan shows the dimensions of the sketch in EXPLAIN output. */
+static void _explainCmsTopKScan(CustomScanState* node, List* ancestors, ExplainState* es)
+{
+	CmsTopKScanState* topKState = (CmsTopKScanState*) node;
+
+	ExplainPropertyInteger("Sketch Depth", NULL, topKState->cms->sketchDepth, es);
+	ExplainPropertyInteger("Sketch Width", NULL, topKState->cms->sketchWidth, es);
+}
+
+
+/*
+ * _resetCmsTopKScan zeroes the sketch of an approximate top-k scan and creates an
+ * empty candidate table, which is keyed by the hash values of the items.
+ */
+static void _resetCmsTopKScan(CmsTopKScanState* topKState)
+{
+	CountMinSketch* cms = topKState->cms;
+	HASHCTL candidateTableInfo;
+
+	MemoryContextReset(topKState->candidateContext);
+	memset(cms->sketch, 0, CmsMatrixSize(cms->sketchDepth, cms->sketchWidth));
+	cms->totalCount = 0;
+
+	memset(&candidateTableInfo, 0, sizeof(candidateTableInfo));
+	candidateTableInfo.keysize = sizeof(((CmsTopKCandidate*) NULL)->hashValueArray);
+	candidateTableInfo.entrysize = sizeof(CmsTopKCandidate);
+	candidateTableInfo.hcxt = topKState->candidateContext;
+	topKState->candidateTable = hash_create("cms_top_k candidates", topKState->itemCount,
+	                                        &candidateTableInfo,
+	                                        HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	topKState->minFrequency = 0;
+	topKState->nullFrequency = 0;
+	topKState->inputDone = false;
+	topKState->results = NULL;
+	topKState->resultCount = 0;
+	topKState->nextResult = 0;
+}
+
+
+/*
+ * _consumeCmsTopKInput adds the grouped column of every input row to the sketch
+ * with _updateCmsInPlace and offers the item to the candidates with its new
+ * estimate. Null items are counted exactly. Then it sorts the candidates, and the
+ * null item if there was one, by decreasing frequency and keeps the first k.
+ */
+static void _consumeCmsTopKInput(CmsTopKScanState* topKState)
+{
+	PlanState* childState = (PlanState*) linitial(topKState->customScanState.custom_ps);
+	TypeCacheEntry* itemTypeCacheEntry = topKState->itemTypeCacheEntry;
+	CmsStatCounters* statCounters = NULL;
+	CmsTopKCandidate* candidate = NULL;
+	HASH_SEQ_STATUS candidateScan;
+	int32 candidateCount = 0;
+
+	CmsStatBeginCall(CMS_STAT_CMS_TOP_K);
+	statCounters = CmsStatPending;
+
+	for (;;)
+	{
+		TupleTableSlot* childSlot = ExecProcNode(childState);
+		uint64 hashValueArray[2] = {0, 0};
+		uint64 frequency = 0;
+		MemoryContext oldContext = NULL;
+		Datum item = 0;
+		bool itemIsNull = false;
+
+		if (TupIsNull(childSlot))
+		{
+			break;
+		}
+
+		item = slot_getattr(childSlot, topKState->childItemNumber, &itemIsNull);
+		if (itemIsNull)
+		{
+			topKState->nullFrequency++;
+			continue;
+		}
+
+		/* Functions evaluated by the input may have counted their own calls */
+		CmsStatPending = statCounters;
+
+		MemoryContextReset(topKState->rowContext);
+		oldContext = MemoryContextSwitchTo(topKState->rowContext);
+		item = _detoastItem(item, itemTypeCacheEntry);
+		frequency = _updateCmsInPlace(topKState->cms, NULL, NULL, item, itemTypeCacheEntry,
+		                              1, hashValueArray);
+		MemoryContextSwitchTo(oldContext);
+
+		_offerCmsTopKCandidate(topKState, hashValueArray, item, frequency);
+	}
+
+	MemoryContextReset(topKState->rowContext);
+
+	candidateCount = (int32) hash_get_num_entries(topKState->candidateTable);
+	topKState->results = MemoryContextAlloc(topKState->candidateContext,
+	                                        sizeof(CmsTopKCandidate*) * (candidateCount + 1));
+
+	hash_seq_init(&candidateScan, topKState->candidateTable);
+	while ((candidate = (CmsTopKCandidate*) hash_seq_search(&candidateScan)) != NULL)
+	{
+		topKState->results[topKState->resultCount] = candidate;
+		topKState->resultCount++;
+	}
+
+	if (topKState->nullFrequency > 0)
+	{
+		candidate = MemoryContextAllocZero(topKState->candidateContext,
+		                                   sizeof(CmsTopKCandidate));
+		candidate->itemIsNull = true;
+		candidate->frequency = topKState->nullFrequency;
+
+		topKState->results[topKState->resultCount] = candidate;
+		topKState->resultCount++;
+	}
+
+	qsort(topKState->results, topKState->resultCount, sizeof(CmsTopKCandidate*),
+	      _compareCmsTopKCandidates);
+	topKState->resultCount = Min(topKState->resultCount, topKState->itemCount);
+	topKState->inputDone = true;
+}
+
+
+/*
+ * _offerCmsTopKCandidate records the new frequency estimate of an item in the
+ * candidate table. The item updates its own entry if it has one, takes a new
+ * entry while there are fewer than k, and otherwise replaces the candidate with
+ * the smallest estimate if its estimate is larger. Estimates only grow, so the
+ * smallest estimate found by a search stays a lower bound until the next one, and
+ * items below it are rejected without searching.
+ */
+static void _offerCmsTopKCandidate(CmsTopKScanState* topKState, uint64* hashValueArray,
+                                   Datum item, uint64 frequency)
+{
+	HTAB* candidateTable = topKState->candidateTable;
+	TypeCacheEntry* itemTypeCacheEntry = topKState->itemTypeCacheEntry;
+	CmsTopKCandidate* candidate = NULL;
+	CmsTopKCandidate* minCandidate = NULL;
+	HASH_SEQ_STATUS candidateScan;
+	MemoryContext oldContext = NULL;
+
+	candidate = (CmsTopKCandidate*) hash_search(candidateTable, hashValueArray,
+	                                            HASH_FIND, NULL);
+	if (candidate != NULL)
+	{
+		candidate->frequency = Max(candidate->frequency, frequency);
+		return;
+	}
+
+	if (hash_get_num_entries(candidateTable) >= topKState->itemCount)
+	{
+		if (frequency <= topKState->minFrequency)
+		{
+			return;
+		}
+
+		hash_seq_init(&candidateScan, candidateTable);
+		while ((candidate = (CmsTopKCandidate*) hash_seq_search(&candidateScan)) != NULL)
+		{
+			if (minCandidate == NULL || candidate->frequency < minCandidate->frequency)
+			{
+				minCandidate = candidate;
+			}
+		}
+
+		topKState->minFrequency = minCandidate->frequency;
+		if (frequency <= minCandidate->frequency)
+		{
+			return;
+		}
+
+		if (!itemTypeCacheEntry->typbyval)
+		{
+			pfree(DatumGetPointer(minCandidate->item));
+		}
+
+		hash_search(candidateTable, minCandidate->hashValueArray, HASH_REMOVE, NULL);
+	}
+
+	candidate = (CmsTopKCandidate*) hash_search(candidateTable, hashValueArray,
+	                                            HASH_ENTER, NULL);
+
+	oldContext = MemoryContextSwitchTo(topKState->candidateContext);
+	candidate->item = datumCopy(item, itemTypeCacheEntry->typbyval,
+	                            itemTypeCacheEntry->typlen);
+	MemoryContextSwitchTo(oldContext);
+
+	candidate->itemIsNull = false;
+	candidate->frequency = frequency;
+}
+
+
+/*
+ * _compareCmsTopKCandidates orders candidates by decreasing frequency estimate,
+ * and candidates with equal estimates by their hash values, so that the order of
+ * ties doesn't depend on the candidate table.
+ */
+static int _compareCmsTopKCandidates(const void* first, const void* second)
+{
+	const CmsTopKCandidate* left = *(const CmsTopKCandidate* const*) first;
+	const CmsTopKCandidate* right = *(const CmsTopKCandidate* const*) second;
+
+	if (left->frequency != right->frequency)
+	{
+		return (left->frequency > right->frequency) ? -1 : 1;
+	}
+	else if (left->hashValueArray[0] != right->hashValueArray[0])
+	{
+		return (left->hashValueArray[0] < right->hashValueArray[0]) ? -1 : 1;
+	}
+	else if (left->hashValueArray[1] != right->hashValueArray[1])
+	{
+		return (left->hashValueArray[1] < right->hashValueArray[1]) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/* ----- Sketch maintenance functionality ----- */
+
+
+/*
+ * cms_add_new_rows is a statement-level trigger which adds the rows a statement
+ * inserted to the sketches of a sketch table. The trigger arguments
+ * are the sketch table, its sketch column, the item column of the rows and the
+ * columns the sketches are grouped by, which have the same names in both tables.
+ * The rows are read from the transition table and grouped by their keys, and
+ * every affected sketch is updated once with the items of its group, so a COPY
+ * of many rows rewrites each sketch once instead of once per row. Groups which
+ * have no sketch yet get a new one with the default parameters. Rows with a null
+ * key are skipped. Updated rows aren't accepted, since their items were already
+ * added when they were inserted.
+ */
+Datum cms_add_new_rows(PG_FUNCTION_ARGS)
+{
+	TriggerData* triggerData = (TriggerData*) fcinfo->context;
+	Trigger* trigger = NULL;
+	Oid sketchTableId = InvalidOid;
+	char* functionSchemaName = NULL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+		                errmsg("cms_add_new_rows: not called by trigger manager")));
+	}
+
+	trigger = triggerData->tg_trigger;
+	if (!TRIGGER_FIRED_AFTER(triggerData->tg_event) ||
+	    !TRIGGER_FIRED_FOR_STATEMENT(triggerData->tg_event) ||
+	    !TRIGGER_FIRED_BY_INSERT(triggerData->tg_event) ||
+	    trigger->tgnewtable == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+		                errmsg("cms_add_new_rows: must be fired after inserting "
+		                       "statements with a new transition table"),
+		                errhint("Create the trigger with AFTER INSERT, "
+		                        "REFERENCING NEW TABLE AS and FOR EACH STATEMENT")));
+	}
+
+	if (trigger->tgnargs < 3)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_add_new_rows"),
+		                errhint("Trigger arguments are the sketch table, the sketch "
+		                        "column, the item column and the key columns")));
+	}
+
+	sketchTableId = DatumGetObjectId(DirectFunctionCall1(regclassin,
+	                                                     CStringGetDatum(trigger->tgargs[0])));
+	functionSchemaName = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	SPI_connect();
+	SPI_register_trigger_data(triggerData);
+
+	_updateSketches("cms_add_new_rows", quote_identifier(trigger->tgnewtable), sketchTableId,
+	                trigger->tgargs[1], trigger->tgargs[2], &trigger->tgargs[3],
+	                trigger->tgnargs - 3, functionSchemaName, 0, NULL, NULL);
+
+	SPI_finish();
+
+	return PointerGetDatum(NULL);
+}
+
+
+/*
+ * cms_consume_changes is a user-facing UDF which folds the rows inserted into the
+ * source tables of cms_change_sources into their sketch tables, reading them
+ * from the given logical replication slot. The slot has to be created with this
+ * library as its output plugin. Every sketch is updated once per call like in
+ * cms_add_new_rows, with the rows of at most batch size bytes of WAL. The
+ * position up to which changes were folded is kept in cms_change_progress and
+ * committed together with the sketches, and the slot is only advanced to it by
+ * the next call, so changes are folded exactly once even if a call fails. The
+ * function returns that position, the number of rows it folded and whether the
+ * batch was full, so callers repeat it while it folded rows or left changes
+ * behind. The position isn't moved if the batch folded nothing and wasn't full,
+ * because committing it writes WAL which the next call would decode again.
+ */
+Datum cms_consume_changes(PG_FUNCTION_ARGS)
+{
+	Name slotName = PG_GETARG_NAME(0);
+	int64 batchSize = PG_GETARG_INT64(1);
+	char* functionSchemaName = NULL;
+	char* progressTableName = NULL;
+	Oid argumentTypes[2] = {NAMEOID, LSNOID};
+	Datum arguments[2] = {0, 0};
+	SPITupleTable* sources = NULL;
+	uint64 sourceCount = 0;
+	uint64 sourceIndex = 0;
+	XLogRecPtr appliedLsn = InvalidXLogRecPtr;
+	XLogRecPtr confirmedLsn = InvalidXLogRecPtr;
+	XLogRecPtr flushLsn = InvalidXLogRecPtr;
+	XLogRecPtr endLsn = InvalidXLogRecPtr;
+	int64 foldedRowCount = 0;
+	bool batchFull = false;
+	StringInfo query = makeStringInfo();
+	TupleDesc tupleDescriptor = NULL;
+	HeapTuple resultTuple = NULL;
+	Datum values[3];
+	bool nulls[3] = {false, false, false};
+	bool isNull = false;
+
+	if (batchSize <= 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_consume_changes"),
+		                errhint("Batch size has to be positive")));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		                errmsg("function returning record called in context "
+		                       "that cannot accept type record")));
+	}
+
+	tupleDescriptor = BlessTupleDesc(tupleDescriptor);
+	functionSchemaName = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	progressTableName = quote_qualified_identifier(functionSchemaName, "cms_change_progress");
+	arguments[0] = NameGetDatum(slotName);
+
+	SPI_connect();
+
+	/* the progress row is locked, so only one call at a time reads the slot */
+	appendStringInfo(query,
+	                 "INSERT INTO %s (slot_name, applied_lsn) "
+	                 "SELECT slot_name, confirmed_flush_lsn FROM pg_catalog.pg_replication_slots "
+	                 "WHERE slot_name = $1 AND confirmed_flush_lsn IS NOT NULL "
+	                 "ON CONFLICT (slot_name) DO NOTHING",
+	                 progressTableName);
+	SPI_execute_with_args(query->data, 1, argumentTypes, arguments, NULL, false, 0);
+
+	resetStringInfo(query);
+	appendStringInfo(query,
+	                 "SELECT progress.applied_lsn, slots.confirmed_flush_lsn, "
+	                 "pg_catalog.pg_current_wal_flush_lsn() "
+	                 "FROM %s progress JOIN pg_catalog.pg_replication_slots slots USING (slot_name) "
+	                 "WHERE slot_name = $1 AND slots.plugin = 'cms_mms' "
+	                 "AND slots.database = pg_catalog.current_database() "
+	                 "FOR UPDATE OF progress",
+	                 progressTableName);
+	SPI_execute_with_args(query->data, 1, argumentTypes, arguments, NULL, false, 0);
+	if (SPI_processed != 1)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_consume_changes"),
+		                errhint("Slot has to be a logical replication slot of this "
+		                        "database with the cms_mms output plugin")));
+	}
+
+	appliedLsn = DatumGetLSN(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+	                                       1, &isNull));
+	confirmedLsn = DatumGetLSN(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+	                                         2, &isNull));
+	flushLsn = DatumGetLSN(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+	                                     3, &isNull));
+
+	if (appliedLsn > confirmedLsn)
+	{
+		/* changes up to the applied position were folded by a committed call */
+		arguments[1] = LSNGetDatum(appliedLsn);
+		SPI_execute_with_args("SELECT pg_catalog.pg_replication_slot_advance($1, $2)",
+		                      2, argumentTypes, arguments, NULL, false, 0);
 	}
 	else
 	{
-		_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+		/* changes before the confirmed position of the slot can't be decoded again */
+		appliedLsn = confirmedLsn;
+	}
+
+	endLsn = flushLsn;
+	if (endLsn > appliedLsn && endLsn - appliedLsn > (uint64) batchSize)
+	{
+		endLsn = appliedLsn + batchSize;
+		batchFull = true;
+	}
+
+	/* every source decodes the same range, which ends at the same position */
+	arguments[1] = LSNGetDatum(endLsn);
+
+	if (endLsn > appliedLsn)
+	{
+		resetStringInfo(query);
+		appendStringInfo(query,
+		                 "SELECT source_table::pg_catalog.oid, sketch_table::pg_catalog.oid, "
+		                 "sketch_column, item_column, key_columns FROM %s",
+		                 quote_qualified_identifier(functionSchemaName, "cms_change_sources"));
+		SPI_execute(query->data, true, 0);
+		sources = SPI_tuptable;
+		sourceCount = SPI_processed;
+	}
+
+	for (sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+	{
+		HeapTuple source = sources->vals[sourceIndex];
+		TupleDesc sourceDescriptor = sources->tupdesc;
+		Oid sourceTableId = DatumGetObjectId(SPI_getbinval(source, sourceDescriptor, 1, &isNull));
+		Oid sketchTableId = DatumGetObjectId(SPI_getbinval(source, sourceDescriptor, 2, &isNull));
+		ArrayType* keyArray = DatumGetArrayTypeP(SPI_getbinval(source, sourceDescriptor, 5,
+		                                                       &isNull));
+		int keyCount = 0;
+		int keyIndex = 0;
+		char** keyColumns = _readNameArray(keyArray, &keyCount);
+		char* itemColumn = SPI_getvalue(source, sourceDescriptor, 4);
+		StringInfo columnList = makeStringInfo();
+		StringInfo optionList = makeStringInfo();
+		StringInfo newRows = makeStringInfo();
+
+		/* only the item and key columns are decoded, and cast to their current types */
+		_appendDecodedColumn(columnList, optionList, sourceTableId, itemColumn, slotName);
+		for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+		{
+			if (strcmp(keyColumns[keyIndex], itemColumn) != 0)
+			{
+				_appendDecodedColumn(columnList, optionList, sourceTableId,
+				                     keyColumns[keyIndex], slotName);
+			}
+		}
+
+		appendStringInfo(newRows,
+		                 "(SELECT %s FROM "
+		                 "(SELECT data::pg_catalog.jsonb AS new_row "
+		                 "FROM pg_catalog.pg_logical_slot_peek_changes($1, $2, NULL, 'table', '%u'%s) "
+		                 "OFFSET 0) changes) new_rows",
+		                 columnList->data, sourceTableId, optionList->data);
+
+		foldedRowCount += _updateSketches("cms_consume_changes", newRows->data, sketchTableId,
+		                                  SPI_getvalue(source, sourceDescriptor, 3), itemColumn,
+		                                  keyColumns, keyCount, functionSchemaName,
+		                                  2, argumentTypes, arguments);
+	}
+
+	/* the position of an empty batch is kept until there is more to decode */
+	if (foldedRowCount > 0 || batchFull)
+	{
+		resetStringInfo(query);
+		appendStringInfo(query, "UPDATE %s SET applied_lsn = $2 WHERE slot_name = $1",
+		                 progressTableName);
+		SPI_execute_with_args(query->data, 2, argumentTypes, arguments, NULL, false, 0);
+
+		appliedLsn = endLsn;
+	}
+
+	SPI_finish();
+
+	values[0] = LSNGetDatum(appliedLsn);
+	values[1] = Int64GetDatum(foldedRowCount);
+	values[2] = BoolGetDatum(batchFull);
+
+	resultTuple = heap_form_tuple(tupleDescriptor, values, nulls);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(resultTuple));
+}
+
+
+/*
+ * _appendDecodedColumn appends the given column of a source table to the columns
+ * which cms_consume_changes reads from the JSON objects of decoded rows, and the
+ * option which asks the output plugin for it. The value is cast to the type the
+ * column has now. A column which the table no longer has is an error, since the
+ * rows of the slot can't be folded as cms_change_sources describes.
+ */
+static void _appendDecodedColumn(StringInfo columnList, StringInfo optionList, Oid sourceTableId,
+                                 const char* columnName, Name slotName)
+{
+	AttrNumber attributeNumber = get_attnum(sourceTableId, columnName);
+	Oid typeId = InvalidOid;
+	int32 typeModifier = -1;
+	Oid collationId = InvalidOid;
+
+	if (attributeNumber == InvalidAttrNumber)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+		                errmsg("column \"%s\" of table %s does not exist", columnName,
+		                       _qualifiedRelationName(sourceTableId)),
+		                errdetail("Rows of replication slot \"%s\" are folded into sketches "
+		                          "as cms_change_sources describes", NameStr(*slotName)),
+		                errhint("Update the columns of the table in cms_change_sources")));
+	}
+
+	get_atttypetypmodcoll(sourceTableId, attributeNumber, &typeId, &typeModifier, &collationId);
+
+	appendStringInfo(columnList, "%s(changes.new_row ->> %s)::%s AS %s",
+	                 (columnList->len > 0) ? ", " : "", quote_literal_cstr(columnName),
+	                 format_type_extended(typeId, typeModifier,
+	                                      FORMAT_TYPE_TYPEMOD_GIVEN | FORMAT_TYPE_FORCE_QUALIFY),
+	                 quote_identifier(columnName));
+	appendStringInfo(optionList, ", 'column', %s", quote_literal_cstr(columnName));
+}
+
+
+/*
+ * cms_compact_rollups is a user-facing UDF which folds fine-grained sketch rows
+ * into coarser rows of the same table, for every rollup in cms_rollups. Rows
+ * whose time isn't aligned to the rollup unit are folded once their whole
+ * coarse period is older than the rollup delay, so rows which are still being
+ * written are left alone. The sketches of the folded rows are unioned into the
+ * aligned row of their keys and period, which is inserted if it doesn't exist,
+ * and the folded rows are deleted. Each call folds one batch per rollup, whose
+ * sketches take about the given amount of memory, and returns the number of
+ * rows it folded, so callers repeat it until it returns zero. Rollups of a
+ * sketch column which another call is folding are skipped.
+ */
+Datum cms_compact_rollups(PG_FUNCTION_ARGS)
+{
+	int32 batchMemory = PG_GETARG_INT32(0);
+	char* functionSchemaName = NULL;
+	const char* quotedSchemaName = NULL;
+	SPITupleTable* rollups = NULL;
+	uint64 rollupCount = 0;
+	uint64 rollupIndex = 0;
+	StringInfo query = makeStringInfo();
+	int64 foldedRowCount = 0;
+	bool isNull = false;
+	int spiResult = 0;
+
+	if (batchMemory <= 0)
+	{
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_compact_rollups"),
+		                errhint("Batch memory has to be positive")));
+	}
+
+	functionSchemaName = get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid));
+	quotedSchemaName = quote_identifier(functionSchemaName);
+
+	SPI_connect();
+
+	appendStringInfo(query,
+	                 "SELECT sketch_table::pg_catalog.oid, sketch_column, time_column, "
+	                 "rollup_unit, rollup_delay, key_columns FROM %s",
+	                 quote_qualified_identifier(functionSchemaName, "cms_rollups"));
+	SPI_execute(query->data, true, 0);
+	rollups = SPI_tuptable;
+	rollupCount = SPI_processed;
+
+	for (rollupIndex = 0; rollupIndex < rollupCount; rollupIndex++)
+	{
+		HeapTuple rollup = rollups->vals[rollupIndex];
+		TupleDesc rollupDescriptor = rollups->tupdesc;
+		Oid sketchTableId = DatumGetObjectId(SPI_getbinval(rollup, rollupDescriptor, 1, &isNull));
+		char* sketchTableName = _qualifiedRelationName(sketchTableId);
+		const char* sketchColumn = quote_identifier(SPI_getvalue(rollup, rollupDescriptor, 2));
+		const char* timeColumn = quote_identifier(SPI_getvalue(rollup, rollupDescriptor, 3));
+		char* rollupUnit = quote_literal_cstr(SPI_getvalue(rollup, rollupDescriptor, 4));
+		char* rollupDelay = quote_literal_cstr(SPI_getvalue(rollup, rollupDescriptor, 5));
+		ArrayType* keyArray = DatumGetArrayTypeP(SPI_getbinval(rollup, rollupDescriptor, 6,
+		                                                       &isNull));
+		int keyCount = 0;
+		char** keyColumns = _readNameArray(keyArray, &keyCount);
+		StringInfo keyList = makeStringInfo();
+		StringInfo foldedRows = makeStringInfo();
+		StringInfo keyCondition = makeStringInfo();
+		StringInfo updatedKeyCondition = makeStringInfo();
+		Size sketchSize = 0;
+		int64 batchRowCount = 0;
+		int keyIndex = 0;
+
+		/* rows which aren't aligned to the unit, in periods which are complete */
+		appendStringInfo(foldedRows,
+		                 "%s < pg_catalog.date_trunc(%s, pg_catalog.now() - %s::pg_catalog.interval) "
+		                 "AND %s <> pg_catalog.date_trunc(%s, %s)",
+		                 timeColumn, rollupUnit, rollupDelay,
+		                 timeColumn, rollupUnit, timeColumn);
+		for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+		{
+			const char* keyColumn = quote_identifier(keyColumns[keyIndex]);
+
+			appendStringInfo(keyList, "%s, ", keyColumn);
+			appendStringInfo(foldedRows, " AND %s IS NOT NULL", keyColumn);
+			appendStringInfo(keyCondition, " AND sketches.%s = coarse_rows.%s",
+			                 keyColumn, keyColumn);
+			appendStringInfo(updatedKeyCondition, " AND updated_rows.%s = coarse_rows.%s",
+			                 keyColumn, keyColumn);
+		}
+
+		/*
+		 * Calls which fold the same sketch column at the same time could both
+		 * insert the coarse row of a period, so a call skips the column while
+		 * another one holds it until the end of its transaction.
+		 */
+		resetStringInfo(query);
+		appendStringInfo(query,
+		                 "SELECT pg_catalog.pg_try_advisory_xact_lock(%d, pg_catalog.hashtext(%s))",
+		                 (int32) sketchTableId, quote_literal_cstr(sketchColumn));
+		spiResult = SPI_execute(query->data, false, 1);
+		if (spiResult != SPI_OK_SELECT)
+		{
+			elog(ERROR, "cms_compact_rollups: could not lock the rollup: %s",
+			     SPI_result_code_string(spiResult));
+		}
+
+		if (!DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+		                                1, &isNull)))
+		{
+			continue;
+		}
+
+		/* the batch holds the folded sketches and about as many unions */
+		resetStringInfo(query);
+		appendStringInfo(query, "SELECT %s FROM %s WHERE %s AND %s IS NOT NULL LIMIT 1",
+		                 sketchColumn, sketchTableName, foldedRows->data, sketchColumn);
+		SPI_execute(query->data, true, 1);
+		if (SPI_processed == 0)
+		{
+			continue;
+		}
+
+		sketchSize = toast_raw_datum_size(SPI_getbinval(SPI_tuptable->vals[0],
+		                                                SPI_tuptable->tupdesc, 1, &isNull));
+		batchRowCount = Max(((int64) batchMemory * 1024) / (2 * (int64) sketchSize), 1);
+
+		resetStringInfo(query);
+		appendStringInfo(query,
+		                 "WITH folded_rows AS ("
+		                 "DELETE FROM %s WHERE ctid IN ("
+		                 "SELECT ctid FROM %s WHERE %s ORDER BY %s LIMIT " INT64_FORMAT " "
+		                 "FOR UPDATE SKIP LOCKED) "
+		                 "RETURNING %spg_catalog.date_trunc(%s, %s) AS %s, %s), "
+		                 "coarse_rows AS ("
+		                 "SELECT %s%s, %s.cms_union_agg(%s) AS %s FROM folded_rows "
+		                 "GROUP BY %s%s), "
+		                 "updated_rows AS ("
+		                 "UPDATE %s sketches SET %s = %s.cms_union(sketches.%s, coarse_rows.%s) "
+		                 "FROM coarse_rows WHERE sketches.%s = coarse_rows.%s%s "
+		                 "RETURNING sketches.*), "
+		                 "inserted_rows AS ("
+		                 "INSERT INTO %s (%s%s, %s) SELECT %s%s, %s FROM coarse_rows "
+		                 "WHERE NOT EXISTS (SELECT 1 FROM updated_rows "
+		                 "WHERE updated_rows.%s = coarse_rows.%s%s) RETURNING 1) "
+		                 "SELECT pg_catalog.count(*) FROM folded_rows",
+		                 sketchTableName, sketchTableName, foldedRows->data, timeColumn,
+		                 batchRowCount,
+		                 keyList->data, rollupUnit, timeColumn, timeColumn, sketchColumn,
+		                 keyList->data, timeColumn, quotedSchemaName, sketchColumn, sketchColumn,
+		                 keyList->data, timeColumn,
+		                 sketchTableName, sketchColumn, quotedSchemaName, sketchColumn,
+		                 sketchColumn, timeColumn, timeColumn, keyCondition->data,
+		                 sketchTableName, keyList->data, timeColumn, sketchColumn,
+		                 keyList->data, timeColumn, sketchColumn,
+		                 timeColumn, timeColumn, updatedKeyCondition->data);
+
+		spiResult = SPI_execute(query->data, false, 0);
+		if (spiResult != SPI_OK_SELECT)
+		{
+			elog(ERROR, "cms_compact_rollups: could not fold rows: %s",
+			     SPI_result_code_string(spiResult));
+		}
+
+		foldedRowCount += DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+		                                              SPI_tuptable->tupdesc, 1, &isNull));
 	}
 
-	/*
-	 * Calculate hash values for the given item and then get frequency estimate
-	 * with these hashed values.
-	 */
-	MurmurHash3_x64_128(itemString->data, itemString->len, MURMUR_SEED, &hashValueArray);
-	frequency = _cmsEstimateHashedItemFrequency(cms, hashValueArray);
+	SPI_finish();
 
-	return frequency;
+	PG_RETURN_INT64(foldedRowCount);
 }
 
-/* ----- Min-mask sketch functionality ----- */
-
 
-/* mms_in creates mms from printable representation */
-Datum mms_in(PG_FUNCTION_ARGS)
+/*
+ * _updateSketches adds the items of the given new rows to the sketches of their
+ * groups in the sketch table, and returns the number of rows it added. New rows
+ * are a relation in the FROM clause, which may use the given parameters. The
+ * caller has to be connected to SPI.
+ *
+ * Two statements which add the first rows of a group could both insert its
+ * sketch. If the key columns are a unique key of the sketch table, the insert
+ * falls back to updating the sketch the other statement inserted. Otherwise the
+ * groups are locked first, in a statement of their own, so the update sees the
+ * sketches which statements that held the locks before inserted.
+ */
+static int64 _updateSketches(const char* functionName, const char* newRows, Oid sketchTableId,
+                             const char* sketchColumn, const char* itemColumn,
+                             char** keyColumns, int keyCount, const char* functionSchemaName,
+                             int argumentCount, Oid* argumentTypes, Datum* arguments)
 {
-	Datum datum = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+	bool uniqueKey = _hasUniqueKey(sketchTableId, keyColumns, keyCount);
+	StringInfo query = makeStringInfo();
+	bool isNull = false;
+	int spiResult = 0;
 
-	return datum;
-}
+	if (!uniqueKey)
+	{
+		StringInfo lockKey = makeStringInfo();
+		int keyIndex = 0;
 
+		/* groups are locked in the same order by every statement */
+		appendStringInfoString(lockKey, "0");
+		if (keyCount > 0)
+		{
+			resetStringInfo(lockKey);
+			appendStringInfoString(lockKey, "pg_catalog.hashtext(ROW(");
+			for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+			{
+				appendStringInfo(lockKey, "%s%s", (keyIndex > 0) ? ", " : "",
+				                 quote_identifier(keyColumns[keyIndex]));
+			}
+			appendStringInfoString(lockKey, ")::pg_catalog.text)");
+		}
 
-/* mms_out converts mms to printable representation */
-Datum mms_out(PG_FUNCTION_ARGS)
-{
-	Datum datum = DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0));
+		appendStringInfo(query,
+		                 "SELECT pg_catalog.pg_advisory_xact_lock(%d, lock_key) FROM ("
+		                 "SELECT DISTINCT %s AS lock_key FROM %s WHERE true",
+		                 (int32) sketchTableId, lockKey->data, newRows);
+		for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+		{
+			appendStringInfo(query, " AND %s IS NOT NULL",
+			                 quote_identifier(keyColumns[keyIndex]));
+		}
+		appendStringInfoString(query, ") lock_keys ORDER BY lock_key");
 
-	PG_RETURN_CSTRING(datum);
+		spiResult = SPI_execute_with_args(query->data, argumentCount, argumentTypes,
+		                                  arguments, NULL, false, 0);
+		if (spiResult != SPI_OK_SELECT)
+		{
+			elog(ERROR, "%s: could not lock sketches: %s", functionName,
+			     SPI_result_code_string(spiResult));
+		}
+
+		resetStringInfo(query);
+	}
+
+	_appendSketchUpdateQuery(query, newRows, _qualifiedRelationName(sketchTableId),
+	                         sketchColumn, itemColumn, keyColumns, keyCount, uniqueKey,
+	                         functionSchemaName);
+
+	spiResult = SPI_execute_with_args(query->data, argumentCount, argumentTypes, arguments,
+	                                  NULL, false, 0);
+	if (spiResult != SPI_OK_SELECT)
+	{
+		elog(ERROR, "%s: could not update sketches: %s", functionName,
+		     SPI_result_code_string(spiResult));
+	}
+
+	return DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc,
+	                                   1, &isNull));
 }
 
 
-/* mms_recv creates mms from external binary format */
-Datum mms_recv(PG_FUNCTION_ARGS)
+/*
+ * _hasUniqueKey returns whether the given columns are exactly the columns of a
+ * unique index of the relation which can arbitrate ON CONFLICT, that is a valid
+ * and immediate index without expressions or a predicate.
+ */
+static bool _hasUniqueKey(Oid relationId, char** keyColumns, int keyCount)
 {
-	Datum datum = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+	StringInfo query = makeStringInfo();
+	int keyIndex = 0;
 
-	return datum;
+	if (keyCount == 0)
+	{
+		return false;
+	}
+
+	appendStringInfo(query,
+	                 "SELECT 1 FROM pg_catalog.pg_index i "
+	                 "WHERE i.indrelid = %u AND i.indisunique AND i.indisvalid "
+	                 "AND i.indimmediate AND i.indpred IS NULL AND i.indexprs IS NULL "
+	                 "AND (SELECT pg_catalog.array_agg(a.attname ORDER BY a.attname) "
+	                 "FROM pg_catalog.pg_attribute a "
+	                 "WHERE a.attrelid = i.indrelid AND a.attnum = ANY (i.indkey)) = "
+	                 "(SELECT pg_catalog.array_agg(k ORDER BY k) "
+	                 "FROM pg_catalog.unnest(ARRAY[",
+	                 relationId);
+	for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+	{
+		appendStringInfo(query, "%s%s", (keyIndex > 0) ? ", " : "",
+		                 quote_literal_cstr(keyColumns[keyIndex]));
+	}
+	appendStringInfoString(query, "]::pg_catalog.name[]) k) LIMIT 1");
+
+	if (SPI_execute(query->data, true, 1) != SPI_OK_SELECT)
+	{
+		elog(ERROR, "could not look up the unique keys of relation %u", relationId);
+	}
+
+	return (SPI_processed == 1);
 }
 
 
-/* mms_send converts mms to external binary format */
-Datum mms_send(PG_FUNCTION_ARGS)
+/*
+ * _appendSketchUpdateQuery appends the statement which adds the items of the
+ * given new rows to the sketches of their groups. New rows are a relation in the
+ * FROM clause. They are grouped by the key columns, and the sketch of each group
+ * is updated once with the array of its items, or inserted with the default
+ * parameters if the group has no sketch yet. If the key columns are a unique key,
+ * a sketch which was inserted concurrently is updated instead. Rows with a null
+ * key are skipped. The statement returns the number of rows it added.
+ */
+static void _appendSketchUpdateQuery(StringInfo query, const char* newRows,
+                                     const char* sketchTableName, const char* sketchColumn,
+                                     const char* itemColumn, char** keyColumns, int keyCount,
+                                     bool uniqueKey, const char* functionSchemaName)
 {
-	Datum datum = DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0));
+	const char* quotedSketchColumn = quote_identifier(sketchColumn);
+	const char* quotedSchemaName = quote_identifier(functionSchemaName);
+	StringInfo keyList = makeStringInfo();
+	StringInfo keyFilter = makeStringInfo();
+	StringInfo keyCondition = makeStringInfo();
+	StringInfo updatedKeyCondition = makeStringInfo();
+	StringInfo conflictKeyList = makeStringInfo();
+	StringInfo conflictKeyCondition = makeStringInfo();
+	StringInfo conflictClause = makeStringInfo();
+	int keyIndex = 0;
+
+	/* the key columns select the sketch of a group, and there may be none */
+	appendStringInfoString(keyFilter, "true");
+	appendStringInfoString(keyCondition, "true");
+	appendStringInfoString(updatedKeyCondition, "true");
+	for (keyIndex = 0; keyIndex < keyCount; keyIndex++)
+	{
+		const char* keyColumn = quote_identifier(keyColumns[keyIndex]);
+
+		appendStringInfo(keyList, "%s, ", keyColumn);
+		appendStringInfo(keyFilter, " AND %s IS NOT NULL", keyColumn);
+		appendStringInfo(keyCondition, " AND sketches.%s = new_items.%s",
+		                 keyColumn, keyColumn);
+		appendStringInfo(updatedKeyCondition, " AND updated_sketches.%s = new_items.%s",
+		                 keyColumn, keyColumn);
+		appendStringInfo(conflictKeyList, "%s%s", (keyIndex > 0) ? ", " : "", keyColumn);
+		appendStringInfo(conflictKeyCondition, " AND new_items.%s = excluded.%s",
+		                 keyColumn, keyColumn);
+	}
 
-	return datum;
+	/* the items of a conflicting group are added to the sketch which exists */
+	if (uniqueKey)
+	{
+		appendStringInfo(conflictClause,
+		                 "ON CONFLICT (%s) DO UPDATE SET %s = %s.cms_add_array(sketches.%s, "
+		                 "(SELECT new_items.items FROM new_items WHERE true%s)) ",
+		                 conflictKeyList->data, quotedSketchColumn, quotedSchemaName,
+		                 quotedSketchColumn, conflictKeyCondition->data);
+	}
+
+	appendStringInfo(query,
+	                 "WITH new_items AS ("
+	                 "SELECT %spg_catalog.array_agg(%s) AS items, pg_catalog.count(*) AS row_count "
+	                 "FROM %s WHERE %s GROUP BY %strue), "
+	                 "updated_sketches AS ("
+	                 "UPDATE %s sketches SET %s = %s.cms_add_array(sketches.%s, new_items.items) "
+	                 "FROM new_items WHERE %s RETURNING sketches.*), "
+	                 "inserted_sketches AS ("
+	                 "INSERT INTO %s AS sketches (%s%s) "
+	                 "SELECT %s%s.cms_add_array(%s.cms(), items) FROM new_items "
+	                 "WHERE NOT EXISTS (SELECT 1 FROM updated_sketches WHERE %s) "
+	                 "%sRETURNING 1) "
+	                 "SELECT COALESCE(pg_catalog.sum(row_count), 0)::pg_catalog.int8 "
+	                 "FROM new_items",
+	                 keyList->data, quote_identifier(itemColumn), newRows,
+	                 keyFilter->data, keyList->data,
+	                 sketchTableName, quotedSketchColumn, quotedSchemaName,
+	                 quotedSketchColumn, keyCondition->data,
+	                 sketchTableName, keyList->data, quotedSketchColumn,
+	                 keyList->data, quotedSchemaName,
+	                 quotedSchemaName, updatedKeyCondition->data, conflictClause->data);
 }
 
 
-/* 
- * mms is a user-facing UDF that creates a min-mask sketch structure
- * with given paramters. Note there is no top-n parameter for this function.
- * errorBound and confidenceInterval have default values so they are
- * optional parameters.
+/*
+ * _qualifiedRelationName returns the name of the given relation, qualified with
+ * its schema and quoted as needed.
  */
-Datum mms(PG_FUNCTION_ARGS)
+static char* _qualifiedRelationName(Oid relationId)
 {
-	float8 errorBound = PG_GETARG_FLOAT8(0);
-	float8 confidenceInterval =  PG_GETARG_FLOAT8(1);
+	char* relationName = get_rel_name(relationId);
 
-	MinMaskSketch* mms = _createMms(errorBound, confidenceInterval);
+	if (relationName == NULL)
+	{
+		ereport(ERROR, (errcode(ERRCODE_UNDEFINED_TABLE),
+		                errmsg("relation with OID %u does not exist", relationId)));
+	}
 
-	PG_RETURN_POINTER(mms);
+	return quote_qualified_identifier(get_namespace_name(get_rel_namespace(relationId)),
+	                                  relationName);
 }
 
 
 /*
- * mms_add is a user-facing UDF that adds an item to an existing min-mask sketch.
- * This function differs from the cms_add counter-part because it also needs the
- * new item's associated mask to add to the sketch.
+ * _readNameArray returns the names in the given name array as strings, and sets
+ * the number of names.
  */
-Datum mms_add(PG_FUNCTION_ARGS)
+static char** _readNameArray(ArrayType* nameArray, int* nameCount)
 {
-	MinMaskSketch* currentMms = NULL;
-	MinMaskSketch* updatedMms = NULL;
-	Datum newItem = 0;
-	TypeCacheEntry* newItemTypeCacheEntry = NULL;
-	Oid newItemType = InvalidOid;
-	uint32 newItemMask = 0;
+	Datum* nameDatums = NULL;
+	char** names = NULL;
+	int nameIndex = 0;
 
-	if (PG_ARGISNULL(0))
+	deconstruct_array(nameArray, NAMEOID, NAMEDATALEN, false, 'c',
+	                  &nameDatums, NULL, nameCount);
+
+	names = palloc0(sizeof(char*) * (*nameCount + 1));
+	for (nameIndex = 0; nameIndex < *nameCount; nameIndex++)
 	{
-		PG_RETURN_NULL();
+		names[nameIndex] = NameStr(*DatumGetName(nameDatums[nameIndex]));
 	}
-	else
+
+	return names;
+}
+
+
+/* ----- Rate limiter functionality ----- */
+
+
+/*
+ * cms_rate_check is a user-facing UDF which checks a call of the given key
+ * against the rate limiter of the given name in shared memory. It returns true
+ * and counts the call if the key made fewer calls than the given limit within
+ * the given window, and false otherwise. Calls which are rejected are not
+ * counted. Counts may be overestimated like the ones of a sliding-window
+ * sketch, so a key may be limited early but never late.
+ */
+Datum cms_rate_check(PG_FUNCTION_ARGS)
+{
+	char* limiterName = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int64 callLimit = PG_GETARG_INT64(2);
+	Interval* window = PG_GETARG_INTERVAL_P(3);
+	int64 windowLength = 0;
+	Datum key = 0;
+	TypeCacheEntry* keyTypeCacheEntry = NULL;
+	Oid keyType = InvalidOid;
+	StringInfo keyString = makeStringInfo();
+	uint64 hashValueArray[2] = {0, 0};
+	bool allowed = false;
+	instr_time startTime;
+
+	CmsStatBeginCall(CMS_STAT_CMS_RATE_CHECK);
+
+	if (callLimit < 0)
 	{
-		currentMms = (MinMaskSketch*) PG_GETARG_VARLENA_P(0);
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_rate_check"),
+		                errhint("Limit has to be zero or positive")));
 	}
 
-	if (PG_ARGISNULL(1))
+	/* months don't have a fixed length, so they count as 30 days like in epoch */
+	windowLength = window->time + (window->day + (int64) window->month * DAYS_PER_MONTH) *
+	               USECS_PER_DAY;
+	if (windowLength <= 0)
 	{
-		PG_RETURN_POINTER(currentMms);
+		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		                errmsg("invalid parameters for cms_rate_check"),
+		                errhint("Window has to be positive")));
 	}
 
-	newItemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
-	if (newItemType == InvalidOid)
+	keyType = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (keyType == InvalidOid)
 	{
 		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 		                errmsg("could not determine input data type")));
 	}
 
-	newItem = PG_GETARG_DATUM(1);
-	newItemTypeCacheEntry = lookup_type_cache(newItemType, 0);
+	keyTypeCacheEntry = lookup_type_cache(keyType, 0);
+	key = _detoastItem(PG_GETARG_DATUM(1), keyTypeCacheEntry);
 
-	newItemMask = PG_GETARG_INT64(2);
+	CmsStatTimerStart(&startTime);
+	_convertDatumToBytes(key, keyTypeCacheEntry, keyString);
+	CmsHashBytes(keyString->data, keyString->len, hashValueArray);
+	CmsStatTimerStop(&startTime, &CmsStatPending->hashTime);
 
-	updatedMms = _updateMms(currentMms, newItem, newItemTypeCacheEntry, newItemMask);
+	allowed = CmsLimiterCheck(limiterName, hashValueArray, callLimit, windowLength);
 
-	PG_RETURN_POINTER(updatedMms);
+	PG_RETURN_BOOL(allowed);
 }
 
 
-/* mms_get_mask is a user-facing UDF that retrieves the estimated mask of a given item. */
-Datum mms_get_mask(PG_FUNCTION_ARGS)
+/* ----- Column statistics functionality ----- */
+
+
+/*
+ * cms_eq_selectivity is a restriction selectivity estimator for equality
+ * operators, with the arguments of eqsel. If the column compared with a constant
+ * has a sketch in cms_column_statistics, the selectivity is the frequency
+ * estimate of the constant divided by the number of rows the sketch was built
+ * from. Unlike most common values lists, the sketch has an estimate for every
+ * value, so rare values of skewed columns aren't estimated from the average of
+ * all values which aren't common. Other clauses and columns are estimated by
+ * eqsel.
+ */
+Datum cms_eq_selectivity(PG_FUNCTION_ARGS)
 {
-	MinMaskSketch* mms = (MinMaskSketch*) PG_GETARG_VARLENA_P(0);
-	Datum item = PG_GETARG_DATUM(1);
-	Oid itemType = get_fn_expr_argtype(fcinfo->flinfo, 1);
-	TypeCacheEntry* itemTypeCacheEntry = NULL;
-	uint32 mask = 0;
+	PlannerInfo* root = (PlannerInfo*) PG_GETARG_POINTER(0);
+	List* arguments = (List*) PG_GETARG_POINTER(2);
+	int varRelid = PG_GETARG_INT32(3);
+	VariableStatData variableData;
+	Node* otherArgument = NULL;
+	bool variableOnLeft = false;
+	Var* columnVar = NULL;
+	Const* constant = NULL;
+	RangeTblEntry* rangeTableEntry = NULL;
+	TypeCacheEntry* constantTypeCacheEntry = NULL;
+	CmsColumnStatistics* columnStatistics = NULL;
+	uint64 frequency = 0;
+	float8 selectivity = 0.0;
 
-	if (itemType == InvalidOid)
+	CmsStatBeginCall(CMS_STAT_CMS_EQ_SELECTIVITY);
+
+	if (!get_restriction_variable(root, arguments, varRelid, &variableData,
+	                              &otherArgument, &variableOnLeft))
 	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-		                errmsg("could not determine input data types")));
+		return eqsel(fcinfo);
 	}
 
-	itemTypeCacheEntry = lookup_type_cache(itemType, 0);
-	mask = _mmsEstimateItemMask(mms, item, itemTypeCacheEntry);
+	/* Only plain table columns compared with constants of their type have sketches */
+	if (!IsA(variableData.var, Var) || !IsA(otherArgument, Const))
+	{
+		ReleaseVariableStats(variableData);
+		return eqsel(fcinfo);
+	}
 
-	PG_RETURN_INT64(mask);
-}
+	columnVar = (Var*) variableData.var;
+	constant = (Const*) otherArgument;
+	rangeTableEntry = planner_rt_fetch(columnVar->varno, root);
+	if (constant->constisnull || constant->consttype != columnVar->vartype ||
+	    columnVar->varattno <= 0 || rangeTableEntry->rtekind != RTE_RELATION)
+	{
+		ReleaseVariableStats(variableData);
+		return eqsel(fcinfo);
+	}
 
+	/* Look up the type first, loading it may invalidate cached sketches */
+	constantTypeCacheEntry = lookup_type_cache(constant->consttype, 0);
+	columnStatistics = _cmsColumnStatistics(rangeTableEntry->relid, columnVar->varattno,
+	                                        get_func_namespace(fcinfo->flinfo->fn_oid));
+	ReleaseVariableStats(variableData);
 
-/* 
- * _createMms creates a MinMaskSketch with given parameters. Its behavior is very similar
- * to the _createCms.
- */
-static MinMaskSketch* _createMms(float8 errorBound, float8 confidenceInterval)
-{
-	MinMaskSketch* mms = NULL;
-	uint32 sketchWidth = 0;
-	uint32 sketchDepth = 0;
-	Size staticStructSize = 0;
-	Size sketchSize = 0;
-	Size totalMmsSize = 0;
-	
-	if (errorBound <= 0 || errorBound >= 1)
+	if (columnStatistics->cms == NULL)
 	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-		                errmsg("invalid parameters for mms"),
-		                errhint("Error bound has to be between 0 and 1")));
+		return eqsel(fcinfo);
 	}
-	else if (confidenceInterval <= 0 || confidenceInterval >= 1)
+
+	if (columnStatistics->rowCount > 0)
 	{
-		ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-		                errmsg("invalid parameters for mms"),
-		                errhint("Confidence interval has to be between 0 and 1")));
+		frequency = _cmsEstimateItemFrequency(columnStatistics->cms, constant->constvalue,
+		                                      constantTypeCacheEntry);
+		selectivity = (float8) frequency / (float8) columnStatistics->rowCount;
 	}
 
-	sketchWidth = (uint32) ceil(exp(1) / errorBound);
-	sketchDepth = (uint32) ceil(log(1 / (1 - confidenceInterval)));
-	sketchSize =  sizeof(uint64) * sketchDepth * sketchWidth;
-	staticStructSize = sizeof(MinMaskSketch);
-	totalMmsSize = staticStructSize + sketchSize;
+	CLAMP_PROBABILITY(selectivity);
 
-	mms = palloc0(totalMmsSize);
-	mms->sketchDepth = sketchDepth;
-	mms->sketchWidth = sketchWidth;
+	PG_RETURN_FLOAT8(selectivity);
+}
 
-	SET_VARSIZE(mms, totalMmsSize);
 
-	return mms;
+/*
+ * cms_column_statistics_changed is the trigger of the cms_column_statistics table.
+ * It invalidates the relcache entries of the tables whose sketches are added,
+ * changed or removed, so every backend reads them again at its next estimate.
+ * Invalidations are sent when the transaction commits.
+ */
+Datum cms_column_statistics_changed(PG_FUNCTION_ARGS)
+{
+	TriggerData* triggerData = (TriggerData*) fcinfo->context;
+	TupleDesc statisticsTupleDescriptor = NULL;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+	{
+		ereport(ERROR, (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+		                errmsg("cms_column_statistics_changed: not called by trigger manager")));
+	}
+
+	statisticsTupleDescriptor = RelationGetDescr(triggerData->tg_relation);
+	_invalidateStatisticsRelation(triggerData->tg_trigtuple, statisticsTupleDescriptor);
+
+	if (TRIGGER_FIRED_BY_UPDATE(triggerData->tg_event))
+	{
+		_invalidateStatisticsRelation(triggerData->tg_newtuple, statisticsTupleDescriptor);
+	}
+
+	return PointerGetDatum(NULL);
 }
 
 
 /*
- * _updateMms is a helper function to add a new item to the min-mask sketch structure.
- * It differs from _updateCms in that it needs to accept the new item's bitmask to update
- * the sketch correctly.
+ * _cmsColumnStatistics returns the cached sketch of the given table column, and
+ * reads it from the cms_column_statistics table of the given schema if it isn't
+ * cached or was invalidated. The sketch is null if the column has none.
  */
-static MinMaskSketch* _updateMms(MinMaskSketch* currentMms, Datum newItem,
-              TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask)
+static CmsColumnStatistics* _cmsColumnStatistics(Oid relationId, AttrNumber attributeNumber,
+                                                 Oid namespaceId)
 {
-	MinMaskSketch* updatedMms = NULL;
-	Datum detoastedItem = 0;
-	// Oid newItemType = newItemTypeCacheEntry->type_id;
-	// Oid currentItemType = InvalidOid;
+	CmsColumnStatisticsKey statisticsKey;
+	CmsColumnStatistics* columnStatistics = NULL;
+	CountMinSketch* cms = NULL;
+	int64 rowCount = 0;
+	bool found = false;
 
-	/* TODO -- Check item type correctness */
+	if (ColumnStatisticsCache == NULL)
+	{
+		HASHCTL cacheInfo;
 
-	if (newItemTypeCacheEntry->typlen == -1)
+		memset(&cacheInfo, 0, sizeof(cacheInfo));
+		cacheInfo.keysize = sizeof(CmsColumnStatisticsKey);
+		cacheInfo.entrysize = sizeof(CmsColumnStatistics);
+		cacheInfo.hcxt = CacheMemoryContext;
+		ColumnStatisticsCache = hash_create("cms column statistics", 64, &cacheInfo,
+		                                    HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		CacheRegisterRelcacheCallback(_invalidateCmsColumnStatistics, (Datum) 0);
+	}
+
+	memset(&statisticsKey, 0, sizeof(statisticsKey));
+	statisticsKey.relationId = relationId;
+	statisticsKey.attributeNumber = attributeNumber;
+
+	columnStatistics = (CmsColumnStatistics*) hash_search(ColumnStatisticsCache,
+	                                                      &statisticsKey, HASH_FIND, NULL);
+	if (columnStatistics != NULL && columnStatistics->valid)
 	{
-		detoastedItem = PointerGetDatum(PG_DETOAST_DATUM(newItem));
+		return columnStatistics;
 	}
-	else
+
+	/*
+	 * Reading the table may process invalidations, so the entry is only created
+	 * or updated once the sketch is read.
+	 */
+	cms = _readCmsColumnStatistics(relationId, attributeNumber, namespaceId, &rowCount);
+
+	columnStatistics = (CmsColumnStatistics*) hash_search(ColumnStatisticsCache,
+	                                                      &statisticsKey, HASH_ENTER, &found);
+	if (found && columnStatistics->cms != NULL)
 	{
-		detoastedItem = newItem;
+		pfree(columnStatistics->cms);
 	}
 
-	newItemMask = _updateMmsInPlace(currentMms, detoastedItem,
-	                                       newItemTypeCacheEntry, newItemMask);
-	
-	updatedMms = currentMms;
+	columnStatistics->valid = true;
+	columnStatistics->rowCount = rowCount;
+	columnStatistics->cms = cms;
 
-	return updatedMms;
+	return columnStatistics;
 }
 
 
-/* 
- * _updateMmsInPlace updates the sketch inside the MinMaskSketch in-place by
- * adding the new item and returns the new mask for that item.
+/*
+ * _readCmsColumnStatistics reads the sketch of the given table column and the row
+ * count it was built from. The sketch is detoasted into CacheMemoryContext. It
+ * returns null if the column has no sketch. The table is read directly, like the
+ * planner reads pg_statistic, so estimates don't depend on the privileges of the
+ * user.
  */
-static uint64 _updateMmsInPlace(MinMaskSketch* mms, Datum newItem,
-                    TypeCacheEntry* newItemTypeCacheEntry, uint64 newItemMask)
+static CountMinSketch* _readCmsColumnStatistics(Oid relationId, AttrNumber attributeNumber,
+                                                Oid namespaceId, int64* rowCount)
 {
-	uint32 hashIndex = 0;
-	uint64 hashValueArray[2] = {0, 0};
-	StringInfo newItemString = makeStringInfo();
-	uint64 newMask = 0;
-	uint64 minMask = UINT64_MAX;
+	Oid statisticsTableId = get_relname_relid(STATISTICS_TABLE_NAME, namespaceId);
+	Relation statisticsTable = NULL;
+	SysScanDesc statisticsScan = NULL;
+	ScanKeyData scanKeys[2];
+	HeapTuple statisticsTuple = NULL;
+	CountMinSketch* cms = NULL;
 
-	_convertDatumToBytes(newItem, newItemTypeCacheEntry, newItemString);
-	MurmurHash3_x64_128(newItemString->data, newItemString->len, MURMUR_SEED,
-	                    &hashValueArray);
-	
-	minMask = _mmsEstimateHashedItemMask(mms, hashValueArray);
-	newMask = minMask | newItemMask;
-	
-	for (hashIndex = 0; hashIndex < mms->sketchDepth; hashIndex++)
+	if (!OidIsValid(statisticsTableId))
 	{
-		uint64 hashValue = hashValueArray[0] + (hashIndex * hashValueArray[1]);
-		uint32 widthIndex = hashValue % mms->sketchWidth;
-		uint32 depthOffset = hashIndex * mms->sketchWidth;
-		uint32 counterIndex = depthOffset + widthIndex;
-	
-		uint64 counterMask = mms->sketch[counterIndex];
-		if (_countSetBits(newMask) > _countSetBits(counterMask))
-		{
-			mms->sketch[counterIndex] = newMask;
-		}
+		return NULL;
 	}
 
-	return newMask;
+	statisticsTable = table_open(statisticsTableId, AccessShareLock);
+
+	ScanKeyInit(&scanKeys[0], STATISTICS_RELATION_COLUMN, BTEqualStrategyNumber,
+	            F_OIDEQ, ObjectIdGetDatum(relationId));
+	ScanKeyInit(&scanKeys[1], STATISTICS_ATTRIBUTE_COLUMN, BTEqualStrategyNumber,
+	            F_INT2EQ, Int16GetDatum(attributeNumber));
+	statisticsScan = systable_beginscan(statisticsTable, InvalidOid, false, NULL,
+	                                    2, scanKeys);
+
+	statisticsTuple = systable_getnext(statisticsScan);
+	if (HeapTupleIsValid(statisticsTuple))
+	{
+		TupleDesc statisticsTupleDescriptor = RelationGetDescr(statisticsTable);
+		MemoryContext oldContext = NULL;
+		Datum sketchDatum = 0;
+		bool isNull = false;
+
+		*rowCount = DatumGetInt64(heap_getattr(statisticsTuple, STATISTICS_ROW_COUNT_COLUMN,
+		                                       statisticsTupleDescriptor, &isNull));
+		sketchDatum = heap_getattr(statisticsTuple, STATISTICS_SKETCH_COLUMN,
+		                           statisticsTupleDescriptor, &isNull);
+
+		oldContext = MemoryContextSwitchTo(CacheMemoryContext);
+		cms = _checkCms((CountMinSketch*) CmsStatDetoastSketch(sketchDatum, true));
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	systable_endscan(statisticsScan);
+	table_close(statisticsTable, AccessShareLock);
+
+	return cms;
 }
 
 
-/* _mmsEstimateHashedItemMask gets the bitmask of an item from its hashed values. */
-static uint64 _mmsEstimateHashedItemMask(MinMaskSketch* mms, uint64* hashValueArray)
+/*
+ * _invalidateCmsColumnStatistics is the relcache callback of the sketch cache. It
+ * marks the sketches of the given table, or of all tables if no table is given,
+ * as invalid. Sketches aren't freed here, since an estimate may be using them.
+ */
+static void _invalidateCmsColumnStatistics(Datum argument, Oid relationId)
 {
-	uint32 hashIndex = 0;
-	uint64 minMask = UINT64_MAX;
+	HASH_SEQ_STATUS cacheScan;
+	CmsColumnStatistics* columnStatistics = NULL;
 
-	for (hashIndex = 0; hashIndex < mms->sketchDepth; hashIndex++)
+	hash_seq_init(&cacheScan, ColumnStatisticsCache);
+	while ((columnStatistics = (CmsColumnStatistics*) hash_seq_search(&cacheScan)) != NULL)
 	{
-		uint64 hashValue = hashValueArray[0] + (hashIndex * hashValueArray[1]);
-		uint32 widthIndex = hashValue % mms->sketchWidth;
-		uint32 depthOffset = hashIndex * mms->sketchWidth;
-		uint32 counterIndex = depthOffset + widthIndex;
-
-		uint64 counterMask = mms->sketch[counterIndex];
-		if (_countSetBits(counterMask) < _countSetBits(minMask))
+		if (!OidIsValid(relationId) || columnStatistics->key.relationId == relationId)
 		{
-			minMask = counterMask;
+			columnStatistics->valid = false;
 		}
 	}
-
-	return minMask;
 }
 
 
-/* _mmsEstimateItemMask estimates the bitmask value for the given item and returns the bitmask. */
-static uint64 _mmsEstimateItemMask(MinMaskSketch* mms, Datum item,
-                             TypeCacheEntry* itemTypeCacheEntry)
+/*
+ * _invalidateStatisticsRelation invalidates the relcache entry of the table of
+ * the given cms_column_statistics row, unless the table has been dropped.
+ */
+static void _invalidateStatisticsRelation(HeapTuple statisticsTuple,
+                                          TupleDesc statisticsTupleDescriptor)
 {
-	uint64 hashValueArray[2] = {0, 0};
-	StringInfo itemString = makeStringInfo();
-	uint64 mask = 0;
+	bool isNull = false;
+	Oid relationId = DatumGetObjectId(heap_getattr(statisticsTuple,
+	                                               STATISTICS_RELATION_COLUMN,
+	                                               statisticsTupleDescriptor, &isNull));
 
-	if (itemTypeCacheEntry->typlen == -1)
+	if (!isNull && SearchSysCacheExists1(RELOID, ObjectIdGetDatum(relationId)))
 	{
-		Datum detoastedItem =  PointerGetDatum(PG_DETOAST_DATUM(item));
-		_convertDatumToBytes(detoastedItem, itemTypeCacheEntry, itemString);
+		CacheInvalidateRelcacheByRelid(relationId);
 	}
-	else
+}
+
+
+/* ----- Utility functionality ----- */
+
+
+/*
+ * cms_simd_level is a user-facing UDF which returns the instruction set of the
+ * sketch kernels in use, after resolving auto to the detected level.
+ */
+Datum cms_simd_level(PG_FUNCTION_ARGS)
+{
+	const char* simdLevelName = CmsSimdLevelName(CmsActiveSimdLevel());
+
+	PG_RETURN_TEXT_P(CStringGetTextDatum(simdLevelName));
+}
+
+
+/* _checkSimdLevel rejects instruction sets which this CPU doesn't support. */
+static bool _checkSimdLevel(int* newValue, void** extra, GucSource source)
+{
+	if (*newValue != SIMD_LEVEL_AUTO && !CmsSimdLevelSupported(*newValue))
 	{
-		_convertDatumToBytes(item, itemTypeCacheEntry, itemString);
+		GUC_check_errdetail("Instruction set \"%s\" is not supported by this CPU.",
+		                    CmsSimdLevelName(*newValue));
+		return false;
 	}
-	
-	MurmurHash3_x64_128(itemString->data, itemString->len, MURMUR_SEED, &hashValueArray);
-	mask = _mmsEstimateHashedItemMask(mms, hashValueArray);
 
-	return mask;
+	return true;
 }
 
 
-/* _countSetBits counts the number of set bits (1's) in the given binary number and returns the count. */
-static uint64 _countSetBits(uint64 mask)
+/* _assignSimdLevel activates the sketch kernels of the new setting. */
+static void _assignSimdLevel(int newValue, void* extra)
 {
-	int count = 0;
-	while(mask)
+	if (newValue == SIMD_LEVEL_AUTO)
 	{
-		count += mask & 1;
-		mask >>= 1;
+		CmsSetSimdLevel(CmsDetectSimdLevel());
+	}
+	else
+	{
+		CmsSetSimdLevel(newValue);
 	}
-
-	return count;
 }
@@ -0,0 +1,78 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_probes.h
+ *
+ * Static trace points of the extension. Like PostgreSQL's own probes, they are
+ * compiled in only when the server was configured with --enable-dtrace, which
+ * defines ENABLE_DTRACE in pg_config.h. Otherwise every macro expands to
+ * nothing. The probes use the provider name cms_mms, so on Linux they can be
+ * listed and attached to with, for example:
+ *
+ *   bpftrace -l 'usdt:$libdir/cms_mms.so:cms_mms:*'
+ *
+ * Probes and their arguments:
+ *
+ *   add__start(depth, width, itemSize)
+ *   add__done(depth, width, itemSize, newFrequency)
+ *   estimate__start(depth, width, itemSize)
+ *   estimate__done(depth, width, itemSize, frequency)
+ *   union__start(depth, width)
+ *   union__done(depth, width)
+ *   detoast__start(storedSize)
+ *   detoast__done(storedSize, detoastedSize)
+ *   serialize__start(storedSize)
+ *   serialize__done(storedSize, outputSize)
+ *
+ * Dimensions are uint32, sizes are size_t and frequencies are uint64. Stored
+ * sizes are the sizes of values as they were passed in, which may still be
+ * compressed. Add, estimate and union probes cover count-min sketches, while
+ * serialize probes fire in the output and send functions of the cms, mms,
+ * cms_window, cms_dyadic and cms_prefix types.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_PROBES_H
+#define CMS_PROBES_H
+
+#ifdef ENABLE_DTRACE
+
+#include <sys/sdt.h>
+
+#define TRACE_CMS_MMS_ADD_START(depth, width, itemSize) \
+	DTRACE_PROBE3(cms_mms, add__start, depth, width, itemSize)
+#define TRACE_CMS_MMS_ADD_DONE(depth, width, itemSize, newFrequency) \
+	DTRACE_PROBE4(cms_mms, add__done, depth, width, itemSize, newFrequency)
+#define TRACE_CMS_MMS_ESTIMATE_START(depth, width, itemSize) \
+	DTRACE_PROBE3(cms_mms, estimate__start, depth, width, itemSize)
+#define TRACE_CMS_MMS_ESTIMATE_DONE(depth, width, itemSize, frequency) \
+	DTRACE_PROBE4(cms_mms, estimate__done, depth, width, itemSize, frequency)
+#define TRACE_CMS_MMS_UNION_START(depth, width) \
+	DTRACE_PROBE2(cms_mms, union__start, depth, width)
+#define TRACE_CMS_MMS_UNION_DONE(depth, width) \
+	DTRACE_PROBE2(cms_mms, union__done, depth, width)
+#define TRACE_CMS_MMS_DETOAST_START(storedSize) \
+	DTRACE_PROBE1(cms_mms, detoast__start, storedSize)
+#define TRACE_CMS_MMS_DETOAST_DONE(storedSize, detoastedSize) \
+	DTRACE_PROBE2(cms_mms, detoast__done, storedSize, detoastedSize)
+#define TRACE_CMS_MMS_SERIALIZE_START(storedSize) \
+	DTRACE_PROBE1(cms_mms, serialize__start, storedSize)
+#define TRACE_CMS_MMS_SERIALIZE_DONE(storedSize, outputSize) \
+	DTRACE_PROBE2(cms_mms, serialize__done, storedSize, outputSize)
+
+#else
+
+#define TRACE_CMS_MMS_ADD_START(depth, width, itemSize)
+#define TRACE_CMS_MMS_ADD_DONE(depth, width, itemSize, newFrequency)
+#define TRACE_CMS_MMS_ESTIMATE_START(depth, width, itemSize)
+#define TRACE_CMS_MMS_ESTIMATE_DONE(depth, width, itemSize, frequency)
+#define TRACE_CMS_MMS_UNION_START(depth, width)
+#define TRACE_CMS_MMS_UNION_DONE(depth, width)
+#define TRACE_CMS_MMS_DETOAST_START(storedSize)
+#define TRACE_CMS_MMS_DETOAST_DONE(storedSize, detoastedSize)
+#define TRACE_CMS_MMS_SERIALIZE_START(storedSize)
+#define TRACE_CMS_MMS_SERIALIZE_DONE(storedSize, outputSize)
+
+#endif /* ENABLE_DTRACE */
+
+#endif /* CMS_PROBES_H */
@@ -0,0 +1,106 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_rollup.c
+ *
+ * This file contains the background worker which compacts the rollups of
+ * cms_rollups.
+ *
+ * The worker calls cms_compact_rollups in a loop, one transaction per batch,
+ * while there are rows to fold, and sleeps for cms_mms.rollup_naptime once
+ * every rollup is compact. Batches are sized by cms_mms.rollup_batch_memory,
+ * and folded rows are locked with SKIP LOCKED, so the worker neither holds many
+ * locks for long nor waits for writers. The deleted rows are left to
+ * autovacuum, since VACUUM can't run inside the worker's transactions. The
+ * worker needs the extension to be loaded through shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include <limits.h>
+
+#include "miscadmin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+#include "cms_rollup.h"
+#include "cms_worker.h"
+
+
+/* GUC variables */
+bool CmsRollupWorkerEnabled = false;
+char *CmsRollupDatabaseName = NULL;
+int CmsRollupNaptime = 60;
+int CmsRollupBatchMemory = 65536;
+
+/* Local functions forward declarations */
+static char *_compactRollupsQuery(const char *schemaName);
+
+
+/*
+ * CmsRollupInit defines the settings of the rollup worker and, if the extension
+ * is being preloaded and the worker is enabled, registers it. It is called from
+ * _PG_init.
+ */
+void CmsRollupInit(void)
+{
+	DefineCustomBoolVariable("cms_mms.rollup_worker",
+	                         "Starts a background worker which compacts the "
+	                         "rollups of cms_rollups.",
+	                         NULL,
+	                         &CmsRollupWorkerEnabled, false,
+	                         PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomStringVariable("cms_mms.rollup_database",
+	                           "Sets the database the rollup worker connects to.",
+	                           NULL,
+	                           &CmsRollupDatabaseName, "postgres",
+	                           PGC_POSTMASTER, 0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.rollup_naptime",
+	                        "Sets the time the rollup worker sleeps once every "
+	                        "rollup is compact.",
+	                        NULL,
+	                        &CmsRollupNaptime, 60, 1, INT_MAX / 1000,
+	                        PGC_SIGHUP, GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable("cms_mms.rollup_batch_memory",
+	                        "Sets the memory the sketches of one batch of the "
+	                        "rollup worker may take.",
+	                        "Larger batches fold more rows per transaction, and "
+	                        "hold their locks for longer.",
+	                        &CmsRollupBatchMemory, 65536, 64, MAX_KILOBYTES,
+	                        PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+	if (!process_shared_preload_libraries_in_progress || !CmsRollupWorkerEnabled)
+	{
+		return;
+	}
+
+	CmsWorkerRegister("CmsRollupWorkerMain", "cms_mms rollup worker");
+}
+
+
+/*
+ * CmsRollupWorkerMain is the entry point of the rollup worker. It folds batches
+ * until no rollup has rows left to fold, then sleeps for the nap time or until
+ * its latch is set.
+ */
+void CmsRollupWorkerMain(Datum mainArg)
+{
+	CmsWorkerMain(CmsRollupDatabaseName, "compacting sketch rollups",
+	              _compactRollupsQuery, &CmsRollupNaptime, 1000L);
+}
+
+
+/*
+ * _compactRollupsQuery returns the query which calls cms_compact_rollups with the
+ * batch memory of the worker, and returns whether the call folded any rows.
+ */
+static char *_compactRollupsQuery(const char *schemaName)
+{
+	return psprintf("SELECT %s.cms_compact_rollups(%d) > 0", schemaName,
+	                CmsRollupBatchMemory);
+}
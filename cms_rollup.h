@@ -0,0 +1,28 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_rollup.h
+ *
+ * Declarations for the rollup worker of the extension. The worker folds
+ * fine-grained sketch rows into coarser rows of the same table in small batches,
+ * so sketch tables don't fill up with rows nobody queries at their grain.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_ROLLUP_H
+#define CMS_ROLLUP_H
+
+#include "fmgr.h"
+
+
+/* GUC variables */
+extern bool CmsRollupWorkerEnabled;
+extern char *CmsRollupDatabaseName;
+extern int CmsRollupNaptime;
+extern int CmsRollupBatchMemory;
+
+
+extern void CmsRollupInit(void);
+extern PGDLLEXPORT void CmsRollupWorkerMain(Datum mainArg);
+
+#endif /* CMS_ROLLUP_H */
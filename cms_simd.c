@@ -0,0 +1,409 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_simd.c
+ *
+ * This file contains runtime dispatch of the hot sketch kernels. Every kernel
+ * has a scalar implementation and vector implementations for SSE4.2, AVX2,
+ * AVX-512 and NEON, which are all compiled into the same binary. The best level
+ * the CPU supports is detected at runtime, and callers can force a lower level
+ * for testing.
+ *
+ * Item hashing stays on the scalar MurmurHash3 at every level, because hash
+ * values decide which counters an item maps to and are therefore part of the
+ * stored sketch format.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "cms_core.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CMS_HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define CMS_HAVE_NEON_KERNELS 1
+#endif
+
+
+/* CmsKernels keeps the implementation of every kernel for one level. */
+typedef struct CmsKernels
+{
+	void (*computeColumns)(const uint64_t *hashValueArrays, size_t itemCount,
+	                       uint32_t row, uint32_t width, uint32_t *columns);
+	void (*mergeCounters)(CmsCounter *targetCounters, const CmsCounter *sourceCounters,
+	                      size_t counterCount);
+	size_t (*countZeroCounters)(const CmsCounter *counters, size_t counterCount);
+	uint32_t (*countSetBits)(CmsCounter mask);
+	void (*minCounters)(CmsCounter *targetCounters, const CmsCounter *sourceCounters,
+	                    size_t counterCount);
+	CmsCounter (*sumCounters)(const CmsCounter *counters, size_t counterCount);
+	double (*dotCounters)(const CmsCounter *firstCounters,
+	                      const CmsCounter *secondCounters, size_t counterCount);
+} CmsKernels;
+
+
+static void _computeColumnsScalar(const uint64_t *hashValueArrays, size_t itemCount,
+                                  uint32_t row, uint32_t width, uint32_t *columns);
+static void _mergeCountersScalar(CmsCounter *targetCounters,
+                                 const CmsCounter *sourceCounters, size_t counterCount);
+static size_t _countZeroCountersScalar(const CmsCounter *counters, size_t counterCount);
+static uint32_t _countSetBitsScalar(CmsCounter mask);
+static void _minCountersScalar(CmsCounter *targetCounters,
+                               const CmsCounter *sourceCounters, size_t counterCount);
+static CmsCounter _sumCountersScalar(const CmsCounter *counters, size_t counterCount);
+static double _dotCountersScalar(const CmsCounter *firstCounters,
+                                 const CmsCounter *secondCounters, size_t counterCount);
+
+
+#ifdef CMS_HAVE_X86_KERNELS
+
+#define CMS_SIMD_SUFFIX Sse42
+#define CMS_SIMD_LANES 2
+#define CMS_SIMD_TARGET __attribute__((target("sse4.2,popcnt")))
+#include "cms_simd_template.h"
+
+#define CMS_SIMD_SUFFIX Avx2
+#define CMS_SIMD_LANES 4
+#define CMS_SIMD_TARGET __attribute__((target("avx2,popcnt")))
+#include "cms_simd_template.h"
+
+#define CMS_SIMD_SUFFIX Avx512
+#define CMS_SIMD_LANES 8
+#define CMS_SIMD_TARGET __attribute__((target("avx512f,avx512dq,popcnt")))
+#include "cms_simd_template.h"
+
+#endif
+
+#ifdef CMS_HAVE_NEON_KERNELS
+
+#define CMS_SIMD_SUFFIX Neon
+#define CMS_SIMD_LANES 2
+#define CMS_SIMD_TARGET
+#include "cms_simd_template.h"
+
+#endif
+
+
+static const CmsKernels ScalarKernels = {
+	_computeColumnsScalar, _mergeCountersScalar, _countZeroCountersScalar,
+	_countSetBitsScalar, _minCountersScalar, _sumCountersScalar,
+	_dotCountersScalar
+};
+
+#ifdef CMS_HAVE_X86_KERNELS
+static const CmsKernels Sse42Kernels = {
+	_computeColumnsSse42, _mergeCountersSse42, _countZeroCountersSse42,
+	_countSetBitsSse42, _minCountersSse42, _sumCountersSse42,
+	_dotCountersSse42
+};
+static const CmsKernels Avx2Kernels = {
+	_computeColumnsAvx2, _mergeCountersAvx2, _countZeroCountersAvx2,
+	_countSetBitsAvx2, _minCountersAvx2, _sumCountersAvx2,
+	_dotCountersAvx2
+};
+static const CmsKernels Avx512Kernels = {
+	_computeColumnsAvx512, _mergeCountersAvx512, _countZeroCountersAvx512,
+	_countSetBitsAvx512, _minCountersAvx512, _sumCountersAvx512,
+	_dotCountersAvx512
+};
+#endif
+
+#ifdef CMS_HAVE_NEON_KERNELS
+static const CmsKernels NeonKernels = {
+	_computeColumnsNeon, _mergeCountersNeon, _countZeroCountersNeon,
+	_countSetBitsNeon, _minCountersNeon, _sumCountersNeon,
+	_dotCountersNeon
+};
+#endif
+
+static const CmsKernels *ActiveKernels = &ScalarKernels;
+static CmsSimdLevel ActiveSimdLevel = CMS_SIMD_SCALAR;
+
+
+/*
+ * CmsDetectSimdLevel returns the best kernel level the CPU supports. Vector
+ * kernels work on 64-bit counters, so other counter types always use scalar
+ * kernels.
+ */
+CmsSimdLevel CmsDetectSimdLevel(void)
+{
+	if (sizeof(CmsCounter) != sizeof(uint64_t))
+	{
+		return CMS_SIMD_SCALAR;
+	}
+
+#if defined(CMS_HAVE_X86_KERNELS)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+	    __builtin_cpu_supports("popcnt"))
+	{
+		return CMS_SIMD_AVX512;
+	}
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	{
+		return CMS_SIMD_AVX2;
+	}
+	else if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+	{
+		return CMS_SIMD_SSE42;
+	}
+#elif defined(CMS_HAVE_NEON_KERNELS)
+	return CMS_SIMD_NEON;
+#endif
+
+	return CMS_SIMD_SCALAR;
+}
+
+
+/*
+ * CmsSimdLevelSupported returns whether kernels of the given level can run on
+ * this CPU. x86 levels are supersets of each other.
+ */
+int CmsSimdLevelSupported(CmsSimdLevel simdLevel)
+{
+	CmsSimdLevel detectedLevel = CmsDetectSimdLevel();
+
+	if (simdLevel == CMS_SIMD_SCALAR || simdLevel == detectedLevel)
+	{
+		return 1;
+	}
+	else if (simdLevel == CMS_SIMD_NEON || detectedLevel == CMS_SIMD_NEON)
+	{
+		return 0;
+	}
+
+	return simdLevel < detectedLevel;
+}
+
+
+/*
+ * CmsSetSimdLevel makes the kernels of the given level active for the process.
+ * It fails without changing anything if the CPU doesn't support the level.
+ */
+CmsStatus CmsSetSimdLevel(CmsSimdLevel simdLevel)
+{
+	const CmsKernels *kernels = &ScalarKernels;
+
+	if (!CmsSimdLevelSupported(simdLevel))
+	{
+		return CMS_UNSUPPORTED_SIMD_LEVEL;
+	}
+
+	switch (simdLevel)
+	{
+#ifdef CMS_HAVE_X86_KERNELS
+		case CMS_SIMD_SSE42: kernels = &Sse42Kernels; break;
+		case CMS_SIMD_AVX2: kernels = &Avx2Kernels; break;
+		case CMS_SIMD_AVX512: kernels = &Avx512Kernels; break;
+#endif
+#ifdef CMS_HAVE_NEON_KERNELS
+		case CMS_SIMD_NEON: kernels = &NeonKernels; break;
+#endif
+		default: kernels = &ScalarKernels; break;
+	}
+
+	ActiveKernels = kernels;
+	ActiveSimdLevel = simdLevel;
+
+	return CMS_OK;
+}
+
+
+/* CmsActiveSimdLevel returns the level of the active kernels. */
+CmsSimdLevel CmsActiveSimdLevel(void)
+{
+	return ActiveSimdLevel;
+}
+
+
+/* CmsSimdLevelName returns the name of the given level, as used by the GUC. */
+const char * CmsSimdLevelName(CmsSimdLevel simdLevel)
+{
+	switch (simdLevel)
+	{
+		case CMS_SIMD_SCALAR: return "scalar";
+		case CMS_SIMD_SSE42: return "sse4.2";
+		case CMS_SIMD_AVX2: return "avx2";
+		case CMS_SIMD_AVX512: return "avx512";
+		case CMS_SIMD_NEON: return "neon";
+	}
+
+	return "unknown";
+}
+
+
+/*
+ * CmsComputeColumns computes the column in the given row for a batch of items.
+ * The hash values of the items are stored as consecutive pairs.
+ */
+void CmsComputeColumns(const uint64_t *hashValueArrays, size_t itemCount, uint32_t row,
+                       uint32_t width, uint32_t *columns)
+{
+	ActiveKernels->computeColumns(hashValueArrays, itemCount, row, width, columns);
+}
+
+
+/*
+ * CmsMergeCounters adds the source counters to the target counters. Sums
+ * saturate at the largest counter value.
+ */
+void CmsMergeCounters(CmsCounter *targetCounters, const CmsCounter *sourceCounters,
+                      size_t counterCount)
+{
+	ActiveKernels->mergeCounters(targetCounters, sourceCounters, counterCount);
+}
+
+
+/* CmsCountZeroCounters returns the number of zero counters in the given array. */
+size_t CmsCountZeroCounters(const CmsCounter *counters, size_t counterCount)
+{
+	return ActiveKernels->countZeroCounters(counters, counterCount);
+}
+
+
+/*
+ * CmsMinCounters lowers every target counter to the corresponding source counter
+ * if the source counter is smaller.
+ */
+void CmsMinCounters(CmsCounter *targetCounters, const CmsCounter *sourceCounters,
+                    size_t counterCount)
+{
+	ActiveKernels->minCounters(targetCounters, sourceCounters, counterCount);
+}
+
+
+/*
+ * CmsSumCounters returns the sum of the given counters. The sum saturates at the
+ * largest counter value.
+ */
+CmsCounter CmsSumCounters(const CmsCounter *counters, size_t counterCount)
+{
+	return ActiveKernels->sumCounters(counters, counterCount);
+}
+
+
+/*
+ * CmsDotCounters returns the sum of the products of the corresponding counters.
+ * Products and the sum are computed in double precision, since they easily
+ * exceed the range of the counters.
+ */
+double CmsDotCounters(const CmsCounter *firstCounters, const CmsCounter *secondCounters,
+                      size_t counterCount)
+{
+	return ActiveKernels->dotCounters(firstCounters, secondCounters, counterCount);
+}
+
+
+/* MmsCountSetBits counts the number of set bits (1's) in the given mask. */
+uint32_t MmsCountSetBits(CmsCounter mask)
+{
+	return ActiveKernels->countSetBits(mask);
+}
+
+
+static void _computeColumnsScalar(const uint64_t *hashValueArrays, size_t itemCount,
+                                  uint32_t row, uint32_t width, uint32_t *columns)
+{
+	size_t itemIndex = 0;
+
+	for (itemIndex = 0; itemIndex < itemCount; itemIndex++)
+	{
+		columns[itemIndex] = CmsColumnIndex(hashValueArrays + 2 * itemIndex, row, width);
+	}
+}
+
+
+static void _mergeCountersScalar(CmsCounter *targetCounters,
+                                 const CmsCounter *sourceCounters, size_t counterCount)
+{
+	size_t counterIndex = 0;
+
+	for (counterIndex = 0; counterIndex < counterCount; counterIndex++)
+	{
+		CmsCounter targetCounter = targetCounters[counterIndex];
+		CmsCounter mergedCounter = targetCounter + sourceCounters[counterIndex];
+
+		if (mergedCounter < targetCounter)
+		{
+			mergedCounter = CMS_COUNTER_MAX;
+		}
+
+		targetCounters[counterIndex] = mergedCounter;
+	}
+}
+
+
+static size_t _countZeroCountersScalar(const CmsCounter *counters, size_t counterCount)
+{
+	size_t zeroCount = 0;
+	size_t counterIndex = 0;
+
+	for (counterIndex = 0; counterIndex < counterCount; counterIndex++)
+	{
+		zeroCount += (counters[counterIndex] == 0);
+	}
+
+	return zeroCount;
+}
+
+
+static uint32_t _countSetBitsScalar(CmsCounter mask)
+{
+	uint32_t count = 0;
+	while (mask)
+	{
+		count += mask & 1;
+		mask >>= 1;
+	}
+
+	return count;
+}
+
+
+static void _minCountersScalar(CmsCounter *targetCounters,
+                               const CmsCounter *sourceCounters, size_t counterCount)
+{
+	size_t counterIndex = 0;
+
+	for (counterIndex = 0; counterIndex < counterCount; counterIndex++)
+	{
+		if (sourceCounters[counterIndex] < targetCounters[counterIndex])
+		{
+			targetCounters[counterIndex] = sourceCounters[counterIndex];
+		}
+	}
+}
+
+
+static CmsCounter _sumCountersScalar(const CmsCounter *counters, size_t counterCount)
+{
+	CmsCounter sum = 0;
+	size_t counterIndex = 0;
+
+	for (counterIndex = 0; counterIndex < counterCount; counterIndex++)
+	{
+		CmsCounter newSum = sum + counters[counterIndex];
+
+		sum = (newSum < sum) ? CMS_COUNTER_MAX : newSum;
+	}
+
+	return sum;
+}
+
+
+static double _dotCountersScalar(const CmsCounter *firstCounters,
+                                 const CmsCounter *secondCounters, size_t counterCount)
+{
+	double sum = 0.0;
+	size_t counterIndex = 0;
+
+	for (counterIndex = 0; counterIndex < counterCount; counterIndex++)
+	{
+		sum += (double) firstCounters[counterIndex] * (double) secondCounters[counterIndex];
+	}
+
+	return sum;
+}
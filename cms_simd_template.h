@@ -0,0 +1,264 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_simd_template.h
+ *
+ * Vector implementations of the sketch kernels. They are written with GCC
+ * vector extensions, so the same code is compiled once per instruction set and
+ * the compiler picks the instructions for each target. Like PostgreSQL's
+ * simplehash.h, this file is included several times after defining:
+ *
+ *   CMS_SIMD_SUFFIX   suffix of the generated function names
+ *   CMS_SIMD_LANES    number of 64-bit lanes in a vector
+ *   CMS_SIMD_TARGET   function attribute selecting the instruction set
+ *
+ * All of them are undefined at the end of the file. The kernels assume 64-bit
+ * counters; the dispatcher only selects them in that case.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#define CMS_SIMD_NAME(name) CMS_SIMD_NAME_EXPAND(name, CMS_SIMD_SUFFIX)
+#define CMS_SIMD_NAME_EXPAND(name, suffix) CMS_SIMD_NAME_CONCAT(name, suffix)
+#define CMS_SIMD_NAME_CONCAT(name, suffix) name##suffix
+
+#define CmsUint64Vector CMS_SIMD_NAME(CmsUint64Vector)
+#define CmsInt64Vector CMS_SIMD_NAME(CmsInt64Vector)
+#define CmsFloat64Vector CMS_SIMD_NAME(CmsFloat64Vector)
+
+typedef uint64_t CmsUint64Vector __attribute__((vector_size(CMS_SIMD_LANES * 8)));
+typedef int64_t CmsInt64Vector __attribute__((vector_size(CMS_SIMD_LANES * 8)));
+typedef double CmsFloat64Vector __attribute__((vector_size(CMS_SIMD_LANES * 8)));
+
+
+/*
+ * Computes the column of every item in the given row. Vector units have no
+ * 64-bit integer division, so the hash value is reduced 16 bits at a time with
+ * double precision arithmetic. Every intermediate value stays below 2^49 and is
+ * exact; the rounded quotient can be off by one, which the two corrections fix.
+ * The result is identical to the scalar modulo.
+ */
+CMS_SIMD_TARGET static void
+CMS_SIMD_NAME(_computeColumns)(const uint64_t *hashValueArrays, size_t itemCount,
+                               uint32_t row, uint32_t width, uint32_t *columns)
+{
+	const double widthValue = (double) width;
+	const CmsFloat64Vector zeroVector = {0};
+	const CmsFloat64Vector widthVector = zeroVector + widthValue;
+	size_t itemIndex = 0;
+
+	for (; itemIndex + CMS_SIMD_LANES <= itemCount; itemIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector firstHash;
+		CmsUint64Vector secondHash;
+		CmsUint64Vector hashValue;
+		CmsFloat64Vector remainder = zeroVector;
+		int lane = 0;
+		int shift = 0;
+
+		for (lane = 0; lane < CMS_SIMD_LANES; lane++)
+		{
+			firstHash[lane] = hashValueArrays[2 * (itemIndex + lane)];
+			secondHash[lane] = hashValueArrays[2 * (itemIndex + lane) + 1];
+		}
+
+		hashValue = firstHash + secondHash * (uint64_t) row;
+
+		for (shift = 48; shift >= 0; shift -= 16)
+		{
+			CmsUint64Vector chunk = (hashValue >> shift) & 0xFFFF;
+			CmsFloat64Vector value = remainder * 65536.0 +
+			                         __builtin_convertvector(chunk, CmsFloat64Vector);
+			CmsInt64Vector quotient = __builtin_convertvector(value / widthValue,
+			                                                  CmsInt64Vector);
+			CmsInt64Vector tooSmall;
+			CmsInt64Vector tooLarge;
+
+			remainder = value - __builtin_convertvector(quotient, CmsFloat64Vector) *
+			                    widthValue;
+
+			/* comparisons return -1 for true lanes */
+			tooSmall = -(remainder < zeroVector);
+			remainder += __builtin_convertvector(tooSmall, CmsFloat64Vector) * widthVector;
+			tooLarge = -(remainder >= widthVector);
+			remainder -= __builtin_convertvector(tooLarge, CmsFloat64Vector) * widthVector;
+		}
+
+		for (lane = 0; lane < CMS_SIMD_LANES; lane++)
+		{
+			columns[itemIndex + lane] = (uint32_t) remainder[lane];
+		}
+	}
+
+	_computeColumnsScalar(hashValueArrays + 2 * itemIndex, itemCount - itemIndex, row,
+	                      width, columns + itemIndex);
+}
+
+
+/* Adds the source counters to the target counters with saturation. */
+CMS_SIMD_TARGET static void
+CMS_SIMD_NAME(_mergeCounters)(CmsCounter *targetCounters,
+                              const CmsCounter *sourceCounters, size_t counterCount)
+{
+	size_t counterIndex = 0;
+
+	for (; counterIndex + CMS_SIMD_LANES <= counterCount; counterIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector targetVector;
+		CmsUint64Vector sourceVector;
+		CmsUint64Vector mergedVector;
+
+		memcpy(&targetVector, targetCounters + counterIndex, sizeof(targetVector));
+		memcpy(&sourceVector, sourceCounters + counterIndex, sizeof(sourceVector));
+
+		/* lanes which wrapped around are smaller than before and become all ones */
+		mergedVector = targetVector + sourceVector;
+		mergedVector |= (CmsUint64Vector) (mergedVector < targetVector);
+
+		memcpy(targetCounters + counterIndex, &mergedVector, sizeof(mergedVector));
+	}
+
+	_mergeCountersScalar(targetCounters + counterIndex, sourceCounters + counterIndex,
+	                     counterCount - counterIndex);
+}
+
+
+/* Returns the number of counters which are zero. */
+CMS_SIMD_TARGET static size_t
+CMS_SIMD_NAME(_countZeroCounters)(const CmsCounter *counters, size_t counterCount)
+{
+	const CmsUint64Vector zeroVector = {0};
+	CmsInt64Vector zeroCounts = {0};
+	size_t zeroCount = 0;
+	size_t counterIndex = 0;
+	int lane = 0;
+
+	for (; counterIndex + CMS_SIMD_LANES <= counterCount; counterIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector counterVector;
+
+		memcpy(&counterVector, counters + counterIndex, sizeof(counterVector));
+		zeroCounts -= (counterVector == zeroVector);
+	}
+
+	for (lane = 0; lane < CMS_SIMD_LANES; lane++)
+	{
+		zeroCount += (size_t) zeroCounts[lane];
+	}
+
+	return zeroCount + _countZeroCountersScalar(counters + counterIndex,
+	                                            counterCount - counterIndex);
+}
+
+
+/* Counts set bits with the population count instruction of the target. */
+CMS_SIMD_TARGET static uint32_t
+CMS_SIMD_NAME(_countSetBits)(CmsCounter mask)
+{
+	return (uint32_t) __builtin_popcountll((unsigned long long) mask);
+}
+
+
+/* Lowers the target counters to the source counters where those are smaller. */
+CMS_SIMD_TARGET static void
+CMS_SIMD_NAME(_minCounters)(CmsCounter *targetCounters,
+                            const CmsCounter *sourceCounters, size_t counterCount)
+{
+	size_t counterIndex = 0;
+
+	for (; counterIndex + CMS_SIMD_LANES <= counterCount; counterIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector targetVector;
+		CmsUint64Vector sourceVector;
+		CmsUint64Vector smallerMask;
+
+		memcpy(&targetVector, targetCounters + counterIndex, sizeof(targetVector));
+		memcpy(&sourceVector, sourceCounters + counterIndex, sizeof(sourceVector));
+
+		/* comparisons return all ones for true lanes, so the mask selects lanes */
+		smallerMask = (CmsUint64Vector) (sourceVector < targetVector);
+		targetVector = (sourceVector & smallerMask) | (targetVector & ~smallerMask);
+
+		memcpy(targetCounters + counterIndex, &targetVector, sizeof(targetVector));
+	}
+
+	_minCountersScalar(targetCounters + counterIndex, sourceCounters + counterIndex,
+	                   counterCount - counterIndex);
+}
+
+
+/* Returns the sum of the counters, saturating at the largest value. */
+CMS_SIMD_TARGET static CmsCounter
+CMS_SIMD_NAME(_sumCounters)(const CmsCounter *counters, size_t counterCount)
+{
+	CmsUint64Vector sumVector = {0};
+	CmsUint64Vector saturatedVector = {0};
+	CmsCounter sum = 0;
+	CmsCounter laneSum = 0;
+	size_t counterIndex = 0;
+	int lane = 0;
+
+	for (; counterIndex + CMS_SIMD_LANES <= counterCount; counterIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector counterVector;
+
+		memcpy(&counterVector, counters + counterIndex, sizeof(counterVector));
+
+		/* lanes which wrapped around once stay all ones */
+		sumVector += counterVector;
+		saturatedVector |= (CmsUint64Vector) (sumVector < counterVector);
+	}
+
+	sumVector |= saturatedVector;
+	sum = _sumCountersScalar(counters + counterIndex, counterCount - counterIndex);
+
+	for (lane = 0; lane < CMS_SIMD_LANES; lane++)
+	{
+		laneSum = sum + sumVector[lane];
+		sum = (laneSum < sum) ? CMS_COUNTER_MAX : laneSum;
+	}
+
+	return sum;
+}
+
+
+/* Returns the sum of the products of the counters in double precision. */
+CMS_SIMD_TARGET static double
+CMS_SIMD_NAME(_dotCounters)(const CmsCounter *firstCounters,
+                            const CmsCounter *secondCounters, size_t counterCount)
+{
+	CmsFloat64Vector sumVector = {0};
+	double sum = 0.0;
+	size_t counterIndex = 0;
+	int lane = 0;
+
+	for (; counterIndex + CMS_SIMD_LANES <= counterCount; counterIndex += CMS_SIMD_LANES)
+	{
+		CmsUint64Vector firstVector;
+		CmsUint64Vector secondVector;
+
+		memcpy(&firstVector, firstCounters + counterIndex, sizeof(firstVector));
+		memcpy(&secondVector, secondCounters + counterIndex, sizeof(secondVector));
+
+		sumVector += __builtin_convertvector(firstVector, CmsFloat64Vector) *
+		             __builtin_convertvector(secondVector, CmsFloat64Vector);
+	}
+
+	for (lane = 0; lane < CMS_SIMD_LANES; lane++)
+	{
+		sum += sumVector[lane];
+	}
+
+	return sum + _dotCountersScalar(firstCounters + counterIndex,
+	                                secondCounters + counterIndex,
+	                                counterCount - counterIndex);
+}
+
+#undef CmsUint64Vector
+#undef CmsInt64Vector
+#undef CmsFloat64Vector
+#undef CMS_SIMD_NAME
+#undef CMS_SIMD_NAME_EXPAND
+#undef CMS_SIMD_NAME_CONCAT
+#undef CMS_SIMD_SUFFIX
+#undef CMS_SIMD_LANES
+#undef CMS_SIMD_TARGET
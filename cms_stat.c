@@ -0,0 +1,439 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_stat.c
+ *
+ * This file contains the runtime counters of the extension and the functions
+ * behind the pg_stat_cms view.
+ *
+ * Entry points only touch counters which are local to the backend, so counting
+ * needs no locks. The local counters are added to shared memory when the
+ * transaction ends, similar to how the cumulative statistics system collects
+ * table counters. Shared memory is only available when the extension is loaded
+ * through shared_preload_libraries; otherwise the view shows the counters of the
+ * current backend.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "access/xact.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+#include "cms_cache.h"
+#include "cms_probes.h"
+#include "cms_stat.h"
+
+
+/* CmsStatSharedState keeps the counters of all backends in shared memory. */
+typedef struct CmsStatSharedState
+{
+	LWLock *lock;
+	CmsStatCounters counters[CMS_STAT_FUNCTION_COUNT];
+} CmsStatSharedState;
+
+/* Names of the entry points as shown in the view, in CmsStatFunction order */
+static const char *const CmsStatFunctionNames[CMS_STAT_FUNCTION_COUNT] = {
+	"cms",
+	"cms_add",
+	"cms_add_agg",
+	"cms_add_array",
+	"cms_dyadic",
+	"cms_dyadic_add",
+	"cms_dyadic_agg",
+	"cms_eq_selectivity",
+	"cms_fold",
+	"cms_get_frequency",
+	"cms_hhh",
+	"cms_increment",
+	"cms_inner_product",
+	"cms_linear_agg",
+	"cms_prefix",
+	"cms_prefix_add",
+	"cms_prefix_agg",
+	"cms_prefix_get_frequency",
+	"cms_prewarm",
+	"cms_quantile",
+	"cms_range_frequency",
+	"cms_rate_check",
+	"cms_subtract",
+	"cms_top_k",
+	"cms_union",
+	"cms_union_agg",
+	"cms_window",
+	"cms_window_add",
+	"cms_window_advance",
+	"cms_window_get_frequency",
+	"mms",
+	"mms_add",
+	"mms_get_mask"
+};
+
+/* GUC variables */
+bool CmsTrackTiming = false;
+
+/* Counters of this backend which are not yet added to the totals */
+static CmsStatCounters PendingCounters[CMS_STAT_FUNCTION_COUNT];
+static bool HavePendingCounters = false;
+CmsStatCounters *CmsStatPending = &PendingCounters[CMS_STAT_CMS];
+
+/* Totals of this backend, used when there is no shared memory */
+static CmsStatCounters LocalCounters[CMS_STAT_FUNCTION_COUNT];
+
+static CmsStatSharedState *SharedState = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type PreviousShmemRequestHook = NULL;
+#endif
+static shmem_startup_hook_type PreviousShmemStartupHook = NULL;
+
+/* Local functions forward declarations */
+static void _requestSharedMemory(void);
+static void _initSharedMemory(void);
+static void _flushPendingCounters(XactEvent event, void *argument);
+static void _addCounters(CmsStatCounters *targetCounters,
+                         const CmsStatCounters *sourceCounters);
+
+/* Declarations for dynamic loading */
+PG_FUNCTION_INFO_V1(pg_stat_cms);
+PG_FUNCTION_INFO_V1(pg_stat_cms_reset);
+
+
+/*
+ * CmsStatInit defines the settings of the counters and, if the extension is
+ * being preloaded, requests shared memory for them. It is called from _PG_init.
+ */
+void CmsStatInit(void)
+{
+	DefineCustomBoolVariable("cms_mms.track_timing",
+	                         "Collects time spent in sketch hashing, updates and estimates.",
+	                         "Reading the clock for every item adds noticeable "
+	                         "overhead on some platforms, so timing is off by default.",
+	                         &CmsTrackTiming, false, PGC_SUSET, 0, NULL, NULL, NULL);
+
+	RegisterXactCallback(_flushPendingCounters, NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+	{
+		return;
+	}
+
+#if PG_VERSION_NUM >= 150000
+	PreviousShmemRequestHook = shmem_request_hook;
+	shmem_request_hook = _requestSharedMemory;
+#else
+	_requestSharedMemory();
+#endif
+
+	PreviousShmemStartupHook = shmem_startup_hook;
+	shmem_startup_hook = _initSharedMemory;
+}
+
+
+/*
+ * CmsStatBeginCall counts a call of the given entry point and makes its counters
+ * the ones the following sketch operations are added to.
+ */
+void CmsStatBeginCall(CmsStatFunction function)
+{
+	CmsStatPending = &PendingCounters[function];
+	CmsStatPending->calls++;
+	HavePendingCounters = true;
+}
+
+
+/*
+ * CmsStatDetoastSketch detoasts the given sketch like PG_DETOAST_DATUM or
+ * PG_DETOAST_DATUM_COPY, and counts its size if it had to be decompressed or
+ * fetched from out-of-line storage. Sketches stored out of line are copied from
+ * the shared cache if they are cached there, and added to it otherwise.
+ */
+struct varlena * CmsStatDetoastSketch(Datum datum, bool copy)
+{
+	struct varlena *rawValue = (struct varlena *) DatumGetPointer(datum);
+	struct varlena *value = NULL;
+	bool isToasted = VARATT_IS_COMPRESSED(rawValue) || VARATT_IS_EXTERNAL(rawValue);
+
+	value = CmsCacheLookup(rawValue);
+	if (value != NULL)
+	{
+		return value;
+	}
+
+	if (isToasted)
+	{
+		TRACE_CMS_MMS_DETOAST_START((size_t) VARSIZE_ANY(rawValue));
+	}
+
+	if (copy)
+	{
+		value = PG_DETOAST_DATUM_COPY(datum);
+	}
+	else
+	{
+		value = PG_DETOAST_DATUM(datum);
+	}
+
+	if (isToasted)
+	{
+		CmsStatPending->detoastedBytes += VARSIZE(value);
+		TRACE_CMS_MMS_DETOAST_DONE((size_t) VARSIZE_ANY(rawValue),
+		                           (size_t) VARSIZE(value));
+
+		CmsCacheInsert(rawValue, value);
+	}
+
+	return value;
+}
+
+
+/*
+ * CmsStatDetoastItem detoasts the given item like PG_DETOAST_DATUM, and counts
+ * its size if it had to be decompressed or fetched from out-of-line storage.
+ * Items are never cached, since the cache only holds sketches.
+ */
+struct varlena * CmsStatDetoastItem(Datum datum)
+{
+	struct varlena *rawValue = (struct varlena *) DatumGetPointer(datum);
+	struct varlena *value = NULL;
+	bool isToasted = VARATT_IS_COMPRESSED(rawValue) || VARATT_IS_EXTERNAL(rawValue);
+
+	if (!isToasted)
+	{
+		return PG_DETOAST_DATUM(datum);
+	}
+
+	TRACE_CMS_MMS_DETOAST_START((size_t) VARSIZE_ANY(rawValue));
+
+	value = PG_DETOAST_DATUM(datum);
+	CmsStatPending->detoastedBytes += VARSIZE(value);
+
+	TRACE_CMS_MMS_DETOAST_DONE((size_t) VARSIZE_ANY(rawValue), (size_t) VARSIZE(value));
+
+	return value;
+}
+
+
+/*
+ * CmsStatReturnSketch counts the size of a sketch which is returned to be stored.
+ * These are the bytes the server compresses or moves out of line when the sketch
+ * is written to a table.
+ */
+Datum CmsStatReturnSketch(void *sketch)
+{
+	CmsStatPending->toastBytes += VARSIZE(sketch);
+
+	return PointerGetDatum(sketch);
+}
+
+
+/*
+ * pg_stat_cms returns one row with the counters of every entry point. It first
+ * flushes the counters of the current backend, so they include the current
+ * transaction.
+ */
+Datum pg_stat_cms(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *functionContext = NULL;
+	CmsStatCounters *counters = NULL;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldContext = NULL;
+		TupleDesc tupleDescriptor = NULL;
+
+		functionContext = SRF_FIRSTCALL_INIT();
+		oldContext = MemoryContextSwitchTo(functionContext->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupleDescriptor) != TYPEFUNC_COMPOSITE)
+		{
+			ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			                errmsg("function returning record called in context "
+			                       "that cannot accept type record")));
+		}
+
+		_flushPendingCounters(XACT_EVENT_COMMIT, NULL);
+
+		/* take a snapshot, so all rows show the same point in time */
+		counters = palloc(sizeof(CmsStatCounters) * CMS_STAT_FUNCTION_COUNT);
+		if (SharedState != NULL)
+		{
+			LWLockAcquire(SharedState->lock, LW_SHARED);
+			memcpy(counters, SharedState->counters,
+			       sizeof(CmsStatCounters) * CMS_STAT_FUNCTION_COUNT);
+			LWLockRelease(SharedState->lock);
+		}
+		else
+		{
+			memcpy(counters, LocalCounters,
+			       sizeof(CmsStatCounters) * CMS_STAT_FUNCTION_COUNT);
+		}
+
+		functionContext->tuple_desc = BlessTupleDesc(tupleDescriptor);
+		functionContext->user_fctx = counters;
+		functionContext->max_calls = CMS_STAT_FUNCTION_COUNT;
+
+		MemoryContextSwitchTo(oldContext);
+	}
+
+	functionContext = SRF_PERCALL_SETUP();
+	counters = (CmsStatCounters *) functionContext->user_fctx;
+
+	if (functionContext->call_cntr < functionContext->max_calls)
+	{
+		uint64 functionIndex = functionContext->call_cntr;
+		CmsStatCounters *functionCounters = &counters[functionIndex];
+		HeapTuple statTuple = NULL;
+		Datum values[10];
+		bool nulls[10] = {false, false, false, false, false,
+		                  false, false, false, false, false};
+
+		values[0] = CStringGetTextDatum(CmsStatFunctionNames[functionIndex]);
+		values[1] = Int64GetDatum((int64) functionCounters->calls);
+		values[2] = Int64GetDatum((int64) functionCounters->items);
+		values[3] = Int64GetDatum((int64) functionCounters->detoastedBytes);
+		values[4] = Int64GetDatum((int64) functionCounters->toastBytes);
+		values[5] = Int64GetDatum((int64) functionCounters->unions);
+		values[6] = Int64GetDatum((int64) functionCounters->unionBytes);
+		values[7] = Float8GetDatum(functionCounters->hashTime);
+		values[8] = Float8GetDatum(functionCounters->updateTime);
+		values[9] = Float8GetDatum(functionCounters->estimateTime);
+
+		statTuple = heap_form_tuple(functionContext->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(functionContext, HeapTupleGetDatum(statTuple));
+	}
+
+	SRF_RETURN_DONE(functionContext);
+}
+
+
+/*
+ * pg_stat_cms_reset sets all counters to zero. Counters which other backends
+ * haven't flushed yet are added after the reset.
+ */
+Datum pg_stat_cms_reset(PG_FUNCTION_ARGS)
+{
+	memset(PendingCounters, 0, sizeof(PendingCounters));
+	HavePendingCounters = false;
+
+	if (SharedState != NULL)
+	{
+		LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+		memset(SharedState->counters, 0, sizeof(SharedState->counters));
+		LWLockRelease(SharedState->lock);
+	}
+	else
+	{
+		memset(LocalCounters, 0, sizeof(LocalCounters));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/* _requestSharedMemory reserves shared memory and a lock for the counters. */
+static void _requestSharedMemory(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (PreviousShmemRequestHook != NULL)
+	{
+		PreviousShmemRequestHook();
+	}
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(CmsStatSharedState)));
+	RequestNamedLWLockTranche("cms_mms statistics", 1);
+}
+
+
+/*
+ * _initSharedMemory attaches to the shared counters, and initializes them if
+ * this is the first process to do so.
+ */
+static void _initSharedMemory(void)
+{
+	bool found = false;
+
+	if (PreviousShmemStartupHook != NULL)
+	{
+		PreviousShmemStartupHook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	SharedState = ShmemInitStruct("cms_mms statistics", sizeof(CmsStatSharedState),
+	                              &found);
+	if (!found)
+	{
+		SharedState->lock = &(GetNamedLWLockTranche("cms_mms statistics"))->lock;
+		memset(SharedState->counters, 0, sizeof(SharedState->counters));
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * _flushPendingCounters adds the counters of this backend to the totals when a
+ * transaction ends. Work done by aborted transactions is counted as well.
+ */
+static void _flushPendingCounters(XactEvent event, void *argument)
+{
+	CmsStatCounters *totalCounters = LocalCounters;
+	int functionIndex = 0;
+
+	if (!HavePendingCounters)
+	{
+		return;
+	}
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT &&
+	    event != XACT_EVENT_PARALLEL_COMMIT && event != XACT_EVENT_PARALLEL_ABORT)
+	{
+		return;
+	}
+
+	/* adding all entry points takes too long to hold a spinlock */
+	if (SharedState != NULL)
+	{
+		LWLockAcquire(SharedState->lock, LW_EXCLUSIVE);
+		totalCounters = SharedState->counters;
+	}
+
+	for (functionIndex = 0; functionIndex < CMS_STAT_FUNCTION_COUNT; functionIndex++)
+	{
+		_addCounters(&totalCounters[functionIndex], &PendingCounters[functionIndex]);
+	}
+
+	if (SharedState != NULL)
+	{
+		LWLockRelease(SharedState->lock);
+	}
+
+	memset(PendingCounters, 0, sizeof(PendingCounters));
+	HavePendingCounters = false;
+}
+
+
+/* _addCounters adds the source counters to the target counters. */
+static void _addCounters(CmsStatCounters *targetCounters,
+                         const CmsStatCounters *sourceCounters)
+{
+	targetCounters->calls += sourceCounters->calls;
+	targetCounters->items += sourceCounters->items;
+	targetCounters->detoastedBytes += sourceCounters->detoastedBytes;
+	targetCounters->toastBytes += sourceCounters->toastBytes;
+	targetCounters->unions += sourceCounters->unions;
+	targetCounters->unionBytes += sourceCounters->unionBytes;
+	targetCounters->hashTime += sourceCounters->hashTime;
+	targetCounters->updateTime += sourceCounters->updateTime;
+	targetCounters->estimateTime += sourceCounters->estimateTime;
+}
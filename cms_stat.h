@@ -0,0 +1,132 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_stat.h
+ *
+ * Declarations for the runtime counters of the extension, which are shown in
+ * the pg_stat_cms view. Every backend counts calls, items, detoasted bytes,
+ * returned sketch bytes, unions and optionally time per entry point, and adds
+ * them to shared memory at the end of each transaction.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_STAT_H
+#define CMS_STAT_H
+
+#include "fmgr.h"
+#include "portability/instr_time.h"
+
+
+/* CmsStatFunction identifies the entry point which is counted. */
+typedef enum CmsStatFunction
+{
+	CMS_STAT_CMS = 0,
+	CMS_STAT_CMS_ADD,
+	CMS_STAT_CMS_ADD_AGG,
+	CMS_STAT_CMS_ADD_ARRAY,
+	CMS_STAT_CMS_DYADIC,
+	CMS_STAT_CMS_DYADIC_ADD,
+	CMS_STAT_CMS_DYADIC_AGG,
+	CMS_STAT_CMS_EQ_SELECTIVITY,
+	CMS_STAT_CMS_FOLD,
+	CMS_STAT_CMS_GET_FREQUENCY,
+	CMS_STAT_CMS_HHH,
+	CMS_STAT_CMS_INCREMENT,
+	CMS_STAT_CMS_INNER_PRODUCT,
+	CMS_STAT_CMS_LINEAR_AGG,
+	CMS_STAT_CMS_PREFIX,
+	CMS_STAT_CMS_PREFIX_ADD,
+	CMS_STAT_CMS_PREFIX_AGG,
+	CMS_STAT_CMS_PREFIX_GET_FREQUENCY,
+	CMS_STAT_CMS_PREWARM,
+	CMS_STAT_CMS_QUANTILE,
+	CMS_STAT_CMS_RANGE_FREQUENCY,
+	CMS_STAT_CMS_RATE_CHECK,
+	CMS_STAT_CMS_SUBTRACT,
+	CMS_STAT_CMS_TOP_K,
+	CMS_STAT_CMS_UNION,
+	CMS_STAT_CMS_UNION_AGG,
+	CMS_STAT_CMS_WINDOW,
+	CMS_STAT_CMS_WINDOW_ADD,
+	CMS_STAT_CMS_WINDOW_ADVANCE,
+	CMS_STAT_CMS_WINDOW_GET_FREQUENCY,
+	CMS_STAT_MMS,
+	CMS_STAT_MMS_ADD,
+	CMS_STAT_MMS_GET_MASK,
+	CMS_STAT_FUNCTION_COUNT
+} CmsStatFunction;
+
+/*
+ * CmsStatCounters keeps the counters of one entry point. Times are in
+ * milliseconds and only counted when cms_mms.track_timing is on.
+ */
+typedef struct CmsStatCounters
+{
+	uint64 calls;
+	uint64 items;
+	uint64 detoastedBytes;
+	uint64 toastBytes;
+	uint64 unions;
+	uint64 unionBytes;
+	double hashTime;
+	double updateTime;
+	double estimateTime;
+} CmsStatCounters;
+
+
+/* counters of the entry point which is running, set by CmsStatBeginCall */
+extern CmsStatCounters *CmsStatPending;
+
+/* GUC variables */
+extern bool CmsTrackTiming;
+
+
+extern void CmsStatInit(void);
+extern void CmsStatBeginCall(CmsStatFunction function);
+extern struct varlena * CmsStatDetoastSketch(Datum datum, bool copy);
+extern struct varlena * CmsStatDetoastItem(Datum datum);
+extern Datum CmsStatReturnSketch(void *sketch);
+
+/* Fetch sketch arguments and count the bytes which had to be detoasted */
+#define CMS_GETARG_SKETCH_P(n) CmsStatDetoastSketch(PG_GETARG_DATUM(n), false)
+#define CMS_GETARG_SKETCH_P_COPY(n) CmsStatDetoastSketch(PG_GETARG_DATUM(n), true)
+
+
+/* CmsStatTimerStart reads the clock if timing is tracked. */
+static inline void
+CmsStatTimerStart(instr_time *startTime)
+{
+	if (CmsTrackTiming)
+	{
+		INSTR_TIME_SET_CURRENT(*startTime);
+	}
+	else
+	{
+		INSTR_TIME_SET_ZERO(*startTime);
+	}
+}
+
+
+/*
+ * CmsStatTimerStop adds the milliseconds passed since the start time to the
+ * given counter and restarts the timer, so consecutive steps can be timed with
+ * one call each.
+ */
+static inline void
+CmsStatTimerStop(instr_time *startTime, double *elapsedTime)
+{
+	if (!INSTR_TIME_IS_ZERO(*startTime))
+	{
+		instr_time endTime;
+		instr_time duration;
+
+		INSTR_TIME_SET_CURRENT(endTime);
+		duration = endTime;
+		INSTR_TIME_SUBTRACT(duration, *startTime);
+
+		*elapsedTime += INSTR_TIME_GET_MILLISEC(duration);
+		*startTime = endTime;
+	}
+}
+
+#endif /* CMS_STAT_H */
@@ -0,0 +1,162 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_worker.c
+ *
+ * This file contains the main loop which the background workers of the
+ * extension share. The change worker and the rollup worker only differ in the
+ * query which runs one of their batches, and in their settings.
+ *
+ * Every batch runs in its own transaction, so a batch which fails doesn't undo
+ * the ones before it. Errors end the worker, and the postmaster restarts it
+ * after a few seconds. The workers need the extension to be loaded through
+ * shared_preload_libraries.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+
+#include "cms_worker.h"
+
+
+/* Set by the SIGHUP handler of the worker */
+static volatile sig_atomic_t ReloadConfiguration = false;
+
+/* Local functions forward declarations */
+static bool _runBatch(const char *activity, CmsWorkerBatchQuery batchQuery);
+static void _handleSighup(SIGNAL_ARGS);
+
+
+/*
+ * CmsWorkerRegister registers a background worker of the extension which starts
+ * at the given function, connects to a database and is restarted when it ends.
+ * It is called from _PG_init while the extension is being preloaded.
+ */
+void CmsWorkerRegister(const char *functionName, const char *workerName)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "cms_mms");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "%s", functionName);
+	snprintf(worker.bgw_name, BGW_MAXLEN, "%s", workerName);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "%s", workerName);
+
+	RegisterBackgroundWorker(&worker);
+}
+
+
+/*
+ * CmsWorkerMain connects a worker to the given database and runs its batches
+ * until one reports that there is nothing left to do, then sleeps for the nap
+ * time or until its latch is set. The nap time is read after every reload of
+ * the configuration, and is converted to milliseconds with the given unit.
+ */
+void CmsWorkerMain(const char *databaseName, const char *activity,
+                   CmsWorkerBatchQuery batchQuery, const int *naptime, long naptimeUnit)
+{
+	pqsignal(SIGHUP, _handleSighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(databaseName, NULL, 0);
+
+	for (;;)
+	{
+		bool moreWork = _runBatch(activity, batchQuery);
+
+		if (!moreWork)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			                 *naptime * naptimeUnit, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ReloadConfiguration)
+		{
+			ReloadConfiguration = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+	}
+}
+
+
+/*
+ * _runBatch runs the query of one batch in its own transaction, and returns
+ * what the query returned. It does nothing until the extension is created in
+ * the database of the worker.
+ */
+static bool _runBatch(const char *activity, CmsWorkerBatchQuery batchQuery)
+{
+	bool moreWork = false;
+	bool isNull = false;
+	int spiResult = 0;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, activity);
+
+	/* the extension may be created in any schema */
+	spiResult = SPI_execute("SELECT pg_catalog.quote_ident(namespace.nspname) "
+	                        "FROM pg_catalog.pg_extension extension "
+	                        "JOIN pg_catalog.pg_namespace namespace "
+	                        "ON namespace.oid = extension.extnamespace "
+	                        "WHERE extension.extname = 'cms_mms'", true, 1);
+	if (spiResult != SPI_OK_SELECT)
+	{
+		elog(ERROR, "cms_mms worker: could not look up the extension: %s",
+		     SPI_result_code_string(spiResult));
+	}
+
+	if (SPI_processed == 1)
+	{
+		char *schemaName = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		spiResult = SPI_execute(batchQuery(schemaName), false, 1);
+		if (spiResult != SPI_OK_SELECT || SPI_processed != 1)
+		{
+			elog(ERROR, "cms_mms worker: could not run a batch: %s",
+			     SPI_result_code_string(spiResult));
+		}
+
+		moreWork = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[0],
+		                                      SPI_tuptable->tupdesc, 1, &isNull));
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return moreWork;
+}
+
+
+/* _handleSighup asks the worker to reload its configuration. */
+static void _handleSighup(SIGNAL_ARGS)
+{
+	int savedErrno = errno;
+
+	ReloadConfiguration = true;
+	SetLatch(MyLatch);
+
+	errno = savedErrno;
+}
@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ * cms_worker.h
+ *
+ * Declarations for the background workers of the extension. The workers run
+ * one batch per transaction through a function of the extension, and sleep
+ * once a batch reports that there is nothing left to do.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef CMS_WORKER_H
+#define CMS_WORKER_H
+
+#include "fmgr.h"
+
+
+/*
+ * CmsWorkerBatchQuery returns the query which runs one batch of a worker, given
+ * the quoted schema of the extension. The query returns a single boolean, which
+ * is true if the worker should run the next batch right away.
+ */
+typedef char *(*CmsWorkerBatchQuery)(const char *schemaName);
+
+
+extern void CmsWorkerRegister(const char *functionName, const char *workerName);
+extern void CmsWorkerMain(const char *databaseName, const char *activity,
+                          CmsWorkerBatchQuery batchQuery, const int *naptime,
+                          long naptimeUnit);
+
+#endif /* CMS_WORKER_H */
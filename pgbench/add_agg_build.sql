@@ -0,0 +1,2 @@
+--builds one sketch over the whole event table
+SELECT cms_info(cms_add_agg(item)) FROM cms_bench_events;
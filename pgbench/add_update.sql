@@ -0,0 +1,4 @@
+--concurrent single item updates of a few sketch rows
+\set id random(1, :sketches)
+\set item random_zipfian(1, 1000000, 1.1)
+UPDATE cms_bench_sketches SET sketch = cms_add(sketch, :item::bigint) WHERE id = :id;
@@ -0,0 +1,4 @@
+--builds many small sketches, one per group
+SELECT count(*) FROM (
+	SELECT group_id, cms_add_agg(item_text, 0.01, 0.9) FROM cms_bench_events GROUP BY group_id
+) grouped_sketches;
@@ -0,0 +1,5 @@
+--frequency of one item in the sketch of its hour
+\set id random(1, :lookups)
+SELECT l.item, cms_get_frequency(h.sketch, l.item)
+FROM cms_bench_lookup l JOIN cms_bench_hourly h ON h.hour = l.hour
+WHERE l.id = :id;
@@ -0,0 +1,91 @@
+#!/bin/sh
+#-------------------------------------------------------------------------
+#
+# run.sh
+#
+# Runs the pgbench workloads of the extension against the server selected by
+# the usual libpq environment variables (PGHOST, PGPORT, PGDATABASE, ...) and
+# writes one CSV line per workload with throughput, latency percentiles, WAL
+# bytes and temporary file usage.
+#
+# Settings, all optional:
+#   CMS_BENCH_ROWS       rows in the event table (default 10000000)
+#   CMS_BENCH_HOURS      hours the events are spread over (default 720)
+#   CMS_BENCH_GROUPS     groups of the grouped aggregate workload (default 100000)
+#   CMS_BENCH_SKETCHES   sketch rows of the update workload (default 100)
+#   CMS_BENCH_LOOKUPS    keys of the point lookup workload (default 10000)
+#   CMS_BENCH_CLIENTS    clients of the concurrent workloads (default 8)
+#   CMS_BENCH_TIME       seconds per workload (default 60)
+#   CMS_BENCH_WORKLOADS  workloads to run (default all)
+#   CMS_BENCH_SKIP_SETUP set to skip loading the tables
+#   CMS_BENCH_RESULTS    result file (default pgbench_results.csv)
+#
+#-------------------------------------------------------------------------
+
+set -e
+
+SCRIPT_DIR=$(cd "$(dirname "$0")" && pwd)
+
+ROWS=${CMS_BENCH_ROWS:-10000000}
+HOURS=${CMS_BENCH_HOURS:-720}
+GROUP_COUNT=${CMS_BENCH_GROUPS:-100000}
+SKETCHES=${CMS_BENCH_SKETCHES:-100}
+LOOKUPS=${CMS_BENCH_LOOKUPS:-10000}
+CLIENTS=${CMS_BENCH_CLIENTS:-8}
+DURATION=${CMS_BENCH_TIME:-60}
+WORKLOADS=${CMS_BENCH_WORKLOADS:-"add_agg_build grouped_agg add_update point_lookup union_rollup"}
+RESULTS=${CMS_BENCH_RESULTS:-pgbench_results.csv}
+
+PSQL="psql -X -q -A -t -v ON_ERROR_STOP=1"
+
+if [ -z "$CMS_BENCH_SKIP_SETUP" ]; then
+	$PSQL -v rows="$ROWS" -v hours="$HOURS" -v groups="$GROUP_COUNT" \
+	      -v sketches="$SKETCHES" -v lookups="$LOOKUPS" -f "$SCRIPT_DIR/setup.sql"
+fi
+
+echo "workload,clients,seconds,transactions,tps,latency_avg_ms,latency_p50_ms,latency_p95_ms,latency_p99_ms,wal_bytes,temp_files,temp_bytes" > "$RESULTS"
+
+for WORKLOAD in $WORKLOADS; do
+	# aggregate builds scan the whole table, so they run on a single client
+	case $WORKLOAD in
+		add_agg_build|grouped_agg) WORKLOAD_CLIENTS=1 ;;
+		*) WORKLOAD_CLIENTS=$CLIENTS ;;
+	esac
+
+	LOG_DIR=$(mktemp -d)
+	WAL_BEFORE=$($PSQL -c "SELECT pg_current_wal_lsn()")
+	TEMP_BEFORE=$($PSQL -F ' ' -c "SELECT temp_files, temp_bytes FROM pg_stat_database WHERE datname = current_database()")
+
+	pgbench -n -f "$SCRIPT_DIR/$WORKLOAD.sql" -c "$WORKLOAD_CLIENTS" -j "$WORKLOAD_CLIENTS" \
+	        -T "$DURATION" -D hours="$HOURS" -D sketches="$SKETCHES" \
+	        -D lookups="$LOOKUPS" -l --log-prefix="$LOG_DIR/pgbench_log" \
+	        > "$LOG_DIR/output" 2>&1 || { cat "$LOG_DIR/output"; exit 1; }
+
+	# backends report their statistics when they exit
+	sleep 1
+	WAL_AFTER=$($PSQL -c "SELECT pg_current_wal_lsn()")
+	WAL_BYTES=$($PSQL -c "SELECT pg_wal_lsn_diff('$WAL_AFTER', '$WAL_BEFORE')::bigint")
+	TEMP_AFTER=$($PSQL -F ' ' -c "SELECT temp_files, temp_bytes FROM pg_stat_database WHERE datname = current_database()")
+	TEMP_FILES=$(echo "$TEMP_BEFORE $TEMP_AFTER" | awk '{ print $3 - $1 }')
+	TEMP_BYTES=$(echo "$TEMP_BEFORE $TEMP_AFTER" | awk '{ print $4 - $2 }')
+
+	TPS=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$LOG_DIR/output" | tail -1)
+
+	# the third field of the transaction log is the latency in microseconds
+	LATENCIES=$(cat "$LOG_DIR"/pgbench_log* | awk '{ print $3 }' | sort -n | awk '
+		{ latency[NR] = $1; total += $1 }
+		END {
+			if (NR == 0) { print "0 0 0 0 0"; exit }
+			printf "%d %.3f %.3f %.3f %.3f\n", NR, total / NR / 1000,
+			       latency[int((NR - 1) * 0.50) + 1] / 1000,
+			       latency[int((NR - 1) * 0.95) + 1] / 1000,
+			       latency[int((NR - 1) * 0.99) + 1] / 1000
+		}')
+	set -- $LATENCIES
+
+	LINE="$WORKLOAD,$WORKLOAD_CLIENTS,$DURATION,$1,$TPS,$2,$3,$4,$5,$WAL_BYTES,$TEMP_FILES,$TEMP_BYTES"
+	echo "$LINE" >> "$RESULTS"
+	echo "$LINE"
+
+	rm -rf "$LOG_DIR"
+done
@@ -0,0 +1,86 @@
+--
+-- Setup for the pgbench workloads of the extension. Table sizes are given as
+-- psql variables, see run.sh:
+--   rows      number of rows in the event table
+--   hours     number of distinct hours the events are spread over
+--   groups    number of groups for the grouped aggregate workload
+--   sketches  number of sketch rows for the update workload
+--   lookups   number of (hour, item) pairs for the point lookup workload
+--
+
+\if :{?rows}
+\else
+	\set rows 10000000
+\endif
+\if :{?hours}
+\else
+	\set hours 720
+\endif
+\if :{?groups}
+\else
+	\set groups 100000
+\endif
+\if :{?sketches}
+\else
+	\set sketches 100
+\endif
+\if :{?lookups}
+\else
+	\set lookups 10000
+\endif
+
+CREATE EXTENSION IF NOT EXISTS cms_mms;
+
+DROP TABLE IF EXISTS cms_bench_events;
+DROP TABLE IF EXISTS cms_bench_sketches;
+DROP TABLE IF EXISTS cms_bench_hourly;
+DROP TABLE IF EXISTS cms_bench_lookup;
+
+--events with a skewed item distribution, the top items make up most rows
+CREATE TABLE cms_bench_events (
+	event_time timestamptz,
+	group_id int,
+	item bigint,
+	item_text text,
+	source inet
+);
+
+INSERT INTO cms_bench_events
+SELECT timestamptz '2026-01-01' + (i % (:hours * 3600)) * interval '1 second',
+       i % :groups,
+       item,
+       md5(item::text),
+       ('10.' || (item >> 16) % 256 || '.' || (item >> 8) % 256 || '.' || item % 256)::inet
+FROM (SELECT i, floor(power(random(), 4) * 1000000)::bigint AS item
+      FROM generate_series(1, :rows) i) events;
+
+--sketch rows updated concurrently by the update workload
+CREATE TABLE cms_bench_sketches (
+	id int PRIMARY KEY,
+	sketch cms
+);
+
+INSERT INTO cms_bench_sketches SELECT i, cms(0.01, 0.99) FROM generate_series(1, :sketches) i;
+
+--one sketch per hour for the lookup and rollup workloads
+CREATE TABLE cms_bench_hourly (
+	hour timestamptz PRIMARY KEY,
+	sketch cms
+);
+
+INSERT INTO cms_bench_hourly
+SELECT date_trunc('hour', event_time), cms_add_agg(item)
+FROM cms_bench_events GROUP BY 1;
+
+CREATE TABLE cms_bench_lookup (
+	id int PRIMARY KEY,
+	hour timestamptz,
+	item bigint
+);
+
+INSERT INTO cms_bench_lookup
+SELECT i, timestamptz '2026-01-01' + (i % :hours) * interval '1 hour',
+       floor(power(random(), 4) * 1000000)::bigint
+FROM generate_series(1, :lookups) i;
+
+VACUUM ANALYZE cms_bench_events, cms_bench_sketches, cms_bench_hourly, cms_bench_lookup;
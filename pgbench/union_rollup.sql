@@ -0,0 +1,5 @@
+--merges the hourly sketches of a random day
+\set start random(0, :hours - 24)
+SELECT cms_info(cms_union_agg(sketch)) FROM cms_bench_hourly
+WHERE hour >= timestamptz '2026-01-01' + :start * interval '1 hour'
+  AND hour < timestamptz '2026-01-01' + (:start + 24) * interval '1 hour';
@@ -0,0 +1,32 @@
+--
+--Testing update batches of cms_add_agg and cms_add_array
+--
+
+--a small sketch, so colliding conservative updates depend on their order
+CREATE TABLE agg_batch_test AS
+SELECT i AS id, (i * i) % 37 AS item FROM generate_series(1, 1000) i;
+
+--check that batched aggregates leave the same sketch as unbatched ones
+CREATE TABLE agg_batch_sketches AS
+SELECT false AS batched, cms_add_agg(item, 0.1, 0.9 ORDER BY id) AS sketch
+FROM agg_batch_test;
+SET cms_mms.agg_batch_size = 7;
+INSERT INTO agg_batch_sketches
+SELECT true, cms_add_agg(item, 0.1, 0.9 ORDER BY id) FROM agg_batch_test;
+SELECT count(DISTINCT sketch::text) AS distinct_sketches FROM agg_batch_sketches;
+SELECT batched, total_count FROM agg_batch_sketches, cms_stats(sketch) ORDER BY batched;
+RESET cms_mms.agg_batch_size;
+
+--check that adding an array leaves the same sketch as adding its elements
+SELECT cms_add_array(cms(0.1, 0.9), array_agg(item ORDER BY id))::text =
+       (SELECT sketch::text FROM agg_batch_sketches WHERE NOT batched) AS same_sketch
+FROM agg_batch_test;
+
+--check null elements, empty and null arrays
+SELECT cms_get_frequency(sketch, 1) AS frequency, total_count
+FROM (SELECT cms_add_array(cms(0.1, 0.9), ARRAY[1, NULL, 2, 1]) AS sketch) sketches,
+     cms_stats(sketch);
+SELECT cms_get_frequency(cms_add_array(cms(0.1, 0.9), ARRAY['a', 'b', 'a']), 'a'::text);
+SELECT total_count FROM cms_stats(cms_add_array(cms(0.1, 0.9), '{}'::int[]));
+SELECT cms_add_array(cms(0.1, 0.9), NULL::int[]) IS NULL AS is_null;
+SELECT cms_add_array(NULL, ARRAY[1]) IS NULL AS is_null;
@@ -0,0 +1,26 @@
+--
+--Testing update buffer of cms_add_agg
+--
+
+--skewed items, small ones are the most frequent
+CREATE TABLE agg_buffer_test AS
+SELECT i % (1 + i % 100) AS item FROM generate_series(1, 5000) i;
+
+--check estimates without and with a buffer which fills several times
+SELECT count(*) AS mismatches
+FROM (SELECT item, count(*) AS frequency FROM agg_buffer_test GROUP BY item) counts,
+     (SELECT cms_add_agg(item) AS sketch FROM agg_buffer_test) sketches
+WHERE cms_get_frequency(sketch, item) <> frequency;
+
+SET cms_mms.agg_buffer_size = 64;
+SELECT count(*) AS mismatches
+FROM (SELECT item, count(*) AS frequency FROM agg_buffer_test GROUP BY item) counts,
+     (SELECT cms_add_agg(item) AS sketch FROM agg_buffer_test) sketches
+WHERE cms_get_frequency(sketch, item) <> frequency;
+SELECT total_count FROM cms_stats((SELECT cms_add_agg(item, 0.01, 0.99) FROM agg_buffer_test));
+
+--check grouped aggregates and empty input
+SELECT item % 2 AS parity, cms_get_frequency(cms_add_agg(item), 0) AS zeros
+FROM agg_buffer_test GROUP BY item % 2 ORDER BY parity;
+SELECT cms_add_agg(item) IS NULL AS is_null FROM agg_buffer_test WHERE item < 0;
+RESET cms_mms.agg_buffer_size;
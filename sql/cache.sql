@@ -0,0 +1,18 @@
+--
+--Testing the shared sketch cache
+--
+
+--a sketch stored out of line and one stored inline
+CREATE TABLE cache_test (
+	id integer,
+	sketch cms
+);
+ALTER TABLE cache_test ALTER COLUMN sketch SET STORAGE EXTERNAL;
+INSERT INTO cache_test SELECT 1, cms_add_agg(i % 10) FROM generate_series(1, 1000) i;
+INSERT INTO cache_test VALUES (2, cms_add(cms(0.1, 0.9), 3));
+
+--check that sketches are probed as usual when the cache is disabled
+SHOW cms_mms.shared_cache_size;
+SELECT id, cms_prewarm(sketch) FROM cache_test ORDER BY id;
+SELECT id, cms_get_frequency(sketch, 3) FROM cache_test ORDER BY id;
+SELECT cms_prewarm(cms_window(4, 0.1, 0.9)) AS window_cached, cms_prewarm(mms(0.1, 0.9)) AS mms_cached;
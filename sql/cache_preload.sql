@@ -0,0 +1,36 @@
+--
+--Testing the shared sketch cache of a preloaded extension
+--
+CREATE EXTENSION cms_mms;
+
+--the cache holds two sketches
+SHOW cms_mms.shared_cache_size;
+SHOW cms_mms.shared_cache_sketch_size;
+
+--sketches stored out of line and one stored inline
+CREATE TABLE cache_preload_test (
+	id integer,
+	sketch cms
+);
+ALTER TABLE cache_preload_test ALTER COLUMN sketch SET STORAGE EXTERNAL;
+INSERT INTO cache_preload_test SELECT 1, cms_add_agg(i % 10) FROM generate_series(1, 100) i;
+INSERT INTO cache_preload_test SELECT 2, cms_add_agg(i % 10) FROM generate_series(1, 200) i;
+INSERT INTO cache_preload_test SELECT 3, cms_add_agg(i % 10) FROM generate_series(1, 300) i;
+INSERT INTO cache_preload_test VALUES (4, cms_add(cms(0.1, 0.9), 3));
+
+--check that only sketches stored out of line are cached
+SELECT id, cms_prewarm(sketch) FROM cache_preload_test WHERE id IN (1, 4) ORDER BY id;
+
+--check that probing a cached sketch doesn't detoast it
+SELECT pg_stat_cms_reset();
+SELECT cms_get_frequency(sketch, 3) FROM cache_preload_test WHERE id = 1;
+SELECT detoasted_bytes FROM pg_stat_cms WHERE function_name = 'cms_get_frequency';
+
+--check that the least recently used sketch is evicted
+SELECT id, cms_prewarm(sketch) FROM cache_preload_test WHERE id = 2;
+SELECT id, cms_prewarm(sketch) FROM cache_preload_test WHERE id = 3;
+SELECT pg_stat_cms_reset();
+SELECT cms_get_frequency(sketch, 3) FROM cache_preload_test WHERE id = 3;
+SELECT detoasted_bytes FROM pg_stat_cms WHERE function_name = 'cms_get_frequency';
+SELECT cms_get_frequency(sketch, 3) FROM cache_preload_test WHERE id = 1;
+SELECT detoasted_bytes > 0 AS detoasted FROM pg_stat_cms WHERE function_name = 'cms_get_frequency';
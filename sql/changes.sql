@@ -0,0 +1,21 @@
+--
+--Testing sketches maintained from logical decoding
+--
+
+CREATE TABLE changes_events (
+	page text,
+	visitor integer
+);
+CREATE TABLE changes_sketches (
+	page text PRIMARY KEY,
+	visitors cms
+);
+INSERT INTO cms_change_sources (source_table, sketch_table, sketch_column, item_column, key_columns)
+VALUES ('changes_events', 'changes_sketches', 'visitors', 'visitor', '{page}');
+SELECT source_table, sketch_table, sketch_column, item_column, key_columns FROM cms_change_sources;
+
+--check parameters
+SELECT cms_consume_changes('changes_slot', 0);
+SELECT cms_consume_changes('changes_slot');
+SELECT count(*) FROM cms_change_progress;
+DELETE FROM cms_change_sources;
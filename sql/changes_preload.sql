@@ -0,0 +1,50 @@
+--
+--Testing sketches maintained from logical decoding on a preloaded instance
+--
+
+--rows are decoded with the cms_mms output plugin
+SHOW wal_level;
+CREATE TABLE changes_preload_events (
+	page text,
+	visitor integer
+);
+CREATE TABLE changes_preload_sketches (
+	page text PRIMARY KEY,
+	visitors cms
+);
+INSERT INTO cms_change_sources (source_table, sketch_table, sketch_column, item_column, key_columns)
+VALUES ('changes_preload_events', 'changes_preload_sketches', 'visitors', 'visitor', '{page}');
+SELECT 'init' FROM pg_create_logical_replication_slot('changes_preload_slot', 'cms_mms');
+
+--check that inserted rows are folded into the sketches of their groups
+INSERT INTO changes_preload_events SELECT 'page-' || (i % 2), i % 5 FROM generate_series(1, 100) i;
+SELECT folded_rows, batch_full FROM cms_consume_changes('changes_preload_slot');
+SELECT page, cms_get_frequency(visitors, 0) AS visitor_0, cms_get_frequency(visitors, 1) AS visitor_1
+FROM changes_preload_sketches ORDER BY page;
+
+--check that consuming again folds no row twice
+SELECT folded_rows, batch_full FROM cms_consume_changes('changes_preload_slot');
+SELECT page, cms_get_frequency(visitors, 0) AS visitor_0, cms_get_frequency(visitors, 1) AS visitor_1
+FROM changes_preload_sketches ORDER BY page;
+
+--check that other columns can be added and dropped while rows are decoded
+ALTER TABLE changes_preload_events ADD COLUMN referrer text;
+INSERT INTO changes_preload_events SELECT 'page-0', 0, 'search' FROM generate_series(1, 5);
+ALTER TABLE changes_preload_events DROP COLUMN referrer;
+INSERT INTO changes_preload_events VALUES ('page-1', 1);
+SELECT folded_rows, batch_full FROM cms_consume_changes('changes_preload_slot');
+SELECT page, cms_get_frequency(visitors, 0) AS visitor_0, cms_get_frequency(visitors, 1) AS visitor_1
+FROM changes_preload_sketches ORDER BY page;
+
+--check that a tracked column which was renamed is an error
+INSERT INTO changes_preload_events VALUES ('page-1', 1);
+ALTER TABLE changes_preload_events RENAME COLUMN visitor TO visitor_id;
+SELECT folded_rows, batch_full FROM cms_consume_changes('changes_preload_slot');
+UPDATE cms_change_sources SET item_column = 'visitor_id';
+\set VERBOSITY terse
+SELECT folded_rows, batch_full FROM cms_consume_changes('changes_preload_slot');
+\set VERBOSITY default
+
+SELECT 'drop' FROM pg_drop_replication_slot('changes_preload_slot');
+DELETE FROM cms_change_sources;
+DELETE FROM cms_change_progress;
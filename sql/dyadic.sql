@@ -0,0 +1,44 @@
+--
+--Testing dyadic range sketches
+--
+
+--check parameters
+SELECT cms_dyadic(0);
+SELECT cms_dyadic(63);
+SELECT cms_dyadic(16, 2, 0.9);
+SELECT cms_dyadic_add(cms_dyadic(8, 0.1, 0.9), 128);
+SELECT cms_dyadic_add(cms_dyadic(8, 0.1, 0.9), -129);
+SELECT cms_quantile(cms_dyadic(8, 0.1, 0.9), 1.5);
+SELECT cms_quantile(cms_dyadic(8, 0.1, 0.9), 0.5) IS NULL AS empty_quantile;
+SELECT cms_dyadic_info(cms_dyadic(16, 0.01, 0.99));
+SELECT cms_dyadic_add(NULL, 1) IS NULL AS null_sketch;
+
+--response times of 1 to 1000 milliseconds, and every tenth one 5 seconds slower
+CREATE TABLE dyadic_test AS
+SELECT i, CASE WHEN i % 10 = 0 THEN 5000 + i ELSE i END AS response_time
+FROM generate_series(1, 1000) i;
+CREATE TABLE dyadic_sketches AS
+SELECT cms_dyadic_agg(response_time, 20, 0.01, 0.99) AS sketch FROM dyadic_test;
+
+--check range counts against exact counts
+SELECT low, high, cms_range_frequency(sketch, low, high) AS estimate,
+       (SELECT count(*) FROM dyadic_test WHERE response_time BETWEEN low AND high) AS exact
+FROM dyadic_sketches,
+     (VALUES (1, 100), (101, 500), (1000, 5009), (5000, 7000), (-1000000, 1000000),
+             (700, 600)) ranges(low, high);
+
+--check quantiles against exact percentiles
+SELECT q, cms_quantile(sketch, q) AS estimate,
+       (SELECT percentile_disc(q) WITHIN GROUP (ORDER BY response_time)
+        FROM dyadic_test) AS exact
+FROM dyadic_sketches, (VALUES (0.0), (0.25), (0.5), (0.9), (0.95), (1.0)) quantiles(q);
+
+--check negative values, levels of small domains count exactly
+SELECT cms_range_frequency(cms_dyadic_agg(i, 8), -128, -1) AS negatives,
+       cms_quantile(cms_dyadic_agg(i, 8), 0.5) AS median
+FROM generate_series(-100, 99) i;
+
+--check input and output, and adding to a stored sketch
+SELECT sketch::text::cms_dyadic::text = sketch::text AS same_sketch FROM dyadic_sketches;
+SELECT cms_range_frequency(cms_dyadic_add(cms_dyadic_add(sketch, 3), NULL), 3, 3)
+FROM dyadic_sketches;
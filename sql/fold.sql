@@ -0,0 +1,57 @@
+--
+--Testing sketch folding
+--
+
+--check parameters
+SELECT cms_fold(cms(0.01, 0.99), 0);
+SELECT cms_fold(cms(0.01, 0.99), 3);
+SELECT cms_info(cms_fold(cms(0.01, 0.99, 16), 4));
+
+--check that widths can be rounded up to be foldable
+SET cms_mms.width_multiple = 16;
+SELECT cms_info(cms(0.001, 0.99));
+SELECT cms_info(cms_fold(cms(0.001, 0.99), 16));
+RESET cms_mms.width_multiple;
+
+--hourly traffic where item 1 is frequent
+CREATE TABLE fold_test AS
+SELECT i AS id, CASE WHEN i % 3 = 0 THEN 1 ELSE i % 200 END AS item
+FROM generate_series(1, 2000) i;
+CREATE TABLE fold_hours AS
+SELECT id / 500 AS hour, cms_add_agg(item, 0.01, 0.99) AS sketch
+FROM fold_test
+GROUP BY hour;
+
+--check that folding a linear sketch gives the sketch of the narrower width
+SELECT cms_fold(cms_linear_agg(item, 0.01, 0.99), 4)::text =
+       cms_linear_agg(item, 0.04, 0.99)::text AS same_sketch
+FROM fold_test;
+
+--check that folded estimates only grow
+CREATE TABLE fold_sketches AS
+SELECT cms_add_agg(item, 0.01, 0.99) AS full_width,
+       cms_fold(cms_add_agg(item, 0.01, 0.99), 4) AS folded,
+       cms_fold(cms_add_agg(item, 0.01, 0.99, 4), 4) AS folded_hot_items
+FROM fold_test;
+SELECT count(*) AS items,
+       count(*) FILTER (WHERE cms_get_frequency(folded, item) < frequency) AS underestimated,
+       count(*) FILTER (WHERE cms_get_frequency(folded, item) <
+                              cms_get_frequency(full_width, item)) AS below_full_width
+FROM fold_sketches, (SELECT item, count(*) AS frequency FROM fold_test GROUP BY item) items;
+SELECT item, cms_get_frequency(full_width, item) AS full_width,
+       cms_get_frequency(folded, item) AS folded,
+       cms_get_frequency(folded_hot_items, item) AS folded_hot_items
+FROM fold_sketches, (VALUES (1), (2), (3)) items(item);
+SELECT cms_info(folded), (cms_stats(folded)).total_count FROM fold_sketches;
+
+--check that sketches of different widths are folded when merged
+SELECT cms_union(full_width, cms_fold(full_width, 2))::text =
+       cms_fold(cms_union(full_width, full_width), 2)::text AS same_sketch,
+       cms_union(folded, full_width)::text =
+       cms_fold(cms_union(full_width, full_width), 4)::text AS same_folded_sketch
+FROM fold_sketches;
+SELECT cms_union(cms_fold(full_width, 16), cms_fold(full_width, 17)) FROM fold_sketches;
+SELECT cms_union_agg(CASE WHEN hour < 2 THEN cms_fold(sketch, 4) ELSE sketch END
+                     ORDER BY hour)::text =
+       cms_fold(cms_union_agg(sketch ORDER BY hour), 4)::text AS same_sketch
+FROM fold_hours;
@@ -0,0 +1,46 @@
+--
+--Testing augmented sketches with a hot-item filter
+--
+
+--check parameters
+SELECT cms(0.1, 0.9, -1);
+SELECT cms(0.1, 0.9, 1025);
+SELECT cms_info(cms(0.01, 0.99, 16));
+SELECT cms_union(cms(0.1, 0.9, 4), cms(0.1, 0.9, 2));
+SELECT cms_get_frequency(cms_add(cms_add(cms(0.1, 0.9, 2), 1), 1), 1);
+
+--skewed items, small ones are the most frequent
+CREATE TABLE hot_items_test AS
+SELECT i AS id, i % (1 + i % 100) AS item FROM generate_series(1, 5000) i;
+CREATE TABLE hot_items_counts AS
+SELECT item, count(*) AS frequency FROM hot_items_test GROUP BY item;
+
+--check that hot items are counted in the filter and don't raise other estimates
+CREATE TABLE hot_items_sketches AS
+SELECT cms_add_agg(item, 0.05, 0.9 ORDER BY id) AS plain,
+       cms_add_agg(item, 0.05, 0.9, 8 ORDER BY id) AS augmented
+FROM hot_items_test;
+SELECT sum(cms_get_frequency(plain, item) - frequency) AS plain_overestimate,
+       sum(cms_get_frequency(augmented, item) - frequency) AS augmented_overestimate,
+       count(*) FILTER (WHERE cms_get_frequency(augmented, item) < frequency) AS underestimated
+FROM hot_items_counts, hot_items_sketches;
+SELECT item, frequency, cms_get_frequency(augmented, item) AS estimate
+FROM hot_items_counts, hot_items_sketches
+ORDER BY frequency DESC, item LIMIT 4;
+SELECT total_count FROM hot_items_sketches, cms_stats(augmented);
+
+--check that unions reconcile the filters
+CREATE TABLE hot_items_halves AS
+SELECT id % 2 AS half, cms_add_agg(item, 0.05, 0.9, 8 ORDER BY id) AS augmented
+FROM hot_items_test GROUP BY id % 2;
+CREATE TABLE hot_items_merged AS
+SELECT cms_union_agg(augmented ORDER BY half) AS merged FROM hot_items_halves;
+SELECT sum(cms_get_frequency(merged, item) - frequency) AS overestimate,
+       count(*) FILTER (WHERE cms_get_frequency(merged, item) < frequency) AS underestimated
+FROM hot_items_counts, hot_items_merged;
+SELECT item, frequency, cms_get_frequency(merged, item) AS estimate
+FROM hot_items_counts, hot_items_merged
+ORDER BY frequency DESC, item LIMIT 4;
+SELECT cms_union(even.augmented, odd.augmented)::text = merged::text AS same_sketch
+FROM hot_items_halves even, hot_items_halves odd, hot_items_merged
+WHERE even.half = 0 AND odd.half = 1;
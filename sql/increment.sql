@@ -0,0 +1,30 @@
+--
+--Testing cms_increment function of the extension
+--
+
+--check parameters
+SELECT cms_increment(cms(0.01, 0.99), 1, 0);
+SELECT cms_increment(NULL::cms, 1) IS NULL AS null_sketch;
+SELECT estimate, (cms_stats(sketch)).total_count FROM cms_increment(cms(0.01, 0.99), NULL::integer);
+SELECT estimate, (cms_stats(sketch)).total_count FROM cms_increment(cms(0.01, 0.99), 1, NULL);
+
+--check that every addition returns the new estimate of the item
+CREATE TABLE increment_test AS
+WITH RECURSIVE steps(step, sketch, estimate) AS (
+	SELECT 0, cms(0.01, 0.99), 0::bigint
+	UNION ALL
+	SELECT step + 1, increment.sketch, increment.estimate
+	FROM steps, cms_increment(steps.sketch, (step + 1) % 3, 1 + step % 2) increment
+	WHERE step < 9
+)
+SELECT step, step % 3 AS item, 1 + (step - 1) % 2 AS weight, sketch, estimate
+FROM steps WHERE step > 0;
+SELECT step, item, weight, estimate, cms_get_frequency(sketch, item) AS frequency
+FROM increment_test ORDER BY step;
+SELECT (cms_stats(sketch)).total_count FROM increment_test WHERE step = 9;
+
+--check that the sketch is the one cms_add returns
+SELECT (cms_increment(cms_add(cms(0.01, 0.99), 'a'::text), 'a'::text)).sketch::text =
+       cms_add(cms_add(cms(0.01, 0.99), 'a'::text), 'a'::text)::text AS same_sketch;
+SELECT estimate FROM cms_increment(cms_add(cms(0.01, 0.99, 4), 'a'::text), 'a'::text, 3);
+SELECT estimate FROM cms_increment(cms_add(cms(0.01, 0.99, 0, true), 'a'::text), 'a'::text, 3);
@@ -0,0 +1,39 @@
+--
+--Testing inner products of sketches
+--
+
+--check parameters
+SELECT cms_inner_product(cms(0.01, 0.99), cms(0.01, 0.9));
+SELECT cms_inner_product(cms(0.01, 0.99), cms(0.001, 0.99));
+SELECT cms_inner_product(cms(0.01, 0.99), cms(0.01, 0.99));
+SELECT cms_inner_product(cms(0.01, 0.99), NULL) IS NULL AS null_product;
+
+--traffic of two periods, the items of the second one overlap with the first one
+CREATE TABLE inner_product_test AS
+SELECT 1 AS period, i % 100 AS item FROM generate_series(1, 1000) i
+UNION ALL
+SELECT 2, i % 50 + 75 FROM generate_series(1, 1500) i;
+CREATE TABLE inner_product_sketches AS
+SELECT period, cms_linear_agg(item, 0.01, 0.99) AS linear_sketch,
+       cms_add_agg(item, 0.01, 0.99) AS sketch,
+       cms_add_agg(item, 0.01, 0.99, 8) AS hot_items_sketch
+FROM inner_product_test
+GROUP BY period;
+
+--check that join sizes are estimated from the sketches
+SELECT (SELECT count(*) FROM inner_product_test first_period
+        JOIN inner_product_test second_period USING (item)
+        WHERE first_period.period = 1 AND second_period.period = 2) AS join_size,
+       cms_inner_product(first.linear_sketch, second.linear_sketch) AS linear_estimate,
+       cms_inner_product(first.sketch, second.sketch) AS estimate,
+       cms_inner_product(first.hot_items_sketch, second.hot_items_sketch) AS hot_items_estimate,
+       cms_inner_product(cms_fold(first.linear_sketch, 4), second.linear_sketch) AS folded_estimate
+FROM inner_product_sketches first, inner_product_sketches second
+WHERE first.period = 1 AND second.period = 2;
+SELECT period, cms_inner_product(linear_sketch, linear_sketch) AS self_join_size
+FROM inner_product_sketches
+ORDER BY period;
+SELECT cms_inner_product(first.linear_sketch, second.linear_sketch) =
+       cms_inner_product(second.linear_sketch, first.linear_sketch) AS symmetric
+FROM inner_product_sketches first, inner_product_sketches second
+WHERE first.period = 1 AND second.period = 2;
@@ -0,0 +1,34 @@
+--
+--Testing count-min sketches with linear updates
+--
+
+--check parameters
+SELECT cms(0.1, 0.9, 4, true);
+SELECT cms_info(cms(0.01, 0.99, 0, true));
+SELECT cms_union(cms(0.1, 0.9), cms(0.1, 0.9, 0, true));
+SELECT cms_subtract(cms(0.1, 0.9), cms(0.1, 0.9));
+SELECT cms_subtract(cms(0.1, 0.9, 0, true), cms(0.01, 0.99, 0, true));
+SELECT cms_subtract(cms(0.1, 0.9, 0, true), cms_add(cms(0.1, 0.9, 0, true), 1));
+
+--check that subtracting an older sketch leaves the newer items
+CREATE TABLE linear_test AS
+SELECT i AS id, CASE WHEN i % 97 = 0 THEN NULL ELSE i % 20 END AS item
+FROM generate_series(1, 1000) i;
+CREATE TABLE linear_sketches AS
+SELECT cms_linear_agg(item, 0.01, 0.99) FILTER (WHERE id <= 400) AS older,
+       cms_linear_agg(item, 0.01, 0.99) AS newer
+FROM linear_test;
+SELECT cms_subtract(newer, older)::text =
+       (SELECT cms_linear_agg(item, 0.01, 0.99) FROM linear_test WHERE id > 400)::text
+       AS same_sketch,
+       (cms_stats(cms_subtract(newer, older))).total_count
+FROM linear_sketches;
+SELECT cms_union(older, cms_subtract(newer, older))::text = newer::text AS same_sketch
+FROM linear_sketches;
+
+--check that moving aggregates match aggregates recomputed for every frame
+SELECT count(*) AS frames, count(*) FILTER (WHERE moving::text = recomputed::text) AS same_frames
+FROM (SELECT id, cms_linear_agg(item, 0.01, 0.99) OVER (ORDER BY id ROWS 99 PRECEDING) AS moving
+      FROM linear_test WHERE id <= 300) frames,
+LATERAL (SELECT cms_linear_agg(item, 0.01, 0.99) AS recomputed FROM linear_test frame_rows
+         WHERE frame_rows.id BETWEEN frames.id - 99 AND frames.id) recomputed_frames;
@@ -0,0 +1,56 @@
+--
+--Testing the trigger which adds new rows to sketch tables
+--
+
+CREATE TABLE new_rows_events (
+	hour integer,
+	page text,
+	visitor integer
+);
+CREATE TABLE new_rows_sketches (
+	hour integer,
+	page text,
+	visitors cms,
+	PRIMARY KEY (hour, page)
+);
+
+--check trigger definitions
+CREATE TRIGGER new_rows_per_row AFTER INSERT ON new_rows_events
+FOR EACH ROW EXECUTE PROCEDURE cms_add_new_rows('new_rows_sketches', 'visitors', 'visitor', 'hour', 'page');
+INSERT INTO new_rows_events VALUES (1, 'home', 1);
+DROP TRIGGER new_rows_per_row ON new_rows_events;
+CREATE TRIGGER new_rows_update AFTER UPDATE ON new_rows_events REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE cms_add_new_rows('new_rows_sketches', 'visitors', 'visitor', 'hour', 'page');
+UPDATE new_rows_events SET visitor = 7;
+DROP TRIGGER new_rows_update ON new_rows_events;
+CREATE TRIGGER new_rows_no_item AFTER INSERT ON new_rows_events REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE cms_add_new_rows('new_rows_sketches', 'visitors');
+INSERT INTO new_rows_events VALUES (1, 'home', 1);
+DROP TRIGGER new_rows_no_item ON new_rows_events;
+SELECT count(*) FROM new_rows_events;
+
+--check that new rows are added to the sketch of their group
+CREATE TRIGGER new_rows_insert AFTER INSERT ON new_rows_events REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE cms_add_new_rows('new_rows_sketches', 'visitors', 'visitor', 'hour', 'page');
+INSERT INTO new_rows_events SELECT 1, 'home', visitor % 10 FROM generate_series(1, 100) visitor;
+INSERT INTO new_rows_events SELECT 1, 'about', visitor % 3 FROM generate_series(1, 6) visitor;
+SELECT hour, page, cms_get_frequency(visitors, 1) AS visitor_1, cms_get_frequency(visitors, 2) AS visitor_2,
+       (cms_stats(visitors)).total_count
+FROM new_rows_sketches ORDER BY hour, page;
+
+--check that a statement updates existing sketches and creates missing ones, and skips null keys
+INSERT INTO new_rows_events VALUES (1, 'home', 1), (1, 'home', 1), (2, 'home', 1), (NULL, 'home', 1);
+SELECT hour, page, cms_get_frequency(visitors, 1) AS visitor_1, cms_get_frequency(visitors, 7) AS visitor_7,
+       (cms_stats(visitors)).total_count
+FROM new_rows_sketches ORDER BY hour, page;
+
+--check a sketch table without key columns
+CREATE TABLE new_rows_totals (
+	visitors cms
+);
+INSERT INTO new_rows_totals VALUES (cms(0.01, 0.99));
+CREATE TRIGGER new_rows_total AFTER INSERT ON new_rows_events REFERENCING NEW TABLE AS new_rows
+FOR EACH STATEMENT EXECUTE PROCEDURE cms_add_new_rows('new_rows_totals', 'visitors', 'visitor');
+INSERT INTO new_rows_events SELECT 3, 'home', 5 FROM generate_series(1, 4);
+SELECT cms_get_frequency(visitors, 5) AS visitor_5, (cms_stats(visitors)).total_count FROM new_rows_totals;
+SELECT hour, page, cms_get_frequency(visitors, 5) AS visitor_5 FROM new_rows_sketches WHERE hour = 3;
@@ -0,0 +1,32 @@
+--
+--Testing pg_stat_cms view of the extension
+--
+
+SELECT pg_stat_cms_reset();
+
+--check counters of every entry point
+CREATE TABLE pg_stat_cms_test (
+	cms_column cms
+);
+
+INSERT INTO pg_stat_cms_test VALUES (cms_add(cms_add(cms(0.1, 0.9), 1), 2));
+INSERT INTO pg_stat_cms_test VALUES (cms(0.001, 0.99));
+SELECT cms_get_frequency(cms_column, 1) FROM pg_stat_cms_test;
+SELECT cms_get_frequency(cms_union_agg(sketch), 1)
+FROM (SELECT cms_add(cms(0.1, 0.9), i) AS sketch FROM generate_series(1, 3) i) sketches;
+SELECT mms_get_mask(mms_add(mms(0.1, 0.9), 'a'::text, 3), 'a'::text);
+SELECT function_name, calls, items, detoasted_bytes, toast_bytes, unions, union_bytes,
+       hash_time, update_time, estimate_time
+FROM pg_stat_cms;
+
+--check timing
+SET cms_mms.track_timing = on;
+SELECT cms_get_frequency(cms_add_agg(i), 1) FROM generate_series(1, 10000) i;
+SELECT function_name, calls, items, hash_time > 0 AS hash_timed,
+       update_time > 0 AS update_timed, estimate_time > 0 AS estimate_timed
+FROM pg_stat_cms WHERE function_name = 'cms_add_agg';
+RESET cms_mms.track_timing;
+
+--check reset
+SELECT pg_stat_cms_reset();
+SELECT sum(calls) FROM pg_stat_cms;
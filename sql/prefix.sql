@@ -0,0 +1,46 @@
+--
+--Testing prefix sketches and hierarchical heavy hitters
+--
+
+--check parameters
+SELECT cms_prefix('{8,8}');
+SELECT cms_prefix('{8,33}');
+SELECT cms_prefix('{8,16}', '{0}');
+SELECT cms_prefix('{}', '{}');
+SELECT cms_prefix('{8}', '{32}', 0);
+SELECT cms_prefix('{8}', '{32}', 4, 2, 0.9);
+SELECT * FROM cms_hhh(cms_prefix(), 0);
+SELECT cms_prefix_get_frequency(cms_prefix('{8}', '{32}', 4, 0.1, 0.9), '10.0.0.0/16');
+SELECT cms_prefix_info(cms_prefix());
+SELECT cms_prefix_info(cms_prefix('{}', '{48}', 4, 0.01, 0.99));
+SELECT cms_prefix_add(NULL, '10.0.0.1') IS NULL AS null_sketch;
+
+--traffic of one /24 spread over its hosts, one busy host and a few smaller networks
+CREATE TABLE prefix_test AS
+SELECT ('10.1.1.' || (i % 100))::inet AS address FROM generate_series(1, 200) i
+UNION ALL SELECT '10.2.0.1'::inet FROM generate_series(1, 60)
+UNION ALL SELECT ('192.168.0.' || (i % 5))::inet FROM generate_series(1, 10) i
+UNION ALL SELECT '2001:db8::1'::inet FROM generate_series(1, 40)
+UNION ALL SELECT ('2001:db8:0:1::' || i)::inet FROM generate_series(1, 30) i;
+CREATE TABLE prefix_sketches AS
+SELECT cms_prefix_agg(address, 0.01, 0.99) AS sketch FROM prefix_test;
+
+--check that heavy networks are reported once, at their longest heavy prefix
+SELECT * FROM prefix_sketches, cms_hhh(sketch, 50);
+SELECT * FROM prefix_sketches, cms_hhh(sketch, 5);
+SELECT * FROM prefix_sketches, cms_hhh(sketch, 1000);
+
+--check estimates of single prefixes
+SELECT network, cms_prefix_get_frequency(sketch, network) AS frequency
+FROM prefix_sketches,
+     (VALUES ('10.1.0.0/16'::cidr), ('10.1.1.7/32'), ('192.168.0.0/24'),
+             ('2001:db8::/32')) networks(network);
+
+--check that networks only count prefixes within their netmask
+SELECT cms_prefix_get_frequency(cms_prefix_add(sketch, '10.3.0.0/16'::cidr), '10.3.0.0/16'),
+       cms_prefix_get_frequency(cms_prefix_add(sketch, '10.3.0.0/16'::cidr), '10.0.0.0/8'),
+       cms_prefix_get_frequency(cms_prefix_add(sketch, '10.3.0.0/16'::cidr), '10.3.0.0/24')
+FROM prefix_sketches;
+
+--check input and output
+SELECT sketch::text::cms_prefix::text = sketch::text AS same_sketch FROM prefix_sketches;
@@ -0,0 +1,41 @@
+--
+--Testing range unions over a tree of pre-merged sketches
+--
+
+--check parameters
+SELECT * FROM cms_range_nodes(-1, 5);
+SELECT * FROM cms_range_nodes(0, 5, 63);
+SELECT cms_range_add('pg_class', -1, cms(0.1, 0.9));
+
+--check that ranges are covered by the fewest nodes
+SELECT * FROM cms_range_nodes(3, 17);
+SELECT * FROM cms_range_nodes(3, 17, 1);
+SELECT count(*) FROM cms_range_nodes(10, 5);
+SELECT count(*) FROM cms_range_nodes(1000001, 1000001 + 2159);
+
+--hourly sketches, the sketch of an hour counts items 1 to hour + 1
+CREATE TABLE range_union_hours AS
+SELECT hour, cms_add_agg(item, 0.01, 0.99) AS sketch
+FROM generate_series(0, 49) hour, generate_series(1, hour + 1) item
+GROUP BY hour;
+
+--check that a tree maintained hour by hour answers ranges like a full union
+SELECT cms_range_create('range_union_tree');
+SELECT count(cms_range_add('range_union_tree', hour, sketch))
+FROM (SELECT hour, sketch FROM range_union_hours ORDER BY hour) hours;
+SELECT count(DISTINCT level) AS levels, count(*) AS nodes FROM range_union_tree;
+SELECT first, last,
+       cms_union_range('range_union_tree', first, last)::text =
+       (SELECT cms_union_agg(sketch ORDER BY hour) FROM range_union_hours
+        WHERE hour BETWEEN first AND last)::text AS same_sketch,
+       (cms_stats(cms_union_range('range_union_tree', first, last))).total_count
+FROM (VALUES (0, 49), (3, 17), (20, 20), (7, 40)) ranges(first, last);
+SELECT cms_union_range('range_union_tree', 10, 5) IS NULL AS empty_range;
+
+--check that a tree built after a bulk load has the same nodes
+SELECT cms_range_create('range_union_built');
+INSERT INTO range_union_built SELECT 0, hour, sketch FROM range_union_hours;
+SELECT cms_range_build('range_union_built');
+SELECT count(*) AS different_nodes
+FROM range_union_tree FULL JOIN range_union_built USING (level, slot)
+WHERE range_union_tree.sketch::text IS DISTINCT FROM range_union_built.sketch::text;
@@ -0,0 +1,13 @@
+--
+--Testing rate limiters in shared memory
+--
+
+--check parameters
+SELECT cms_rate_check('api', 'user-1'::text, -1, '1 minute');
+SELECT cms_rate_check('api', 'user-1'::text, 10, '0 seconds');
+SELECT cms_rate_check('api', 'user-1'::text, 10, '1 hour ago');
+SELECT cms_rate_check('api', NULL::text, 10, '1 minute') IS NULL AS null_key;
+
+--check that rate limiters are only available when preloaded
+SHOW cms_mms.rate_limiters;
+SELECT cms_rate_check('api', 'user-1'::text, 10, '1 minute');
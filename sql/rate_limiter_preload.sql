@@ -0,0 +1,28 @@
+--
+--Testing rate limiters of a preloaded extension
+--
+
+--two limiters are available
+SHOW cms_mms.rate_limiters;
+SHOW cms_mms.rate_limiter_buckets;
+
+--check that calls are allowed until a key reaches the limit
+SELECT call, cms_rate_check('api', 'user-1'::text, 3, '1 hour') AS allowed
+FROM generate_series(1, 5) call ORDER BY call;
+SELECT cms_rate_check('api', 'user-2'::text, 3, '1 hour') AS allowed;
+
+--check that denied calls are not counted
+SELECT call, cms_rate_check('api', 'user-1'::text, 5, '1 hour') AS allowed
+FROM generate_series(1, 3) call ORDER BY call;
+
+--check that a limiter keeps the window of its first call
+SELECT cms_rate_check('api', 'user-1'::text, 3, '1 minute');
+
+--check that calls are forgotten once they leave the window
+SELECT call, cms_rate_check('burst', 'user-1'::text, 2, '1 second') AS allowed
+FROM generate_series(1, 3) call ORDER BY call;
+SELECT pg_sleep(1.2);
+SELECT cms_rate_check('burst', 'user-1'::text, 2, '1 second') AS allowed;
+
+--check that limiters are claimed until all are in use
+SELECT cms_rate_check('login', 'user-1'::text, 3, '1 hour');
@@ -0,0 +1,40 @@
+--
+--Testing the compaction of sketch rollups
+--
+
+--minutely sketches of two hours, and one which is still being written
+CREATE TABLE rollups_sketches (
+	page text,
+	period timestamp,
+	visitors cms,
+	PRIMARY KEY (page, period)
+);
+INSERT INTO rollups_sketches
+SELECT page, '2020-01-01 10:00'::timestamp + minute * interval '1 minute',
+       cms_add(cms(0.01, 0.99), minute % 3)
+FROM (VALUES ('about'), ('home')) pages(page), generate_series(0, 119) minute;
+INSERT INTO rollups_sketches VALUES ('home', localtimestamp, cms_add(cms(0.01, 0.99), 0));
+INSERT INTO cms_rollups (sketch_table, sketch_column, time_column, rollup_unit, key_columns)
+VALUES ('rollups_sketches', 'visitors', 'period', 'hour', '{page}');
+
+--check parameters
+SELECT cms_compact_rollups(0);
+
+--check that minutely rows are folded into hourly rows in batches
+SELECT cms_compact_rollups(1);
+SELECT count(*) FROM rollups_sketches;
+SELECT cms_compact_rollups();
+SELECT cms_compact_rollups();
+SELECT page, to_char(period, 'YYYY-MM-DD HH24:MI') AS period,
+       cms_get_frequency(visitors, 0) AS frequency_0, cms_get_frequency(visitors, 1) AS frequency_1,
+       cms_get_frequency(visitors, 2) AS frequency_2, (cms_stats(visitors)).total_count
+FROM rollups_sketches WHERE period < '2021-01-01' ORDER BY page, period;
+SELECT count(*) AS current_rows FROM rollups_sketches WHERE period > '2021-01-01';
+
+--check that a row of a later minute is folded into the existing hourly row
+INSERT INTO rollups_sketches VALUES ('home', '2020-01-01 11:30', cms_add(cms(0.01, 0.99), 7));
+SELECT cms_compact_rollups();
+SELECT page, to_char(period, 'YYYY-MM-DD HH24:MI') AS period, cms_get_frequency(visitors, 7) AS frequency_7,
+       (cms_stats(visitors)).total_count
+FROM rollups_sketches WHERE period < '2021-01-01' ORDER BY page, period;
+DELETE FROM cms_rollups;
@@ -0,0 +1,54 @@
+--
+--Testing selectivity estimates from column sketches
+--
+
+--estimated row count of a query
+CREATE FUNCTION selectivity_test_rows(query text)
+	RETURNS bigint
+	AS $$
+DECLARE
+	query_plan json;
+BEGIN
+	EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO query_plan;
+	RETURN (query_plan->0->'Plan'->>'Plan Rows')::bigint;
+END;
+$$ LANGUAGE plpgsql;
+
+--item i appears 1000 / i times, so most items are too rare for the most common values
+CREATE TABLE selectivity_test AS
+SELECT (row_number() OVER ())::integer AS id, item, 'item-' || item AS name
+FROM generate_series(1, 100) item, generate_series(1, 1000 / item) copy;
+ALTER TABLE selectivity_test ALTER COLUMN item SET STATISTICS 10;
+ANALYZE selectivity_test;
+CREATE OPERATOR === (LEFTARG = integer, RIGHTARG = integer, PROCEDURE = int4eq,
+                     RESTRICT = cms_eq_selectivity);
+CREATE OPERATOR === (LEFTARG = text, RIGHTARG = text, PROCEDURE = texteq,
+                     RESTRICT = cms_eq_selectivity);
+
+--check parameters
+SELECT cms_analyze('selectivity_test', 'no_such_column');
+
+--check that equality estimates come from the column sketches
+SELECT cms_analyze('selectivity_test', 'item');
+SELECT cms_analyze('selectivity_test', 'name', 0.01, 0.99);
+SELECT relation, attribute_number, row_count FROM cms_column_statistics ORDER BY attribute_number;
+SELECT item, count(*) AS frequency,
+       selectivity_test_rows(format('SELECT * FROM selectivity_test WHERE item === %s', item)) AS estimate,
+       selectivity_test_rows(format('SELECT * FROM selectivity_test WHERE name === %L', name)) AS name_estimate
+FROM selectivity_test
+WHERE item IN (1, 2, 20, 50, 99)
+GROUP BY item, name
+ORDER BY item;
+SELECT selectivity_test_rows('SELECT * FROM selectivity_test WHERE item === 1000') AS missing_item,
+       selectivity_test_rows('SELECT * FROM selectivity_test WHERE id === 5') AS unique_id;
+
+--check that estimates follow a new sketch of the column
+INSERT INTO selectivity_test SELECT 10000 + i, 99, 'item-99' FROM generate_series(1, 500) i;
+ANALYZE selectivity_test;
+SELECT cms_analyze('selectivity_test', 'item');
+SELECT selectivity_test_rows('SELECT * FROM selectivity_test WHERE item === 99') AS estimate,
+       selectivity_test_rows('SELECT * FROM selectivity_test WHERE item === 1') AS unchanged_estimate;
+
+--check that estimates fall back to the regular statistics without a sketch
+DELETE FROM cms_column_statistics WHERE relation = 'selectivity_test'::regclass;
+SELECT selectivity_test_rows('SELECT * FROM selectivity_test WHERE item === 20') < 50 AS regular_estimate;
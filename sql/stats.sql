@@ -0,0 +1,37 @@
+--
+--Testing cms_stats function of the extension
+--
+
+--check with null and empty values
+SELECT cms_stats(NULL);
+SELECT * FROM cms_stats(cms(0.1, 0.9));
+
+--check total count and estimates after adds
+SELECT total_count, zero_cell_fraction, saturated_cells,
+       round(additive_error::numeric, 4) AS additive_error,
+       round(distinct_items::numeric, 2) AS distinct_items
+FROM cms_stats(cms_add(cms_add(cms_add(cms(0.1, 0.9), 1), 2), 2));
+
+--check total count after union
+SELECT total_count FROM cms_stats(cms_union(cms_add(cms(0.1, 0.9), 1),
+                                            cms_add(cms_add(cms(0.1, 0.9), 1), 3)));
+
+--check aggregates
+SELECT total_count, round(distinct_items::numeric) AS distinct_items
+FROM cms_stats((SELECT cms_add_agg(i, 0.01, 0.99) FROM generate_series(1, 1000) i));
+SELECT total_count
+FROM cms_stats((SELECT cms_union_agg(sketch)
+                FROM (SELECT cms_add_agg(i % 10) AS sketch
+                      FROM generate_series(1, 100) i GROUP BY i % 3) sketches));
+
+--check that sketches of version 1.0.0 are converted
+SELECT '\x0100000003000000000000000200000000000000000000000000000003000000000000000000000000000000'::cms;
+SELECT total_count FROM cms_stats('\x0100000003000000000000000200000000000000000000000000000003000000000000000000000000000000'::cms);
+
+--check that other versions and values whose size doesn't match their header are rejected
+SELECT '\x010000000300000000000001000000000000000000000000000000000000000000000000'::cms;
+SELECT '\x01000000010000000000000200000000000000000000000000000000'::cms;
+SELECT '\x'::cms;
+SELECT '\x01'::cms_window;
+SELECT total_count FROM cms_stats('\x010000000100000000000002050000000000000005000000000000000000000000000000'::cms);
+SELECT cms_get_frequency('\x010000000100000000000002050000000000000005000000000000000000000000000000'::cms, 1);
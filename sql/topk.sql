@@ -0,0 +1,43 @@
+--
+--Testing approximate top-k scans
+--
+
+--item i appears 10 * i times in random order, and some items are null
+CREATE TABLE topk_test AS
+SELECT item, 'item-' || item AS name
+FROM generate_series(1, 20) item, generate_series(1, item * 10) copy
+ORDER BY md5(item || '-' || copy);
+INSERT INTO topk_test SELECT NULL, NULL FROM generate_series(1, 95);
+ANALYZE topk_test;
+
+--check that top-k group counts are planned as a sketch scan
+SET cms_mms.approximate_top_k = on;
+EXPLAIN (COSTS OFF)
+SELECT item, count(*) FROM topk_test GROUP BY item ORDER BY 2 DESC LIMIT 3;
+SELECT item, count(*) FROM topk_test GROUP BY item ORDER BY 2 DESC LIMIT 3;
+SELECT count(*), name FROM topk_test GROUP BY name ORDER BY count(*) DESC LIMIT 5;
+SELECT item, count(*) AS frequency
+FROM topk_test
+WHERE item < 12 OR item IS NULL
+GROUP BY item
+ORDER BY frequency DESC
+LIMIT 4;
+SELECT count(*) AS groups FROM
+(SELECT item, count(*) FROM topk_test GROUP BY item ORDER BY 2 DESC LIMIT 100) top_items;
+
+--check that the scan starts over for every outer row
+SELECT limits.maximum, top_items.item, top_items.count
+FROM (VALUES (5), (15)) limits(maximum),
+LATERAL (SELECT item, count(*) FROM topk_test WHERE item <= limits.maximum
+         GROUP BY item ORDER BY 2 DESC LIMIT 2) top_items;
+
+--check that other queries, and groups whose equal values may differ in bytes, are planned as usual
+EXPLAIN (COSTS OFF)
+SELECT item, count(*) FROM topk_test GROUP BY item ORDER BY 2 LIMIT 3;
+CREATE TABLE topk_numeric AS SELECT item::numeric AS amount FROM topk_test;
+ANALYZE topk_numeric;
+EXPLAIN (COSTS OFF)
+SELECT amount, count(*) FROM topk_numeric GROUP BY amount ORDER BY 2 DESC LIMIT 3;
+RESET cms_mms.approximate_top_k;
+EXPLAIN (COSTS OFF)
+SELECT item, count(*) FROM topk_test GROUP BY item ORDER BY 2 DESC LIMIT 3;
@@ -0,0 +1,48 @@
+--
+--Testing sliding-window sketches
+--
+
+--check parameters
+SELECT cms_window(0);
+SELECT cms_window(1025);
+SELECT cms_window(4, 2, 0.9);
+SELECT cms_window_advance(cms_window(4, 0.1, 0.9), -1);
+SELECT cms_window_info(cms_window(24, 0.01, 0.99));
+SELECT cms_window_add(NULL, 1) IS NULL AS null_window;
+
+--fill four buckets, item 1 is added in every bucket
+CREATE TABLE window_test (
+	window_column cms_window
+);
+INSERT INTO window_test VALUES (cms_window(4, 0.01, 0.99));
+UPDATE window_test
+SET window_column = cms_window_add(cms_window_add(cms_window_add(
+                    cms_window_add(window_column, 1), 1), 1), 2);
+UPDATE window_test
+SET window_column = cms_window_add(cms_window_add(cms_window_add(
+                    cms_window_advance(window_column), 1), 1), 3);
+UPDATE window_test
+SET window_column = cms_window_add(cms_window_add(
+                    cms_window_advance(window_column), 1), NULL::integer);
+UPDATE window_test
+SET window_column = cms_window_add(cms_window_add(
+                    cms_window_advance(window_column), 2), 1);
+SELECT item, cms_window_get_frequency(window_column, item) AS frequency
+FROM window_test, generate_series(1, 4) item;
+SELECT cms_window_info(window_column) FROM window_test;
+
+--check that advancing expires the oldest buckets
+UPDATE window_test SET window_column = cms_window_advance(window_column);
+SELECT item, cms_window_get_frequency(window_column, item) AS frequency
+FROM window_test, generate_series(1, 4) item;
+UPDATE window_test SET window_column = cms_window_advance(window_column, 2);
+SELECT item, cms_window_get_frequency(window_column, item) AS frequency
+FROM window_test, generate_series(1, 4) item;
+SELECT cms_window_info(window_column) FROM window_test;
+SELECT cms_window_get_frequency(cms_window_advance(window_column, 0), 1),
+       cms_window_get_frequency(cms_window_advance(window_column, 5), 1)
+FROM window_test;
+
+--check input and output
+SELECT window_column::text::cms_window::text = window_column::text AS same_window
+FROM window_test;